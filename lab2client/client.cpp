@@ -17,10 +17,26 @@
 #include <netdb.h>
 #include <sys/types.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
 #include <signal.h>
 #include <arpa/inet.h>
+#include <time.h>
 #include <iterator>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <map>
+#include <set>
+#include <algorithm>
+
+#include "protocol.h"
+#include "sharedring.h"
 
 #define CMD_LOGIN      "/login"
 #define CMD_LOGOUT     "/logout"
@@ -30,46 +46,46 @@
 #define CMD_DIRMESSAGE "/directmessage" 
 #define CMD_LIST       "/list"
 #define CMD_QUIT       "/quit"
+#define CMD_SENDFILE   "/sendfile"
+#define CMD_PASTE      "/paste"
+#define CMD_PASTE_END  "/end"
+#define CMD_SWITCH     "/switch"
+#define CMD_SESSMESSAGE "/sessionmessage"
+#define CMD_SEARCH     "/search"
+#define CMD_TRACE      "/trace"
+#define CMD_HISTORY    "/history"
 
 #define SESSION_NOT_FOUND "NoSessionFound"
 
 #define MAXDATASIZE 1380 // max number of bytes we can get at once
+#define RECEIVE_BATCH_SIZE (64 << 10) // Bytes read from the server per wakeup of the main loop
 
-using namespace std;
+#define CHUNK_PAYLOAD_SIZE 1024               // Bytes of a large message sent per chunk
+#define MAX_CHUNKED_MESSAGE_SIZE (16 << 20)   // Largest message that will be reassembled
+#define MAX_REASSEMBLY_SIZE (64 << 20)        // Bytes that may be held for all partial messages
+#define CHUNK_BACKLOG_SIZE (16 << 10)         // Unsent bytes allowed before the next chunk waits
 
+#define LOCAL_SOCKET_PORT "unix"  // Port given with a path to connect to the server's local socket
+#define SHARED_MEMORY_PORT "shm"  // Same, then move our traffic to shared memory
 
-// Defines control packet types
-enum msgType {
-    LOGIN,
-    LO_ACK,
-    LO_NAK,
-    EXIT,
-    JOIN,
-    JN_ACK,
-    JN_NAK,
-    LEAVE_SESS,
-    LS_ACK,
-    LS_NAK,
-    NEW_SESS,
-    NS_ACK,
-    NS_NAK,
-    MESSAGE,
-    QUERY,
-    QU_ACK,
-    DIRMESSAGE,
-    DMESS_ACK,
-    DMESS_NAK
-};
+#define FILE_TO_SESSION "-" // File target prefix naming one of our sessions
+#define OFFLINE_ACK "offline" // After the recipient in a DMESS_ACK when they'll get it on login
+#define SESSION_SEPARATOR ',' // Between the names of sessions a message is sent to
 
+#define MULTICAST_HOLD_SIZE 256 // Session messages held while waiting for a gap to be repaired
 
-// Message structure to be serialized when sending messages
-// Note: when message is stringified, the delimiter between fields is " "
-struct message {
-    unsigned int type;
-    unsigned int size;
-    string source;
-    string data;
-};
+#define LIST_PAGE_SIZE 100  // Names per list asked for in each /list page
+#define LIST_FROM_START "-" // Cursor asking for a list from its first name
+#define LIST_DONE "*"       // Cursor meaning a list has no more names to send
+
+#define TRACE_BUCKETS 64    // Latency histogram buckets, each twice as wide as the last
+
+#define RENDER_FRAME_NS (16 * 1000000ULL) // Least time between writes of incoming messages to the terminal
+#define RENDER_BUFFER_SIZE (1 << 20)      // Bytes of incoming messages held before they're written early
+#define SCROLLBACK_LINES 1000             // Incoming messages kept for /history
+#define SCROLLBACK_LINE_SIZE 4096         // Bytes of each message kept for /history
+
+using namespace std;
 
 
 // Contains connection information about the client and server
@@ -85,7 +101,95 @@ struct connectionDetails {
 int sockfd = -1;                // Socket used to communicate with server
 struct connectionDetails login; // Holds login details pertaining to this client
 bool loggedIn = false;          // Keep track of if this client is logged in
-bool inSession = false;         // Keep track of it this client is in a session
+set<string> joinedSessions;     // Keep track of the sessions this client is in
+string activeSession;           // Session typed messages go to
+bool pasting = false;           // Keep track of if the user is pasting a multi-line message
+string pasteBuffer;             // Lines pasted so far
+
+string receiveBuffer;           // Bytes from the server not yet handled as packets
+deque<string> outgoingChunks;   // Chunks of large messages waiting to be sent
+unsigned int nextMessageID = 0; // Identifies the chunks of each large message sent
+
+// Large messages being reassembled from chunks, keyed by "<source> <message ID>"
+struct partialMessage {
+    string data;                // Chunks received so far
+    unsigned int totalSize;     // Size given by the first chunk, and set aside for the message
+};
+
+unordered_map<string, struct partialMessage> partialMessages;
+size_t reassemblyBytes = 0;     // Total size promised by the partial messages
+
+// A session's multicast group, if the server offered one. Its messages are
+// numbered, and any missed on the group are asked for again. They come over
+// TCP as well until the server is told one has reached us through the group
+struct multicastGroup {
+    int fd;                    // Socket joined to the group, or -1 if joining failed
+    bool receiving;            // A message has come through the group, and the server knows
+    uint32_t nextSequence;     // Number of the next session message to show
+    uint32_t repairFrom;       // First message not yet asked for again
+    
+    // Messages that arrived ahead of a gap, waiting for it to be repaired
+    map<uint32_t, pair<string, string>> heldMessages;
+};
+
+// Key is session name, value is the session's multicast group
+unordered_map<string, struct multicastGroup> multicastGroups;
+
+// Trace mode: messages we type are stamped on the way out, and the server adds
+// its own stamps on the way through. Traced messages from anyone are broken
+// down into the time spent at each hop, kept as histograms of how many took up
+// to each power of two nanoseconds
+enum traceHop {
+    HOP_CLIENT_SEND,     // Sender read the line from stdin until it sent it
+    HOP_NETWORK_IN,      // Until the server read it
+    HOP_SERVER_DISPATCH, // Until the server had worked out the recipients
+    HOP_SERVER_FANOUT,   // Until the server wrote it to us
+    HOP_NETWORK_OUT,     // Until we got it
+    HOP_TOTAL,
+    TRACE_HOPS
+};
+
+const char *traceHopNames[TRACE_HOPS] = {
+    "stdin read -> client send",
+    "client send -> server receive",
+    "server receive -> enqueue",
+    "server enqueue -> write",
+    "server write -> recipient",
+    "end to end"
+};
+
+struct traceHistogram {
+    unsigned long counts[TRACE_BUCKETS];
+    unsigned long total;
+    uint64_t max;
+};
+
+bool tracing = false;           // Whether the messages we type are traced
+uint64_t stdinReadAt;           // When the line being handled was read, if tracing
+unsigned int nextTraceID = 0;
+struct traceHistogram traceHistograms[TRACE_HOPS];
+unsigned long traceSkewed = 0;  // Traces whose stamps went backwards, from clocks on different hosts
+
+// Messages from other clients are gathered here and written to the terminal
+// in one call at most once a frame, instead of being flushed a line at a time.
+// Anything printed straight to the terminal, with cout or perror, writes out
+// what's gathered first with flushRender, so the two never appear out of order
+string renderBuffer;
+uint64_t lastFrameAt = 0;       // When the render buffer was last written
+
+// Ring of the last SCROLLBACK_LINES messages shown, each slot reused in turn
+vector<string> scrollback(SCROLLBACK_LINES);
+size_t scrollbackNext = 0;      // Slot the next message goes in
+size_t scrollbackCount = 0;     // Slots filled so far
+
+// Shared memory the server moved our traffic to, if we logged in on its local
+// socket with SHARED_MEMORY_PORT. The socket is then only used to notice the
+// server closing it. Each side signals the other's eventfd after reading or
+// writing, if it finds the other waiting
+struct sharedChannel *sharedMemory = NULL;
+int clientWakeup = -1;          // Signalled by the server, we sleep on it
+int serverWakeup = -1;          // Signalled by us
+vector<int> passedFds;          // Passed by the server along with what we read
 
 
 // Get sockaddr, IPv4 or IPv6:
@@ -99,12 +203,162 @@ void *get_in_addr(struct sockaddr *sa)
 }
 
 
-// Create a packet string from a message structure
-string stringifyMessage(const struct message* data)
+// Returns the time on the monotonic clock in nanoseconds
+uint64_t monotonicNanoseconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+
+// Writes the messages gathered in the render buffer to the terminal in one go
+// The write blocks if the terminal is behind, which holds off reading from
+// the server rather than letting the buffer grow
+void flushRender()
+{
+    lastFrameAt = monotonicNanoseconds();
+    if(renderBuffer.empty()) return;
+    
+    cout.flush();
+    size_t written = 0;
+    while(written < renderBuffer.length())
+    {
+        ssize_t numBytes = write(STDOUT_FILENO, renderBuffer.data() + written, renderBuffer.length() - written);
+        if(numBytes == -1)
+        {
+            if(errno == EINTR) continue;
+            perror("write");
+            break;
+        }
+        written += numBytes;
+    }
+    renderBuffer.clear();
+}
+
+
+// Shows a line of incoming messages with the next frame, and keeps it in the
+// scrollback
+void showLine(const string &line)
+{
+    scrollback[scrollbackNext].assign(line, 0, SCROLLBACK_LINE_SIZE);
+    scrollbackNext = (scrollbackNext + 1) % SCROLLBACK_LINES;
+    if(scrollbackCount < SCROLLBACK_LINES) scrollbackCount++;
+    
+    renderBuffer += line;
+    renderBuffer += '\n';
+    if(renderBuffer.length() >= RENDER_BUFFER_SIZE) flushRender();
+}
+
+
+// Sleeps on our wakeup until the server signals it, after reading from or
+// writing to the shared memory
+// Returns false if it closed the connection instead
+bool waitForServer()
+{
+    fd_set readable;
+    FD_ZERO(&readable);
+    FD_SET(sockfd, &readable);
+    FD_SET(clientWakeup, &readable);
+    if(select(max(sockfd, clientWakeup) + 1, &readable, NULL, NULL, NULL) == -1) return errno == EINTR;
+    if(FD_ISSET(sockfd, &readable)) return false;
+    
+    uint64_t count;
+    if(read(clientWakeup, &count, sizeof(count)) == -1 && errno != EAGAIN)
+    {
+        flushRender();
+        perror("eventfd: read");
+    }
+    return true;
+}
+
+
+// Sends length bytes of data to the server, through shared memory if we use
+// it and otherwise the socket, waiting for room as needed
+// Returns false if the connection failed
+bool sendAllToServer(const char *data, size_t length)
+{
+    size_t sent = 0;
+    if(sharedMemory == NULL)
+    {
+        while(sent < length)
+        {
+            ssize_t numBytes = send(sockfd, data + sent, length - sent, 0);
+            if(numBytes == -1)
+            {
+                flushRender();
+                perror("send");
+                return false;
+            }
+            sent += numBytes;
+        }
+        return true;
+    }
+    
+    struct sharedRing *ring = &sharedMemory->toServer;
+    while(sent < length)
+    {
+        size_t numBytes = sharedRingWrite(ring, data + sent, length - sent);
+        sent += numBytes;
+        if(numBytes > 0) sharedRingWake(ring->readerWaiting, serverWakeup);
+        else if(sharedRingWriterSleeps(ring, 1) && !waitForServer())
+        {
+            flushRender();
+            cout << "Server closed the connection" << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+
+// Reads up to length bytes the server has sent, waiting for some to arrive.
+// Descriptors it passes with them are added to passedFds
+// Returns the number of bytes read, 0 if it closed the connection or -1 on error
+ssize_t receiveFromServer(char *buffer, size_t length)
+{
+    if(sharedMemory == NULL)
+    {
+        char control[CMSG_SPACE(3 * sizeof(int))];
+        struct iovec iov = {buffer, length};
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        
+        ssize_t numBytes = recvmsg(sockfd, &msg, MSG_CMSG_CLOEXEC);
+        for(struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); numBytes > 0 && cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+            int *fds = (int *) CMSG_DATA(cmsg);
+            passedFds.insert(passedFds.end(), fds, fds + (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+        }
+        return numBytes;
+    }
+    
+    struct sharedRing *ring = &sharedMemory->toClient;
+    size_t numBytes;
+    while((numBytes = sharedRingRead(ring, buffer, length)) == 0)
+    {
+        if(sharedRingReaderSleeps(ring) && !waitForServer()) return 0;
+    }
+    sharedRingWake(ring->writerWaiting, serverWakeup);
+    return numBytes;
+}
+
+
+// Unmaps our shared memory and closes its wakeups, once the connection is
+// being closed
+void closeSharedMemory()
 {
-    string dataStr = to_string(data->type) + " " + to_string(data->size) 
-                     + " " + data->source + " " + data->data;
-    return dataStr;
+    if(sharedMemory == NULL) return;
+    munmap(sharedMemory, sizeof(struct sharedChannel));
+    close(clientWakeup);
+    close(serverWakeup);
+    sharedMemory = NULL;
+    clientWakeup = serverWakeup = -1;
 }
 
 
@@ -113,16 +367,589 @@ string stringifyMessage(const struct message* data)
 // Returns true if message is successfully sent
 bool sendToServer(struct message *data)
 {
-    int numBytes;
     string dataStr = stringifyMessage(data);
     
     if(dataStr.length() + 1 > MAXDATASIZE) return false;
-    if((numBytes = send(sockfd, dataStr.c_str(), dataStr.length() + 1, 0)) == -1)
+    return sendAllToServer(dataStr.c_str(), dataStr.length() + 1);
+}
+
+
+// Prints the last count messages in the scrollback, oldest first
+void printScrollback(size_t count)
+{
+    count = min(count, scrollbackCount);
+    for(size_t i = 0; i < count; i++)
     {
-        perror("send");
-        return false;
+        const string &line = scrollback[(scrollbackNext + SCROLLBACK_LINES - count + i) % SCROLLBACK_LINES];
+        cout << line << '\n';
+    }
+    if(count == 0) cout << "No messages yet" << '\n';
+    cout.flush();
+}
+
+
+// Takes the next whole packet out of the receive buffer
+// Returns false if there isn't one yet
+bool takePacket(string &packet)
+{
+    size_t end = receiveBuffer.find('\0');
+    if(end == string::npos) return false;
+    
+    packet = receiveBuffer.substr(0, end);
+    receiveBuffer.erase(0, end + 1);
+    return true;
+}
+
+
+// Waits for the next whole packet from the server
+// Returns false if the connection failed
+bool receivePacket(string &packet)
+{
+    char buffer[MAXDATASIZE];
+    int numBytes;
+    
+    while(!takePacket(packet))
+    {
+        if((numBytes = receiveFromServer(buffer, MAXDATASIZE)) <= 0)
+        {
+            flushRender();
+            if(numBytes == 0) cout << "Server closed the connection" << endl;
+            else perror("recv");
+            return false;
+        }
+        receiveBuffer.append(buffer, numBytes);
+    }
+    return true;
+}
+
+
+// Shows a message from one or more of our sessions, naming them if we're in
+// more than one
+void printSessionMessage(const string &sessions, const string &source, const string &text)
+{
+    if(joinedSessions.size() > 1) showLine("[" + sessions + "] " + source + ": " + text);
+    else showLine(source + ": " + text);
+}
+
+
+// Adds a traced message's time at each hop to the histograms
+// Stamps are "<client read> <client send> <server receive> <server enqueue> <server write>"
+void recordTrace(stringstream &stamps, uint64_t receivedAt)
+{
+    uint64_t times[TRACE_HOPS + 1];
+    for(int i = 0; i < TRACE_HOPS - 1; i++) stamps >> times[i];
+    times[TRACE_HOPS - 1] = receivedAt;
+    
+    uint64_t hops[TRACE_HOPS];
+    for(int hop = 0; hop < HOP_TOTAL; hop++)
+    {
+        if(times[hop + 1] < times[hop])
+        {
+            traceSkewed++;
+            return;
+        }
+        hops[hop] = times[hop + 1] - times[hop];
+    }
+    hops[HOP_TOTAL] = receivedAt - times[0];
+    
+    for(int hop = 0; hop < TRACE_HOPS; hop++)
+    {
+        struct traceHistogram &histogram = traceHistograms[hop];
+        int bucket = hops[hop] == 0 ? 0 : 64 - __builtin_clzll(hops[hop]);
+        histogram.counts[min(bucket, TRACE_BUCKETS - 1)]++;
+        histogram.total++;
+        histogram.max = max(histogram.max, hops[hop]);
+    }
+}
+
+
+// Returns a number of nanoseconds in the most readable unit
+string formatNanoseconds(uint64_t nanoseconds)
+{
+    char text[32];
+    if(nanoseconds < 10000) snprintf(text, sizeof(text), "%lluns", (unsigned long long) nanoseconds);
+    else if(nanoseconds < 10000000) snprintf(text, sizeof(text), "%.1fus", nanoseconds / 1e3);
+    else snprintf(text, sizeof(text), "%.1fms", nanoseconds / 1e6);
+    return text;
+}
+
+
+// Prints the histogram of each hop traced messages have taken so far
+void dumpTraces()
+{
+    for(int hop = 0; hop < TRACE_HOPS; hop++)
+    {
+        const struct traceHistogram &histogram = traceHistograms[hop];
+        cout << traceHopNames[hop] << ": " << histogram.total << " message(s)";
+        if(histogram.total == 0)
+        {
+            cout << endl;
+            continue;
+        }
+        cout << ", max " << formatNanoseconds(histogram.max) << endl;
+        
+        // Bucket b holds times up to 2^b ns
+        unsigned long seen = 0;
+        for(int bucket = 0; bucket < TRACE_BUCKETS; bucket++)
+        {
+            if(histogram.counts[bucket] == 0) continue;
+            seen += histogram.counts[bucket];
+            printf("  <= %-8s %8lu %5.1f%%\n", formatNanoseconds(1ULL << bucket).c_str(), 
+                   histogram.counts[bucket], 100.0 * seen / histogram.total);
+        }
+    }
+    if(traceSkewed > 0) cout << traceSkewed << " trace(s) skipped, clocks on different hosts" << endl;
+}
+
+
+// Forgets a large message that is being reassembled, and gives back the
+// memory set aside for it
+void dropPartialMessage(unordered_map<string, struct partialMessage>::iterator partial)
+{
+    reassemblyBytes -= partial->second.totalSize;
+    partialMessages.erase(partial);
+}
+
+
+// Adds a chunk of a large message to the ones received before it and prints
+// the message once it is whole
+// Chunk data is "<message ID> <offset> <total size> <payload>", after the
+// sessions it was sent to
+void handleMessageChunk(const string &source, const string &sessions, stringstream &ss)
+{
+    unsigned int messageID, offset, totalSize;
+    string payload;
+    ss >> messageID >> offset >> totalSize;
+    ss.get(); // Remove the space before the payload
+    getline(ss, payload, '\0');
+    
+    string key = source + " " + to_string(messageID);
+    auto partial = partialMessages.find(key);
+    
+    if(offset == 0)
+    {
+        // A message started again replaces what was received of it
+        if(partial != partialMessages.end()) dropPartialMessage(partial);
+        
+        // Only start a message if it fits in the memory set aside for them
+        if(totalSize > MAX_CHUNKED_MESSAGE_SIZE || reassemblyBytes + totalSize > MAX_REASSEMBLY_SIZE)
+        {
+            showLine("Message from " + source + " is too large to receive");
+            return;
+        }
+        reassemblyBytes += totalSize;
+        partial = partialMessages.insert(make_pair(key, partialMessage())).first;
+        partial->second.totalSize = totalSize;
+    }
+    else if(partial == partialMessages.end()) return; // Message was dropped
+    
+    // Chunks arrive in order and agree on the size, anything else means the
+    // message can't be rebuilt
+    struct partialMessage &message = partial->second;
+    if(offset != message.data.length() || totalSize != message.totalSize || 
+       offset + payload.length() > message.totalSize)
+    {
+        dropPartialMessage(partial);
+        return;
+    }
+    
+    message.data += payload;
+    if(message.data.length() == message.totalSize)
+    {
+        printSessionMessage(sessions, source, message.data);
+        dropPartialMessage(partial);
+    }
+}
+
+
+// Saves a file another client sent, which follows the FILE_SEND packet on the
+// connection, under its name in the current directory
+// Request data is "<size> <file name>"
+void receiveFile(const string &source, stringstream &ss)
+{
+    // Messages that came before the file are shown before it's taken off the
+    // connection, and before any error saving it
+    flushRender();
+    
+    unsigned long size;
+    string name;
+    ss >> size;
+    ss.get(); // Remove the space before the name
+    getline(ss, name, '\0');
+    
+    // Never write outside the current directory
+    name = name.substr(name.find_last_of('/') + 1);
+    if(name.empty() || name == "." || name == "..") name = "received_file";
+    
+    // Don't overwrite files that are already there
+    string path = name;
+    int filefd;
+    for(int copy = 1; (filefd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644)) == -1 
+                      && errno == EEXIST; copy++)
+    {
+        path = name + "." + to_string(copy);
+    }
+    if(filefd == -1) perror("open");
+    
+    // Part of the file may have come in with the packets before it
+    unsigned long received = size < receiveBuffer.length() ? size : receiveBuffer.length();
+    if(filefd != -1 && write(filefd, receiveBuffer.data(), received) == -1) perror("write");
+    receiveBuffer.erase(0, received);
+    
+    // Keep reading until the whole file is off the connection, even if it
+    // can't be saved, so the packets after it still line up
+    char buffer[1 << 16];
+    while(received < size)
+    {
+        size_t length = size - received < sizeof(buffer) ? size - received : sizeof(buffer);
+        int numBytes = receiveFromServer(buffer, length);
+        if(numBytes <= 0)
+        {
+            perror("recv");
+            break;
+        }
+        if(filefd != -1 && write(filefd, buffer, numBytes) == -1) perror("write");
+        received += numBytes;
+    }
+    
+    if(filefd != -1)
+    {
+        close(filefd);
+        showLine(source + " sent file '" + path + "' (" + to_string(size) + " bytes)");
+    }
+}
+
+
+// Leaves a session's multicast group, if it has one
+void leaveMulticastGroup(const string &sessionID)
+{
+    auto group = multicastGroups.find(sessionID);
+    if(group == multicastGroups.end()) return;
+    
+    if(group->second.fd != -1) close(group->second.fd);
+    multicastGroups.erase(group);
+}
+
+
+// Stops counting a session among ours after leaving it, or it being closed
+void forgetSession(const string &sessionID)
+{
+    joinedSessions.erase(sessionID);
+    
+    // Typed messages go to another session we're still in
+    if(sessionID == activeSession)
+    {
+        activeSession = joinedSessions.empty() ? "" : *joinedSessions.begin();
+        if(!activeSession.empty())
+        {
+            flushRender();
+            cout << "Now sending to session '" << activeSession << "'" << endl;
+        }
+    }
+}
+
+
+// Joins the multicast group the server sends a session's messages to, on the
+// interface the connection to the server goes through, and tells the server so
+// If joining fails the messages keep coming over TCP
+// Data is "<session> <group address> <port> <next message number>"
+void joinMulticastGroup(const string &data)
+{
+    string sessionID, address;
+    unsigned int port;
+    uint32_t sequence;
+    stringstream ss(data);
+    if(!(ss >> sessionID >> address >> port >> sequence)) return;
+    
+    leaveMulticastGroup(sessionID);
+    struct multicastGroup &state = multicastGroups[sessionID];
+    state.fd = -1;
+    state.receiving = false;
+    state.nextSequence = state.repairFrom = sequence;
+    
+    struct ip_mreq membership;
+    struct sockaddr_in local, group;
+    socklen_t length = sizeof(local);
+    if(inet_pton(AF_INET, address.c_str(), &membership.imr_multiaddr) != 1 ||
+       getsockname(sockfd, (struct sockaddr *) &local, &length) == -1 ||
+       local.sin_family != AF_INET) return;
+    membership.imr_interface = local.sin_addr;
+    
+    // Other clients on this host may be listening on the same port
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0), yes = 1;
+    if(fd == -1) return;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    
+    memset(&group, 0, sizeof(group));
+    group.sin_family = AF_INET;
+    group.sin_port = htons(port);
+    group.sin_addr = membership.imr_multiaddr;
+    if(bind(fd, (struct sockaddr *) &group, sizeof(group)) == -1 ||
+       setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) == -1)
+    {
+        flushRender();
+        perror("multicast");
+        close(fd);
+        return;
+    }
+    state.fd = fd;
+    
+    struct message joined;
+    joined.type = MC_JOINED;
+    joined.source = login.clientID;
+    joined.data = sessionID;
+    joined.size = joined.data.length() + 1;
+    sendToServer(&joined);
+}
+
+
+// Shows the held messages of a session that no longer have a gap in front of them
+void showHeldMessages(const string &sessionID, struct multicastGroup &group)
+{
+    auto held = group.heldMessages.begin();
+    while(held != group.heldMessages.end() && held->first <= group.nextSequence)
+    {
+        if(held->first == group.nextSequence)
+        {
+            if(held->second.first != login.clientID)
+                printSessionMessage(sessionID, held->second.first, held->second.second);
+            group.nextSequence++;
+        }
+        held = group.heldMessages.erase(held);
+    }
+}
+
+
+// Handles a numbered session message, from the multicast group or from the
+// server when it's repairing a gap or the group isn't being received
+// Messages are shown in order, and a gap in the numbers is asked for again
+// Data is "<session> <number> <message>"
+void handleMulticastMessage(const struct message &packet)
+{
+    string sessionID, text;
+    uint32_t sequence;
+    stringstream ss(packet.data);
+    if(!(ss >> sessionID >> sequence)) return;
+    ss.get(); // Remove extra space
+    getline(ss, text, '\0');
+    
+    auto found = multicastGroups.find(sessionID);
+    if(found == multicastGroups.end()) return;
+    struct multicastGroup &group = found->second;
+    if(sequence < group.nextSequence) return;
+    
+    if(sequence > group.nextSequence)
+    {
+        bool held = group.heldMessages.size() < MULTICAST_HOLD_SIZE;
+        if(held) group.heldMessages[sequence] = make_pair(packet.source, text);
+        
+        // Ask for everything missing up to this one, and this one if it can't wait
+        uint32_t first = max(group.nextSequence, group.repairFrom);
+        uint32_t last = held ? sequence - 1 : sequence;
+        if(first <= last)
+        {
+            struct message nak;
+            nak.type = MC_NAK;
+            nak.source = login.clientID;
+            nak.data = sessionID + " " + to_string(first) + " " + to_string(last);
+            nak.size = nak.data.length() + 1;
+            sendToServer(&nak);
+            group.repairFrom = last + 1;
+        }
+        return;
+    }
+    
+    // Our own messages are numbered too, but were already shown when typed
+    if(packet.source != login.clientID) printSessionMessage(sessionID, packet.source, text);
+    group.nextSequence++;
+    showHeldMessages(sessionID, group);
+}
+
+
+// Handles the server saying some session messages are too old to repair
+// Data is "<session> <first> <last>"
+void skipLostMessages(const string &data)
+{
+    string sessionID;
+    uint32_t first, last;
+    stringstream ss(data);
+    if(!(ss >> sessionID >> first >> last)) return;
+    
+    auto found = multicastGroups.find(sessionID);
+    if(found == multicastGroups.end() || last < found->second.nextSequence) return;
+    struct multicastGroup &group = found->second;
+    
+    showLine("(" + to_string(last - max(first, group.nextSequence) + 1) + " message(s) lost)");
+    group.nextSequence = last + 1;
+    showHeldMessages(sessionID, group);
+}
+
+
+// Handles a datagram from a session's multicast group. The first to arrive
+// tells the server the group reaches us, so it stops sending us copies over TCP
+void receiveMulticastMessage(int fd)
+{
+    char buf[MAXDATASIZE + 1];
+    ssize_t nbytes = recv(fd, buf, MAXDATASIZE, 0);
+    if(nbytes <= 0) return;
+    
+    buf[nbytes] = '\0';
+    struct message packet = messageFromPacket(buf);
+    if(packet.type != MC_MESSAGE) return;
+    
+    string sessionID;
+    stringstream ss(packet.data);
+    ss >> sessionID;
+    auto group = multicastGroups.find(sessionID);
+    if(group != multicastGroups.end() && !group->second.receiving)
+    {
+        struct message receiving;
+        receiving.type = MC_RECEIVING;
+        receiving.source = login.clientID;
+        receiving.data = sessionID;
+        receiving.size = receiving.data.length() + 1;
+        sendToServer(&receiving);
+        group->second.receiving = true;
+    }
+    handleMulticastMessage(packet);
+}
+
+
+// Handlers for packets the server sends without being asked, one for each
+// packet type that can arrive that way. Replies to requests fall through to
+// the default, which leaves them for the request that is waiting on them
+template<msgType type> struct serverMessageHandler {
+    static bool handle(struct message &) { return false; }
+};
+
+template<> struct serverMessageHandler<MESSAGE> {
+    static bool handle(struct message &packet)
+    {
+        string sessions, text;
+        stringstream ss(packet.data);
+        ss >> sessions;
+        ss.get(); // Remove extra space
+        getline(ss, text, '\0');
+        
+        printSessionMessage(sessions, packet.source, text);
+        return true;
+    }
+};
+
+template<> struct serverMessageHandler<MESSAGE_TRACE> {
+    static bool handle(struct message &packet)
+    {
+        uint64_t receivedAt = monotonicNanoseconds();
+        string sessions, traceID, text;
+        stringstream ss(packet.data);
+        ss >> sessions >> traceID;
+        recordTrace(ss, receivedAt);
+        ss.get(); // Remove extra space
+        getline(ss, text, '\0');
+        
+        printSessionMessage(sessions, packet.source, text);
+        return true;
+    }
+};
+
+template<> struct serverMessageHandler<DIRMESSAGE> {
+    static bool handle(struct message &packet)
+    {
+        showLine(packet.source + "(DM): " + packet.data.substr(1));
+        return true;
+    }
+};
+
+template<> struct serverMessageHandler<MESSAGE_CHUNK> {
+    static bool handle(struct message &packet)
+    {
+        string sessions;
+        stringstream ss(packet.data);
+        ss >> sessions;
+        handleMessageChunk(packet.source, sessions, ss);
+        return true;
+    }
+};
+
+template<> struct serverMessageHandler<MC_GROUP> {
+    static bool handle(struct message &packet)
+    {
+        joinMulticastGroup(packet.data);
+        return true;
+    }
+};
+
+template<> struct serverMessageHandler<MC_MESSAGE> {
+    static bool handle(struct message &packet)
+    {
+        handleMulticastMessage(packet);
+        return true;
+    }
+};
+
+template<> struct serverMessageHandler<MC_LOST> {
+    static bool handle(struct message &packet)
+    {
+        skipLostMessages(packet.data);
+        return true;
+    }
+};
+
+template<> struct serverMessageHandler<SESS_CLOSED> {
+    static bool handle(struct message &packet)
+    {
+        string sessionID = packet.data.substr(1);
+        showLine("Session '" + sessionID + "' was closed by the server");
+        leaveMulticastGroup(sessionID);
+        forgetSession(sessionID);
+        return true;
+    }
+};
+
+template<> struct serverMessageHandler<BROADCAST> {
+    static bool handle(struct message &packet)
+    {
+        showLine("Announcement from the server: " + packet.data.substr(1));
+        return true;
+    }
+};
+
+template<> struct serverMessageHandler<FILE_SEND> {
+    static bool handle(struct message &packet)
+    {
+        stringstream ss(packet.data);
+        receiveFile(packet.source, ss);
+        return true;
+    }
+};
+
+
+// Handles a packet the server sent without being asked, such as a message from
+// another client
+// Returns false if the packet is a reply to a request instead
+bool handleServerMessage(const string &reply)
+{
+    struct message packet = messageFromPacket(reply.c_str());
+    return packetDispatcher<serverMessageHandler, struct message &>::dispatch(packet.type, packet);
+}
+
+
+// Waits for the server's reply to a request, handling any messages from other
+// clients that arrive before it
+// Messages shown while waiting are written out first, so they come before
+// whatever is printed about the reply
+// Returns false if the connection failed
+bool receiveReply(string &reply)
+{
+    while(receivePacket(reply))
+    {
+        if(!handleServerMessage(reply))
+        {
+            flushRender();
+            return true;
+        }
     }
-    return true;
+    return false;
 }
 
 
@@ -130,8 +957,7 @@ bool sendToServer(struct message *data)
 // Returns true if login is successful
 bool requestLogin(struct connectionDetails login)
 {
-    char buffer[MAXDATASIZE];
-    int numBytes, response;
+    int response;
     struct message info;
     info.type = LOGIN;
     info.size = login.clientPassword.length() + 1;
@@ -144,14 +970,11 @@ bool requestLogin(struct connectionDetails login)
     }
     
     // Server response
-    if((numBytes = recv(sockfd, buffer, MAXDATASIZE, 0)) == -1)
-    {
-        perror("recv");
-        return false;
-    }
+    string s;
+    if(!receiveReply(s)) return false;
     
     // Checking packet type
-    string s(buffer), temp, data;
+    string temp, data;
     stringstream ss(s);
     ss >> response >> temp >> temp >> data;
     
@@ -178,6 +1001,49 @@ bool requestLogin(struct connectionDetails login)
 }
 
 
+// Asks the server to move our traffic from its local socket to shared memory,
+// which it passes to us with its SHM_ACK. If it turns us down we carry on
+// over the socket
+// Returns true if we're using shared memory
+bool requestSharedMemory()
+{
+    struct message request;
+    request.type = SHM_ATTACH;
+    request.size = 0;
+    request.source = login.clientID;
+    request.data = "";
+    
+    string reply;
+    passedFds.clear();
+    if(!sendToServer(&request) || !receiveReply(reply)) return false;
+    
+    struct message packet = messageFromPacket(reply.c_str());
+    void *memory = MAP_FAILED;
+    if(packet.type == SHM_ACK && passedFds.size() == 3)
+    {
+        memory = mmap(NULL, sizeof(struct sharedChannel), PROT_READ | PROT_WRITE, MAP_SHARED, passedFds[0], 0);
+        if(memory == MAP_FAILED) perror("mmap");
+    }
+    if(memory == MAP_FAILED)
+    {
+        if(packet.type == SHM_NAK) cout << "Error: " << packet.data << endl;
+        else if(packet.type != SHM_ACK) cout << "shm: unknown message type received" << endl;
+        for(auto const & fd : passedFds) close(fd);
+        passedFds.clear();
+        return false;
+    }
+    
+    // The mapping keeps the memory, so the memfd isn't needed
+    sharedMemory = (struct sharedChannel *) memory;
+    close(passedFds[0]);
+    serverWakeup = passedFds[1];
+    clientWakeup = passedFds[2];
+    passedFds.clear();
+    cout << "Using shared memory" << endl;
+    return true;
+}
+
+
 // Sends the logout request to the server
 void logout()
 {
@@ -188,6 +1054,14 @@ void logout()
     info.data = "";
     
     if(sendToServer(&info)) cout << "Logout successful!" << endl;
+    
+    // Nothing left over from this connection is useful to the next one
+    receiveBuffer.clear();
+    outgoingChunks.clear();
+    partialMessages.clear();
+    reassemblyBytes = 0;
+    while(!multicastGroups.empty()) leaveMulticastGroup(multicastGroups.begin()->first);
+    closeSharedMemory();
 }
 
 
@@ -195,8 +1069,7 @@ void logout()
 // Returns true if session is joined
 bool requestJoinSession(string sessionID, string sessionPassword)
 {
-    char buffer[MAXDATASIZE];
-    int numBytes, response;
+    int response;
     struct message joinSession;
     joinSession.type = JOIN;
     joinSession.size = sessionID.length() + 1;
@@ -209,14 +1082,11 @@ bool requestJoinSession(string sessionID, string sessionPassword)
     }
     
     // Server response
-    if((numBytes = recv(sockfd, buffer, MAXDATASIZE, 0)) == -1)
-    {
-        perror("recv");
-        return false;
-    }
+    string s;
+    if(!receiveReply(s)) return false;
     
     // Checking packet type
-    string s(buffer), temp, data;
+    string temp, data;
     stringstream ss(s);
     ss >> response >> temp >> temp >> data;
     
@@ -243,17 +1113,16 @@ bool requestJoinSession(string sessionID, string sessionPassword)
 }
 
 
-// Asks server to remove it from the current session and checks server's response
+// Asks server to remove it from the given session and checks server's response
 // Returns true if session is exited
-bool requestLeaveSession()
+bool requestLeaveSession(string sessionID)
 {
-    char buffer[MAXDATASIZE];
-    int numBytes, response;
+    int response;
     struct message leaveSession;
     leaveSession.type = LEAVE_SESS;
-    leaveSession.size = 0;
+    leaveSession.size = sessionID.length() + 1;
     leaveSession.source = login.clientID;
-    leaveSession.data = "";
+    leaveSession.data = sessionID;
     
     // Sends login request to server
     if(!sendToServer(&leaveSession)){
@@ -261,13 +1130,10 @@ bool requestLeaveSession()
     }
     
     // Server response
-    if((numBytes = recv(sockfd, buffer, MAXDATASIZE, 0)) == -1)
-    {
-        perror("recv");
-        return false;
-    }
+    string s;
+    if(!receiveReply(s)) return false;
         
-    string s(buffer), temp, data;
+    string temp, data;
     stringstream ss(s);
     ss >> response >> temp >> temp >> data;
 
@@ -284,6 +1150,7 @@ bool requestLeaveSession()
     }
     else if (response == LS_ACK)
     {
+        leaveMulticastGroup(data);
         cout << "Exited session '" << data << "'!" << endl;
         return true;
     }
@@ -299,8 +1166,7 @@ bool requestLeaveSession()
 // Returns true if session was successfully created
 bool requestNewSession(string sessionID, string sessionPassword)
 {
-    char buffer[MAXDATASIZE];
-    int numBytes, response;
+    int response;
     struct message newSession;
     newSession.type = NEW_SESS;
     newSession.size = sessionID.length() + 1;
@@ -313,14 +1179,11 @@ bool requestNewSession(string sessionID, string sessionPassword)
     }
     
     // Server response
-    if((numBytes = recv(sockfd, buffer, MAXDATASIZE, 0)) == -1)
-    {
-        perror("recv");
-        return false;
-    }
+    string s;
+    if(!receiveReply(s)) return false;
         
     // Checking packet type
-    string s(buffer), temp, data;
+    string temp, data;
     stringstream ss(s);
     ss >> response >> temp >> temp >> data;
 
@@ -350,77 +1213,177 @@ bool requestNewSession(string sessionID, string sessionPassword)
 
 
 // Prints out list of connected clients and available sessions
-void printClientSessionList(string buffer)
+void printClientSessionList(const vector<string> &clients, const vector<string> &sessions)
 {
-    // Get rid of type, data_size, and source, leaving just the list of clients and sessions
-    stringstream ss(buffer);
-    string temp;
-    ss >> temp >> temp >> temp;
+    cout << endl << "Clients Online:" << endl;
+    for(auto const & client : clients) cout << " " << client << endl;
+    
+    cout << endl << "Available Sessions:" << endl;
+    for(auto const & session : sessions) cout << " " << session << endl;
+}
 
-    // Printing list of clients and sessions
-    string data;
+
+// Requests the list of active clients and available sessions whose names
+// start with the prefix, one page at a time until the server has sent them all
+// Returns true if the whole list was received
+bool requestClientSessionList(string prefix, vector<string> &clients, vector<string> &sessions)
+{
+    int response;
+    string clientCursor = LIST_FROM_START, sessionCursor = LIST_FROM_START;
     
-    cout << endl;
-    while(ss >> data)
+    while(clientCursor != LIST_DONE || sessionCursor != LIST_DONE)
     {
-        if(data == "Clients" || data == "Available") 
+        // Prepare message asking for the page after the cursors
+        struct message info;
+        info.type = QUERY;
+        info.source = login.clientID;
+        info.data = clientCursor + " " + sessionCursor + " " + to_string(LIST_PAGE_SIZE) 
+                    + " " + prefix;
+        info.size = info.data.length() + 1;
+
+        if(!sendToServer(&info)){
+            cout << "List unavailable!" << endl;
+            return false;
+        }
+
+        // Server response
+        string s;
+        if(!receiveReply(s)) return false;
+
+        // Checking packet type
+        string temp, data;
+        stringstream ss(s);
+        ss >> response >> temp >> temp;
+
+        if(response == QU_NAK)
+        {
+            getline(ss >> ws, data);
+            cout << "Error: " << data << endl;
+            return false;
+        }
+        if(response != QU_ACK)
+        {
+            cout << "List unavailable!" << endl;
+            return false;
+        }
+        
+        // Page received, sort the names into their lists
+        vector<string> *names = &clients;
+        string nextClientCursor = LIST_DONE, nextSessionCursor = LIST_DONE;
+        while(ss >> data)
         {
-            if (data == "Available") cout << endl;
-            cout << data;
-            ss >> data;
+            if(data == "Clients" || data == "Available")
+            {
+                names = (data == "Clients") ? &clients : &sessions;
+                ss >> data;
+            }
+            else if(data == "More:") ss >> nextClientCursor >> nextSessionCursor;
+            else names->push_back(data);
         }
-        cout << " " << data << endl;
+        
+        // Guard against a server that doesn't make progress
+        if(nextClientCursor == clientCursor && nextSessionCursor == sessionCursor) return false;
+        clientCursor = nextClientCursor;
+        sessionCursor = nextSessionCursor;
     }
-   
+    return true;
 }
 
 
-// Sends a request to return the list of active clients and available sessions
-// Returns session list if bool is true
-pair<bool, string> requestClientSessionList()
+// Searches the history of a session for messages with all of the terms and
+// prints the most recent ones
+// Returns true if the search was answered
+bool requestSearch(const string &sessionID, const string &terms)
 {
-    int numBytes, response;
-    char buffer[MAXDATASIZE];
+    struct message search;
+    search.type = SEARCH;
+    search.source = login.clientID;
+    search.data = sessionID + " " + terms;
+    search.size = search.data.length() + 1;
     
-    // Prepare message
-    struct message info;
-    info.type = QUERY;
-    info.size = 0;
-    info.source = login.clientID;
-    info.data = "";
+    if(!sendToServer(&search)) return false;
     
-    if(!sendToServer(&info)){
-        cout << "List unavailable!" << endl;
-        return make_pair(false, "NoList");
+    // Each match comes in its own packet, then the number of them
+    while(1)
+    {
+        string s;
+        if(!receiveReply(s)) return false;
+        
+        struct message reply = messageFromPacket(s.c_str());
+        stringstream ss(reply.data);
+        if(reply.type == SE_HIT)
+        {
+            time_t sent;
+            string source, text;
+            ss >> sent >> source;
+            ss.get(); // Remove extra space
+            getline(ss, text, '\0');
+            
+            char when[32];
+            strftime(when, sizeof(when), "%Y-%m-%d %H:%M", localtime(&sent));
+            cout << "[" << when << "] " << source << ": " << text << endl;
+        }
+        else if(reply.type == SE_ACK)
+        {
+            unsigned int found = 0;
+            ss >> found;
+            cout << found << " message(s) found in '" << sessionID << "'" << endl;
+            return true;
+        }
+        else if(reply.type == SE_NAK)
+        {
+            cout << "Error:" << reply.data << endl;
+            return false;
+        }
+        else
+        {
+            cout << "search: unknown message type received" << endl;
+            return false;
+        }
     }
-    
-    // Server response
-    if((numBytes = recv(sockfd, buffer, MAXDATASIZE, 0)) == -1)
+}
+
+
+// Connects to the server's local socket at the path given in place of its IP
+// Returns the socket, or -1 if it can't connect
+int createLocalConnection()
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if(login.serverPort != LOCAL_SOCKET_PORT && login.serverPort != SHARED_MEMORY_PORT)
     {
-        perror("recv");
-        return make_pair(false, "NoList");
+        cout << "Port must be " LOCAL_SOCKET_PORT " or " SHARED_MEMORY_PORT " for a local socket!" << endl;
+        return -1;
     }
+    if(login.serverIP.length() >= sizeof(address.sun_path))
+    {
+        cout << "Local socket path is too long!" << endl;
+        return -1;
+    }
+    strcpy(address.sun_path, login.serverIP.c_str());
     
-    // Checking packet type
-    string s(buffer);
-    stringstream ss(s);
-    ss >> response;
-    
-    if(response != QU_ACK)
+    int newSockFD = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(newSockFD == -1)
     {
-        cout << "List unavailable!" << endl;
-        return make_pair(false, "NoList");
+        perror("client: socket");
+        return -1;
     }
-    // List received, return it
-    else
+    if(connect(newSockFD, (struct sockaddr *) &address, sizeof(address)) == -1)
     {
-        return make_pair(true, s);
+        perror("client: connect");
+        close(newSockFD);
+        return -1;
     }
+    
+    printf("Trying to connect to server at %s\n", login.serverIP.c_str());
+    return newSockFD;
 }
 
 
 // Creates connection with server and returns socket file descriptor that
-// describes the connection
+// describes the connection. A server IP with a '/' in it is the path of the
+// server's local socket
 int createConnection()
 {
     int newSockFD, rv;
@@ -433,6 +1396,7 @@ int createConnection()
     {
         cout << "Invalid login info!" << endl;
     }
+    if(login.serverIP.find('/') != string::npos) return createLocalConnection();
     
     memset(&hints, 0, sizeof hints);
     hints.ai_family = AF_UNSPEC;
@@ -468,6 +1432,11 @@ int createConnection()
         return -1;
     }
 
+    // Only report the socket as writable once most of what was sent has gone
+    // out, so chunks don't pile up in front of the next typed message
+    int lowat = CHUNK_BACKLOG_SIZE;
+    setsockopt(newSockFD, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat));
+
     //Retrieves IP address from the server that is currently being connected to
     inet_ntop(p->ai_family, get_in_addr((struct sockaddr *) p->ai_addr),
             s, sizeof s);
@@ -477,15 +1446,72 @@ int createConnection()
 }
 
 
-void sendMessage(string message)
+// Sends a message as a traced one if it fits in a packet with its stamps
+// Returns false if it doesn't
+bool sendTracedMessage(const string &sessions, const string &message)
+{
+    string prefix = sessions + " " + login.clientID + "-" + to_string(nextTraceID) + " " + 
+                    to_string(stdinReadAt) + " ";
+    string data = prefix + to_string(monotonicNanoseconds()) + " " + message;
+    string packet = encodePacket<MESSAGE_TRACE>(login.clientID, data);
+    if(packet.length() + 1 + 3 * 20 > MAXDATASIZE) return false; // Room for the server's stamps
+    
+    nextTraceID++;
+    sendAllToServer(packet.c_str(), packet.length() + 1);
+    return true;
+}
+
+
+// Sends a message to one or more of our sessions, given as
+// "<session>[,<session>...]"
+// Messages too large for one packet are split into chunks that are sent one at
+// a time from the main loop, so the user can keep chatting while they go out
+void sendMessage(string sessions, string message)
 {
     struct message sessMessage;
     sessMessage.type = MESSAGE;
-    sessMessage.size = message.length() + 1;
     sessMessage.source = login.clientID;
-    sessMessage.data = message;
+    sessMessage.data = sessions + " " + message;
+    sessMessage.size = sessMessage.data.length() + 1;
+    
+    if(tracing && sendTracedMessage(sessions, message)) return;
+    if(stringifyMessage(&sessMessage).length() + 1 <= MAXDATASIZE)
+    {
+        if(!sendToServer(&sessMessage)) cout << "Message not sent!" << endl;
+        return;
+    }
+    if(message.length() > MAX_CHUNKED_MESSAGE_SIZE)
+    {
+        cout << "Message is too large to send!" << endl;
+        return;
+    }
     
-    if(!sendToServer(&sessMessage)) cout << "Message not sent!" << endl;
+    unsigned int messageID = nextMessageID++;
+    size_t queued = outgoingChunks.size();
+    for(size_t offset = 0; offset < message.length(); offset += CHUNK_PAYLOAD_SIZE)
+    {
+        string data = sessions + " " + to_string(messageID) + " " + to_string(offset) + " " 
+                      + to_string(message.length()) + " " 
+                      + message.substr(offset, CHUNK_PAYLOAD_SIZE);
+        outgoingChunks.push_back(encodePacket<MESSAGE_CHUNK>(login.clientID, data));
+        
+        // The session names take up room in every chunk
+        if(outgoingChunks.back().length() + 1 > MAXDATASIZE)
+        {
+            outgoingChunks.resize(queued);
+            cout << "Too many sessions to send a large message to!" << endl;
+            return;
+        }
+    }
+}
+
+
+// Sends the next waiting chunk of a large message
+void sendNextChunk()
+{
+    const string &chunk = outgoingChunks.front();
+    sendAllToServer(chunk.c_str(), chunk.length() + 1);
+    outgoingChunks.pop_front();
 }
 
 
@@ -499,8 +1525,7 @@ unsigned int countNumArguments(std::string const& str)
 
 bool sendDirectMessage(string receiverID, string message)
 {
-    char buffer[MAXDATASIZE];
-    int numBytes, response;
+    int response;
     struct message dirMessage;
     dirMessage.type = DIRMESSAGE;
     dirMessage.source = login.clientID;
@@ -510,13 +1535,10 @@ bool sendDirectMessage(string receiverID, string message)
     if(!sendToServer(&dirMessage)) cout << "Message not sent!" << endl;
     
     // Server response
-    if((numBytes = recv(sockfd, buffer, MAXDATASIZE, 0)) == -1)
-    {
-        perror("recv");
-        return false;
-    }
+    string s;
+    if(!receiveReply(s)) return false;
         
-    string s(buffer), temp, data;
+    string temp, data;
     stringstream ss(s);
     ss >> response >> temp >> temp >> data;
     
@@ -530,7 +1552,13 @@ bool sendDirectMessage(string receiverID, string message)
         cout << "Error: " << data << endl;
         return false;
     }
-    else if (response == DMESS_ACK) return true;
+    else if (response == DMESS_ACK)
+    {
+        string status;
+        ss >> status;
+        if(status == OFFLINE_ACK) cout << data << " is offline, they'll get the message when they log in" << endl;
+        return true;
+    }
     else
     {
         cout << "directmessage: unknown message type received" << endl;
@@ -538,7 +1566,93 @@ bool sendDirectMessage(string receiverID, string message)
     }
 }
 
-int main(int argc, char** argv)
+// Checks a file transfer reply from the server
+// Returns true if it is FILE_ACK, and puts its data in data
+bool checkFileReply(string &data)
+{
+    string s, temp;
+    int response;
+    if(!receiveReply(s)) return false;
+    
+    stringstream ss(s);
+    ss >> response >> temp >> temp;
+    ss.get(); // Remove the space before the data
+    getline(ss, data, '\0');
+    
+    if(response == FILE_NAK)
+    {
+        cout << "Error: " << data << endl;
+        return false;
+    }
+    else if(response != FILE_ACK)
+    {
+        cout << "sendfile: unknown message type received" << endl;
+        return false;
+    }
+    return true;
+}
+
+
+// Sends a file to a client, or to a session if receiverID is FILE_TO_SESSION
+// followed by the session's name, once the server has agreed to take it
+// Returns true if the file was delivered
+bool sendFile(string receiverID, string path)
+{
+    int filefd = open(path.c_str(), O_RDONLY);
+    struct stat fileInfo;
+    if(filefd == -1 || fstat(filefd, &fileInfo) == -1 || !S_ISREG(fileInfo.st_mode))
+    {
+        cout << "Can't read file '" << path << "'!" << endl;
+        if(filefd != -1) close(filefd);
+        return false;
+    }
+    
+    struct message fileRequest;
+    fileRequest.type = FILE_SEND;
+    fileRequest.source = login.clientID;
+    fileRequest.data = receiverID + " " + to_string(fileInfo.st_size) + " " 
+                       + path.substr(path.find_last_of('/') + 1);
+    fileRequest.size = fileRequest.data.length() + 1;
+    
+    string data;
+    if(!sendToServer(&fileRequest) || !checkFileReply(data))
+    {
+        close(filefd);
+        return false;
+    }
+    
+    // Server is ready, let the kernel copy the file straight to the socket, or
+    // copy it into shared memory a piece at a time
+    off_t offset = 0;
+    while(offset < fileInfo.st_size)
+    {
+        if(sharedMemory == NULL && sendfile(sockfd, filefd, &offset, fileInfo.st_size - offset) <= 0)
+        {
+            perror("sendfile");
+            close(filefd);
+            return false;
+        }
+        if(sharedMemory == NULL) continue;
+        
+        char buffer[1 << 16];
+        ssize_t length = pread(filefd, buffer, min((off_t) sizeof(buffer), fileInfo.st_size - offset), offset);
+        if(length <= 0 || !sendAllToServer(buffer, length))
+        {
+            if(length <= 0) perror("pread");
+            close(filefd);
+            return false;
+        }
+        offset += length;
+    }
+    close(filefd);
+    
+    if(!checkFileReply(data)) return false;
+    cout << "File sent to " << data << " client(s)!" << endl;
+    return true;
+}
+
+
+int main(int argc, char**)
 {
     if (argc != 1)
     {
@@ -547,10 +1661,12 @@ int main(int argc, char** argv)
     }
     
     fd_set master, read_fds; // WIll hold descriptors for connection and stdin
+    fd_set write_fds;        // Holds the connection while chunks are waiting to be sent
     int fdmax;
     
     FD_ZERO(&master);
     FD_ZERO(&read_fds);
+    FD_ZERO(&write_fds);
     FD_SET(STDIN_FILENO, &master); // File descriptor for standard input
     
     fdmax = STDIN_FILENO;
@@ -558,16 +1674,101 @@ int main(int argc, char** argv)
     /********************** GET LOGIN/CONNECTION INFO *************************/
 
     cout << "\nPlease enter login information in the following format:\n"
-            "/login <client_id> <password> <server-IP> <server-port>\n" << endl;
+            "/login <client_id> <password> <server-IP> <server-port>\n"
+            "or, on the server's host, with the path of its local socket and a port of "
+            LOCAL_SOCKET_PORT " or " SHARED_MEMORY_PORT "\n" << endl;
 
     while(1)
     {        
+        // Handle packets that arrived together with the reply to the last request
+        string packet;
+        while(takePacket(packet)) handleServerMessage(packet);
+        
+        // With shared memory, handle what's in our ring and mark us as waiting
+        // for more. A chunk can go once the server has taken most of what we
+        // sent, and we're marked as waiting for that too
+        bool sharedReady = false, chunkReady = false;
+        if(sharedMemory != NULL)
+        {
+            static char buf[RECEIVE_BATCH_SIZE];
+            size_t nbytes = sharedRingRead(&sharedMemory->toClient, buf, RECEIVE_BATCH_SIZE);
+            if(nbytes > 0)
+            {
+                sharedRingWake(sharedMemory->toClient.writerWaiting, serverWakeup);
+                receiveBuffer.append(buf, nbytes);
+                while(takePacket(packet)) handleServerMessage(packet);
+            }
+            sharedReady = !sharedRingReaderSleeps(&sharedMemory->toClient);
+            chunkReady = !outgoingChunks.empty() && 
+                         !sharedRingWriterSleeps(&sharedMemory->toServer, SHARED_RING_SIZE - CHUNK_BACKLOG_SIZE);
+        }
+        
         read_fds = master; // copy master list
-        if (select(fdmax+1, &read_fds, NULL, NULL, NULL) == -1)
+        FD_ZERO(&write_fds);
+        if(sockfd != -1 && sharedMemory == NULL && !outgoingChunks.empty()) FD_SET(sockfd, &write_fds);
+        int maxfd = fdmax;
+        if(sharedMemory != NULL)
+        {
+            FD_SET(clientWakeup, &read_fds);
+            maxfd = max(maxfd, clientWakeup);
+        }
+        
+        // Wake up in time to write out any messages waiting for the next frame
+        struct timeval frameWait, *timeout = NULL;
+        if(sharedReady || chunkReady)
         {
+            frameWait.tv_sec = frameWait.tv_usec = 0;
+            timeout = &frameWait;
+        }
+        else if(!renderBuffer.empty())
+        {
+            uint64_t now = monotonicNanoseconds(), due = lastFrameAt + RENDER_FRAME_NS;
+            uint64_t wait = due > now ? due - now : 0;
+            frameWait.tv_sec = wait / 1000000000ULL;
+            frameWait.tv_usec = wait % 1000000000ULL / 1000;
+            timeout = &frameWait;
+        }
+        for(auto const & group : multicastGroups)
+        {
+            if(group.second.fd == -1) continue;
+            FD_SET(group.second.fd, &read_fds);
+            maxfd = max(maxfd, group.second.fd);
+        }
+        
+        if (select(maxfd+1, &read_fds, &write_fds, NULL, timeout) == -1)
+        {
+            flushRender();
             perror("select");
             exit(4);
         }
+        
+        // Datagrams from the sessions' multicast groups, handled before
+        // anything that could leave one of the groups
+        vector<int> groupfds;
+        for(auto const & group : multicastGroups)
+        {
+            if(group.second.fd != -1 && FD_ISSET(group.second.fd, &read_fds)) groupfds.push_back(group.second.fd);
+        }
+        for(auto const & fd : groupfds)
+        {
+            receiveMulticastMessage(fd);
+            FD_CLR(fd, &read_fds);
+        }
+        
+        // What the wakeup was for is found by looking at the rings next pass
+        if(sharedMemory != NULL && FD_ISSET(clientWakeup, &read_fds))
+        {
+            uint64_t count;
+            if(read(clientWakeup, &count, sizeof(count)) == -1 && errno != EAGAIN)
+            {
+                flushRender();
+                perror("eventfd: read");
+            }
+            FD_CLR(clientWakeup, &read_fds);
+        }
+        
+        // Send one chunk per pass so typed messages can go out in between
+        if(sockfd != -1 && (FD_ISSET(sockfd, &write_fds) || chunkReady)) sendNextChunk();
 
         for(int i = 0; i <= fdmax; i++)
         {
@@ -575,12 +1776,17 @@ int main(int argc, char** argv)
             {
                 if(i == sockfd) // Message from the server
                 {
+                    // Read everything waiting in one go, so a burst of
+                    // messages is handled and shown in a single frame.
+                    // With shared memory, the socket only turns readable
+                    // when the server closes it
                     int nbytes;
-                    char buf[MAXDATASIZE];
+                    static char buf[RECEIVE_BATCH_SIZE];
 
                     // Got error or connection closed by server
-                    if ((nbytes = recv(i, buf, MAXDATASIZE, 0)) <= 0)
+                    if ((nbytes = recv(i, buf, RECEIVE_BATCH_SIZE, 0)) <= 0)
                     {
+                        flushRender();
                         if (nbytes == 0) // Connection closed
                         {
                             cout << "Server closed! Goodbye!" << endl;
@@ -593,18 +1799,8 @@ int main(int argc, char** argv)
                     }
                     else // Received data
                     {
-                        string received(buf), size, source, message;
-                        int type;
-                        stringstream ss(received);
-                        ss >> type >> size >> source;
-                        
-                        getline(ss, message);
-                        message.erase(0, 1); // Remove extra space from getline
-
-                        if(type == MESSAGE)
-                            cout << source << ": " << message << endl;
-                        else if(type == DIRMESSAGE)
-                            cout << source << "(DM): " << message << endl;
+                        receiveBuffer.append(buf, nbytes);
+                        while(takePacket(packet)) handleServerMessage(packet);
                     }
                 }
                 else // Only 2 descriptors in set, so this is stdin
@@ -612,7 +1808,26 @@ int main(int argc, char** argv)
                     // Create stringstream to extract login input from user
                     string input, command;
                     getline(cin, input);
+                    flushRender();
+                    if(tracing) stdinReadAt = monotonicNanoseconds();
                     stringstream ss(input);
+                    
+                    // Collect pasted lines until the user ends the paste
+                    if(pasting)
+                    {
+                        if(input == CMD_PASTE_END)
+                        {
+                            pasting = false;
+                            if(!pasteBuffer.empty())
+                            {
+                                pasteBuffer.erase(pasteBuffer.length() - 1); // Remove last newline
+                                sendMessage(activeSession, pasteBuffer);
+                            }
+                            pasteBuffer.clear();
+                        }
+                        else pasteBuffer += input + "\n";
+                        continue;
+                    }
 
                     ss >> command;
 
@@ -638,6 +1853,7 @@ int main(int argc, char** argv)
                                 FD_SET(sockfd, &master);
                                 if(sockfd > fdmax) fdmax = sockfd;
                                 loggedIn = true;
+                                if(login.serverPort == SHARED_MEMORY_PORT) requestSharedMemory();
                             }
                             else
                             {
@@ -655,9 +1871,9 @@ int main(int argc, char** argv)
                         {
                             cout << "Usage: /logout" << endl;
                         }
-                        else if(inSession)
+                        else if(!joinedSessions.empty())
                         {
-                            cout << "Please leave the session before logging out!" << endl;
+                            cout << "Please leave your sessions before logging out!" << endl;
                         }
                         else if(loggedIn)
                         {
@@ -678,9 +1894,9 @@ int main(int argc, char** argv)
                         {
                             cout << "Usage: /quit" << endl;
                         }
-                        else if(inSession)
+                        else if(!joinedSessions.empty())
                         {
-                            cout << "Please leave the session before quitting!" << endl;
+                            cout << "Please leave your sessions before quitting!" << endl;
                         }
                         else if(loggedIn)
                         {
@@ -713,7 +1929,8 @@ int main(int argc, char** argv)
                             ss >> sessionID >> sessionPassword;
                             if(requestJoinSession(sessionID, sessionPassword))
                             {
-                                inSession = true;
+                                joinedSessions.insert(sessionID);
+                                activeSession = sessionID;
                             }
                         }
                         cout << endl;
@@ -721,14 +1938,100 @@ int main(int argc, char** argv)
                     else if(command == CMD_LEAVESESS)
                     {
                         unsigned int numArguments = countNumArguments(input) - 1;
-                        if(numArguments != 0)
+                        string sessionID = activeSession;
+                        ss >> sessionID;
+                        
+                        if(numArguments > 1)
+                        {
+                            cout << "Usage: /leavesession [name]" << endl;
+                        }
+                        else if(requestLeaveSession(sessionID)) forgetSession(sessionID);
+                        cout << endl;
+                    }
+                    else if(command == CMD_SWITCH)
+                    {
+                        unsigned int numArguments = countNumArguments(input) - 1;
+                        string sessionID;
+                        ss >> sessionID;
+                        
+                        if(numArguments != 1)
+                        {
+                            cout << "Usage: /switch <name>" << endl;
+                        }
+                        else if(joinedSessions.find(sessionID) == joinedSessions.end())
+                        {
+                            cout << "Not in session '" << sessionID << "'!" << endl;
+                        }
+                        else
+                        {
+                            activeSession = sessionID;
+                            cout << "Now sending to session '" << activeSession << "'" << endl;
+                        }
+                        cout << endl;
+                    }
+                    else if(command == CMD_SESSMESSAGE)
+                    {
+                        unsigned int numArguments = countNumArguments(input) - 1;
+                        string sessions, message, missing;
+                        ss >> sessions;
+                        ss.get(); // Remove the space before the message
+                        getline(ss, message);
+                        
+                        stringstream names(sessions);
+                        for(string sessionID; getline(names, sessionID, SESSION_SEPARATOR); )
+                        {
+                            if(joinedSessions.find(sessionID) == joinedSessions.end()) missing = sessionID;
+                        }
+                        
+                        if(numArguments < 2)
+                        {
+                            cout << "Usage: /sessionmessage <name>[,<name>...] <message>" << endl;
+                        }
+                        else if(!missing.empty())
+                        {
+                            cout << "Not in session '" << missing << "'!" << endl;
+                        }
+                        else sendMessage(sessions, message);
+                    }
+                    else if(command == CMD_TRACE)
+                    {
+                        string mode;
+                        ss >> mode;
+                        
+                        if(mode == "on" || mode == "off")
+                        {
+                            tracing = mode == "on";
+                            cout << "Tracing " << (tracing ? "on" : "off") << endl;
+                        }
+                        else if(mode == "dump") dumpTraces();
+                        else cout << "Usage: /trace on|off|dump" << endl;
+                        cout << endl;
+                    }
+                    else if(command == CMD_HISTORY)
+                    {
+                        unsigned int numArguments = countNumArguments(input) - 1;
+                        long count = SCROLLBACK_LINES;
+                        ss >> count;
+                        
+                        if(numArguments > 1 || count <= 0)
                         {
-                            cout << "Usage: /leavesession" << endl;
+                            cout << "Usage: /history [count]" << endl;
                         }
-                        else if(requestLeaveSession())
+                        else printScrollback(count);
+                        cout << endl;
+                    }
+                    else if(command == CMD_SEARCH)
+                    {
+                        unsigned int numArguments = countNumArguments(input) - 1;
+                        string sessionID, terms;
+                        ss >> sessionID;
+                        getline(ss, terms);
+                        
+                        if(numArguments < 2)
                         {
-                            inSession = false;
+                            cout << "Usage: /search <name> <terms>" << endl;
                         }
+                        else requestSearch(sessionID, terms);
                         cout << endl;
                     }
                     else if (command == CMD_CREATESESS)
@@ -744,7 +2047,8 @@ int main(int argc, char** argv)
                             ss >> sessionID >> sessionPassword;
                             if(requestNewSession(sessionID, sessionPassword))
                             {
-                                inSession = true;
+                                joinedSessions.insert(sessionID);
+                                activeSession = sessionID;
                             }
                         }
                         cout << endl;
@@ -752,19 +2056,24 @@ int main(int argc, char** argv)
                     else if(command == CMD_LIST)
                     {
                         unsigned int numArguments = countNumArguments(input) - 1;
-                        if(numArguments != 0)
+                        if(numArguments > 1)
                         {
-                            cout << "Usage: /list" << endl;
+                            cout << "Usage: /list [prefix]" << endl;
                         }
-                        else if(inSession)
+                        else if(!joinedSessions.empty())
                         {
-                            cout << "Please leave the session before listing connected "
+                            cout << "Please leave your sessions before listing connected "
                                     "clients and available sessions!" << endl;
                         }
                         else
                         {
-                            auto res = requestClientSessionList();
-                            if(res.first == true) printClientSessionList(res.second);
+                            string prefix;
+                            vector<string> clients, sessions;
+                            ss >> prefix;
+                            if(requestClientSessionList(prefix, clients, sessions))
+                            {
+                                printClientSessionList(clients, sessions);
+                            }
                         }
                         cout << endl;
                     }
@@ -807,26 +2116,66 @@ int main(int argc, char** argv)
                         }
                         cout << endl;
                     }
+                    else if(command == CMD_SENDFILE)
+                    {
+                        unsigned int numArguments = countNumArguments(input) - 1;
+                        string receiverID = FILE_TO_SESSION + activeSession, path;
+                        if(numArguments == 2) ss >> receiverID;
+                        ss >> path;
+                        
+                        if(numArguments != 1 && numArguments != 2)
+                        {
+                            cout << "Usage: /sendfile [user] <path>" << endl;
+                        }
+                        else if(numArguments == 1 && joinedSessions.empty())
+                        {
+                            cout << "Please join a session or name a user to send the file to!" << endl;
+                        }
+                        else sendFile(receiverID, path);
+                        cout << endl;
+                    }
+                    else if(command == CMD_PASTE)
+                    {
+                        unsigned int numArguments = countNumArguments(input) - 1;
+                        if(numArguments != 0)
+                        {
+                            cout << "Usage: /paste" << endl;
+                        }
+                        else if(joinedSessions.empty())
+                        {
+                            cout << "Please join a session before pasting a message!" << endl;
+                        }
+                        else
+                        {
+                            pasting = true;
+                            cout << "Paste your message, then type " << CMD_PASTE_END 
+                                 << " on its own line to send it" << endl;
+                        }
+                        cout << endl;
+                    }
                     else
                     {
-                        if(!inSession)
+                        if(joinedSessions.empty())
                         {
                             cout << "Unknown command" << endl;
                             cout << endl;
                         }
                         else
                         {
-                            // Send message to the server to send to all clients in the session
+                            // Send message to the server to send to all clients in the active session
                             string message;
                             getline(ss, message);
                             message.insert(0, command); // Command is part of the message
                             
-                            sendMessage(message);
+                            sendMessage(activeSession, message);
                         }
                     }
                 }
             }
         }
+        
+        // Messages shown in this pass go out with the next frame
+        if(!renderBuffer.empty() && monotonicNanoseconds() - lastFrameAt >= RENDER_FRAME_NS) flushRender();
     }
     return 0;
 }
\ No newline at end of file
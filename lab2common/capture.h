@@ -0,0 +1,32 @@
+/*
+ * File:   capture.h
+ *
+ * Format of the traffic captures written by the server and read back by the
+ * replay tool
+ */
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+
+#define CAPTURE_MAGIC "CHATCAP1" // First 8 bytes of a capture file
+
+// A capture is CAPTURE_MAGIC followed by records in the order the server saw
+// them. Each record is a captureRecord, followed by the packet for a
+// CAPTURE_PACKET and by nothing for the other kinds
+enum captureKind {
+    CAPTURE_OPEN,       // A connection was accepted
+    CAPTURE_PACKET,     // A whole packet was received, length bytes including its '\0'
+    CAPTURE_FILE_DATA,  // length bytes of a file were received, which aren't kept
+    CAPTURE_CLOSE       // The connection was closed by either end
+};
+
+struct __attribute__((packed)) captureRecord {
+    uint64_t time;          // Nanoseconds since the capture started
+    uint32_t connection;    // Numbered from 1 in the order connections were accepted
+    uint32_t length;
+    uint8_t kind;           // A captureKind
+};
+
+#endif /* CAPTURE_H */
@@ -0,0 +1,186 @@
+/* 
+ * File:   protocol.h
+ *
+ * Control packet types and packet encoding shared by the client and server.
+ * Kept to a header, as the encoders and dispatch tables are templates made
+ * for each packet type where they're used, and each project builds from one
+ * source file with nothing to link but the system's libraries
+ */
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <string>
+#include <stddef.h>
+#include <stdlib.h>
+
+#define ACK_DATA "NoData" // Data of a packet that was sent without any
+
+// Every control packet type and the number it goes over the wire as. The
+// enum, the encoders and the dispatch tables below are all generated from
+// this list, so new types only need adding here
+#define PROTOCOL_MESSAGE_TYPES(X) \
+    X(LOGIN, 0)                   \
+    X(LO_ACK, 1)                  \
+    X(LO_NAK, 2)                  \
+    X(EXIT, 3)                    \
+    X(JOIN, 4)                    \
+    X(JN_ACK, 5)                  \
+    X(JN_NAK, 6)                  \
+    X(LEAVE_SESS, 7)              \
+    X(LS_ACK, 8)                  \
+    X(LS_NAK, 9)                  \
+    X(NEW_SESS, 10)               \
+    X(NS_ACK, 11)                 \
+    X(NS_NAK, 12)                 \
+    X(MESSAGE, 13)                \
+    X(QUERY, 14)                  \
+    X(QU_ACK, 15)                 \
+    X(DIRMESSAGE, 16)             \
+    X(DMESS_ACK, 17)              \
+    X(DMESS_NAK, 18)              \
+    X(MESSAGE_CHUNK, 19)          \
+    X(FILE_SEND, 20)              \
+    X(FILE_ACK, 21)               \
+    X(FILE_NAK, 22)               \
+    X(MC_GROUP, 23)               \
+    X(MC_JOINED, 24)              \
+    X(MC_MESSAGE, 25)             \
+    X(MC_NAK, 26)                 \
+    X(MC_LOST, 27)                \
+    X(SEARCH, 28)                 \
+    X(SE_HIT, 29)                 \
+    X(SE_ACK, 30)                 \
+    X(SE_NAK, 31)                 \
+    X(MESSAGE_TRACE, 32)          \
+    X(SESS_CLOSED, 33)            \
+    X(SHM_ATTACH, 34)             \
+    X(SHM_ACK, 35)                \
+    X(SHM_NAK, 36)                \
+    X(BROADCAST, 37)              \
+    X(QU_NAK, 38)                 \
+    X(MC_RECEIVING, 39)
+
+
+// Defines control packet types
+#define PROTOCOL_ENUM_VALUE(name, number) name = number,
+enum msgType {
+    PROTOCOL_MESSAGE_TYPES(PROTOCOL_ENUM_VALUE)
+    MSG_TYPE_COUNT
+};
+#undef PROTOCOL_ENUM_VALUE
+
+// Types are numbered in order so they can index the dispatch tables
+#define PROTOCOL_CHECK_ORDER(name, number) \
+    static_assert(name < MSG_TYPE_COUNT, #name " is numbered past the end of the table");
+PROTOCOL_MESSAGE_TYPES(PROTOCOL_CHECK_ORDER)
+#undef PROTOCOL_CHECK_ORDER
+
+
+// Message structure to be serialized when sending messages
+// Note: when message is stringified, the delimiter between fields is " "
+struct message {
+    unsigned int type;
+    unsigned int size;
+    std::string source;
+    std::string data;
+};
+
+
+// The "<type> " every packet of a type starts with, known at compile time
+template<msgType type> struct packetPrefix;
+
+#define PROTOCOL_PREFIX(name, number)                                             \
+    template<> struct packetPrefix<name> {                                        \
+        static constexpr const char *text() { return #number " "; }              \
+        static constexpr size_t length() { return sizeof(#number " ") - 1; }      \
+    };
+PROTOCOL_MESSAGE_TYPES(PROTOCOL_PREFIX)
+#undef PROTOCOL_PREFIX
+
+
+// Create a packet string from a message structure
+inline std::string stringifyMessage(const struct message *data)
+{
+    std::string type = std::to_string(data->type), size = std::to_string(data->size);
+    std::string dataStr;
+    dataStr.reserve(type.length() + size.length() + data->source.length() + data->data.length() + 3);
+    
+    dataStr += type;
+    dataStr += ' ';
+    dataStr += size;
+    dataStr += ' ';
+    dataStr += data->source;
+    dataStr += ' ';
+    dataStr += data->data;
+    return dataStr;
+}
+
+
+// Creates the packet string for a message of a type known at compile time,
+// with its size set from the data
+template<msgType type>
+inline std::string encodePacket(const std::string &source, const std::string &data)
+{
+    std::string size = std::to_string(data.length() + 1);
+    std::string dataStr;
+    dataStr.reserve(packetPrefix<type>::length() + size.length() + source.length() + data.length() + 2);
+    
+    dataStr.append(packetPrefix<type>::text(), packetPrefix<type>::length());
+    dataStr += size;
+    dataStr += ' ';
+    dataStr += source;
+    dataStr += ' ';
+    dataStr += data;
+    return dataStr;
+}
+
+
+// Creates a message structure from a packet (string)
+// The data keeps the space that separates it from the source, and is ACK_DATA
+// if the packet ends at the source
+inline struct message messageFromPacket(const char *buf)
+{
+    struct message packet;
+    char *end;
+    
+    packet.type = strtoul(buf, &end, 10);
+    packet.size = strtoul(end, &end, 10);
+    
+    const char *source = end;
+    while(*source == ' ' || *source == '\t' || *source == '\n') source++;
+    const char *sourceEnd = source;
+    while(*sourceEnd != '\0' && *sourceEnd != ' ' && *sourceEnd != '\t' && *sourceEnd != '\n') sourceEnd++;
+    
+    packet.source.assign(source, sourceEnd);
+    if(*sourceEnd == '\0') packet.data = ACK_DATA;
+    else packet.data.assign(sourceEnd);
+    return packet;
+}
+
+
+// Table of handlers indexed by packet type, filled in at compile time with
+// Handler<type>::handle for every type in the schema, so handling a packet is
+// one bounds check and one indirect call
+// Handlers return false for packets they don't deal with
+template<template<msgType> class Handler, typename... Args>
+struct packetDispatcher {
+    typedef bool (*handlerFunction)(Args...);
+    static const handlerFunction handlers[MSG_TYPE_COUNT];
+    
+    // Returns false if the type is unknown or its handler didn't deal with it
+    static bool dispatch(unsigned int type, Args... args)
+    {
+        return type < MSG_TYPE_COUNT && handlers[type](args...);
+    }
+};
+
+#define PROTOCOL_HANDLER(name, number) &Handler<name>::handle,
+template<template<msgType> class Handler, typename... Args>
+const typename packetDispatcher<Handler, Args...>::handlerFunction
+packetDispatcher<Handler, Args...>::handlers[MSG_TYPE_COUNT] = {
+    PROTOCOL_MESSAGE_TYPES(PROTOCOL_HANDLER)
+};
+#undef PROTOCOL_HANDLER
+
+#endif /* PROTOCOL_H */
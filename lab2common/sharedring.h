@@ -0,0 +1,112 @@
+/*
+ * File:   sharedring.h
+ *
+ * Rings in shared memory that a client on the same host as the server can send
+ * and receive packets through instead of its socket
+ */
+
+#ifndef SHAREDRING_H
+#define SHAREDRING_H
+
+#include <atomic>
+#include <algorithm>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SHARED_RING_SIZE (1 << 20) // Bytes each way, must be a power of two
+
+// Single-producer/single-consumer byte stream. Each side only moves its own
+// position. A side that runs out of data to read or room to write sets its
+// waiting flag and sleeps on its eventfd, and the other side signals that
+// eventfd if it finds the flag set after moving its position
+struct sharedRing {
+    alignas(64) std::atomic<uint64_t> head;         // Next byte to read, moved by the reader
+    alignas(64) std::atomic<uint64_t> tail;         // Next byte to write, moved by the writer
+    alignas(64) std::atomic<uint32_t> readerWaiting;
+    std::atomic<uint32_t> writerWaiting;
+    char data[SHARED_RING_SIZE];
+};
+
+// The shared memory of a connection, created zeroed by the server and passed
+// to the client with the eventfds each side sleeps on
+struct sharedChannel {
+    struct sharedRing toServer;
+    struct sharedRing toClient;
+};
+
+
+// Returns the bytes waiting to be read
+inline size_t sharedRingUsed(struct sharedRing *ring)
+{
+    return ring->tail.load(std::memory_order_acquire) - ring->head.load(std::memory_order_acquire);
+}
+
+
+// Copies as much of data into the ring as there's room for
+// Returns the number of bytes written
+inline size_t sharedRingWrite(struct sharedRing *ring, const char *data, size_t length)
+{
+    uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+    size_t room = SHARED_RING_SIZE - (tail - ring->head.load(std::memory_order_acquire));
+    if(length > room) length = room;
+
+    size_t index = tail & (SHARED_RING_SIZE - 1);
+    size_t first = std::min(length, (size_t) SHARED_RING_SIZE - index);
+    memcpy(ring->data + index, data, first);
+    memcpy(ring->data, data + first, length - first);
+    ring->tail.store(tail + length, std::memory_order_release);
+    return length;
+}
+
+
+// Copies up to length bytes out of the ring
+// Returns the number of bytes read
+inline size_t sharedRingRead(struct sharedRing *ring, char *buffer, size_t length)
+{
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    size_t used = ring->tail.load(std::memory_order_acquire) - head;
+    if(length > used) length = used;
+
+    size_t index = head & (SHARED_RING_SIZE - 1);
+    size_t first = std::min(length, (size_t) SHARED_RING_SIZE - index);
+    memcpy(buffer, ring->data + index, first);
+    memcpy(buffer + first, ring->data, length - first);
+    ring->head.store(head + length, std::memory_order_release);
+    return length;
+}
+
+
+// Marks the reader as waiting before it sleeps
+// Returns false if data arrived meanwhile, so it shouldn't sleep after all
+inline bool sharedRingReaderSleeps(struct sharedRing *ring)
+{
+    ring->readerWaiting.store(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return sharedRingUsed(ring) == 0;
+}
+
+
+// Marks the writer as waiting for room for length bytes before it sleeps
+// Returns false if there's room now, so it shouldn't sleep after all
+inline bool sharedRingWriterSleeps(struct sharedRing *ring, size_t length)
+{
+    ring->writerWaiting.store(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return SHARED_RING_SIZE - sharedRingUsed(ring) < length;
+}
+
+
+// Signals the other side's eventfd after moving a position, if it was waiting
+// on the flag: the reader's after a write, the writer's after a read
+inline void sharedRingWake(std::atomic<uint32_t> &waiting, int eventfd)
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(waiting.load(std::memory_order_relaxed) == 0 || waiting.exchange(0) == 0) return;
+
+    uint64_t one = 1;
+    if(write(eventfd, &one, sizeof(one)) == -1) perror("eventfd: write");
+}
+
+#endif /* SHAREDRING_H */
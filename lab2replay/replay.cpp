@@ -0,0 +1,477 @@
+/*
+ * File:   replay.cpp
+ *
+ * Drives a server with the traffic in a capture written by "server -w", either
+ * at the speed it was recorded or as fast as the server will take it, and
+ * reports the throughput and how long requests took to be answered
+ */
+
+#include <cstdlib>
+#include <string>
+#include <iostream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <time.h>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <algorithm>
+
+#include "protocol.h"
+#include "capture.h"
+
+#define RECEIVE_SIZE 65536      // Bytes read from a connection at once
+#define REPLY_WAIT_MS 2000      // Longest wait for replies before moving to another connection
+#define DRAIN_WAIT_MS 1000      // Time left for the last replies once the capture is sent
+#define ZERO_BLOCK_SIZE 65536   // Bytes of zeros sent at once in place of file contents
+
+using namespace std;
+
+
+// A request sent that the server will answer, and when it was sent
+struct pendingReply {
+    unsigned int type;
+    uint64_t sentAt;
+};
+
+// A connection from the capture that is being replayed
+struct replayConnection {
+    int sockfd;
+    deque<struct pendingReply> pending; // Requests not yet answered, oldest first
+    string received;                    // Bytes of a packet that hasn't all arrived
+    unsigned long fileRemaining;        // Bytes of a file being sent to us still to skip
+    unsigned long fileSending;          // Bytes of our own file still to send
+};
+
+// Connections by their number in the capture
+unordered_map<uint32_t, struct replayConnection> connections;
+
+// Sockets of every open connection, for select
+fd_set master;
+int fdmax = -1;
+
+// Totals for the report
+unsigned long packetsSent = 0, bytesSent = 0, packetsReceived = 0, bytesReceived = 0;
+unsigned long failedConnections = 0;
+vector<uint64_t> replyLatencies; // Nanoseconds each answered request took
+
+const char *serverIP, *serverPort;
+
+
+// Returns the time on the monotonic clock in nanoseconds
+uint64_t monotonicNanoseconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+
+// Returns the request a packet from the server answers, or MSG_TYPE_COUNT if
+// it isn't a reply
+unsigned int requestAnswered(unsigned int type)
+{
+    switch(type)
+    {
+        case LO_ACK: case LO_NAK: return LOGIN;
+        case JN_ACK: case JN_NAK: return JOIN;
+        case LS_ACK: case LS_NAK: return LEAVE_SESS;
+        case NS_ACK: case NS_NAK: return NEW_SESS;
+        case QU_ACK: case QU_NAK: return QUERY;
+        case DMESS_ACK: case DMESS_NAK: return DIRMESSAGE;
+        case FILE_ACK: case FILE_NAK: return FILE_SEND;
+        case SE_ACK: case SE_NAK: return SEARCH;
+        case SHM_ACK: case SHM_NAK: return SHM_ATTACH;
+        default: return MSG_TYPE_COUNT;
+    }
+}
+
+
+// Returns true for the requests the server always answers
+bool expectsReply(unsigned int type)
+{
+    switch(type)
+    {
+        case LOGIN: case JOIN: case LEAVE_SESS: case NEW_SESS: case QUERY:
+        case DIRMESSAGE: case FILE_SEND: case SEARCH: case SHM_ATTACH: return true;
+        default: return false;
+    }
+}
+
+
+// Records how long the oldest request a reply answers took
+void matchReply(struct replayConnection &connection, unsigned int type)
+{
+    unsigned int request = requestAnswered(type);
+    if(request == MSG_TYPE_COUNT) return;
+
+    for(auto it = connection.pending.begin(); it != connection.pending.end(); it++)
+    {
+        if(it->type != request) continue;
+        replyLatencies.push_back(monotonicNanoseconds() - it->sentAt);
+        connection.pending.erase(it);
+        return;
+    }
+}
+
+
+// Splits what arrived on a connection into packets, skipping the contents of
+// files sent to it
+void takePackets(struct replayConnection &connection)
+{
+    size_t start = 0;
+    while(start < connection.received.length())
+    {
+        if(connection.fileRemaining > 0)
+        {
+            size_t skip = min((size_t) connection.fileRemaining, connection.received.length() - start);
+            connection.fileRemaining -= skip;
+            start += skip;
+            continue;
+        }
+
+        size_t end = connection.received.find('\0', start);
+        if(end == string::npos) break;
+
+        struct message packet = messageFromPacket(connection.received.c_str() + start);
+        packetsReceived++;
+        if(packet.type == FILE_SEND) connection.fileRemaining = strtoul(packet.data.c_str(), NULL, 10);
+        matchReply(connection, packet.type);
+        start = end + 1;
+    }
+    connection.received.erase(0, start);
+}
+
+
+// Closes a connection, forgetting the replies it was waiting for
+void closeConnection(uint32_t id)
+{
+    auto it = connections.find(id);
+    if(it == connections.end()) return;
+
+    FD_CLR(it->second.sockfd, &master);
+    close(it->second.sockfd);
+    connections.erase(it);
+}
+
+
+// Reads whatever the server sent on every connection, waiting up to timeoutMs
+// for something to arrive. A connection waiting to send is also woken when it
+// can, so the server is never left blocked writing to us while we wait on it
+void pollConnections(int timeoutMs, int writefd = -1)
+{
+    fd_set read_fds = master, write_fds;
+    FD_ZERO(&write_fds);
+    if(writefd != -1) FD_SET(writefd, &write_fds);
+
+    struct timeval tv;
+    tv.tv_sec = timeoutMs / 1000;
+    tv.tv_usec = (timeoutMs % 1000) * 1000;
+
+    int highest = max(fdmax, writefd);
+    if(select(highest + 1, &read_fds, &write_fds, NULL, &tv) <= 0) return;
+
+    vector<uint32_t> hungUp;
+    char buffer[RECEIVE_SIZE];
+    for(auto &entry : connections)
+    {
+        struct replayConnection &connection = entry.second;
+        if(!FD_ISSET(connection.sockfd, &read_fds)) continue;
+
+        ssize_t nbytes;
+        while((nbytes = recv(connection.sockfd, buffer, sizeof buffer, 0)) > 0)
+        {
+            bytesReceived += nbytes;
+            connection.received.append(buffer, nbytes);
+        }
+        takePackets(connection);
+        if(nbytes == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) hungUp.push_back(entry.first);
+    }
+
+    // The capture says when each connection closed, but the server may close
+    // one first, such as after a failed login
+    for(auto const & id : hungUp) closeConnection(id);
+}
+
+
+// Sends all of a buffer on a connection, reading replies while it waits
+// Returns false if the connection failed or the server closed it meanwhile
+bool sendAll(uint32_t id, const char *data, size_t length)
+{
+    while(length > 0)
+    {
+        auto it = connections.find(id);
+        if(it == connections.end()) return false;
+
+        ssize_t nbytes = send(it->second.sockfd, data, length, MSG_NOSIGNAL);
+        if(nbytes == -1)
+        {
+            if(errno != EAGAIN && errno != EWOULDBLOCK) return false;
+            pollConnections(REPLY_WAIT_MS, it->second.sockfd);
+            continue;
+        }
+        bytesSent += nbytes;
+        data += nbytes;
+        length -= nbytes;
+    }
+    return true;
+}
+
+
+// Connects to the server for a connection that was accepted in the capture
+void openConnection(uint32_t id)
+{
+    struct addrinfo hints, *servinfo, *p;
+    int rv, sockfd = -1;
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if((rv = getaddrinfo(serverIP, serverPort, &hints, &servinfo)) != 0)
+    {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+        exit(1);
+    }
+
+    for(p = servinfo; p != NULL; p = p->ai_next)
+    {
+        if((sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1) continue;
+        if(connect(sockfd, p->ai_addr, p->ai_addrlen) == 0) break;
+        close(sockfd);
+        sockfd = -1;
+    }
+    freeaddrinfo(servinfo);
+
+    if(sockfd == -1 || sockfd >= FD_SETSIZE)
+    {
+        if(sockfd != -1) close(sockfd);
+        perror("replay: connect");
+        failedConnections++;
+        return;
+    }
+
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+
+    struct replayConnection connection;
+    connection.sockfd = sockfd;
+    connection.fileRemaining = 0;
+    connection.fileSending = 0;
+    connections[id] = connection;
+
+    FD_SET(sockfd, &master);
+    fdmax = max(fdmax, sockfd);
+}
+
+
+// Sends a captured packet, remembering the requests the server will answer
+void sendPacket(uint32_t id, const char *packet, size_t length)
+{
+    auto it = connections.find(id);
+    if(it == connections.end()) return;
+    struct replayConnection &connection = it->second;
+
+    unsigned int type = strtoul(packet, NULL, 10);
+    if(type == FILE_SEND)
+    {
+        // The contents follow as FILE_DATA records once the server is ready,
+        // and it answers again when they have all gone
+        unsigned long size = 0;
+        struct message request = messageFromPacket(packet);
+        sscanf(request.data.c_str(), "%*s %lu", &size);
+        connection.fileSending = size;
+    }
+
+    struct pendingReply reply;
+    reply.type = type;
+    reply.sentAt = monotonicNanoseconds();
+    if(expectsReply(type)) connection.pending.push_back(reply);
+
+    if(!sendAll(id, packet, length)) closeConnection(id);
+    else packetsSent++;
+}
+
+
+// Sends zeros in place of the part of a file a connection sent in the capture
+void sendFileData(uint32_t id, uint32_t length)
+{
+    static const char zeros[ZERO_BLOCK_SIZE] = {0};
+    uint32_t total = length;
+
+    while(length > 0)
+    {
+        size_t chunk = min((size_t) length, sizeof zeros);
+        if(!sendAll(id, zeros, chunk))
+        {
+            closeConnection(id);
+            return;
+        }
+        length -= chunk;
+    }
+
+    auto it = connections.find(id);
+    if(it == connections.end()) return;
+    struct replayConnection &connection = it->second;
+
+    connection.fileSending -= min((unsigned long) total, connection.fileSending);
+    if(connection.fileSending == 0)
+    {
+        struct pendingReply reply;
+        reply.type = FILE_SEND;
+        reply.sentAt = monotonicNanoseconds();
+        connection.pending.push_back(reply);
+    }
+}
+
+
+// Waits until a connection's requests have been answered, so the next
+// connection's traffic reaches the server in the order it was captured
+void waitForReplies(uint32_t id)
+{
+    uint64_t deadline = monotonicNanoseconds() + (uint64_t) REPLY_WAIT_MS * 1000000;
+    for(auto it = connections.find(id); it != connections.end() && !it->second.pending.empty();
+        it = connections.find(id))
+    {
+        uint64_t now = monotonicNanoseconds();
+        if(now >= deadline) return;
+        pollConnections((deadline - now) / 1000000 + 1);
+    }
+}
+
+
+// Returns the latency at a percentile of the sorted latencies, in milliseconds
+double percentileMs(const vector<uint64_t> &sorted, double percentile)
+{
+    if(sorted.empty()) return 0;
+    size_t index = min(sorted.size() - 1, (size_t) (percentile / 100 * sorted.size()));
+    return sorted[index] / 1e6;
+}
+
+
+int main(int argc, char** argv)
+{
+    bool fast = false;
+    int opt;
+    while((opt = getopt(argc, argv, "f")) != -1)
+    {
+        if(opt == 'f') fast = true;
+        else
+        {
+            fprintf(stderr, "usage: replay [-f] capture_file server_IP server_port\n");
+            exit(1);
+        }
+    }
+    if(argc - optind != 3)
+    {
+        fprintf(stderr, "usage: replay [-f] capture_file server_IP server_port\n");
+        exit(1);
+    }
+    serverIP = argv[optind + 1];
+    serverPort = argv[optind + 2];
+
+    FILE *capture = fopen(argv[optind], "rb");
+    if(capture == NULL)
+    {
+        perror("fopen");
+        exit(2);
+    }
+
+    char magic[sizeof(CAPTURE_MAGIC) - 1];
+    if(fread(magic, 1, sizeof magic, capture) != sizeof magic ||
+       memcmp(magic, CAPTURE_MAGIC, sizeof magic) != 0)
+    {
+        fprintf(stderr, "replay: %s is not a capture\n", argv[optind]);
+        exit(2);
+    }
+
+    FD_ZERO(&master);
+
+    struct captureRecord record;
+    vector<char> packet;
+    uint32_t lastConnection = 0;
+    unsigned long records = 0;
+    uint64_t start = monotonicNanoseconds();
+
+    while(fread(&record, sizeof record, 1, capture) == 1)
+    {
+        if(record.kind == CAPTURE_PACKET)
+        {
+            packet.resize(record.length + 1);
+            if(fread(packet.data(), 1, record.length, capture) != record.length) break;
+            packet[record.length] = '\0';
+        }
+        records++;
+
+        // Keep to the recorded timing, reading replies while waiting
+        if(!fast)
+        {
+            uint64_t now;
+            while((now = monotonicNanoseconds()) < start + record.time)
+            {
+                pollConnections((start + record.time - now) / 1000000 + 1);
+            }
+        }
+
+        if(record.connection != lastConnection)
+        {
+            waitForReplies(lastConnection);
+            lastConnection = record.connection;
+        }
+
+        switch(record.kind)
+        {
+            case CAPTURE_OPEN: openConnection(record.connection); break;
+            case CAPTURE_PACKET: sendPacket(record.connection, packet.data(), record.length); break;
+            case CAPTURE_FILE_DATA: sendFileData(record.connection, record.length); break;
+            case CAPTURE_CLOSE:
+                // The client had its answers before it went in the capture
+                waitForReplies(record.connection);
+                closeConnection(record.connection);
+                break;
+        }
+
+        pollConnections(0);
+    }
+    if(ferror(capture)) perror("fread");
+    fclose(capture);
+
+    // Give the last replies a chance to arrive, and keep reading a while
+    // longer for messages the server sends without being asked
+    uint64_t sent = monotonicNanoseconds();
+    vector<uint32_t> waiting;
+    for(auto const & entry : connections)
+    {
+        if(!entry.second.pending.empty()) waiting.push_back(entry.first);
+    }
+    for(auto const & id : waiting) waitForReplies(id);
+    uint64_t now, drained = monotonicNanoseconds() + (uint64_t) DRAIN_WAIT_MS * 1000000;
+    while((now = monotonicNanoseconds()) < drained) pollConnections((drained - now) / 1000000 + 1);
+
+    unsigned long unanswered = 0;
+    for(auto const & entry : connections) unanswered += entry.second.pending.size();
+    while(!connections.empty()) closeConnection(connections.begin()->first);
+
+    double seconds = (sent - start) / 1e9;
+    sort(replyLatencies.begin(), replyLatencies.end());
+
+    printf("Replayed %lu records at %s speed in %.3f s\n", records, fast ? "full" : "recorded", seconds);
+    printf("Sent %lu packets, %lu bytes (%.0f packets/s, %.2f MB/s)\n", packetsSent, bytesSent,
+           seconds > 0 ? packetsSent / seconds : 0, seconds > 0 ? bytesSent / seconds / 1e6 : 0);
+    printf("Received %lu packets, %lu bytes\n", packetsReceived, bytesReceived);
+    printf("Replies: %zu answered, %lu unanswered, p50 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+           replyLatencies.size(), unanswered, percentileMs(replyLatencies, 50),
+           percentileMs(replyLatencies, 99), percentileMs(replyLatencies, 100));
+    if(failedConnections > 0) printf("%lu connections could not be made\n", failedConnections);
+
+    return 0;
+}
@@ -0,0 +1,73 @@
+/*
+ * File:   framescan.h
+ *
+ * Finding where packets end in a batch of bytes read from a client
+ */
+
+#ifndef FRAMESCAN_H
+#define FRAMESCAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+
+// Finds the packet ends (NUL bytes) in data[0, length) a byte at a time,
+// storing up to maxEnds of their offsets in ends, and returns how many it found
+inline size_t findFrameEndsScalar(const char *data, size_t length, size_t *ends, size_t maxEnds)
+{
+    size_t found = 0;
+    for(size_t i = 0; i < length; i++)
+    {
+        if(data[i] != '\0') continue;
+        ends[found++] = i;
+        if(found == maxEnds) break;
+    }
+    return found;
+}
+
+
+// Finds the packet ends (NUL bytes) in data[0, length), storing up to maxEnds
+// of their offsets in ends, and returns how many it found
+// Looks at 16 bytes at a time (32 with AVX2) where the CPU allows it, so a
+// whole batch of pipelined packets is searched in one sweep
+inline size_t findFrameEnds(const char *data, size_t length, size_t *ends, size_t maxEnds)
+{
+    size_t found = 0, i = 0;
+    if(maxEnds == 0) return 0;
+
+#if defined(__AVX2__)
+    const __m256i zero = _mm256_setzero_si256();
+    for(; i + 32 <= length; i += 32)
+    {
+        __m256i bytes = _mm256_loadu_si256((const __m256i *) (data + i));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, zero));
+        for(; mask != 0; mask &= mask - 1)
+        {
+            ends[found++] = i + __builtin_ctz(mask);
+            if(found == maxEnds) return found;
+        }
+    }
+#elif defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    for(; i + 16 <= length; i += 16)
+    {
+        __m128i bytes = _mm_loadu_si128((const __m128i *) (data + i));
+        uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, zero));
+        for(; mask != 0; mask &= mask - 1)
+        {
+            ends[found++] = i + __builtin_ctz(mask);
+            if(found == maxEnds) return found;
+        }
+    }
+#endif
+    
+    // Whatever is left over, or everything without SIMD, a byte at a time
+    size_t count = findFrameEndsScalar(data + i, length - i, ends + found, maxEnds - found);
+    for(size_t f = found; f < found + count; f++) ends[f] += i;
+    return found + count;
+}
+
+#endif /* FRAMESCAN_H */
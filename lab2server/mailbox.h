@@ -0,0 +1,181 @@
+/*
+ * File:   mailbox.h
+ *
+ * Mailbox other threads hand items to an event loop through, without a lock
+ */
+
+#ifndef MAILBOX_H
+#define MAILBOX_H
+
+#include <atomic>
+#include <stdint.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#define CACHE_LINE_SIZE 64     // Keeps producer and consumer state on separate lines
+#define MAILBOX_CAPACITY 4096  // Slots per mailbox, must be a power of two
+
+// One slot of the mailbox. The sequence number tells producers and the consumer
+// whose turn it is to use the slot, so no lock is needed
+template<typename Item>
+struct alignas(CACHE_LINE_SIZE) mailboxSlot {
+    std::atomic<size_t> sequence;
+    Item item;
+};
+
+// Bounded lock-free multi-producer/single-consumer queue owned by an event loop.
+// Producers wake the loop through an eventfd, but only the first post after the
+// loop has started draining writes to it, so a burst of posts costs one wakeup.
+// Producers that find it full wait on a second eventfd until the loop has
+// drained it, so the loop is never more than a mailbox behind
+template<typename Item>
+struct mailbox {
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> tail;      // Next slot to post to
+    alignas(CACHE_LINE_SIZE) std::atomic<bool> wakeupPending;
+    alignas(CACHE_LINE_SIZE) size_t head;                   // Next slot to drain, consumer only
+    int eventfd;
+    struct mailboxSlot<Item> slots[MAILBOX_CAPACITY];
+    
+    alignas(CACHE_LINE_SIZE) std::atomic<unsigned int> roomWaiters; // Producers waiting for a free slot
+    int roomfd;                                                     // Signalled for them once it's drained
+};
+
+
+// Sets up an empty mailbox and the eventfd used to wake its event loop
+// Returns the eventfd, or -1 on error
+template<typename Item>
+int createMailbox(struct mailbox<Item> *box)
+{
+    for(size_t i = 0; i < MAILBOX_CAPACITY; i++)
+    {
+        box->slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    box->tail.store(0, std::memory_order_relaxed);
+    box->wakeupPending.store(false, std::memory_order_relaxed);
+    box->roomWaiters.store(0, std::memory_order_relaxed);
+    box->head = 0;
+    
+    if((box->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1 ||
+       (box->roomfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+    {
+        perror("eventfd");
+        return -1;
+    }
+    return box->eventfd;
+}
+
+
+// Posts an item for the event loop, may be called from any thread
+// Returns false if the mailbox is full
+template<typename Item>
+bool postToMailbox(struct mailbox<Item> *box, const Item &item)
+{
+    size_t pos = box->tail.load(std::memory_order_relaxed);
+    struct mailboxSlot<Item> *slot;
+    
+    while(1)
+    {
+        slot = &box->slots[pos & (MAILBOX_CAPACITY - 1)];
+        size_t sequence = slot->sequence.load(std::memory_order_acquire);
+        long diff = (long) sequence - (long) pos;
+        
+        if(diff == 0) // Slot is free, try to claim it
+        {
+            if(box->tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+        }
+        else if(diff < 0) return false; // Consumer hasn't freed the slot yet
+        else pos = box->tail.load(std::memory_order_relaxed); // Another producer got it
+    }
+    
+    slot->item = item;
+    slot->sequence.store(pos + 1, std::memory_order_release);
+    
+    // Only the first post since the loop last woke up needs to signal it. The
+    // fence pairs with the one in clearMailboxWakeup: either the loop sees the
+    // item, or we see the flag it cleared and signal it
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(!box->wakeupPending.exchange(true, std::memory_order_acq_rel))
+    {
+        uint64_t one = 1;
+        if(write(box->eventfd, &one, sizeof(one)) == -1) perror("mailbox: write");
+    }
+    return true;
+}
+
+
+// Posts an item for the event loop, waiting for room if the mailbox is full,
+// may be called from any thread but the loop's. A producer faster than the
+// loop is held to its pace, rather than what the loop has yet to take growing
+// without bound
+template<typename Item>
+void postToMailboxOrWait(struct mailbox<Item> *box, const Item &item)
+{
+    if(postToMailbox(box, item)) return;
+    
+    box->roomWaiters.fetch_add(1, std::memory_order_relaxed);
+    while(1)
+    {
+        // Clear the last signal before looking for room again. The fence pairs
+        // with the one in announceMailboxRoom: either we see the slots the loop
+        // freed, or it sees us waiting and signals roomfd
+        uint64_t count;
+        if(read(box->roomfd, &count, sizeof(count)) == -1 && errno != EAGAIN) perror("mailbox: read");
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(postToMailbox(box, item)) break;
+        
+        struct pollfd room = {box->roomfd, POLLIN, 0};
+        if(poll(&room, 1, -1) == -1 && errno != EINTR) perror("mailbox: poll");
+    }
+    box->roomWaiters.fetch_sub(1, std::memory_order_relaxed);
+}
+
+
+// Clears the mailbox's wakeup before the event loop drains it, so that a post
+// racing with the drain either gets seen by it or signals the eventfd again
+template<typename Item>
+void clearMailboxWakeup(struct mailbox<Item> *box)
+{
+    uint64_t count;
+    if(read(box->eventfd, &count, sizeof(count)) == -1 && errno != EAGAIN) perror("mailbox: read");
+    box->wakeupPending.store(false, std::memory_order_relaxed);
+    
+    // Without this the store could be seen after the loads of the drain
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+
+// Takes the oldest item out of the mailbox, event loop thread only. The slot
+// is left holding an empty item, so it doesn't keep what the item owned
+// Returns false if the mailbox is empty
+template<typename Item>
+bool takeFromMailbox(struct mailbox<Item> *box, Item *item)
+{
+    struct mailboxSlot<Item> *slot = &box->slots[box->head & (MAILBOX_CAPACITY - 1)];
+    size_t sequence = slot->sequence.load(std::memory_order_acquire);
+    
+    if((long) sequence - (long) (box->head + 1) < 0) return false;
+    
+    *item = slot->item;
+    slot->item = Item();
+    slot->sequence.store(box->head + MAILBOX_CAPACITY, std::memory_order_release);
+    box->head++;
+    return true;
+}
+
+
+// Wakes the producers waiting for room once the event loop has drained the
+// mailbox, event loop thread only
+template<typename Item>
+void announceMailboxRoom(struct mailbox<Item> *box)
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(box->roomWaiters.load(std::memory_order_relaxed) == 0) return;
+    
+    uint64_t one = 1;
+    if(write(box->roomfd, &one, sizeof(one)) == -1) perror("mailbox: write");
+}
+
+#endif /* MAILBOX_H */
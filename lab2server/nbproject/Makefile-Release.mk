@@ -38,6 +38,63 @@ OBJECTFILES= \
 	${OBJECTDIR}/server.o
 
 
+# Test Directory
+TESTDIR=${CND_BUILDDIR}/${CND_CONF}/${CND_PLATFORM}/tests
+
+# Test Files
+TESTFILES= \
+	${TESTDIR}/TestFiles/f1 \
+	${TESTDIR}/TestFiles/f2 \
+	${TESTDIR}/TestFiles/f3 \
+	${TESTDIR}/TestFiles/f4 \
+	${TESTDIR}/TestFiles/f5 \
+	${TESTDIR}/TestFiles/f6 \
+	${TESTDIR}/TestFiles/f7 \
+	${TESTDIR}/TestFiles/f8 \
+	${TESTDIR}/TestFiles/f9 \
+	${TESTDIR}/TestFiles/f10 \
+	${TESTDIR}/TestFiles/f11 \
+	${TESTDIR}/TestFiles/f12 \
+	${TESTDIR}/TestFiles/f13 \
+	${TESTDIR}/TestFiles/f14 \
+	${TESTDIR}/TestFiles/f15 \
+	${TESTDIR}/TestFiles/f16 \
+	${TESTDIR}/TestFiles/f17 \
+	${TESTDIR}/TestFiles/f18 \
+	${TESTDIR}/TestFiles/f19 \
+	${TESTDIR}/TestFiles/f20 \
+	${TESTDIR}/TestFiles/f21 \
+	${TESTDIR}/TestFiles/f22 \
+	${TESTDIR}/TestFiles/f23 \
+	${TESTDIR}/TestFiles/f24
+
+# Test Object Files
+TESTOBJECTFILES= \
+	${TESTDIR}/tests/mailboxtest.o \
+	${TESTDIR}/tests/taskstest.o \
+	${TESTDIR}/tests/sharedringtest.o \
+	${TESTDIR}/tests/sessiontabletest.o \
+	${TESTDIR}/tests/hotsessiontest.o \
+	${TESTDIR}/tests/mailboxbench.o \
+	${TESTDIR}/tests/chunkbench.o \
+	${TESTDIR}/tests/filebench.o \
+	${TESTDIR}/tests/upgradebench.o \
+	${TESTDIR}/tests/startupbench.o \
+	${TESTDIR}/tests/pingbench.o \
+	${TESTDIR}/tests/protocolbench.o \
+	${TESTDIR}/tests/framescantest.o \
+	${TESTDIR}/tests/framescanbench.o \
+	${TESTDIR}/tests/multicastbench.o \
+	${TESTDIR}/tests/offlinebench.o \
+	${TESTDIR}/tests/soaktest.o \
+	${TESTDIR}/tests/stormbench.o \
+	${TESTDIR}/tests/taskbench.o \
+	${TESTDIR}/tests/clientbench.o \
+	${TESTDIR}/tests/lanebench.o \
+	${TESTDIR}/tests/transportbench.o \
+	${TESTDIR}/tests/sessionmemorybench.o \
+	${TESTDIR}/tests/announcebench.o
+
 # C Compiler Flags
 CFLAGS=
 
@@ -60,16 +117,270 @@ LDLIBSOPTIONS=
 
 ${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}/server: ${OBJECTFILES}
 	${MKDIR} -p ${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}
-	${LINK.cc} -o ${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}/server ${OBJECTFILES} ${LDLIBSOPTIONS}
+	${LINK.cc} -o ${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}/server ${OBJECTFILES} ${LDLIBSOPTIONS} -pthread
 
 ${OBJECTDIR}/server.o: server.cpp 
 	${MKDIR} -p ${OBJECTDIR}
 	${RM} "$@.d"
-	$(COMPILE.cc) -O2 -std=c++11 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/server.o server.cpp
+	$(COMPILE.cc) -O2 -std=c++11 -I../lab2common -pthread -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/server.o server.cpp
 
 # Subprojects
 .build-subprojects:
 
+# Build Test Targets
+.build-tests-conf: .build-tests-subprojects .build-conf ${TESTFILES}
+.build-tests-subprojects:
+	cd ../lab2client && ${MAKE}  -f Makefile CONF=Release
+
+${TESTDIR}/TestFiles/f1: ${TESTDIR}/tests/mailboxtest.o
+	${MKDIR} -p ${TESTDIR}/TestFiles
+	${LINK.cc} -o ${TESTDIR}/TestFiles/f1 $^ ${LDLIBSOPTIONS} -pthread
+
+${TESTDIR}/tests/mailboxtest.o: tests/mailboxtest.cpp
+	${MKDIR} -p ${TESTDIR}/tests
+	${RM} "$@.d"
+	$(COMPILE.cc) -O2 -std=c++11 -I../lab2common -pthread -MMD -MP -MF "$@.d" -o ${TESTDIR}/tests/mailboxtest.o tests/mailboxtest.cpp
+
+${TESTDIR}/TestFiles/f2: ${TESTDIR}/tests/taskstest.o
+	${MKDIR} -p ${TESTDIR}/TestFiles
+	${LINK.cc} -o ${TESTDIR}/TestFiles/f2 $^ ${LDLIBSOPTIONS} -pthread
+
+${TESTDIR}/tests/taskstest.o: tests/taskstest.cpp
+	${MKDIR} -p ${TESTDIR}/tests
+	${RM} "$@.d"
+	$(COMPILE.cc) -O2 -std=c++11 -I../lab2common -pthread -MMD -MP -MF "$@.d" -o ${TESTDIR}/tests/taskstest.o tests/taskstest.cpp
+
+${TESTDIR}/TestFiles/f3: ${TESTDIR}/tests/sharedringtest.o
+	${MKDIR} -p ${TESTDIR}/TestFiles
+	${LINK.cc} -o ${TESTDIR}/TestFiles/f3 $^ ${LDLIBSOPTIONS} -pthread
+
+${TESTDIR}/tests/sharedringtest.o: tests/sharedringtest.cpp
+	${MKDIR} -p ${TESTDIR}/tests
+	${RM} "$@.d"
+	$(COMPILE.cc) -O2 -std=c++11 -I../lab2common -pthread -MMD -MP -MF "$@.d" -o ${TESTDIR}/tests/sharedringtest.o tests/sharedringtest.cpp
+
+${TESTDIR}/TestFiles/f4: ${TESTDIR}/tests/sessiontabletest.o
+	${MKDIR} -p ${TESTDIR}/TestFiles
+	${LINK.cc} -o ${TESTDIR}/TestFiles/f4 $^ ${LDLIBSOPTIONS} -pthread
+
+${TESTDIR}/tests/sessiontabletest.o: tests/sessiontabletest.cpp
+	${MKDIR} -p ${TESTDIR}/tests
+	${RM} "$@.d"
+	$(COMPILE.cc) -O2 -std=c++11 -I../lab2common -pthread -MMD -MP -MF "$@.d" -o ${TESTDIR}/tests/sessiontabletest.o tests/sessiontabletest.cpp
+
+${TESTDIR}/TestFiles/f5: ${TESTDIR}/tests/hotsessiontest.o
+	${MKDIR} -p ${TESTDIR}/TestFiles
+	${LINK.cc} -o ${TESTDIR}/TestFiles/f5 $^ ${LDLIBSOPTIONS} -pthread
+
+${TESTDIR}/tests/hotsessiontest.o: tests/hotsessiontest.cpp
+	${MKDIR} -p ${TESTDIR}/tests
+	${RM} "$@.d"
+	$(COMPILE.cc) -O2 -std=c++11 -I../lab2common -pthread -MMD -MP -MF "$@.d" -o ${TESTDIR}/tests/hotsessiontest.o tests/hotsessiontest.cpp
+
+${TESTDIR}/TestFiles/f6: ${TESTDIR}/tests/mailboxbench.o
+	${MKDIR} -p ${TESTDIR}/TestFiles
+	${LINK.cc} -o ${TESTDIR}/TestFiles/f6 $^ ${LDLIBSOPTIONS} -pthread
+
+${TESTDIR}/tests/mailboxbench.o: tests/mailboxbench.cpp
+	${MKDIR} -p ${TESTDIR}/tests
+	${RM} "$@.d"
+	$(COMPILE.cc) -O2 -std=c++11 -I../lab2common -pthread -MMD -MP -MF "$@.d" -o ${TESTDIR}/tests/mailboxbench.o tests/mailboxbench.cpp
+
+${TESTDIR}/TestFiles/f7: ${TESTDIR}/tests/chunkbench.o
+	${MKDIR} -p ${TESTDIR}/TestFiles
+	${LINK.cc} -o ${TESTDIR}/TestFiles/f7 $^ ${LDLIBSOPTIONS} -pthread
+
+${TESTDIR}/tests/chunkbench.o: tests/chunkbench.cpp
+	${MKDIR} -p ${TESTDIR}/tests
+	${RM} "$@.d"
+	$(COMPILE.cc) -O2 -std=c++11 -I../lab2common -pthread -MMD -MP -MF "$@.d" -o ${TESTDIR}/tests/chunkbench.o tests/chunkbench.cpp
+
+${TESTDIR}/TestFiles/f8: ${TESTDIR}/tests/filebench.o
+	${MKDIR} -p ${TESTDIR}/TestFiles
+	${LINK.cc} -o ${TESTDIR}/TestFiles/f8 $^ ${LDLIBSOPTIONS} -pthread
+
+${TESTDIR}/tests/filebench.o: tests/filebench.cpp
+	${MKDIR} -p ${TESTDIR}/tests
+	${RM} "$@.d"
+	$(COMPILE.cc) -O2 -std=c++11 -I../lab2common -pthread -MMD -MP -MF "$@.d" -o ${TESTDIR}/tests/filebench.o tests/filebench.cpp
+
+${TESTDIR}/TestFiles/f9: ${TESTDIR}/tests/upgradebench.o
+	${MKDIR} -p ${TESTDIR}/TestFiles
+	${LINK.cc} -o ${TESTDIR}/TestFiles/f9 $^ ${LDLIBSOPTIONS} -pthread
+
+${TESTDIR}/tests/upgradebench.o: tests/upgradebench.cpp
+	${MKDIR} -p ${TESTDIR}/tests
+	${RM} "$@.d"
+	$(COMPILE.cc) -O2 -std=c++11 -I../lab2common -pthread -MMD -MP -MF "$@.d" -o ${TESTDIR}/tests/upgradebench.o tests/upgradebench.cpp
+
+${TESTDIR}/TestFiles/f10: ${TESTDIR}/tests/startupbench.o
+	${MKDIR} -p ${TESTDIR}/TestFiles
+	${LINK.cc} -o ${TESTDIR}/TestFiles/f10 $^ ${LDLIBSOPTIONS} -pthread
+
+${TESTDIR}/tests/startupbench.o: tests/startupbench.cpp
+	${MKDIR} -p ${TESTDIR}/tests
+	${RM} "$@.d"
+	$(COMPILE.cc) -O2 -std=c++11 -I../lab2common -pthread -MMD -MP -MF "$@.d" -o ${TESTDIR}/tests/startupbench.o tests/startupbench.cpp
+
+${TESTDIR}/TestFiles/f11: ${TESTDIR}/tests/pingbench.o
+	${MKDIR} -p ${TESTDIR}/TestFiles
+	${LINK.cc} -o ${TESTDIR}/TestFiles/f11 $^ ${LDLIBSOPTIONS} -pthread
+
+${TESTDIR}/tests/pingbench.o: tests/pingbench.cpp
+	${MKDIR} -p ${TESTDIR}/tests
+	${RM} "$@.d"
+	$(COMPILE.cc) -O2 -std=c++11 -I../lab2common -pthread -MMD -MP -MF "$@.d" -o ${TESTDIR}/tests/pingbench.o tests/pingbench.cpp
+
+${TESTDIR}/TestFiles/f12: ${TESTDIR}/tests/protocolbench.o
+	${MKDIR} -p ${TESTDIR}/TestFiles
+	${LINK.cc} -o ${TESTDIR}/TestFiles/f12 $^ ${LDLIBSOPTIONS} -pthread
+
+${TESTDIR}/tests/protocolbench.o: tests/protocolbench.cpp
+	${MKDIR} -p ${TESTDIR}/tests
+	${RM} "$@.d"
+	$(COMPILE.cc) -O2 -std=c++11 -I../lab2common -pthread -MMD -MP -MF "$@.d" -o ${TESTDIR}/tests/protocolbench.o tests/protocolbench.cpp
+
+${TESTDIR}/TestFiles/f13: ${TESTDIR}/tests/framescantest.o
+	${MKDIR} -p ${TESTDIR}/TestFiles
+	${LINK.cc} -o ${TESTDIR}/TestFiles/f13 $^ ${LDLIBSOPTIONS} -pthread
+
+${TESTDIR}/tests/framescantest.o: tests/framescantest.cpp
+	${MKDIR} -p ${TESTDIR}/tests
+	${RM} "$@.d"
+	$(COMPILE.cc) -O2 -std=c++11 -I../lab2common -pthread -MMD -MP -MF "$@.d" -o ${TESTDIR}/tests/framescantest.o tests/framescantest.cpp
+
+${TESTDIR}/TestFiles/f14: ${TESTDIR}/tests/framescanbench.o
+	${MKDIR} -p ${TESTDIR}/TestFiles
+	${LINK.cc} -o ${TESTDIR}/TestFiles/f14 $^ ${LDLIBSOPTIONS} -pthread
+
+${TESTDIR}/tests/framescanbench.o: tests/framescanbench.cpp
+	${MKDIR} -p ${TESTDIR}/tests
+	${RM} "$@.d"
+	$(COMPILE.cc) -O2 -std=c++11 -I../lab2common -pthread -MMD -MP -MF "$@.d" -o ${TESTDIR}/tests/framescanbench.o tests/framescanbench.cpp
+
+${TESTDIR}/TestFiles/f15: ${TESTDIR}/tests/multicastbench.o
+	${MKDIR} -p ${TESTDIR}/TestFiles
+	${LINK.cc} -o ${TESTDIR}/TestFiles/f15 $^ ${LDLIBSOPTIONS} -pthread
+
+${TESTDIR}/tests/multicastbench.o: tests/multicastbench.cpp
+	${MKDIR} -p ${TESTDIR}/tests
+	${RM} "$@.d"
+	$(COMPILE.cc) -O2 -std=c++11 -I../lab2common -pthread -MMD -MP -MF "$@.d" -o ${TESTDIR}/tests/multicastbench.o tests/multicastbench.cpp
+
+${TESTDIR}/TestFiles/f16: ${TESTDIR}/tests/offlinebench.o
+	${MKDIR} -p ${TESTDIR}/TestFiles
+	${LINK.cc} -o ${TESTDIR}/TestFiles/f16 $^ ${LDLIBSOPTIONS} -pthread
+
+${TESTDIR}/tests/offlinebench.o: tests/offlinebench.cpp
+	${MKDIR} -p ${TESTDIR}/tests
+	${RM} "$@.d"
+	$(COMPILE.cc) -O2 -std=c++11 -I../lab2common -pthread -MMD -MP -MF "$@.d" -o ${TESTDIR}/tests/offlinebench.o tests/offlinebench.cpp
+
+${TESTDIR}/TestFiles/f17: ${TESTDIR}/tests/soaktest.o
+	${MKDIR} -p ${TESTDIR}/TestFiles
+	${LINK.cc} -o ${TESTDIR}/TestFiles/f17 $^ ${LDLIBSOPTIONS} -pthread
+
+${TESTDIR}/tests/soaktest.o: tests/soaktest.cpp
+	${MKDIR} -p ${TESTDIR}/tests
+	${RM} "$@.d"
+	$(COMPILE.cc) -O2 -std=c++11 -I../lab2common -pthread -MMD -MP -MF "$@.d" -o ${TESTDIR}/tests/soaktest.o tests/soaktest.cpp
+
+${TESTDIR}/TestFiles/f18: ${TESTDIR}/tests/stormbench.o
+	${MKDIR} -p ${TESTDIR}/TestFiles
+	${LINK.cc} -o ${TESTDIR}/TestFiles/f18 $^ ${LDLIBSOPTIONS} -pthread
+
+${TESTDIR}/tests/stormbench.o: tests/stormbench.cpp
+	${MKDIR} -p ${TESTDIR}/tests
+	${RM} "$@.d"
+	$(COMPILE.cc) -O2 -std=c++11 -I../lab2common -pthread -MMD -MP -MF "$@.d" -o ${TESTDIR}/tests/stormbench.o tests/stormbench.cpp
+
+${TESTDIR}/TestFiles/f19: ${TESTDIR}/tests/taskbench.o
+	${MKDIR} -p ${TESTDIR}/TestFiles
+	${LINK.cc} -o ${TESTDIR}/TestFiles/f19 $^ ${LDLIBSOPTIONS} -pthread
+
+${TESTDIR}/tests/taskbench.o: tests/taskbench.cpp
+	${MKDIR} -p ${TESTDIR}/tests
+	${RM} "$@.d"
+	$(COMPILE.cc) -O2 -std=c++11 -I../lab2common -pthread -MMD -MP -MF "$@.d" -o ${TESTDIR}/tests/taskbench.o tests/taskbench.cpp
+
+${TESTDIR}/TestFiles/f20: ${TESTDIR}/tests/clientbench.o
+	${MKDIR} -p ${TESTDIR}/TestFiles
+	${LINK.cc} -o ${TESTDIR}/TestFiles/f20 $^ ${LDLIBSOPTIONS} -pthread
+
+${TESTDIR}/tests/clientbench.o: tests/clientbench.cpp
+	${MKDIR} -p ${TESTDIR}/tests
+	${RM} "$@.d"
+	$(COMPILE.cc) -O2 -std=c++11 -I../lab2common -pthread -MMD -MP -MF "$@.d" -o ${TESTDIR}/tests/clientbench.o tests/clientbench.cpp
+
+${TESTDIR}/TestFiles/f21: ${TESTDIR}/tests/lanebench.o
+	${MKDIR} -p ${TESTDIR}/TestFiles
+	${LINK.cc} -o ${TESTDIR}/TestFiles/f21 $^ ${LDLIBSOPTIONS} -pthread
+
+${TESTDIR}/tests/lanebench.o: tests/lanebench.cpp
+	${MKDIR} -p ${TESTDIR}/tests
+	${RM} "$@.d"
+	$(COMPILE.cc) -O2 -std=c++11 -I../lab2common -pthread -MMD -MP -MF "$@.d" -o ${TESTDIR}/tests/lanebench.o tests/lanebench.cpp
+
+${TESTDIR}/TestFiles/f22: ${TESTDIR}/tests/transportbench.o
+	${MKDIR} -p ${TESTDIR}/TestFiles
+	${LINK.cc} -o ${TESTDIR}/TestFiles/f22 $^ ${LDLIBSOPTIONS} -pthread
+
+${TESTDIR}/tests/transportbench.o: tests/transportbench.cpp
+	${MKDIR} -p ${TESTDIR}/tests
+	${RM} "$@.d"
+	$(COMPILE.cc) -O2 -std=c++11 -I../lab2common -pthread -MMD -MP -MF "$@.d" -o ${TESTDIR}/tests/transportbench.o tests/transportbench.cpp
+
+${TESTDIR}/TestFiles/f23: ${TESTDIR}/tests/sessionmemorybench.o
+	${MKDIR} -p ${TESTDIR}/TestFiles
+	${LINK.cc} -o ${TESTDIR}/TestFiles/f23 $^ ${LDLIBSOPTIONS} -pthread
+
+${TESTDIR}/tests/sessionmemorybench.o: tests/sessionmemorybench.cpp
+	${MKDIR} -p ${TESTDIR}/tests
+	${RM} "$@.d"
+	$(COMPILE.cc) -O2 -std=c++11 -I../lab2common -pthread -MMD -MP -MF "$@.d" -o ${TESTDIR}/tests/sessionmemorybench.o tests/sessionmemorybench.cpp
+
+${TESTDIR}/TestFiles/f24: ${TESTDIR}/tests/announcebench.o
+	${MKDIR} -p ${TESTDIR}/TestFiles
+	${LINK.cc} -o ${TESTDIR}/TestFiles/f24 $^ ${LDLIBSOPTIONS} -pthread
+
+${TESTDIR}/tests/announcebench.o: tests/announcebench.cpp
+	${MKDIR} -p ${TESTDIR}/tests
+	${RM} "$@.d"
+	$(COMPILE.cc) -O2 -std=c++11 -I../lab2common -pthread -MMD -MP -MF "$@.d" -o ${TESTDIR}/tests/announcebench.o tests/announcebench.cpp
+
+
+# Run Test Targets
+.test-conf:
+	@if [ "${TEST}" = "" ]; \
+	then  \
+	    ${TESTDIR}/TestFiles/f1 || exit 1; \
+	    ${TESTDIR}/TestFiles/f2 || exit 1; \
+	    ${TESTDIR}/TestFiles/f3 ${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}/server || exit 1; \
+	    ${TESTDIR}/TestFiles/f4 || exit 1; \
+	    ${TESTDIR}/TestFiles/f5 ${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}/server || exit 1; \
+	    ${TESTDIR}/TestFiles/f6 || exit 1; \
+	    ${TESTDIR}/TestFiles/f7 ${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}/server || exit 1; \
+	    ${TESTDIR}/TestFiles/f8 ${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}/server || exit 1; \
+	    ${TESTDIR}/TestFiles/f9 ${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}/server || exit 1; \
+	    ${TESTDIR}/TestFiles/f10 ${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}/server || exit 1; \
+	    ${TESTDIR}/TestFiles/f11 ${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}/server || exit 1; \
+	    ${TESTDIR}/TestFiles/f12 || exit 1; \
+	    ${TESTDIR}/TestFiles/f13 || exit 1; \
+	    ${TESTDIR}/TestFiles/f14 || exit 1; \
+	    ${TESTDIR}/TestFiles/f15 ${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}/server || exit 1; \
+	    ${TESTDIR}/TestFiles/f16 ${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}/server || exit 1; \
+	    ${TESTDIR}/TestFiles/f17 ${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}/server || exit 1; \
+	    ${TESTDIR}/TestFiles/f18 ${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}/server || exit 1; \
+	    ${TESTDIR}/TestFiles/f19 || exit 1; \
+	    ${TESTDIR}/TestFiles/f20 ../lab2client/${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}/client || exit 1; \
+	    ${TESTDIR}/TestFiles/f21 ${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}/server || exit 1; \
+	    ${TESTDIR}/TestFiles/f22 ${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}/server || exit 1; \
+	    ${TESTDIR}/TestFiles/f23 ${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}/server || exit 1; \
+	    ${TESTDIR}/TestFiles/f24 ${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}/server || exit 1; \
+	else  \
+	    ./${TEST} || exit 1; \
+	fi
+
 # Clean Targets
 .clean-conf: ${CLEAN_SUBPROJECTS}
 	${RM} -r ${CND_BUILDDIR}/${CND_CONF}
@@ -23,46 +23,135 @@
 #include <signal.h>
 #include <unordered_map>
 #include <unordered_set>
+#include <set>
+#include <atomic>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <vector>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <algorithm>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#include <linux/tcp.h>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <pthread.h>
+#include <chrono>
+#include <malloc.h>
+#include <math.h>
+#include <fnmatch.h>
+
+#include "protocol.h"
+#include "capture.h"
+#include "sharedring.h"
+#include "mailbox.h"
+#include "tasks.h"
+#include "sessiontable.h"
+#include "framescan.h"
 
 #define SESSION_NOT_FOUND "No session found!"
-#define ACK_DATA "NoData"
+#define SESSION_SEPARATOR ','  // Between the names of sessions a message is sent to
 
-#define BACKLOG 10       // How many pending connections queue will hold
+#define BACKLOG 4096     // How many pending connections queue will hold, unless -b is
+                         // given, the kernel caps it at net.core.somaxconn
+#define ACCEPTS_PER_PASS 256    // Max connections accepted on each pass of the main loop
+#define DEFER_ACCEPT_SECONDS 5  // How long the kernel holds a connection back for its LOGIN
+#define LOGIN_TIMEOUT 10        // Seconds a connection has to send its LOGIN once accepted
 #define MAXDATASIZE 1380 // Max number of bytes we can get at once 
 
-using namespace std;
+#define FRAMES_PER_PASS 8 // Max packets handled per client on each pass of the main
+                          // loop, so one client streaming chunks can't starve others
+#define RECEIVE_RING_SIZE (32 << 10) // Bytes buffered per client, must be a power of two
+
+#define MAX_FILE_SIZE (1UL << 30)   // Largest file clients may send
+#define FILE_SPLICE_SIZE (1 << 16)  // Max bytes moved per splice() call
+#define FILE_SPOOL_TEMPLATE "/tmp/chatfileXXXXXX"
+#define FILE_TO_SESSION "-"         // File target prefix naming one of the sender's sessions
+
+#define HANDOFF_FDS_PER_MESSAGE 250     // SCM_RIGHTS takes at most 253 fds per message
+#define HANDOFF_PIECE_SIZE (1 << 16)    // Bytes of registry state sent per message
+#define HANDOFF_TIMEOUT 10              // Seconds the successor has to take each piece of state and say it's ready
+#define HANDOFF_DRAIN_TIMEOUT 5         // Seconds clients have to take what's being sent them before a hand off
+#define HANDOFF_DRAIN_POLL 10           // Milliseconds between looks at shared memory clients' rings meanwhile
+
+#define SNAPSHOT_FILE "sessions.snap"        // Snapshot of the sessions in the state directory
+#define SNAPSHOT_MAGIC "CHATSNP1"           // First 8 bytes of a snapshot file
+#define JOURNAL_PREFIX "sessions.journal."  // Followed by the journal's generation
+#define JOURNAL_CREATE 'C'                  // Journal record for a session being created
+#define JOURNAL_REMOVE 'R'                  // Journal record for a session being removed
+#define SNAPSHOT_INTERVAL 60                // Seconds between snapshots, if sessions changed
+#define SNAPSHOT_BUFFER_SIZE (1 << 16)      // Bytes of records the snapshot is written out in
+
+#define CPU_SYSFS_PATH "/sys/devices/system/cpu/cpu" // Followed by the CPU number
+
+#define LIST_PAGE_SIZE 100  // Default number of names per list in a /list page
+#define LIST_FROM_START "-" // Cursor asking for a list from its first name
+#define LIST_DONE "*"       // Cursor meaning a list has no more names to send
+#define LIST_PACKET_ROOM 64 // Bytes of a list page taken by the packet header and the lists' labels
+
+#define OFFLINE_MEMORY_BUDGET (8UL << 20) // Bytes of queued direct messages kept in memory, for all users
+#define OFFLINE_SPILL_LIMIT (64UL << 20)  // Bytes of queued direct messages kept on disk, per user
+#define OFFLINE_MAILBOX_PREFIX "mailbox."    // Followed by the username, for spilled messages
+#define OFFLINE_DIR_TEMPLATE "/tmp/chatmailXXXXXX" // Used for spilled messages with no state directory
+#define OFFLINE_ACK " offline"             // Added to a DMESS_ACK when the message was queued
+#define OFFLINE_DELIVERY_CHUNK (256 << 10) // Bytes of spilled direct messages read from disk at a time
+
+#define HISTORY_FILE "history.log"                 // Session messages, in the state directory
+#define HISTORY_SEGMENT_PREFIX "history.segment."  // Followed by the range of the log indexed
+#define HISTORY_SEGMENT_TEMP "history.segment.tmp" // Segment still being written
+#define HISTORY_SEGMENT_MAGIC "CHATIDX1"           // First 8 bytes of a segment file
+#define HISTORY_SEGMENT_MESSAGES 65536  // Messages indexed in memory before being written out
+#define HISTORY_READ_SIZE (4 << 20)     // Bytes of the log indexed on each pass
+#define HISTORY_WRITE_SIZE (1 << 20)    // Bytes of a segment buffered before being written
+#define HISTORY_INDEX_INTERVAL 200      // Milliseconds between checks for new messages
+#define HISTORY_MEMORY_SHARE 4          // The in-memory index is written out early at this fraction
+                                        // of the soft memory limit, if there is one
+#define HISTORY_MAX_TERM 32             // Longer words are cut to this many bytes
+#define SEARCH_RESULTS 20               // Most recent matches sent back for a search
+
+#define MULTICAST_GROUPS 256    // Groups handed out from the base address before reuse
+#define MULTICAST_HISTORY 1024  // Messages kept per session to repair gaps with
+
+#define ADMIN_OUTPUT_SIZE (64 << 10) // Response bytes made ahead of what an admin connection has read
+#define ADMIN_MAX_COMMAND 1024       // Longest command line taken from an admin connection
+#define ADMIN_HOT_SESSIONS 10        // Sessions listed by "hot" if no count is given
+#define ADMIN_END ".\n"              // Line ending every admin response
+
+#define BROADCAST_WAVE 256   // Recipients announcements are sent to on each pass
+#define BROADCAST_SCAN 4096  // Sessions matched against announcements' patterns on each pass
+
+#define SESSION_RATE_WINDOW 1.0 // Seconds a session's message rate is averaged over
+#define HOT_SESSION_LOAD 20000  // Deliveries a second at which a session's messages are batched, unless -H is given
+
+#define SESSION_MEMORY 200         // Rough bytes of bookkeeping for a session, besides its name and password
+#define MEMBERSHIP_MEMORY 44       // Rough bytes of bookkeeping for a client being in a session
+#define MULTICAST_GROUP_MEMORY 832 // Rough bytes of bookkeeping for a session's multicast group, besides its history
+#define LIVE_TERM_MEMORY 96        // Rough bytes of bookkeeping for a word in the in-memory index, besides the key
+#define MEMORY_RESUME_PERCENT 90   // Percent of the soft limit memory has to fall under to stop shedding
+#define MEMORY_CHECK_INTERVAL 100  // Milliseconds between checks while memory is short
+#define MEMORY_REPORT_TOP 10       // Connections and sessions listed by "memory" if no count is given
+
+#define CAPTURE_BUFFER_SIZE (1 << 20) // Bytes of capture records buffered before being written
 
-// Defines control packet types
-enum msgType {
-    LOGIN,
-    LO_ACK,
-    LO_NAK,
-    EXIT,
-    JOIN,
-    JN_ACK,
-    JN_NAK,
-    LEAVE_SESS,
-    LS_ACK,
-    LS_NAK,
-    NEW_SESS,
-    NS_ACK,
-    NS_NAK,
-    MESSAGE,
-    QUERY,
-    QU_ACK,
-    DIRMESSAGE,
-    DMESS_ACK,
-    DMESS_NAK
-};
-
-
-// Message structure to be serialized when sending messages
-struct message {
-    unsigned int type;
-    unsigned int size;
-    string source;
-    string data;
-};
+
+#define OUTBOUND_LOWAT (16 << 10)       // Unsent bytes in a client's socket under which it counts as having room
+#define OUTBOUND_QUANTUM (64 << 10)     // Credit a client with room is given each pass, for all but replies
+#define OUTBOUND_QUEUE_LIMIT (4 << 20)  // Bytes queued for a client before it's disconnected for falling behind
+#define OUTBOUND_BATCH 64               // Most queued packets sent in one write
+
+using namespace std;
 
 // Keeps a list of all users that are permitted to login
 unordered_map<string, string> permittedClientList({
@@ -74,16 +163,390 @@ unordered_map<string, string> permittedClientList({
     {"john", "smith"}
 }); 
 
-// Key is file descriptor, value is client username and password
-unordered_map<int, pair<string, string>> clientList;
+// Users and sessions have IDs indexing where their names are kept, which
+// connections, memberships and session loads refer to them by. The sorted
+// presence index, multicast groups and offline mailboxes still key them by
+// name. Users are only ever the permitted ones, so their IDs are handed out on
+// first login for good
+vector<string> userNames;
+unordered_map<string, uint32_t> userIDs;
+
+// Key is file descriptor, value is the user ID of the client
+unordered_map<int, uint32_t> clientList;
+
+// Sessions open, by name and by ID
+struct sessionTable sessionTable;
+
+// Key is file descriptor, value is the IDs of the sessions the client is in.
+// The reverse of the sessions' members, kept in step with them so a client's
+// sessions can be found without walking every session
+unordered_map<int, unordered_set<uint32_t>> clientSessions;
+
+// Bytes received from a client that haven't been handled yet. Positions count
+// every byte ever received and wrap around the buffer, so a recv() can take as
+// much as there is room for and packets are handled straight out of it
+struct receiveRing {
+    char *data = NULL;  // RECEIVE_RING_SIZE bytes, allocated when data first arrives
+    size_t head = 0;    // Position of the first byte not handled yet
+    size_t tail = 0;    // Position after the last byte received
+    size_t scanned = 0; // Position the search for packet ends has reached
+    bool traced = false;    // Client has sent traced messages, so reads are timed
+    uint64_t receivedAt = 0; // When the last read finished, if traced
+};
+
+// Key is file descriptor, value is the bytes received from the client that
+// don't make up a whole packet yet, or packets left over from the last pass
+unordered_map<int, struct receiveRing> receiveRings;
+
+// Clients with whole packets still waiting in their receive buffer
+unordered_set<int> backloggedClients;
+
+// How far a newly accepted connection has got with logging in
+enum loginProgress {
+    LOGIN_WAITING,  // Not all of its LOGIN has arrived
+    LOGIN_DONE,
+    LOGIN_FAILED    // Turned away, hung up or sent something else
+};
+
+// Queue length the listener is given, set with -b
+int listenBacklog = BACKLOG;
+
+// Connections accepted that haven't sent all of their LOGIN yet. They are read
+// from as their data arrives, and dropped if they haven't logged in within
+// LOGIN_TIMEOUT. Key is file descriptor
+struct pendingLogin {
+    uint64_t acceptedAt = 0;
+    string received;        // Start of the LOGIN, taken off the socket so it stops being readable
+};
+unordered_map<int, struct pendingLogin> pendingLogins;
+deque<pair<uint64_t, int>> loginDeadlines;  // Accept times and fds, oldest first
+bool acceptsWaiting = false;    // The listener had more than ACCEPTS_PER_PASS last pass
+
+// A file being received from a client. The data is moved from the socket into
+// a spooled copy through a pipe with splice(), so it never passes through the
+// server's memory, and then handed to the recipients with sendfile()
+struct fileRelay {
+    int spoolfd;              // Unlinked temp file holding the data received so far
+    int pipefds[2];           // Pipe the data goes through on its way to the spool
+    unsigned long size;       // Size of the whole file
+    unsigned long remaining;  // Bytes of the file still to come from the sender
+    string target;            // Username of the recipient, or FILE_TO_SESSION and the session
+    string name;              // File name given by the sender
+};
+
+// Key is file descriptor of a client sending a file, value is its transfer
+unordered_map<int, struct fileRelay> fileRelays;
+
+// Direct messages for a permitted user who isn't logged in, held until they
+// next log in. Messages are kept in memory while the total for all users is
+// under OFFLINE_MEMORY_BUDGET, and after that are appended to the user's file in
+// mailboxDirectory. Once a user's messages have started going to disk the rest
+// follow them there, so they are still delivered in the order they were sent
+struct offlineMailbox {
+    deque<string> packets;      // Stringified DIRMESSAGE packets, each ending in '\0'
+    size_t bytes = 0;           // Bytes of packets, counted against OFFLINE_MEMORY_BUDGET
+    size_t spilledBytes = 0;    // Bytes in the user's file
+    int spillfd = -1;           // The user's file, opened for appending when first needed
+    bool delivering = false;    // Being sent to the user, who is online but has new
+                                // messages added here behind the rest until it's empty
+};
+
+// Key is username, value is the messages waiting for them
+unordered_map<string, struct offlineMailbox> offlineMailboxes;
+size_t offlineBytes = 0;    // Bytes of packets held in memory across all mailboxes
+string mailboxDirectory;    // The state directory if given, otherwise a temp directory
+                            // made when messages are first spilled
+
+// A session's multicast group. Each MESSAGE to the session is numbered and sent
+// to the group once, instead of to every member over TCP, and members that miss
+// some ask for them again over TCP. Members still get every message over TCP
+// until they say a message has reached them through the group, so those that
+// can't join it, or that the group's datagrams don't reach, don't miss any
+struct multicastGroup {
+    struct sockaddr_in address;   // Group and port the messages are sent to
+    struct in_addr interface;     // Server address members must reach it through
+    uint32_t nextSequence;        // Number of the next message sent
+    unordered_set<int> listeners; // Members that have joined the group
+    unordered_set<int> receivers; // Listeners a message has reached through the group
+    deque<string> history;        // The last MULTICAST_HISTORY messages sent, or
+                                  // none while memory is short
+    size_t historyBytes = 0;      // Memory the history is accounted as using
+};
+
+// Key is session name, value is its multicast group, if multicast is on
+unordered_map<string, struct multicastGroup> multicastGroups;
+
+// Multicast is on if a base group address is given, and groups for the
+// sessions are handed out from it in turn
+int multicastfd = -1;
+struct in_addr multicastBase;
+uint16_t multicastPort;             // Network byte order, same as the server's
+uint32_t nextMulticastGroup = 0;
+struct in_addr multicastInterface;  // Interface the socket currently sends on
+
+// Sorted names of the clients online and the sessions available, updated on
+// login, logout, create and leave so that /list pages can be served in order
+// without walking clientList and sessionTable.records
+set<string> onlineClients;
+set<string> availableSessions;
+
+// Sessions and their passwords are kept in stateDirectory if one is given.
+// Every change is appended to the journal for the current generation, and
+// every SNAPSHOT_INTERVAL a forked copy of the server writes out a snapshot of
+// them all so older journals can be deleted
+string stateDirectory;
+int journalfd = -1;
+uint32_t journalGeneration = 1;
+bool sessionsChanged = false;   // Since the last snapshot was started
+pid_t snapshotPid = -1;         // Process writing a snapshot, if any
+uint32_t snapshotGeneration;    // First journal not covered by that snapshot
+time_t lastSnapshot = 0;
+
+// Bumped on every change to the sets above, used to know when the cached
+// first page of /list is stale
+unsigned long presenceVersion = 1;
+unsigned long cachedListVersion = 0;
+string cachedListPacket;
+
+// Session messages are appended to the history log in the state directory,
+// if there is one. Records are gathered in historyBuffer and written once per
+// pass of the main loop
+int historyfd = -1;
+string historyBuffer;
+
+// The history is searched through an inverted index built by the indexer
+// thread as the log grows. Each session and word has a list of the log offsets
+// of the messages that contain it, kept in memory for the newest messages and
+// written out as a segment every HISTORY_SEGMENT_MESSAGES. Segments of the same
+// size are merged, so there are only ever a few of them. Everything below is
+// used by the indexer thread only, once it has started
+struct segmentHeader {
+    char magic[8];
+    uint64_t startOffset;   // Range of the log the segment covers
+    uint64_t endOffset;
+    uint64_t messages;
+    uint64_t termCount;
+    uint64_t termsOffset;   // Where the segmentTerm for each key is, in key order
+    uint64_t keysOffset;    // Where the keys they point into are
+};
+
+// A key is "<session>\0<word>", and its postings are the gaps between the log
+// offsets of the messages that contain it as varints
+struct segmentTerm {
+    uint64_t keyOffset;
+    uint64_t postingsOffset;
+    uint64_t lastDoc;       // Offset of the last message, to continue the gaps from in a merge
+    uint32_t keyLength;
+    uint32_t postingsLength;
+};
+
+struct historySegment {
+    string path;
+    char *data;             // The whole file, mapped read only
+    size_t length;
+    struct segmentHeader header;
+    const struct segmentTerm *terms;
+    const char *keys;
+};
+
+vector<struct historySegment> historySegments;  // Oldest first, covering the log up to liveStart
+unordered_map<string, vector<uint64_t>> liveTerms;  // Messages from liveStart on
+uint64_t liveStart = 0;
+uint64_t liveMessages = 0;
+uint64_t indexedOffset = 0;     // End of the last whole message indexed
+int historyReadfd = -1;
+
+// A search for messages in a session containing all of the terms, answered by
+// the indexer thread through loopMailbox
+struct searchRequest {
+    int sockfd;
+    string userID;
+    string sessionID;
+    vector<string> terms;
+};
+
+mutex indexerLock;                      // Guards the two below
+condition_variable indexerWakeup;
+deque<struct searchRequest> searchRequests;
+bool indexerStopping = false;
+atomic<bool> indexerFinished(false);
+thread indexerThread;
+
+
+struct taskWorker loopWorker;   // Runs tasks' slow work, handing them back through loopMailbox
+
+// Tasks waiting for room to send to their client, by its socket
+unordered_map<int, struct loopTask *> writeWaiters;
+
+
+// What's sent to a client goes in one of three lanes: replies to its requests,
+// then direct messages, then messages to its sessions. Packets are sent
+// straight away while the client has credit and room in its socket, and queued
+// once it runs out of either. Clients with a queue are watched for room, and
+// are given OUTBOUND_QUANTUM more credit on each pass that they have some.
+// Replies don't need credit, and go ahead of anything still queued. A file sent
+// on to a client waits in its lane as the FILE_SEND packet it follows, and its
+// contents are sent from the spool a credit's worth at a time, with nothing
+// else sent to the client until it has all gone
+enum outboundLane {
+    LANE_CONTROL,
+    LANE_DIRECT,
+    LANE_BROADCAST,
+    LANE_COUNT
+};
+
+struct queuedPacket {
+    string data;                        // With its '\0'
+    int filefd = -1;                    // File whose contents follow the packet, if any
+    size_t fileSize = 0;
+    bool passesShared = false;          // SHM_ACK, sent with the client's shared memory and wakeups
+};
+
+struct outboundQueue {
+    deque<struct queuedPacket> lanes[LANE_COUNT];
+    int partialLane = -1;               // Lane whose first packet is half sent, if any
+    size_t sent = 0;                    // Bytes of that packet and its file already sent
+    size_t bytes = 0;                   // Bytes of packets waiting in all the lanes, not counting files
+};
+
+// Key is socket, for the clients that have packets waiting
+unordered_map<int, struct outboundQueue> outboundQueues;
+size_t outboundBytes = 0;               // Bytes waiting across all the queues
+size_t outboundCredit[FD_SETSIZE];      // Bytes each client may still be sent before it's queued
+unordered_set<int> laggingClients;      // Fell OUTBOUND_QUEUE_LIMIT behind, to be disconnected
+size_t queuedFiles = 0;                 // Files waiting in the lanes, which an upgrade waits for
+
+// Clients on the same host can connect to a Unix socket at localPath instead,
+// if -u is given, and once logged in there can ask to move their traffic to
+// shared memory. Their socket is then only watched for them hanging up
+string localPath;
+int localListener = -1;
+bool localAcceptsWaiting = false;   // The local listener had more than ACCEPTS_PER_PASS last pass
+
+struct sharedTransport {
+    struct sharedChannel *channel;  // Mapped from memfd
+    int memfd;
+    int serverWakeup;   // Signalled by the client when it has written or read
+    int clientWakeup;   // Signalled by us when we have
+};
+
+// Key is socket, for the clients using shared memory
+unordered_map<int, struct sharedTransport> sharedTransports;
+
+// Key is socket, for the clients whose shared memory is set up but still
+// waiting to be passed to them with the SHM_ACK queued for them
+unordered_map<int, struct sharedTransport> attachingTransports;
+
+
+// A packet handed to the event loop by another thread, to be delivered to the
+// client logged in as recipientID on sockfd
+struct mailboxItem {
+    int sockfd;
+    string recipientID;
+    struct message packet;
+    string packets;                 // Stringified packets to send together instead, if any
+    struct loopTask *task = NULL;   // Task to carry on with instead, if any
+};
+
+// Deliveries posted to the server's event loop
+struct mailbox<struct mailboxItem> loopMailbox;
+
+// Admin console on a local Unix socket, if a path is given. Each connection
+// sends commands a line at a time, and long listings are written out a piece
+// at a time from the event loop as the connection reads them
+enum adminStream {
+    ADMIN_STREAM_NONE,
+    ADMIN_STREAM_SESSIONS,      // Listing sessions, from the one after cursor
+    ADMIN_STREAM_CONNECTIONS    // Listing connections, from fds[next]
+};
+
+struct adminConnection {
+    string input;               // Command lines not run yet
+    string output;              // Response not written yet
+    enum adminStream streaming = ADMIN_STREAM_NONE;
+    string cursor;
+    vector<int> fds;
+    size_t next = 0;
+};
 
-// Key is session name, value is set of file descriptors describing clients
-// connected to the session
-unordered_map<string, unordered_set<int>> sessionList;
+int adminListener = -1;
+string adminPath;
+unordered_map<int, struct adminConnection> adminConnections;
 
-// Key is session name, value is set to the be the password set by the client
-// making the session
-unordered_map<string, string> sessionPasswordList;
+// Announcements made from the admin console, oldest first. Each is encoded
+// once, and sent to BROADCAST_WAVE recipients a pass, with the sessions its
+// patterns are matched against BROADCAST_SCAN at a time, so announcing to
+// every session only takes a slice of each pass from everyone else's traffic.
+// A user found in several of its targets is only sent it once
+struct broadcastJob {
+    string packet;                          // With its '\0'
+    vector<string> patterns;                // Session name patterns still being matched
+    string prefix;                          // Shared by every session the patterns can match
+    string cursor;                          // Last session matched
+    unordered_set<uint32_t> reached;        // Users found so far
+    vector<pair<int, uint32_t>> recipients; // Socket and user, in case the socket is reused meanwhile
+    size_t next = 0;                        // Recipients sent to so far
+    size_t delivered = 0;                   // Of those, the ones still logged in
+    uint64_t startedAt;
+};
+
+deque<struct broadcastJob> broadcastJobs;
+
+// Traffic through each session, for the admin console and to find the hot
+// ones. rate is messages a second averaged over about SESSION_RATE_WINDOW, and
+// a session's load is that times the members each message goes out to. Once
+// the load reaches hotSessionLoad the session is hot, and its messages are
+// queued for each member rather than written straight away, so a member gets
+// a whole pass's worth of them in one write. It cools off again under half that
+struct sessionLoad {
+    unsigned long messages = 0;     // Since the session was created
+    double rate = 0;
+    uint64_t ratedAt = 0;           // When rate was last brought up to date
+    bool hot = false;
+};
+
+// Key is session ID
+unordered_map<uint32_t, struct sessionLoad> sessionLoads;
+unsigned long hotSessionLoad = HOT_SESSION_LOAD;    // 0 never batches
+
+// Memory held for the things below, kept up to date as they change so the
+// total can be checked on every pass. Names are counted once for each place
+// they're copied to
+size_t ringBytes = 0;       // Receive rings and shared memory channels
+size_t sessionBytes = 0;    // Sessions, their passwords, members and multicast groups
+size_t multicastBytes = 0;  // Multicast messages kept to repair gaps with
+atomic<size_t> liveIndexBytes(0);   // In-memory index, kept by the indexer thread
+
+// Limits on the memory accounted for, if -M is given. Over the soft limit the
+// server sheds the history it keeps in memory and stops reading from the
+// biggest consumers, and over the hard limit it disconnects them until it's
+// back under the soft limit
+size_t softMemoryLimit = 0;
+size_t hardMemoryLimit = 0;
+bool memoryPressure = false;        // Over the soft limit as of the last check
+unordered_set<int> pausedClients;   // Not read from until the pressure is off
+atomic<bool> indexerShedding(false);    // Has the indexer write out its index as it goes
+
+// Inbound traffic is captured to a file for replaying, if -w is given. Records
+// are gathered in captureBuffer and written once per pass of the main loop,
+// like the history log. Connections are numbered as they are accepted rather
+// than by fd, since fds are reused
+string capturePath;
+int capturefd = -1;
+string captureBuffer;
+uint64_t captureStart;                      // Monotonic time record times count from
+uint32_t nextCaptureConnection = 1;
+unordered_map<int, uint32_t> captureConnections;   // Key is fd, value is its number
+
+// Low latency mode: the core the event loop is pinned to (-1 if it isn't),
+// and how long to keep polling for packets after each event before sleeping
+int loopCPU = -1;
+unsigned int busyPollMicroseconds = 0;
+
+// Set by SIGUSR2 to hand the server over to a freshly started copy of its binary
+volatile sig_atomic_t upgradeRequested = 0;
+string serverPath;          // Binary to start on upgrade
+vector<string> serverArgs;  // Command line options and port to start it with
 
 // Get sockaddr, IPv4 or IPv6:
 void *get_in_addr(struct sockaddr *sa)
@@ -96,6 +559,154 @@ void *get_in_addr(struct sockaddr *sa)
 }
 
 
+// Returns the milliseconds elapsed since start
+double millisecondsSince(const struct timespec &start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) * 1000.0 + (now.tv_nsec - start.tv_nsec) / 1e6;
+}
+
+
+// Returns the time on the monotonic clock in nanoseconds, which is what traced
+// messages are stamped with
+uint64_t monotonicNanoseconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+
+// Returns the NUMA node a CPU belongs to, or -1 if it can't be found
+int cpuToNumaNode(int cpu)
+{
+    DIR *dir = opendir((CPU_SYSFS_PATH + to_string(cpu)).c_str());
+    if(dir == NULL) return -1;
+    
+    int node = -1;
+    struct dirent *entry;
+    while((entry = readdir(dir)) != NULL)
+    {
+        if(strncmp(entry->d_name, "node", 4) == 0) node = atoi(entry->d_name + 4);
+    }
+    closedir(dir);
+    return node;
+}
+
+
+// Pins the event loop to a core and makes memory allocated from then on come
+// from that core's NUMA node, so buffers and the client and session lists sit
+// next to the CPU that uses them. Call before anything big is allocated
+void pinEventLoop(int cpu)
+{
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    if(sched_setaffinity(0, sizeof(cpus), &cpus) == -1)
+    {
+        perror("sched_setaffinity");
+        return;
+    }
+    
+    int node = cpuToNumaNode(cpu);
+    if(node < 0) return;
+    
+    unsigned long nodeMask[16] = {0};
+    nodeMask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+    if(syscall(SYS_set_mempolicy, MPOL_PREFERRED, nodeMask, 8 * sizeof(nodeMask)) == -1)
+    {
+        perror("set_mempolicy");
+    }
+    printf("server: event loop pinned to CPU %d on NUMA node %d\n", cpu, node);
+}
+
+
+// Has the kernel poll the device queue for a client's packets when the socket
+// is empty instead of waiting for an interrupt
+void setBusyPoll(int sockfd)
+{
+    int microseconds = busyPollMicroseconds;
+    if(setsockopt(sockfd, SOL_SOCKET, SO_BUSY_POLL, &microseconds, sizeof(microseconds)) == -1)
+    {
+        perror("setsockopt SO_BUSY_POLL");
+    }
+}
+
+
+// Starts capturing inbound traffic to the file at path, replacing it
+// Returns false if it can't be created
+bool openCapture(const string &path)
+{
+    capturefd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if(capturefd == -1)
+    {
+        perror("capture: open");
+        return false;
+    }
+    captureBuffer.assign(CAPTURE_MAGIC, 8);
+    captureStart = monotonicNanoseconds();
+    return true;
+}
+
+
+// Writes out the capture records gathered since the last flush
+void flushCapture()
+{
+    if(captureBuffer.empty()) return;
+    
+    if(write(capturefd, captureBuffer.data(), captureBuffer.length()) != (ssize_t) captureBuffer.length())
+    {
+        perror("capture: write");
+    }
+    captureBuffer.clear();
+}
+
+
+// Adds a record of something received on a connection to the capture, if
+// there is one. Only packets have their data kept
+void captureTraffic(int sockfd, enum captureKind kind, const char *data, uint32_t length)
+{
+    if(capturefd == -1) return;
+    
+    auto connection = captureConnections.find(sockfd);
+    if(kind == CAPTURE_OPEN) connection = captureConnections.insert(make_pair(sockfd, nextCaptureConnection++)).first;
+    if(connection == captureConnections.end()) return;
+    
+    struct captureRecord record;
+    record.time = monotonicNanoseconds() - captureStart;
+    record.connection = connection->second;
+    record.length = length;
+    record.kind = kind;
+    captureBuffer.append((const char *) &record, sizeof(record));
+    if(kind == CAPTURE_PACKET) captureBuffer.append(data, length);
+    
+    if(kind == CAPTURE_CLOSE) captureConnections.erase(connection);
+    if(captureBuffer.length() >= CAPTURE_BUFFER_SIZE) flushCapture();
+}
+
+
+// Starts a listener taking connections, or updates one handed over to us.
+// Accepts never block, and the kernel holds a connection back until its
+// LOGIN has arrived so it can usually be logged in right away
+// Returns false if it can't listen
+bool listenOn(int listener)
+{
+    int deferSeconds = DEFER_ACCEPT_SECONDS;
+    if(setsockopt(listener, IPPROTO_TCP, TCP_DEFER_ACCEPT, &deferSeconds, sizeof(deferSeconds)) == -1)
+    {
+        perror("setsockopt: TCP_DEFER_ACCEPT");
+    }
+    fcntl(listener, F_SETFL, fcntl(listener, F_GETFL) | O_NONBLOCK);
+    
+    if (listen(listener, listenBacklog) == -1) {
+        perror("listen");
+        return false;
+    }
+    return true;
+}
+
+
 // Creates socket that listens for new connections and returns the file descriptor
 int createListenerSocket(const char* portNum)
 {
@@ -118,7 +729,8 @@ int createListenerSocket(const char* portNum)
     
     for(p = ai; p != NULL; p = p->ai_next)
     {
-        listener = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        // Not inherited by anything exec'd, a successor gets it through a hand off
+        listener = socket(p->ai_family, p->ai_socktype | SOCK_CLOEXEC, p->ai_protocol);
         if (listener < 0) continue;
         
         // lose the pesky "address already in use" error message
@@ -142,610 +754,5530 @@ int createListenerSocket(const char* portNum)
     freeaddrinfo(ai); // all done with this
 
     // listen
-    if (listen(listener, BACKLOG) == -1) {
-        perror("listen");
-        exit(3);
-    }
+    if (!listenOn(listener)) exit(3);
     
     return listener;
 }
 
 
-// Create a packet string from a message structure
-string stringifyMessage(const struct message* data)
-{   
-    string dataStr = to_string(data->type) + " " + to_string(data->size) 
-                     + " " + data->source + " " + data->data;
-    return dataStr;
+// Creates the listening socket clients on the same host can connect to at
+// path, replacing any left behind by an earlier run
+// Returns -1 if it can't be created
+int createLocalSocket(const string &path)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if(path.length() >= sizeof(address.sun_path))
+    {
+        fprintf(stderr, "server: local socket path is too long\n");
+        return -1;
+    }
+    strcpy(address.sun_path, path.c_str());
+    
+    int sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(sockfd == -1)
+    {
+        perror("local: socket");
+        return -1;
+    }
+    
+    unlink(path.c_str());
+    if(bind(sockfd, (struct sockaddr *) &address, sizeof(address)) == -1 || 
+       listen(sockfd, listenBacklog) == -1)
+    {
+        perror("local: bind");
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
 }
 
 
-// Creates a message structure from a packet (string)
-struct message messageFromPacket(const char* buf)
+// Returns true if a client connected through the local socket
+bool isLocalSocket(int sockfd)
 {
-    string buffer(buf);
-    stringstream ss(buffer);
-    struct message packet;
-    ss >> packet.type >> packet.size >> packet.source;
-    if(!getline(ss, packet.data)) packet.data = ACK_DATA;
-    return packet;
+    int domain;
+    socklen_t length = sizeof(domain);
+    return getsockopt(sockfd, SOL_SOCKET, SO_DOMAIN, &domain, &length) == 0 && domain == AF_UNIX;
 }
 
 
-// Return the sessionID that the sockfd is connected to
-// Returns "NoSessionFound" if session could not be found
-string clientSockfdToSessionID (int sockfd)
+// Returns the shared memory a client sends and receives through, or NULL if
+// it uses its socket
+struct sharedTransport *sharedTransportOf(int sockfd)
 {
-    for (auto session = sessionList.begin(); session != sessionList.end(); session++)
-    {
-        // Check if the given client is connected to this session
-        auto client = session->second.find(sockfd);
-        if(client != session->second.end()) return session->first;
-    }
-
-    // Session could not be found 
-    return SESSION_NOT_FOUND;
+    if(sharedTransports.empty()) return NULL;
+    auto shared = sharedTransports.find(sockfd);
+    return shared == sharedTransports.end() ? NULL : &shared->second;
 }
 
 
-// Sends a message to client in the following format:
-//   message = "<type> <data_size> <source> <data>"
-// Returns true if message is successfully sent
-bool sendToClient(struct message *data, int sockfd)
+// Sends the buffers in iov to a client, through its ring if it uses shared
+// memory and otherwise its socket. Either way, it fails with EAGAIN if there's
+// no room to send any of them
+// Returns the number of bytes sent, or -1 on error
+ssize_t writeToClient(int sockfd, const struct iovec *iov, int count)
 {
-    int numBytes;
-    string dataStr = stringifyMessage(data);
-
-    if(dataStr.length() + 1 > MAXDATASIZE) return false;
-    if((numBytes = send(sockfd, dataStr.c_str(), dataStr.length() + 1, 0)) == -1)
+    struct sharedTransport *shared = sharedTransportOf(sockfd);
+    if(shared == NULL)
     {
-        perror("send");
-        return false;
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = (struct iovec *) iov;
+        msg.msg_iovlen = count;
+        return sendmsg(sockfd, &msg, MSG_NOSIGNAL);
     }
-    return true;
-}
-
-
-// Send an acknowledge to a client if their login is successful
-void acknowledgeLogin(int sockfd)
-{
-    struct message loginAck;
-    loginAck.type = LO_ACK;
-    loginAck.size = 0;
-    loginAck.source = "SERVER";
-    loginAck.data = "";
     
-    sendToClient(&loginAck, sockfd);
-}
-
-// Checks if the user can login to the server
-// If not, string returned is reason for error
-pair<bool, string> canUserConnect(string userID, string password)
-{
-    // Checks if the user is on the list of permitted clients
-    if(permittedClientList.find(userID) != permittedClientList.end())
+    struct sharedRing *ring = &shared->channel->toClient;
+    size_t total = 0, written = 0;
+    for(int i = 0; i < count; i++) total += iov[i].iov_len;
+    while(written == 0 && total > 0)
     {
-        // Checks if the user is already logged in 
-        for (auto client = clientList.begin(); client != clientList.end(); client++)
+        for(int i = 0; i < count; i++)
         {
-            if(client->second.first == userID)
-            {
-                return make_pair(false, "User is already logged in!");
-            }
+            size_t length = sharedRingWrite(ring, (const char *) iov[i].iov_base, iov[i].iov_len);
+            written += length;
+            if(length < iov[i].iov_len) break;
         }
+        if(written > 0 || !sharedRingWriterSleeps(ring, 1)) continue;
         
-        // Check if password is correct
-        if(password != permittedClientList.find(userID)->second)
-        {
-            return make_pair(false, "Password is incorrect!");
-        }
-        return make_pair(true, ACK_DATA); 
+        errno = EAGAIN;
+        return -1;
     }
-    return make_pair(false, "Username does not exist!");
+    sharedRingWake(ring->readerWaiting, shared->clientWakeup);
+    return written;
 }
 
 
-// Logs a client described by a file descriptor into the server
-// Returns true if successful
-// TODO Check if the client is double logging in
-bool loginClient(int sockfd)
+// Sends length bytes of data to a client with writeToClient()
+ssize_t sendBytesToClient(int sockfd, const char *data, size_t length)
 {
-    char buffer[MAXDATASIZE];
-    int numBytes;
-    struct message loginInfo;
-    struct message ack;
-    ack.size = 0;
-    ack.source = "SERVER";
-    ack.data = ACK_DATA;
-    
-    if((numBytes = recv(sockfd, buffer, MAXDATASIZE, 0)) == -1)
-    {
-        perror("recv");
-        return false;
-    }
+    struct iovec iov = {(void *) data, length};
+    return writeToClient(sockfd, &iov, 1);
+}
+
+
+// Sends length bytes of a file from offset to a client, straight from the page
+// cache with sendfile(), or through a buffer a piece at a time if it uses
+// shared memory. Either way, it fails with EAGAIN if there's no room to send
+// any of them
+// Returns the number of bytes sent, or -1 on error
+ssize_t sendFileData(int sockfd, int filefd, off_t offset, size_t length)
+{
+    ssize_t numBytes;
+    if(sharedTransportOf(sockfd) == NULL) numBytes = sendfile(sockfd, filefd, &offset, length);
     else
     {
-        string s(buffer);
-        stringstream ss(s);
-        ss >> loginInfo.type >> loginInfo.size
-           >> loginInfo.source >> loginInfo.data;
-    }
-    
-    // Check if user is permitted to connect to the server
-    pair<bool, string> userConnectReq = canUserConnect(loginInfo.source, loginInfo.data);
-    if (userConnectReq.first == false)
-    {
-        // Send back reason for error
-        ack.type = LO_NAK;
-        ack.data = userConnectReq.second;
-        ack.size = ack.data.length() + 1;
-        
-        sendToClient(&ack, sockfd);
-        return false;
+        static char buffer[FILE_SPLICE_SIZE];
+        numBytes = pread(filefd, buffer, min(length, (size_t) FILE_SPLICE_SIZE), offset);
+        if(numBytes > 0) numBytes = sendBytesToClient(sockfd, buffer, numBytes);
     }
     
-    else
+    // The spool is never shorter than the size it was sent with
+    if(numBytes == 0)
     {
-        // Client can login, add it to the list of active clients
-        clientList.insert(make_pair(sockfd, make_pair(loginInfo.source, loginInfo.data)));
-        
-        // No data sent back
-        ack.type = LO_ACK;
-        
-        sendToClient(&ack, sockfd);
-        return true;
+        errno = EIO;
+        return -1;
     }
+    return numBytes;
 }
 
-// Checks if the password corresponds with the session being attempted to join
-bool checkSessionPassword (string sessionID, string sessionPassword)
+
+// Returns true if a client has room to be sent more: select found its socket
+// writable, or it uses shared memory and its ring isn't full
+bool clientHasRoom(int sockfd, fd_set *writable)
 {
-    auto currentSession = sessionPasswordList.find(sessionID);
+    struct sharedTransport *shared = sharedTransportOf(sockfd);
+    if(shared == NULL) return FD_ISSET(sockfd, writable);
+    return sharedRingUsed(&shared->channel->toClient) < SHARED_RING_SIZE;
+}
 
-    if (currentSession -> second == sessionPassword) return true;
-    else return false; 
 
+// Has select watch a client for room to be sent more. Clients using shared
+// memory wake us through their wakeup instead, which is always watched
+void watchClientRoom(int sockfd, fd_set *writable, int *maxfd)
+{
+    if(sharedTransportOf(sockfd) != NULL) return;
+    FD_SET(sockfd, writable);
+    *maxfd = max(*maxfd, sockfd);
 }
 
-// Adds client to the specified session
-// If the session exists and they aren't already in a session, it sends back the
-// session they were added to
-// Otherwise, it sends back the reason they couldn't be added to the specified session
-// Returns true if successful
+
+// Reads as much of what a client using shared memory has sent as fits in iov,
+// and signals it if it was waiting for room. Once its ring is empty we're
+// marked as waiting, so it signals us when it sends more
+// Returns the number of bytes read
+size_t readSharedData(struct sharedTransport &shared, const struct iovec *iov, int count)
+{
+    struct sharedRing *ring = &shared.channel->toServer;
+    size_t length = 0;
+    for(int i = 0; i < count; i++)
+    {
+        size_t n = sharedRingRead(ring, (char *) iov[i].iov_base, iov[i].iov_len);
+        length += n;
+        if(n < iov[i].iov_len) break;
+    }
+    if(length > 0) sharedRingWake(ring->writerWaiting, shared.clientWakeup);
+    if(sharedRingUsed(ring) == 0) sharedRingReaderSleeps(ring);
+    return length;
+}
+
+
+// Returns true if the socket of a client using shared memory turned readable
+// because the client hung up, or sent something there instead of its ring
+bool sharedSocketClosed(int sockfd)
+{
+    char byte;
+    ssize_t numBytes = recv(sockfd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return numBytes >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+}
+
+
+// Returns true if a client using shared memory has something for the main
+// loop to do straight away: packets in its ring, or room for what's waiting to
+// be sent to it. Its wakeup is only signalled if it saw us waiting, which we
+// may have stopped doing before going back to sleep. A client whose ring is
+// full isn't written to until it has room, so we're marked as waiting for it
+// here instead
+bool sharedTransportsReady()
+{
+    for(auto const & shared : sharedTransports)
+    {
+        int sockfd = shared.first;
+        struct sharedChannel *channel = shared.second.channel;
+        if(sharedRingUsed(&channel->toServer) > 0 && pausedClients.find(sockfd) == pausedClients.end()) return true;
+        if(outboundQueues.find(sockfd) == outboundQueues.end() && writeWaiters.find(sockfd) == writeWaiters.end())
+        {
+            continue;
+        }
+        if(!sharedRingWriterSleeps(&channel->toClient, 1)) return true;
+    }
+    return false;
+}
+
+
+// Adds the wakeups of the clients using shared memory to those select watches
+void watchSharedWakeups(fd_set *readable, int *maxfd)
+{
+    for(auto const & shared : sharedTransports)
+    {
+        FD_SET(shared.second.serverWakeup, readable);
+        *maxfd = max(*maxfd, shared.second.serverWakeup);
+    }
+}
+
+
+// Resets the wakeups select found signalled, and takes them out of the set so
+// they aren't mistaken for clients. What each was for is found by looking at
+// the client's rings, which the main loop does anyway
+void clearSharedWakeups(fd_set *readable)
+{
+    for(auto const & shared : sharedTransports)
+    {
+        if(!FD_ISSET(shared.second.serverWakeup, readable)) continue;
+        uint64_t count;
+        if(read(shared.second.serverWakeup, &count, sizeof(count)) == -1 && errno != EAGAIN)
+        {
+            perror("eventfd: read");
+        }
+        FD_CLR(shared.second.serverWakeup, readable);
+    }
+}
+
+
+// Unmaps a client's shared memory and closes its memfd and wakeups
+void closeSharedTransport(struct sharedTransport &shared)
+{
+    if(shared.channel != NULL) munmap(shared.channel, sizeof(struct sharedChannel));
+    for(int fd : {shared.memfd, shared.serverWakeup, shared.clientWakeup})
+    {
+        if(fd != -1) close(fd);
+    }
+}
+
+
+// Makes the shared memory and wakeups for a client, or maps the memory of
+// ones handed over by a predecessor
+// Returns false if they couldn't be set up, with whatever was closed again
+bool openSharedTransport(struct sharedTransport &shared, bool create)
+{
+    shared.channel = NULL;
+    if(create)
+    {
+        shared.memfd = memfd_create("chatchannel", MFD_CLOEXEC);
+        shared.serverWakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        shared.clientWakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(shared.memfd == -1 || ftruncate(shared.memfd, sizeof(struct sharedChannel)) == -1 ||
+           shared.serverWakeup == -1 || shared.clientWakeup == -1)
+        {
+            perror("shared memory: create");
+            closeSharedTransport(shared);
+            return false;
+        }
+    }
+    
+    // select() has to be able to watch the wakeup
+    void *memory = mmap(NULL, sizeof(struct sharedChannel), PROT_READ | PROT_WRITE, MAP_SHARED, shared.memfd, 0);
+    if(memory == MAP_FAILED || shared.serverWakeup >= FD_SETSIZE)
+    {
+        if(memory == MAP_FAILED) perror("shared memory: mmap");
+        else munmap(memory, sizeof(struct sharedChannel));
+        closeSharedTransport(shared);
+        return false;
+    }
+    shared.channel = (struct sharedChannel *) memory;
+    ringBytes += sizeof(struct sharedChannel);
+    return true;
+}
+
+
+// Tells the event loop that a thread posting to loopMailbox has finished, so
+// it can stop draining the mailbox for it and join it
+void finishPosting(atomic<bool> &finished)
+{
+    finished.store(true, memory_order_release);
+    uint64_t one = 1;
+    if(write(loopMailbox.eventfd, &one, sizeof(one)) == -1) perror("mailbox: write");
+}
+
+
+// Has the event loop carry on with step once a task's client has room for more
+// to be sent
+void awaitWritable(struct loopTask *task, void (*step)(struct loopTask *))
+{
+    task->step = step;
+    writeWaiters[task->sockfd] = task;
+}
+
+
+// Moves a client onto the shared memory passed to it with the SHM_ACK that has
+// just gone out. Whatever is sent to it from now on goes through its ring
+void startSharedTransport(int sockfd)
+{
+    auto attaching = attachingTransports.find(sockfd);
+    if(attaching == attachingTransports.end()) return;
+    struct sharedTransport shared = attaching->second;
+    attachingTransports.erase(attaching);
+    
+    // We only mark ourselves as waiting after emptying the ring, so start
+    // out that way or what the client sends first wouldn't wake us
+    sharedRingReaderSleeps(&shared.channel->toServer);
+    sharedTransports[sockfd] = shared;
+    printf("server: socket %d moved to shared memory\n", sockfd);
+}
+
+
+// Removes the first packet of one of a client's lanes once it has been sent,
+// with the file following it if any
+void takeQueuedPacket(int sockfd, struct outboundQueue &queue, int lane)
+{
+    struct queuedPacket &packet = queue.lanes[lane].front();
+    size_t length = packet.data.length();
+    if(packet.filefd != -1)
+    {
+        close(packet.filefd);
+        queuedFiles--;
+    }
+    if(packet.passesShared) startSharedTransport(sockfd);
+    queue.lanes[lane].pop_front();
+    queue.bytes -= length;
+    outboundBytes -= length;
+    if(queue.partialLane == lane)
+    {
+        queue.partialLane = -1;
+        queue.sent = 0;
+    }
+}
+
+
+// Sends as much of the rest of the packet a client's queue stopped in the
+// middle of as the client has room for, so something else can be sent to the
+// client after it. A file following it is too big to wait for, and is left to
+// go out with the rest of the queue
+// Returns false if the packet or a file is still on its way to the client
+bool finishQueuedPacket(int sockfd)
+{
+    if(outboundQueues.empty()) return true;
+    auto queue = outboundQueues.find(sockfd);
+    if(queue == outboundQueues.end() || queue->second.partialLane == -1) return true;
+    
+    struct outboundQueue &waiting = queue->second;
+    const struct queuedPacket &packet = waiting.lanes[waiting.partialLane].front();
+    if(packet.filefd != -1) return false;
+    ssize_t numBytes = sendBytesToClient(sockfd, packet.data.data() + waiting.sent, 
+                                         packet.data.length() - waiting.sent);
+    if(numBytes == -1)
+    {
+        if(errno != EAGAIN && errno != EWOULDBLOCK) perror("send");
+        return false;
+    }
+    waiting.sent += numBytes;
+    if(waiting.sent < packet.data.length()) return false;
+    
+    takeQueuedPacket(sockfd, waiting, waiting.partialLane);
+    if(waiting.bytes == 0) outboundQueues.erase(queue);
+    return true;
+}
+
+
+// Sends as much of a task's data, a run of whole packets, as its client has
+// room for. A packet left half sent is finished by finishTaskPacket before
+// anything else goes to the client, and nothing is sent while a file queued for
+// the client is on its way
+// Returns true once all of it has been sent. If the connection has failed it
+// keeps returning false until the client is disconnected
+bool sendTaskData(struct loopTask *task)
+{
+    if(!finishQueuedPacket(task->sockfd)) return false;
+    while(task->sent < task->data.length())
+    {
+        ssize_t numBytes = sendBytesToClient(task->sockfd, task->data.data() + task->sent, 
+                                             task->data.length() - task->sent);
+        if(numBytes == -1)
+        {
+            if(errno != EAGAIN && errno != EWOULDBLOCK) perror("send");
+            return false;
+        }
+        task->sent += numBytes;
+    }
+    return true;
+}
+
+
+// Sends as much of the rest of the packet a task waiting to send to a client
+// stopped in the middle of as the client has room for, so something else can
+// be sent to the client after it
+// Returns false if the packet is still on its way to the client
+bool finishTaskPacket(int sockfd)
+{
+    if(writeWaiters.empty()) return true;
+    auto waiter = writeWaiters.find(sockfd);
+    if(waiter == writeWaiters.end()) return true;
+    
+    struct loopTask *task = waiter->second;
+    if(task->sent == 0 || task->data[task->sent - 1] == '\0') return true;
+    
+    size_t packetEnd = task->data.find('\0', task->sent);
+    packetEnd = packetEnd == string::npos ? task->data.length() : packetEnd + 1;
+    ssize_t numBytes = sendBytesToClient(sockfd, task->data.data() + task->sent, packetEnd - task->sent);
+    if(numBytes == -1)
+    {
+        if(errno != EAGAIN && errno != EWOULDBLOCK) perror("send");
+        return false;
+    }
+    task->sent += numBytes;
+    return task->sent == packetEnd;
+}
+
+
+// Adds the sockets tasks are waiting to send on to those select watches
+void watchTaskWriters(fd_set *writable, int *maxfd)
+{
+    for(auto const & waiter : writeWaiters) watchClientRoom(waiter.first, writable, maxfd);
+}
+
+
+// Carries on with the tasks whose clients have room to be sent more
+// With no writable set, carries on with all of them
+void resumeTaskWriters(fd_set *writable)
+{
+    vector<struct loopTask *> ready;
+    for(auto it = writeWaiters.begin(); it != writeWaiters.end(); )
+    {
+        if(writable != NULL && !clientHasRoom(it->first, writable)) it++;
+        else
+        {
+            ready.push_back(it->second);
+            it = writeWaiters.erase(it);
+        }
+    }
+    for(auto const & task : ready) task->step(task);
+}
+
+
+// Returns true if the user a task is for is still logged in where it started
+bool taskClientPresent(const struct loopTask *task)
+{
+    auto client = clientList.find(task->sockfd);
+    return client != clientList.end() && userNames[client->second] == task->userID;
+}
+
+
+// Hands a task back from the worker thread, to carry on with on the event
+// loop once it's taken from the mailbox
+void handTaskBack(struct loopTask *task)
+{
+    struct mailboxItem item;
+    item.sockfd = task->sockfd;
+    item.task = task;
+    postToMailboxOrWait(&loopMailbox, item);
+}
+
+
+// Returns the ID of a user, interning its name the first time it's seen
+uint32_t internUser(const string &userID)
+{
+    auto interned = userIDs.insert(make_pair(userID, (uint32_t) userNames.size()));
+    if(interned.second) userNames.push_back(userID);
+    return interned.first->second;
+}
+
+
+// Returns the name of a logged in client
+const string &clientName(int sockfd)
+{
+    return userNames[clientList.find(sockfd)->second];
+}
+
+
+// Records a client or session appearing in or leaving the presence index
+void addPresence(set<string> &names, const string &name)
+{
+    if(names.insert(name).second) presenceVersion++;
+}
+
+void removePresence(set<string> &names, const string &name)
+{
+    if(names.erase(name) > 0) presenceVersion++;
+}
+
+
+// Returns the bytes a copy of a string allocates, none if it fits inside the
+// string itself. Copies are only as big as the text, so this is the same for
+// every copy of it
+size_t stringMemory(const string &str)
+{
+    return str.length() > 15 ? str.length() + 1 : 0;
+}
+
+
+// Returns the memory accounted to a session existing, with its name kept in
+// its record and availableSessions
+size_t sessionFootprint(const string &sessionID, const string &sessionPassword)
+{
+    return SESSION_MEMORY + 2 * stringMemory(sessionID) + stringMemory(sessionPassword);
+}
+
+
+// Appends a session name and password to a snapshot or journal record
+void appendSessionRecord(string &record, const string &sessionID, const string &sessionPassword)
+{
+    uint16_t lengths[2] = {(uint16_t) sessionID.length(), (uint16_t) sessionPassword.length()};
+    record.append((const char *) lengths, sizeof(lengths));
+    record += sessionID + sessionPassword;
+}
+
+
+// Reads a session name and password appended by appendSessionRecord()
+// Returns false if the data ends first, such as a record cut off by a crash
+bool readSessionRecord(const char *data, size_t length, size_t &pos, 
+                       string &sessionID, string &sessionPassword)
+{
+    uint16_t lengths[2];
+    if(pos + sizeof(lengths) > length) return false;
+    memcpy(lengths, data + pos, sizeof(lengths));
+    pos += sizeof(lengths);
+    
+    if(pos + lengths[0] + lengths[1] > length) return false;
+    sessionID.assign(data + pos, lengths[0]);
+    sessionPassword.assign(data + pos + lengths[0], lengths[1]);
+    pos += lengths[0] + lengths[1];
+    return true;
+}
+
+
+// Returns the generations of the journals in the state directory, oldest first
+vector<uint32_t> listJournalGenerations()
+{
+    vector<uint32_t> generations;
+    DIR *dir = opendir(stateDirectory.c_str());
+    if(dir == NULL) return generations;
+    
+    struct dirent *entry;
+    size_t prefixLength = strlen(JOURNAL_PREFIX);
+    while((entry = readdir(dir)) != NULL)
+    {
+        if(strncmp(entry->d_name, JOURNAL_PREFIX, prefixLength) == 0)
+        {
+            generations.push_back(strtoul(entry->d_name + prefixLength, NULL, 10));
+        }
+    }
+    closedir(dir);
+    
+    sort(generations.begin(), generations.end());
+    return generations;
+}
+
+
+string journalPath(uint32_t generation)
+{
+    return stateDirectory + "/" + JOURNAL_PREFIX + to_string(generation);
+}
+
+
+// Starts appending session changes to the journal of the given generation
+void openJournal(uint32_t generation)
+{
+    if(journalfd != -1) close(journalfd);
+    
+    journalGeneration = generation;
+    journalfd = open(journalPath(generation).c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if(journalfd == -1) perror("journal: open");
+}
+
+
+// Records a session being created or removed in the journal
+void journalSessionChange(char change, const string &sessionID, const string &sessionPassword)
+{
+    sessionsChanged = true;
+    if(journalfd == -1) return;
+    
+    string record(1, change);
+    appendSessionRecord(record, sessionID, sessionPassword);
+    if(write(journalfd, record.data(), record.length()) != (ssize_t) record.length())
+    {
+        perror("journal: write");
+    }
+}
+
+
+// Adds a session without any clients, as it was before the server restarted
+// Sessions restored in name order can say so, which makes adding each one to
+// the presence index constant time
+void restoreSession(const string &sessionID, const string &sessionPassword, bool inOrder = false)
+{
+    struct sessionRecord *session = findSession(&sessionTable, sessionID);
+    if(session == NULL) addSession(&sessionTable, sessionID, sessionPassword);
+    else
+    {
+        sessionBytes -= sessionFootprint(sessionID, session->password);
+        session->password = sessionPassword;
+    }
+    sessionBytes += sessionFootprint(sessionID, sessionPassword);
+    
+    if(inOrder) availableSessions.insert(availableSessions.end(), sessionID);
+    else availableSessions.insert(sessionID);
+    presenceVersion++;
+}
+
+
+// Loads the sessions from the latest snapshot in the state directory, applies
+// the changes journaled since, and opens a new journal to continue in
+void loadSessions()
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint32_t firstGeneration = 1;
+    
+    // The snapshot is mapped rather than read so loading it is one pass over memory
+    int snapshotfd = open((stateDirectory + "/" + SNAPSHOT_FILE).c_str(), O_RDONLY);
+    struct stat snapshotInfo;
+    if(snapshotfd != -1 && fstat(snapshotfd, &snapshotInfo) == 0 && snapshotInfo.st_size >= 16)
+    {
+        size_t length = snapshotInfo.st_size;
+        const char *data = (const char *) mmap(NULL, length, PROT_READ, MAP_PRIVATE, snapshotfd, 0);
+        
+        if(data != MAP_FAILED && memcmp(data, SNAPSHOT_MAGIC, 8) == 0)
+        {
+            uint32_t count;
+            memcpy(&firstGeneration, data + 8, sizeof(firstGeneration));
+            memcpy(&count, data + 12, sizeof(count));
+            reserveSessions(&sessionTable, count);
+            
+            size_t pos = 16;
+            string sessionID, sessionPassword;
+            for(uint32_t i = 0; i < count && readSessionRecord(data, length, pos, sessionID, sessionPassword); i++)
+            {
+                restoreSession(sessionID, sessionPassword, true);
+            }
+        }
+        if(data != MAP_FAILED) munmap((void *) data, length);
+    }
+    if(snapshotfd != -1) close(snapshotfd);
+    
+    // Replay the journals written since the snapshot was taken
+    uint32_t lastGeneration = firstGeneration;
+    for(auto const & generation : listJournalGenerations())
+    {
+        if(generation < firstGeneration) continue;
+        lastGeneration = generation;
+        
+        ifstream journal(journalPath(generation), ios::binary);
+        string records((istreambuf_iterator<char>(journal)), istreambuf_iterator<char>());
+        
+        size_t pos = 0;
+        string sessionID, sessionPassword;
+        while(pos < records.length())
+        {
+            char change = records[pos++];
+            if(!readSessionRecord(records.data(), records.length(), pos, sessionID, sessionPassword)) break;
+            
+            if(change == JOURNAL_CREATE) restoreSession(sessionID, sessionPassword);
+            else
+            {
+                uint32_t id = sessionIDOf(&sessionTable, sessionID);
+                if(id != NO_SESSION)
+                {
+                    sessionBytes -= sessionFootprint(sessionID, sessionTable.records[id].password);
+                    removeSession(&sessionTable, id);
+                }
+                removePresence(availableSessions, sessionID);
+            }
+        }
+    }
+    
+    // Start a fresh generation so the next snapshot can cover everything loaded
+    openJournal(lastGeneration + 1);
+    sessionsChanged = true;
+    lastSnapshot = time(NULL);
+    
+    printf("server: loaded %zu sessions in %.3f ms\n", sessionTable.count, 
+           millisecondsSince(start));
+}
+
+
+// Writes out what the snapshot has buffered
+// Returns false if it couldn't be written
+bool flushSnapshot(int snapshotfd, const char *buffer, size_t &used)
+{
+    for(size_t written = 0; written < used; )
+    {
+        ssize_t numBytes = write(snapshotfd, buffer + written, used - written);
+        if(numBytes == -1 && errno == EINTR) continue;
+        if(numBytes <= 0) return false;
+        written += numBytes;
+    }
+    used = 0;
+    return true;
+}
+
+
+// Adds bytes to what the snapshot has buffered, writing it out each time it
+// fills, without anything that could allocate
+// Returns false if it couldn't be written
+bool bufferSnapshot(int snapshotfd, char *buffer, size_t &used, const void *data, size_t length)
+{
+    const char *bytes = (const char *) data;
+    while(length > 0)
+    {
+        if(used == SNAPSHOT_BUFFER_SIZE && !flushSnapshot(snapshotfd, buffer, used)) return false;
+        size_t piece = min(length, SNAPSHOT_BUFFER_SIZE - used);
+        memcpy(buffer + used, bytes, piece);
+        used += piece;
+        bytes += piece;
+        length -= piece;
+    }
+    return true;
+}
+
+
+// Writes a snapshot of every session from a forked copy of the server, whose
+// memory is shared copy-on-write, so the main loop never waits on the disk.
+// Later changes go to a new journal generation, and older journals are
+// deleted once the snapshot is safely written
+void startSnapshot()
+{
+    if(snapshotPid != -1) return; // Last one is still being written
+    
+    openJournal(journalGeneration + 1);
+    snapshotGeneration = journalGeneration;
+    sessionsChanged = false;
+    lastSnapshot = time(NULL);
+    
+    // The child writes to a temp file and renames it so a crash never leaves
+    // half a snapshot. The indexer and task worker may be holding the heap's
+    // or stdio's locks when we fork, and the child gets them held by threads
+    // it doesn't have, so it must not allocate or use stdio. The paths are
+    // made here, and the records copied into a buffer on its stack
+    string path = stateDirectory + "/" + SNAPSHOT_FILE;
+    string tempPath = path + ".tmp";
+    if((snapshotPid = fork()) == -1)
+    {
+        perror("snapshot: fork");
+        return;
+    }
+    if(snapshotPid != 0) return;
+    
+    int snapshotfd = open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if(snapshotfd == -1) _exit(1);
+    
+    char buffer[SNAPSHOT_BUFFER_SIZE];
+    size_t used = 0;
+    uint32_t count = sessionTable.count;
+    bool written = bufferSnapshot(snapshotfd, buffer, used, SNAPSHOT_MAGIC, 8) &&
+                   bufferSnapshot(snapshotfd, buffer, used, &snapshotGeneration, sizeof(snapshotGeneration)) &&
+                   bufferSnapshot(snapshotfd, buffer, used, &count, sizeof(count));
+    
+    // Written in name order, which is cheaper to load back into the presence
+    // index. Each record is laid out as appendSessionRecord() does it
+    for(auto session = availableSessions.begin(); written && session != availableSessions.end(); ++session)
+    {
+        const string &sessionPassword = findSession(&sessionTable, *session)->password;
+        uint16_t lengths[2] = {(uint16_t) session->length(), (uint16_t) sessionPassword.length()};
+        written = bufferSnapshot(snapshotfd, buffer, used, lengths, sizeof(lengths)) &&
+                  bufferSnapshot(snapshotfd, buffer, used, session->data(), session->length()) &&
+                  bufferSnapshot(snapshotfd, buffer, used, sessionPassword.data(), sessionPassword.length());
+    }
+    
+    written = written && flushSnapshot(snapshotfd, buffer, used) && fsync(snapshotfd) == 0;
+    written = close(snapshotfd) == 0 && written;
+    _exit(written && rename(tempPath.c_str(), path.c_str()) == 0 ? 0 : 1);
+}
+
+
+// Checks on the process writing a snapshot and cleans up after it finishes
+void checkSnapshot()
+{
+    int status;
+    if(snapshotPid == -1 || waitpid(snapshotPid, &status, WNOHANG) != snapshotPid) return;
+    snapshotPid = -1;
+    
+    if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        cout << "Snapshot of sessions failed, keeping journals" << endl;
+        sessionsChanged = true;
+        return;
+    }
+    
+    // Everything in the older journals is in the snapshot now
+    for(auto const & generation : listJournalGenerations())
+    {
+        if(generation < snapshotGeneration) unlink(journalPath(generation).c_str());
+    }
+}
+
+
+// Removes a session that has no clients left
+void closeSession(const string &sessionID)
+{
+    uint32_t id = sessionIDOf(&sessionTable, sessionID);
+    if(id != NO_SESSION)
+    {
+        sessionBytes -= sessionFootprint(sessionID, sessionTable.records[id].password);
+        sessionLoads.erase(id);
+        removeSession(&sessionTable, id);
+    }
+    auto group = multicastGroups.find(sessionID);
+    if(group != multicastGroups.end())
+    {
+        multicastBytes -= group->second.historyBytes;
+        sessionBytes -= MULTICAST_GROUP_MEMORY;
+        multicastGroups.erase(group);
+    }
+    removePresence(availableSessions, sessionID);
+    journalSessionChange(JOURNAL_REMOVE, sessionID, "");
+}
+
+
+// Returns true if the client is in the given session
+bool isInSession(int sockfd, const string &sessionID)
+{
+    struct sessionRecord *session = findSession(&sessionTable, sessionID);
+    return session != NULL && hasMember(session->members, sockfd);
+}
+
+
+// Returns the session the client is in if it's in exactly one, which is what
+// requests that don't name a session mean
+// Returns SESSION_NOT_FOUND otherwise
+string onlySessionOf(int sockfd)
+{
+    auto sessions = clientSessions.find(sockfd);
+    if(sessions == clientSessions.end() || sessions->second.size() != 1) return SESSION_NOT_FOUND;
+    return sessionTable.records[*sessions->second.begin()].name;
+}
+
+
+// Returns the lane a packet is sent to a client in, from its type
+enum outboundLane packetLane(const char *packet)
+{
+    switch(strtoul(packet, NULL, 10))
+    {
+        case MESSAGE:
+        case MESSAGE_CHUNK:
+        case MESSAGE_TRACE:
+        case MC_MESSAGE:
+            return LANE_BROADCAST;
+        case DIRMESSAGE:
+        case FILE_SEND:
+            return LANE_DIRECT;
+        default:
+            return LANE_CONTROL;
+    }
+}
+
+
+// Sends the next piece of the file following the packet at the front of a
+// client's lane, as far as its room and credit allow, and takes the packet off
+// the lane once all of the file has gone
+// Returns false if the client ran out of room or credit or its connection
+// failed first
+bool sendQueuedFile(int sockfd, struct outboundQueue &queue, int lane)
+{
+    const struct queuedPacket &packet = queue.lanes[lane].front();
+    size_t offset = queue.sent - packet.data.length();
+    size_t length = min(packet.fileSize - offset, outboundCredit[sockfd]);
+    if(length > 0)
+    {
+        ssize_t numBytes = sendFileData(sockfd, packet.filefd, offset, length);
+        if(numBytes == -1)
+        {
+            if(errno != EAGAIN && errno != EWOULDBLOCK) perror("sendfile");
+            return false;
+        }
+        outboundCredit[sockfd] -= numBytes;
+        queue.sent += numBytes;
+        offset += numBytes;
+    }
+    if(offset < packet.fileSize) return false;
+    
+    takeQueuedPacket(sockfd, queue, lane);
+    return true;
+}
+
+
+// Sends the SHM_ACK at the front of a client's lane with the shared memory and
+// wakeups set up for it, which go with its first byte, and takes it off the
+// lane once all of it has gone. Anything sent to the client after that goes
+// through its ring
+// Returns false if the client ran out of room or its connection failed first
+bool sendSharedAck(int sockfd, struct outboundQueue &queue, int lane)
+{
+    const struct queuedPacket &packet = queue.lanes[lane].front();
+    auto attaching = attachingTransports.find(sockfd);
+    if(attaching == attachingTransports.end())
+    {
+        takeQueuedPacket(sockfd, queue, lane);
+        return true;
+    }
+    
+    struct sharedTransport &shared = attaching->second;
+    int fds[3] = {shared.memfd, shared.serverWakeup, shared.clientWakeup};
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = {(void *) packet.data.data(), packet.data.length()};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    
+    // The rest of the packet, if it doesn't all fit, is finished like any other
+    ssize_t numBytes = sendmsg(sockfd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if(numBytes == -1)
+    {
+        if(errno != EAGAIN && errno != EWOULDBLOCK) perror("shared memory: sendmsg");
+        return false;
+    }
+    if((size_t) numBytes < packet.data.length())
+    {
+        queue.partialLane = lane;
+        queue.sent = numBytes;
+        return false;
+    }
+    takeQueuedPacket(sockfd, queue, lane);
+    return true;
+}
+
+
+// Sends up to limit packets from the front of one of a client's lanes,
+// gathering as many into each write as its credit allows. Replies are sent
+// whatever the credit
+// Returns false if the client ran out of room or credit or its connection
+// failed first
+bool sendFromLane(int sockfd, struct outboundQueue &queue, int lane, size_t limit)
+{
+    deque<struct queuedPacket> &packets = queue.lanes[lane];
+    while(!packets.empty() && limit > 0)
+    {
+        // A file goes out on its own once the packet in front of it has
+        if(queue.partialLane == lane && queue.sent >= packets.front().data.length())
+        {
+            if(!sendQueuedFile(sockfd, queue, lane)) return false;
+            limit--;
+            continue;
+        }
+        
+        // The packet passing a client its shared memory goes out on its own
+        if(packets.front().passesShared && queue.partialLane != lane)
+        {
+            if(!sendSharedAck(sockfd, queue, lane)) return false;
+            limit--;
+            continue;
+        }
+        
+        struct iovec iov[OUTBOUND_BATCH];
+        size_t count = 0, length = 0;
+        for(auto it = packets.begin(); it != packets.end() && count < min(limit, (size_t) OUTBOUND_BATCH); it++)
+        {
+            // A packet already started is finished even without credit
+            size_t offset = count == 0 && queue.partialLane == lane ? queue.sent : 0;
+            size_t size = it->data.length() - offset;
+            if(lane != LANE_CONTROL && offset == 0 && length + size > outboundCredit[sockfd]) break;
+            if(count > 0 && it->passesShared) break;
+            
+            iov[count].iov_base = (void *) (it->data.data() + offset);
+            iov[count].iov_len = size;
+            length += size;
+            count++;
+            
+            // Nothing can go between a packet and the file following it, and
+            // nothing goes over the socket after the client moves to its ring
+            if(it->filefd != -1 || it->passesShared) break;
+        }
+        if(count == 0) return false;
+        
+        ssize_t numBytes = writeToClient(sockfd, iov, count);
+        if(numBytes == -1)
+        {
+            if(errno != EAGAIN && errno != EWOULDBLOCK) perror("send");
+            return false;
+        }
+        if(lane != LANE_CONTROL) outboundCredit[sockfd] -= min(outboundCredit[sockfd], (size_t) numBytes);
+        
+        // Take off the packets that were sent, and note how far into the next
+        // one. A packet with a file stays on until the file has gone too
+        size_t left = numBytes;
+        while(left > 0)
+        {
+            size_t offset = queue.partialLane == lane ? queue.sent : 0;
+            size_t remaining = packets.front().data.length() - offset;
+            if(left < remaining || packets.front().filefd != -1)
+            {
+                queue.partialLane = lane;
+                queue.sent = offset + left;
+                break;
+            }
+            left -= remaining;
+            takeQueuedPacket(sockfd, queue, lane);
+            limit--;
+        }
+        if((size_t) numBytes < length) return false;
+    }
+    return true;
+}
+
+
+// Sends what's queued for a client, in lanes up to lastLane, as far as its
+// room and credit allow. A half sent packet is finished before anything else
+void sendQueuedPackets(int sockfd, struct outboundQueue &queue, int lastLane)
+{
+    if(!finishTaskPacket(sockfd)) return;
+    if(queue.partialLane != -1 && !sendFromLane(sockfd, queue, queue.partialLane, 1)) return;
+    for(int lane = LANE_CONTROL; lane <= lastLane; lane++)
+    {
+        if(!sendFromLane(sockfd, queue, lane, SIZE_MAX)) return;
+    }
+}
+
+
+// Forgets what was queued for a client whose connection is being closed
+void dropOutboundQueue(int sockfd)
+{
+    auto queue = outboundQueues.find(sockfd);
+    if(queue == outboundQueues.end()) return;
+    for(auto const & packets : queue->second.lanes)
+    {
+        for(auto const & packet : packets)
+        {
+            if(packet.filefd == -1) continue;
+            close(packet.filefd);
+            queuedFiles--;
+        }
+    }
+    outboundBytes -= queue->second.bytes;
+    outboundQueues.erase(queue);
+}
+
+
+// Adds the clients with packets queued to those select watches for room
+void watchOutboundQueues(fd_set *writable, int *maxfd)
+{
+    for(auto const & queue : outboundQueues) watchClientRoom(queue.first, writable, maxfd);
+}
+
+
+// Sends to the clients with room what's queued for them. Each is topped up
+// with OUTBOUND_QUANTUM of credit, and every client's replies and direct
+// messages are sent before anyone's session messages, so a client with a big
+// backlog can only hold up the others by its share of the pass
+void serviceOutboundQueues(fd_set *writable)
+{
+    vector<int> ready;
+    for(auto const & queue : outboundQueues)
+    {
+        if(clientHasRoom(queue.first, writable)) ready.push_back(queue.first);
+    }
+    
+    for(int lastLane : {LANE_DIRECT, LANE_BROADCAST})
+    {
+        for(auto const & sockfd : ready)
+        {
+            auto queue = outboundQueues.find(sockfd);
+            if(queue == outboundQueues.end()) continue;
+            if(lastLane == LANE_DIRECT) outboundCredit[sockfd] = OUTBOUND_QUANTUM;
+            
+            sendQueuedPackets(sockfd, queue->second, lastLane);
+            if(queue->second.bytes == 0) outboundQueues.erase(queue);
+        }
+    }
+}
+
+
+// Sends packets to a client in a lane, or queues them behind what's already
+// waiting there. Batched packets are always queued, to be sent with the rest
+// of the pass's on the next one. A client that falls OUTBOUND_QUEUE_LIMIT
+// behind isn't sent any more, and is disconnected on the next pass
+// Returns false if the connection failed
+bool sendPacketsToClient(const char *packets, size_t length, int sockfd, enum outboundLane lane, 
+                         bool batch = false)
+{
+    if(!laggingClients.empty() && laggingClients.find(sockfd) != laggingClients.end()) return false;
+    auto queue = outboundQueues.empty() ? outboundQueues.end() : outboundQueues.find(sockfd);
+    size_t sent = 0;
+    
+    if(queue == outboundQueues.end())
+    {
+        if(lane != LANE_CONTROL && outboundCredit[sockfd] < length) outboundCredit[sockfd] = 0;
+        else if(!batch && finishTaskPacket(sockfd))
+        {
+            ssize_t numBytes = sendBytesToClient(sockfd, packets, length);
+            if(numBytes == -1)
+            {
+                if(errno != EAGAIN && errno != EWOULDBLOCK)
+                {
+                    perror("send");
+                    return false;
+                }
+                numBytes = 0;
+            }
+            if(lane != LANE_CONTROL) outboundCredit[sockfd] -= numBytes;
+            if((size_t) numBytes == length) return true;
+            sent = numBytes;
+        }
+        queue = outboundQueues.insert(make_pair(sockfd, outboundQueue())).first;
+    }
+    
+    struct outboundQueue &waiting = queue->second;
+    waiting.lanes[lane].push_back(queuedPacket());
+    waiting.lanes[lane].back().data.assign(packets, length);
+    waiting.bytes += length;
+    outboundBytes += length;
+    if(sent > 0)
+    {
+        waiting.partialLane = lane;
+        waiting.sent = sent;
+    }
+    
+    if(waiting.bytes > OUTBOUND_QUEUE_LIMIT) laggingClients.insert(sockfd);
+    return true;
+}
+
+
+// Sends an already stringified packet to a client
+// Returns true if packet is successfully sent
+bool sendPacketToClient(const string &dataStr, int sockfd, bool batch = false)
+{
+    if(dataStr.length() + 1 > MAXDATASIZE) return false;
+    return sendPacketsToClient(dataStr.c_str(), dataStr.length() + 1, sockfd, packetLane(dataStr.c_str()), batch);
+}
+
+
+// Queues a FILE_SEND packet for a client in the direct lane, with the first
+// size bytes of filefd to follow it. The file is closed once they have gone,
+// or the client has
+void queueFileToClient(const string &dataStr, int sockfd, int filefd, size_t size)
+{
+    if(!laggingClients.empty() && laggingClients.find(sockfd) != laggingClients.end())
+    {
+        close(filefd);
+        return;
+    }
+    
+    struct outboundQueue &waiting = outboundQueues[sockfd];
+    waiting.lanes[LANE_DIRECT].push_back(queuedPacket());
+    struct queuedPacket &packet = waiting.lanes[LANE_DIRECT].back();
+    packet.data.assign(dataStr.c_str(), dataStr.length() + 1);
+    packet.filefd = filefd;
+    packet.fileSize = size;
+    waiting.bytes += packet.data.length();
+    outboundBytes += packet.data.length();
+    queuedFiles++;
+}
+
+
+// Sends a message to client in the following format:
+//   message = "<type> <data_size> <source> <data>"
+// Returns true if message is successfully sent
+bool sendToClient(struct message *data, int sockfd)
+{
+    return sendPacketToClient(stringifyMessage(data), sockfd);
+}
+
+
+// Delivers an item posted to the mailbox, or carries on with the task handed
+// back by the worker thread in it
+// Items for clients that have since logged out are dropped
+void deliverMailboxItem(struct mailboxItem &item)
+{
+    // A task carries on even if its client has gone, to clean up after itself
+    if(item.task != NULL)
+    {
+        item.task->step(item.task);
+        return;
+    }
+    
+    auto client = clientList.find(item.sockfd);
+    if(client == clientList.end() || userNames[client->second] != item.recipientID) return;
+    
+    if(item.packets.empty()) sendToClient(&item.packet, item.sockfd);
+    else sendPacketsToClient(item.packets.data(), item.packets.length(), item.sockfd, LANE_CONTROL);
+}
+
+
+// Delivers everything posted to the mailbox since the last wakeup, then lets
+// producers waiting for room carry on
+void drainMailbox(struct mailbox<struct mailboxItem> *box)
+{
+    struct mailboxItem item;
+    clearMailboxWakeup(box);
+    while(takeFromMailbox(box, &item)) deliverMailboxItem(item);
+    announceMailboxRoom(box);
+}
+
+
+// Waits for a thread that posts to loopMailbox to finish, draining the mailbox
+// meanwhile so the thread is never stuck waiting for room in it. The thread
+// calls finishPosting as it returns
+void joinPoster(thread &poster, atomic<bool> &finished)
+{
+    while(!finished.load(memory_order_acquire))
+    {
+        struct pollfd wakeup = {loopMailbox.eventfd, POLLIN, 0};
+        if(poll(&wakeup, 1, -1) == -1 && errno != EINTR) perror("mailbox: poll");
+        drainMailbox(&loopMailbox);
+    }
+    poster.join();
+}
+
+
+void startTaskWorker()
+{
+    startTaskWorker(&loopWorker, handTaskBack, finishPosting);
+}
+
+
+// Stops the worker once it has done the work it was given. Tasks it hands back
+// meanwhile are carried on with here, and any that await work again have it
+// done straight away
+void stopTaskWorker()
+{
+    if(!loopWorker.thread.joinable()) return;
+    askTaskWorkerToStop(&loopWorker);
+    joinPoster(loopWorker.thread, loopWorker.finished);
+}
+
+
+// Send an acknowledge to a client if their login is successful
+void acknowledgeLogin(int sockfd)
+{
+    struct message loginAck;
+    loginAck.type = LO_ACK;
+    loginAck.size = 0;
+    loginAck.source = "SERVER";
+    loginAck.data = "";
+    
+    sendToClient(&loginAck, sockfd);
+}
+
+// Checks if the user can login to the server
+// If not, string returned is reason for error
+pair<bool, string> canUserConnect(string userID, string password)
+{
+    // Checks if the user is on the list of permitted clients
+    if(permittedClientList.find(userID) != permittedClientList.end())
+    {
+        // Checks if the user is already logged in 
+        if(onlineClients.find(userID) != onlineClients.end())
+        {
+            return make_pair(false, "User is already logged in!");
+        }
+        
+        // Check if password is correct
+        if(password != permittedClientList.find(userID)->second)
+        {
+            return make_pair(false, "Password is incorrect!");
+        }
+        return make_pair(true, ACK_DATA); 
+    }
+    return make_pair(false, "Username does not exist!");
+}
+
+
+// Returns the file a user's spilled direct messages are kept in
+string mailboxPath(const string &userID)
+{
+    return mailboxDirectory + "/" + OFFLINE_MAILBOX_PREFIX + userID;
+}
+
+
+// Holds a direct message for a permitted user who isn't logged in, in memory
+// if there's room in the budget and the server isn't short of memory, and
+// otherwise at the end of their file
+// Returns false if their mailbox is full or can't be written to
+bool queueOfflineMessage(const string &userID, const string &packet)
+{
+    struct offlineMailbox &box = offlineMailboxes[userID];
+    size_t length = packet.length() + 1;
+    
+    if(box.spilledBytes == 0 && offlineBytes + length <= OFFLINE_MEMORY_BUDGET && !memoryPressure)
+    {
+        box.packets.emplace_back(packet.c_str(), length);
+        box.bytes += length;
+        offlineBytes += length;
+        return true;
+    }
+    
+    if(box.spilledBytes + length > OFFLINE_SPILL_LIMIT) return false;
+    if(mailboxDirectory.empty())
+    {
+        char directory[] = OFFLINE_DIR_TEMPLATE;
+        if(mkdtemp(directory) == NULL)
+        {
+            perror("mailbox: mkdtemp");
+            return false;
+        }
+        mailboxDirectory = directory;
+    }
+    if(box.spillfd == -1)
+    {
+        box.spillfd = open(mailboxPath(userID).c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+        if(box.spillfd == -1)
+        {
+            perror("mailbox: open");
+            return false;
+        }
+    }
+    if(write(box.spillfd, packet.c_str(), length) != (ssize_t) length)
+    {
+        perror("mailbox: write");
+        if(ftruncate(box.spillfd, box.spilledBytes) == -1) perror("mailbox: ftruncate");
+        return false;
+    }
+    box.spilledBytes += length;
+    return true;
+}
+
+
+// Reads the next chunk of a user's spilled direct messages, on the worker
+// thread, cut short after the last whole packet in it
+// Leaves the task's data empty if there's nothing more to read
+void readOfflineChunk(struct loopTask *task)
+{
+    task->data.resize(task->length);
+    ssize_t numBytes = task->fd == -1 ? 0 : pread(task->fd, &task->data[0], task->length, task->offset);
+    if(numBytes == -1) perror("mailbox: pread");
+    task->data.resize(max(numBytes, (ssize_t) 0));
+    
+    size_t lastPacketEnd = task->data.rfind('\0');
+    if(lastPacketEnd != string::npos) task->data.resize(lastPacketEnd + 1);
+    task->sent = 0;
+}
+
+
+// Sends a user the direct messages that came while they were away as their
+// socket has room: first those held in memory, then those spilled to disk a
+// chunk at a time, each read by the worker thread. Messages that arrive
+// meanwhile are added to the mailbox behind the rest, so this carries on until
+// it is empty. If the user logs out first, what's left is kept for next time
+// and sent from the start of the file again then, or straight away if they've
+// already logged back in
+void sendOfflineMessages(struct loopTask *task)
+{
+    struct offlineMailbox &box = offlineMailboxes[task->userID];
+    
+    if(!taskClientPresent(task))
+    {
+        task->sockfd = -1;
+        for(auto const & client : clientList)
+        {
+            if(userNames[client.second] == task->userID) task->sockfd = client.first;
+        }
+        if(task->sockfd == -1)
+        {
+            if(task->fd != -1) close(task->fd);
+            box.delivering = false;
+            finishTask(&loopWorker, task);
+            return;
+        }
+        task->data.clear();
+        task->sent = 0;
+        task->packets = 0;
+        task->offset = 0;
+    }
+    else if(!sendTaskData(task))
+    {
+        awaitWritable(task, sendOfflineMessages);
+        return;
+    }
+    else if(task->packets > 0)
+    {
+        for(; task->packets > 0; task->packets--)
+        {
+            box.bytes -= box.packets.front().length();
+            offlineBytes -= box.packets.front().length();
+            box.packets.pop_front();
+        }
+    }
+    else if(task->length > 0)
+    {
+        // Give up on the rest of the file if it can't be read
+        if(task->data.empty()) box.spilledBytes = task->offset;
+        task->offset += task->data.length();
+        task->length = 0;
+    }
+    
+    // Messages held in memory came before any on disk
+    if(!box.packets.empty())
+    {
+        task->data.clear();
+        for(auto const & packet : box.packets) task->data += packet;
+        task->packets = box.packets.size();
+        task->sent = 0;
+        sendOfflineMessages(task);
+        return;
+    }
+    if((size_t) task->offset < box.spilledBytes)
+    {
+        if(task->fd == -1 && (task->fd = open(mailboxPath(task->userID).c_str(), O_RDONLY | O_CLOEXEC)) == -1)
+        {
+            perror("mailbox: open");
+        }
+        task->length = min((size_t) OFFLINE_DELIVERY_CHUNK, box.spilledBytes - task->offset);
+        awaitWork(&loopWorker, task, readOfflineChunk, sendOfflineMessages);
+        return;
+    }
+    
+    if(task->fd != -1) close(task->fd);
+    if(box.spilledBytes > 0) unlink(mailboxPath(task->userID).c_str());
+    if(box.spillfd != -1) close(box.spillfd);
+    offlineMailboxes.erase(task->userID);
+    finishTask(&loopWorker, task);
+}
+
+
+// Starts sending a user who has just logged in the direct messages that came
+// while they were away
+void deliverOfflineMessages(int sockfd, const string &userID)
+{
+    auto mailbox = offlineMailboxes.find(userID);
+    if(mailbox == offlineMailboxes.end() || mailbox->second.delivering) return;
+    
+    cout << "Delivering " << mailbox->second.bytes + mailbox->second.spilledBytes 
+         << " bytes of direct messages to " << userID << endl;
+    mailbox->second.delivering = true;
+    sendOfflineMessages(startTask(&loopWorker, sockfd, userID));
+}
+
+
+// Picks up the direct messages spilled to the state directory by an earlier
+// run of the server
+void loadOfflineMailboxes()
+{
+    DIR *dir = opendir(mailboxDirectory.c_str());
+    if(dir == NULL) return;
+    
+    struct dirent *entry;
+    size_t prefixLength = strlen(OFFLINE_MAILBOX_PREFIX);
+    while((entry = readdir(dir)) != NULL)
+    {
+        if(strncmp(entry->d_name, OFFLINE_MAILBOX_PREFIX, prefixLength) != 0) continue;
+        
+        string userID = entry->d_name + prefixLength;
+        struct stat info;
+        if(permittedClientList.find(userID) == permittedClientList.end() || 
+           stat(mailboxPath(userID).c_str(), &info) == -1 || info.st_size == 0) continue;
+        
+        offlineMailboxes[userID].spilledBytes = info.st_size;
+    }
+    closedir(dir);
+}
+
+
+// Logs a client described by a file descriptor into the server
+// Returns true if successful
+// TODO Check if the client is double logging in
+bool loginClient(int sockfd, const char *buffer)
+{
+    struct message loginInfo;
+    struct message ack;
+    ack.size = 0;
+    ack.source = "SERVER";
+    ack.data = ACK_DATA;
+    
+    string s(buffer);
+    stringstream ss(s);
+    ss >> loginInfo.type >> loginInfo.size
+       >> loginInfo.source >> loginInfo.data;
+    
+    // Check if user is permitted to connect to the server
+    pair<bool, string> userConnectReq = canUserConnect(loginInfo.source, loginInfo.data);
+    if (userConnectReq.first == false)
+    {
+        // Send back reason for error
+        ack.type = LO_NAK;
+        ack.data = userConnectReq.second;
+        ack.size = ack.data.length() + 1;
+        
+        sendToClient(&ack, sockfd);
+        return false;
+    }
+    
+    else
+    {
+        // Client can login, add it to the list of active clients
+        clientList.insert(make_pair(sockfd, internUser(loginInfo.source)));
+        addPresence(onlineClients, loginInfo.source);
+        
+        // The socket stays nonblocking, as accepted. What's sent to clients
+        // is queued once they're full, and they only count as having room
+        // again once little is left unsent, so queued replies aren't stuck
+        // behind much. Queued packets are already gathered into as few writes
+        // as possible, so they go out without waiting on Nagle's algorithm
+        int lowat = OUTBOUND_LOWAT;
+        if(!isLocalSocket(sockfd) && 
+           setsockopt(sockfd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat)) == -1)
+        {
+            perror("setsockopt TCP_NOTSENT_LOWAT");
+        }
+        int one = 1;
+        if(!isLocalSocket(sockfd) && setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) == -1)
+        {
+            perror("setsockopt TCP_NODELAY");
+        }
+        outboundCredit[sockfd] = OUTBOUND_QUANTUM;
+        
+        // No data sent back
+        ack.type = LO_ACK;
+        
+        sendToClient(&ack, sockfd);
+        deliverOfflineMessages(sockfd, loginInfo.source);
+        return true;
+    }
+}
+
+
+// Reads a newly accepted connection's LOGIN and logs the client in, if all of
+// it has arrived. Nothing past the end of the LOGIN is taken off the socket.
+// Part of one is kept with the connection's pending login, so that select
+// doesn't keep finding the socket readable while the rest is on its way
+// Returns LOGIN_WAITING if it hasn't all arrived yet
+enum loginProgress readLogin(int sockfd)
+{
+    auto pending = pendingLogins.empty() ? pendingLogins.end() : pendingLogins.find(sockfd);
+    size_t received = pending == pendingLogins.end() ? 0 : pending->second.received.length();
+    
+    char buffer[MAXDATASIZE];
+    ssize_t numBytes = recv(sockfd, buffer, MAXDATASIZE - received, MSG_PEEK);
+    if(numBytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return LOGIN_WAITING;
+    if(numBytes <= 0) return LOGIN_FAILED;
+    
+    char *end = (char *) memchr(buffer, '\0', numBytes);
+    ssize_t length = end == NULL ? numBytes : end - buffer + 1;
+    if(recv(sockfd, buffer, length, 0) != length) return LOGIN_FAILED;
+    if(end == NULL && received + length == MAXDATASIZE) return LOGIN_FAILED;
+    
+    const char *login = buffer;
+    if(end == NULL || received > 0)
+    {
+        if(pending == pendingLogins.end()) pending = pendingLogins.insert(make_pair(sockfd, pendingLogin())).first;
+        pending->second.received.append(buffer, length);
+        if(end == NULL) return LOGIN_WAITING;
+        
+        login = pending->second.received.data();
+        length = pending->second.received.length();
+    }
+    captureTraffic(sockfd, CAPTURE_PACKET, login, length);
+    
+    return loginClient(sockfd, login) ? LOGIN_DONE : LOGIN_FAILED;
+}
+
+
+// Moves a new connection on once its LOGIN has been read, or has been found not
+// to have arrived yet. Connections that logged in are watched like any other
+// client, those still waiting are watched for the rest of it, and the others
+// are closed
+void finishLogin(int sockfd, enum loginProgress progress, fd_set *master, int *fdmax)
+{
+    if(progress == LOGIN_WAITING)
+    {
+        struct pendingLogin &pending = pendingLogins[sockfd];
+        if(pending.acceptedAt == 0)
+        {
+            uint64_t now = monotonicNanoseconds();
+            pending.acceptedAt = now;
+            loginDeadlines.push_back(make_pair(now, sockfd));
+            FD_SET(sockfd, master);
+            if (sockfd > *fdmax) *fdmax = sockfd;
+        }
+        return;
+    }
+    pendingLogins.erase(sockfd);
+    
+    if(progress == LOGIN_DONE)
+    {
+        FD_SET(sockfd, master);
+        if (sockfd > *fdmax) *fdmax = sockfd;
+        
+        struct sockaddr_storage remoteaddr;
+        socklen_t addrlen = sizeof(remoteaddr);
+        char remoteIP[INET6_ADDRSTRLEN] = "?";
+        if(getpeername(sockfd, (struct sockaddr *) &remoteaddr, &addrlen) == 0)
+        {
+            if(remoteaddr.ss_family == AF_UNIX) strcpy(remoteIP, "the local socket");
+            else inet_ntop(remoteaddr.ss_family, get_in_addr((struct sockaddr *) &remoteaddr), 
+                           remoteIP, INET6_ADDRSTRLEN);
+        }
+        printf("server: new connection from %s on socket %d\n", remoteIP, sockfd);
+    }
+    else
+    {
+        cout << "Attempted connection failed" << endl;
+        dropOutboundQueue(sockfd);
+        captureTraffic(sockfd, CAPTURE_CLOSE, NULL, 0);
+        FD_CLR(sockfd, master);
+        close(sockfd);
+    }
+}
+
+
+// Accepts the connections waiting on a listener, up to ACCEPTS_PER_PASS of
+// them so the clients already connected aren't kept waiting by a flood of
+// new ones. Any left over are taken on the next pass, which waiting is set for
+void acceptConnections(int listener, bool *waiting, fd_set *master, int *fdmax)
+{
+    *waiting = false;
+    for(int accepted = 0; accepted < ACCEPTS_PER_PASS; accepted++)
+    {
+        int newfd = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (newfd == -1)
+        {
+            if (errno == ECONNABORTED || errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept");
+            return;
+        }
+        
+        // select() can't watch it
+        if (newfd >= FD_SETSIZE)
+        {
+            printf("server: too many connections, dropped socket %d\n", newfd);
+            close(newfd);
+            continue;
+        }
+        if(busyPollMicroseconds > 0 && listener != localListener) setBusyPoll(newfd);
+        
+        captureTraffic(newfd, CAPTURE_OPEN, NULL, 0);
+        finishLogin(newfd, readLogin(newfd), master, fdmax);
+    }
+    *waiting = true;
+}
+
+
+// Closes connections that have gone LOGIN_TIMEOUT without logging in
+void expireLogins(fd_set *master)
+{
+    uint64_t cutoff = monotonicNanoseconds() - (uint64_t) LOGIN_TIMEOUT * 1000000000;
+    while(!loginDeadlines.empty() && loginDeadlines.front().first < cutoff)
+    {
+        // The fd may have logged in, or been reused, since
+        int sockfd = loginDeadlines.front().second;
+        auto pending = pendingLogins.find(sockfd);
+        if(pending != pendingLogins.end() && pending->second.acceptedAt == loginDeadlines.front().first)
+        {
+            printf("server: socket %d didn't log in in time\n", sockfd);
+            pendingLogins.erase(pending);
+            captureTraffic(sockfd, CAPTURE_CLOSE, NULL, 0);
+            FD_CLR(sockfd, master);
+            close(sockfd);
+        }
+        loginDeadlines.pop_front();
+    }
+}
+
+
+// Creates the socket messages are sent to multicast groups on
+// Returns -1 if the socket can't be created
+int createMulticastSocket()
+{
+    int sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if(sockfd == -1)
+    {
+        perror("socket");
+        return -1;
+    }
+    
+    // Groups are for the local network segment only, and clients on this host
+    // need a copy too
+    unsigned char ttl = 1, loop = 1;
+    setsockopt(sockfd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+    setsockopt(sockfd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+    multicastInterface.s_addr = htonl(INADDR_ANY);
+    return sockfd;
+}
+
+
+// Tells a client that just joined a session which multicast group the session's
+// messages are sent to, creating the group if it's the session's first
+// Clients that reach the server through a different address than the session's
+// first member are on another network segment, and get messages over TCP instead
+void offerMulticastGroup(int sockfd, const string &sessionID)
+{
+    if(multicastfd == -1) return;
+    
+    struct sockaddr_in local;
+    socklen_t length = sizeof(local);
+    if(getsockname(sockfd, (struct sockaddr *) &local, &length) == -1 ||
+       local.sin_family != AF_INET) return;
+    
+    auto found = multicastGroups.find(sessionID);
+    if(found == multicastGroups.end())
+    {
+        struct multicastGroup group;
+        memset(&group.address, 0, sizeof(group.address));
+        group.address.sin_family = AF_INET;
+        group.address.sin_port = multicastPort;
+        group.address.sin_addr.s_addr = htonl(ntohl(multicastBase.s_addr) + 
+                                              nextMulticastGroup++ % MULTICAST_GROUPS);
+        group.interface = local.sin_addr;
+        group.nextSequence = 0;
+        found = multicastGroups.insert(make_pair(sessionID, group)).first;
+        sessionBytes += MULTICAST_GROUP_MEMORY;
+    }
+    
+    struct multicastGroup &group = found->second;
+    if(group.interface.s_addr != local.sin_addr.s_addr) return;
+    
+    char address[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &group.address.sin_addr, address, sizeof(address));
+    
+    struct message offer;
+    offer.type = MC_GROUP;
+    offer.source = "SERVER";
+    offer.data = sessionID + " " + address + " " + to_string(ntohs(multicastPort)) + " " 
+                 + to_string(group.nextSequence);
+    offer.size = offer.data.length() + 1;
+    sendToClient(&offer, sockfd);
+}
+
+
+// Stops sending a session's messages to a client through its multicast group
+void leaveMulticastGroup(const string &sessionID, int sockfd)
+{
+    auto group = multicastGroups.find(sessionID);
+    if(group == multicastGroups.end()) return;
+    group->second.listeners.erase(sockfd);
+    group->second.receivers.erase(sockfd);
+}
+
+
+// Records that a client has joined its session's multicast group, so messages
+// are sent to the group for it. It keeps getting them over TCP too until one
+// reaches it through the group
+// Data is "<session>"
+void joinMulticastGroup(int sockfd, const string &data)
+{
+    string sessionID;
+    stringstream ss(data);
+    ss >> sessionID;
+    
+    auto group = multicastGroups.find(sessionID);
+    if(group == multicastGroups.end() || !isInSession(sockfd, sessionID)) return;
+    group->second.listeners.insert(sockfd);
+}
+
+
+// Records that a session message reached a client through the group, so it
+// only gets them over TCP again when it asks for ones it missed
+// Data is "<session>"
+void confirmMulticastGroup(int sockfd, const string &data)
+{
+    string sessionID;
+    stringstream ss(data);
+    ss >> sessionID;
+    
+    auto group = multicastGroups.find(sessionID);
+    if(group == multicastGroups.end() || 
+       group->second.listeners.find(sockfd) == group->second.listeners.end()) return;
+    group->second.receivers.insert(sockfd);
+}
+
+
+// Sends a client the messages it missed from its session's multicast group
+// again over TCP, and tells it about any that are too old to be sent again
+// Data is "<session> <first> <last>"
+void repairMulticastGap(int sockfd, const string &data)
+{
+    string sessionID;
+    uint32_t first, last;
+    stringstream ss(data);
+    if(!(ss >> sessionID >> first >> last)) return;
+    
+    auto found = multicastGroups.find(sessionID);
+    if(found == multicastGroups.end() || !isInSession(sockfd, sessionID)) return;
+    struct multicastGroup &group = found->second;
+    
+    // Nothing has been sent to the group yet, so nothing can be missing
+    if(group.nextSequence == 0) return;
+    if(last >= group.nextSequence) last = group.nextSequence - 1;
+    if(first > last) return;
+    
+    // Everything older than what's kept, or all of it once the history is
+    // shed, can only be reported lost
+    uint32_t oldest = group.nextSequence - group.history.size();
+    if(first < oldest || group.history.empty())
+    {
+        struct message lost;
+        lost.type = MC_LOST;
+        lost.source = "SERVER";
+        lost.data = sessionID + " " + to_string(first) + " " + to_string(min(last, oldest - 1));
+        lost.size = lost.data.length() + 1;
+        sendToClient(&lost, sockfd);
+        
+        if(last < oldest || group.history.empty()) return;
+        first = oldest;
+    }
+    
+    for(uint32_t sequence = first; sequence <= last && sequence - oldest < group.history.size(); sequence++)
+    {
+        sendPacketToClient(group.history[sequence - oldest], sockfd);
+    }
+}
+
+
+// Numbers a message to a session and sends it to the session's multicast group,
+// and over TCP to the members other than the sender that aren't receiving it
+// Returns false if the message is too big to be numbered
+bool sendMulticastMessage(struct multicastGroup &group, const string &sessionID,
+                          const struct message &packet, int senderfd)
+{
+    string data = sessionID + " " + to_string(group.nextSequence) + " " + packet.data;
+    string dataStr = encodePacket<MC_MESSAGE>(packet.source, data);
+    if(dataStr.length() + 1 > MAXDATASIZE) return false;
+    
+    group.nextSequence++;
+    if(!memoryPressure)
+    {
+        group.history.push_back(dataStr);
+        group.historyBytes += stringMemory(group.history.back());
+        multicastBytes += stringMemory(group.history.back());
+    }
+    if(group.history.size() > MULTICAST_HISTORY)
+    {
+        group.historyBytes -= stringMemory(group.history.front());
+        multicastBytes -= stringMemory(group.history.front());
+        group.history.pop_front();
+    }
+    
+    if(!group.listeners.empty())
+    {
+        if(group.interface.s_addr != multicastInterface.s_addr)
+        {
+            setsockopt(multicastfd, IPPROTO_IP, IP_MULTICAST_IF, &group.interface, sizeof(group.interface));
+            multicastInterface = group.interface;
+        }
+        if(sendto(multicastfd, dataStr.c_str(), dataStr.length() + 1, 0, 
+                  (struct sockaddr *) &group.address, sizeof(group.address)) == -1)
+        {
+            perror("sendto");
+        }
+    }
+    
+    for(auto const & clientSockfd : membersOf(findSession(&sessionTable, sessionID)->members))
+    {
+        if(clientSockfd != senderfd && group.receivers.find(clientSockfd) == group.receivers.end())
+        {
+            sendPacketToClient(dataStr, clientSockfd);
+        }
+    }
+    return true;
+}
+
+
+// Adds a client to a session, in both directions of the membership index
+void addToSession(int sockfd, const string &sessionID)
+{
+    uint32_t id = sessionIDOf(&sessionTable, sessionID);
+    addMember(sessionTable.records[id].members, sockfd);
+    clientSessions[sockfd].insert(id);
+    sessionBytes += MEMBERSHIP_MEMORY;
+}
+
+
+// Removes a client from a session, closing the session if it was the last one
+void removeFromSession(int sockfd, const string &sessionID)
+{
+    uint32_t id = sessionIDOf(&sessionTable, sessionID);
+    struct sessionMembers &members = sessionTable.records[id].members;
+    removeMember(members, sockfd);
+    sessionBytes -= MEMBERSHIP_MEMORY;
+    leaveMulticastGroup(sessionID, sockfd);
+    
+    auto sessions = clientSessions.find(sockfd);
+    sessions->second.erase(id);
+    if(sessions->second.empty()) clientSessions.erase(sessions);
+    
+    if(members.count == 0) closeSession(sessionID);
+}
+
+
+// Checks if the password corresponds with the session being attempted to join
+bool checkSessionPassword (string sessionID, string sessionPassword)
+{
+    struct sessionRecord *currentSession = findSession(&sessionTable, sessionID);
+
+    if (currentSession -> password == sessionPassword) return true;
+    else return false; 
+
+}
+
+// Adds client to the specified session
+// If the session exists and they aren't already in it, it sends back the
+// session they were added to
+// Otherwise, it sends back the reason they couldn't be added to the specified session
+// Returns true if successful
 bool joinSession (int sockfd, string sessionData)
 {
-    struct message ack;
-    ack.source = "SERVER";
+    struct message ack;
+    ack.source = "SERVER";
+
+    string sessionID, sessionPassword;  
+    stringstream ss(sessionData);
+    ss >> sessionID >> sessionPassword;
+    
+    // Find the session with the given name
+    struct sessionRecord *session = findSession(&sessionTable, sessionID);
+    
+    // Find if the client is already in the session
+    bool alreadyJoined = isInSession(sockfd, sessionID);
+    
+    // Checking that session exists and client is not already in it
+    if (sessionID != ACK_DATA &&
+        !alreadyJoined &&
+        session != NULL && 
+        checkSessionPassword(sessionID, sessionPassword))
+    {        
+        
+        // Add client to the session
+        addToSession(sockfd, sessionID);
+
+        // Send response with the data as the sessionID
+        ack.type = JN_ACK;
+        ack.data = sessionID;
+        ack.size = ack.data.length() + 1;
+
+        sendToClient(&ack, sockfd);
+        offerMulticastGroup(sockfd, sessionID);
+        return true;
+        
+    }
+    
+    // Session does not exist or client is already in it
+    else 
+    {
+        ack.type = JN_NAK;
+        
+        if (sessionID == ACK_DATA) ack.data = "No session ID was provided!";
+        else if(alreadyJoined) ack.data = "Already in this session!";
+        else if (session == NULL) ack.data = "Session not found!";
+        else if (checkSessionPassword(sessionID, sessionPassword) == false) ack.data = "Password is incorrect!";
+
+
+        ack.size = ack.data.length() + 1;
+        
+        sendToClient(&ack, sockfd);
+        return false;
+    }
+}
+
+
+// Removes client from the named session, or from their only session if the
+// request doesn't name one
+// If they're in it, it sends back the session they were removed from
+// Otherwise, it sends back the reason they couldn't leave the specified session
+// Returns true if successful
+bool leaveSession (int sockfd, string sessionData)
+{
+    struct message ack;
+    ack.source = "SERVER";
+
+    string sessionID;
+    stringstream ss(sessionData);
+    ss >> sessionID;
+    if(sessionID.empty() || sessionID == ACK_DATA) sessionID = onlySessionOf(sockfd);
+    
+    // Check if client is in the session
+    if (isInSession(sockfd, sessionID))
+    {
+        removeFromSession(sockfd, sessionID);
+        
+        ack.type = LS_ACK;
+        ack.data = sessionID;
+        ack.size = ack.data.length() + 1;
+
+        sendToClient(&ack, sockfd);
+        return true;
+    }
+    else
+    {
+        ack.type = LS_NAK;
+        if(clientSessions.find(sockfd) == clientSessions.end()) ack.data = "Not in a session!";
+        else if(sessionID == SESSION_NOT_FOUND) ack.data = "Name the session to leave!";
+        else ack.data = "Not in session '" + sessionID + "'!";
+        ack.size = ack.data.length() + 1;
+        
+        sendToClient(&ack, sockfd);
+        return false;
+    }
+}
+
+
+// Create a new session in the session list and add the requesting client to it
+// If the session doesn't exist, it creates it and adds the client to it, and
+// sends back the sessionID
+// Otherwise, it sends back the reason why it couldn't be created
+// Returns true if successful
+bool createSession(int sockfd, string sessionData)
+{   
+    struct message ack;
+    ack.source = "SERVER";
+    
+    string sessionID, sessionPassword;
+    stringstream ss(sessionData);
+    
+    ss >> sessionID >> sessionPassword;
+    
+    if (sessionID == ACK_DATA)
+    {
+        ack.type = NS_NAK;
+        ack.data = "No session ID was provided!";
+        ack.size = ack.data.length() + 1;
+        
+        sendToClient(&ack, sockfd);
+        return false;  
+    }
+    else if (sessionID.find(SESSION_SEPARATOR) != string::npos)
+    {
+        ack.type = NS_NAK;
+        ack.data = string("Session names can't contain '") + SESSION_SEPARATOR + "'!";
+        ack.size = ack.data.length() + 1;
+        
+        sendToClient(&ack, sockfd);
+        return false;  
+    }
+    else if (findSession(&sessionTable, sessionID) != NULL)
+    {
+        ack.type = NS_NAK;
+        ack.data = "Session already exists!";
+        ack.size = ack.data.length() + 1;
+        
+        sendToClient(&ack, sockfd);
+        return false;
+    }
+    
+    else
+    {
+        // Recording password of the created session list
+        addSession(&sessionTable, sessionID, sessionPassword);
+        addToSession(sockfd, sessionID);
+        sessionBytes += sessionFootprint(sessionID, sessionPassword);
+        addPresence(availableSessions, sessionID);
+        journalSessionChange(JOURNAL_CREATE, sessionID, sessionPassword);
+        
+        ack.type = NS_ACK;
+        ack.data = sessionID;
+        ack.size = ack.data.length() + 1;
+        
+        sendToClient(&ack, sockfd);
+        offerMulticastGroup(sockfd, sessionID);
+        return true;
+    }
+}
+
+
+// Appends the names in the given set that come after the cursor and start with
+// the prefix, stopping after pageSize names or when budget bytes are used up.
+// A name is only added if there's room for it twice, as it may be the cursor
+// in the "More" line, besides the reserved bytes for the other list's cursor
+// Returns the cursor to continue from, or LIST_DONE if the list was exhausted
+string appendListPage(string &buffer, const set<string> &names, const string &cursor,
+                      const string &prefix, unsigned int pageSize, size_t budget, size_t reserved)
+{
+    if(cursor == LIST_DONE) return LIST_DONE;
+    
+    // Start at whichever comes later, the cursor or the first name with the prefix
+    auto it = (cursor == LIST_FROM_START) ? names.begin() : names.upper_bound(cursor);
+    if(!prefix.empty() && (it == names.end() || *it < prefix)) it = names.lower_bound(prefix);
+    
+    string last = cursor;
+    for(unsigned int count = 0; it != names.end(); it++, count++)
+    {
+        if(it->compare(0, prefix.length(), prefix) != 0) return LIST_DONE;
+        if(count == pageSize || buffer.length() + 2 * (it->length() + 1) + reserved > budget) return last;
+        
+        buffer += *it + " ";
+        last = *it;
+    }
+    return LIST_DONE;
+}
+
+
+// Sends back one page of the clients online and sessions available
+// Request data is "<client cursor> <session cursor> <page size> <prefix>", all optional
+// The reply ends with "More: <client cursor> <session cursor>" if either list
+// has names left, which the client sends back to get the next page
+void createList(int sockfd, string requestData)
+{
+    string clientCursor = LIST_FROM_START, sessionCursor = LIST_FROM_START, prefix;
+    unsigned int pageSize = LIST_PAGE_SIZE;
+    
+    stringstream ss(requestData);
+    ss >> clientCursor >> sessionCursor >> pageSize >> prefix;
+    if(pageSize == 0 || pageSize > LIST_PAGE_SIZE) pageSize = LIST_PAGE_SIZE;
+    
+    // The first page of an unfiltered list is by far the most requested, so
+    // keep it encoded until the clients or sessions change
+    bool firstPage = clientCursor == LIST_FROM_START && sessionCursor == LIST_FROM_START
+                     && pageSize == LIST_PAGE_SIZE && prefix.empty();
+    if(firstPage && cachedListVersion == presenceVersion)
+    {
+        sendPacketToClient(cachedListPacket, sockfd);
+        return;
+    }
+    
+    // The session cursor stays as it is if no sessions fit on the page, so
+    // keep room for it in the "More" line while adding clients
+    size_t budget = MAXDATASIZE - LIST_PACKET_ROOM;
+    string buffer = "\nClients Online: ";
+    string clientStart = clientCursor, sessionStart = sessionCursor;
+    clientCursor = appendListPage(buffer, onlineClients, clientCursor, prefix, pageSize, budget, 
+                                  sessionCursor.length());
+    
+    buffer += "\nAvailable Sessions: ";
+    sessionCursor = appendListPage(buffer, availableSessions, sessionCursor, prefix, pageSize, budget, 
+                                   clientCursor.length());
+    
+    struct message listAck;
+    listAck.type = QU_ACK;
+    listAck.source = "SERVER";
+    if(clientCursor != LIST_DONE || sessionCursor != LIST_DONE)
+    {
+        buffer += "\nMore: " + clientCursor + " " + sessionCursor;
+        
+        // A name too long to go on a page with its cursor would hold the
+        // list up for good, and cursors that long don't fit in the reply
+        if((clientCursor == clientStart && sessionCursor == sessionStart) || buffer.length() > budget)
+        {
+            listAck.type = QU_NAK;
+            buffer = "A name is too long to list";
+        }
+    }
+    listAck.size = buffer.length() + 1;
+    listAck.data = buffer;
+    
+    string packet = stringifyMessage(&listAck);
+    if(firstPage)
+    {
+        cachedListPacket = packet;
+        cachedListVersion = presenceVersion;
+    }
+    sendPacketToClient(packet, sockfd);
+}
+
+
+// Adds a number to the end of a posting list, 7 bits per byte with the top bit
+// set on every byte but the last
+void appendVarint(string &postings, uint64_t value)
+{
+    while(value >= 0x80)
+    {
+        postings += (char) (value | 0x80);
+        value >>= 7;
+    }
+    postings += (char) value;
+}
+
+
+// Reads the next number from a posting list and moves pos past it
+// Returns false if the list ends first
+bool readVarint(const char *&pos, const char *end, uint64_t &value)
+{
+    value = 0;
+    for(int shift = 0; pos < end && shift < 64; shift += 7)
+    {
+        unsigned char byte = *pos++;
+        value |= (uint64_t) (byte & 0x7f) << shift;
+        if(!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+
+// Splits text into the words it's indexed and searched by: runs of letters and
+// digits, lowercased, and runs of non-ASCII bytes so UTF-8 words stay whole
+// Returns each word once, in order
+vector<string> historyTerms(const char *text, size_t length)
+{
+    vector<string> terms;
+    string term;
+    for(size_t i = 0; i <= length; i++)
+    {
+        unsigned char c = i < length ? text[i] : ' ';
+        if(isalnum(c) || c >= 0x80)
+        {
+            if(term.length() < HISTORY_MAX_TERM) term += (char) tolower(c);
+        }
+        else if(!term.empty())
+        {
+            terms.push_back(term);
+            term.clear();
+        }
+    }
+    
+    sort(terms.begin(), terms.end());
+    terms.erase(unique(terms.begin(), terms.end()), terms.end());
+    return terms;
+}
+
+
+string historyKey(const string &sessionID, const string &term)
+{
+    return sessionID + '\0' + term;
+}
+
+
+// Adds a message sent to a session to the history log
+// Records are "<length><time><session>\0<source>\0<text>", the length being a
+// 32 bit count of the bytes after it and the time 64 bit seconds since the epoch
+void recordHistory(const string &sessionID, const string &source, const string &text)
+{
+    if(historyfd == -1) return;
+    
+    uint32_t length = sizeof(int64_t) + sessionID.length() + source.length() + text.length() + 2;
+    int64_t now = time(NULL);
+    historyBuffer.append((const char *) &length, sizeof(length));
+    historyBuffer.append((const char *) &now, sizeof(now));
+    historyBuffer += sessionID;
+    historyBuffer += '\0';
+    historyBuffer += source;
+    historyBuffer += '\0';
+    historyBuffer += text;
+}
+
+
+// Writes the history records gathered since the last call to the log
+void flushHistory()
+{
+    if(historyBuffer.empty()) return;
+    
+    if(write(historyfd, historyBuffer.data(), historyBuffer.length()) != (ssize_t) historyBuffer.length())
+    {
+        perror("history: write");
+    }
+    historyBuffer.clear();
+}
+
+
+// A record read back from the history log, pointing into the buffer it was read into
+struct historyRecord {
+    size_t length;          // Of the whole record
+    int64_t time;
+    const char *sessionID;
+    const char *source;
+    const char *text;
+    size_t textLength;
+};
+
+// Returns false if data doesn't start with a whole record
+bool parseHistoryRecord(const char *data, size_t available, struct historyRecord &record)
+{
+    uint32_t length;
+    if(available < sizeof(length)) return false;
+    memcpy(&length, data, sizeof(length));
+    if(length < sizeof(int64_t) + 2 || available - sizeof(length) < length) return false;
+    
+    const char *end = data + sizeof(length) + length;
+    const char *pos = data + sizeof(length) + sizeof(int64_t);
+    memcpy(&record.time, data + sizeof(length), sizeof(int64_t));
+    
+    record.sessionID = pos;
+    if((pos = (const char *) memchr(pos, '\0', end - pos)) == NULL) return false;
+    record.source = ++pos;
+    if((pos = (const char *) memchr(pos, '\0', end - pos)) == NULL) return false;
+    record.text = ++pos;
+    record.textLength = end - pos;
+    record.length = end - data;
+    return true;
+}
+
+
+string segmentPath(uint64_t startOffset, uint64_t endOffset)
+{
+    return stateDirectory + "/" + HISTORY_SEGMENT_PREFIX + to_string(startOffset) + "-" + 
+           to_string(endOffset);
+}
+
+
+// Maps a segment file into memory and checks it fits together
+// Returns false if it doesn't
+bool mapSegment(const string &path, struct historySegment &segment)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd == -1) return false;
+    
+    struct stat info;
+    if(fstat(fd, &info) == -1 || (size_t) info.st_size < sizeof(struct segmentHeader))
+    {
+        close(fd);
+        return false;
+    }
+    void *data = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED) return false;
+    
+    segment.path = path;
+    segment.data = (char *) data;
+    segment.length = info.st_size;
+    memcpy(&segment.header, data, sizeof(segment.header));
+    
+    const struct segmentHeader &header = segment.header;
+    if(memcmp(header.magic, HISTORY_SEGMENT_MAGIC, sizeof(header.magic)) != 0 ||
+       header.termsOffset > segment.length || 
+       header.termCount > (segment.length - header.termsOffset) / sizeof(struct segmentTerm) ||
+       header.keysOffset > segment.length)
+    {
+        munmap(data, info.st_size);
+        return false;
+    }
+    segment.terms = (const struct segmentTerm *) (segment.data + header.termsOffset);
+    segment.keys = segment.data + header.keysOffset;
+    return true;
+}
+
+
+// Writes a segment out to a temp file, postings first and then the terms and
+// their keys, which are small enough to gather in memory
+struct segmentWriter {
+    int fd;
+    uint64_t position;
+    string buffer;
+    vector<struct segmentTerm> terms;
+    string keys;
+};
+
+bool writeSegmentBuffer(struct segmentWriter &writer)
+{
+    size_t written = 0;
+    while(written < writer.buffer.length())
+    {
+        ssize_t numBytes = write(writer.fd, writer.buffer.data() + written, writer.buffer.length() - written);
+        if(numBytes == -1)
+        {
+            perror("history: write");
+            return false;
+        }
+        written += numBytes;
+    }
+    writer.buffer.clear();
+    return true;
+}
+
+
+bool startSegment(struct segmentWriter &writer)
+{
+    string path = stateDirectory + "/" + HISTORY_SEGMENT_TEMP;
+    writer.fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if(writer.fd == -1)
+    {
+        perror("history: open");
+        return false;
+    }
+    writer.position = sizeof(struct segmentHeader);
+    writer.buffer.assign(sizeof(struct segmentHeader), '\0'); // Filled in at the end
+    writer.terms.clear();
+    writer.keys.clear();
+    return true;
+}
+
+
+// Adds a key whose postings have just been written
+void addSegmentTerm(struct segmentWriter &writer, const char *key, size_t keyLength, 
+                    uint64_t postingsOffset, uint64_t lastDoc)
+{
+    struct segmentTerm term;
+    term.keyOffset = writer.keys.length();
+    term.postingsOffset = postingsOffset;
+    term.lastDoc = lastDoc;
+    term.keyLength = keyLength;
+    term.postingsLength = writer.position - postingsOffset;
+    writer.terms.push_back(term);
+    writer.keys.append(key, keyLength);
+}
+
+
+void writeSegmentBytes(struct segmentWriter &writer, const char *data, size_t length)
+{
+    writer.buffer.append(data, length);
+    writer.position += length;
+    if(writer.buffer.length() >= HISTORY_WRITE_SIZE) writeSegmentBuffer(writer);
+}
+
+
+// Writes out the terms and header, and puts the segment in place
+// Returns false if the segment couldn't be written
+bool finishSegment(struct segmentWriter &writer, uint64_t startOffset, uint64_t endOffset, 
+                   uint64_t messages, struct historySegment &segment)
+{
+    struct segmentHeader header;
+    memcpy(header.magic, HISTORY_SEGMENT_MAGIC, sizeof(header.magic));
+    header.startOffset = startOffset;
+    header.endOffset = endOffset;
+    header.messages = messages;
+    header.termCount = writer.terms.size();
+    
+    // Terms are read straight out of the mapped file, so keep them aligned
+    size_t padding = (8 - writer.position % 8) % 8;
+    writer.buffer.append(padding, '\0');
+    writer.position += padding;
+    header.termsOffset = writer.position;
+    header.keysOffset = header.termsOffset + writer.terms.size() * sizeof(struct segmentTerm);
+    writer.buffer.append((const char *) writer.terms.data(), writer.terms.size() * sizeof(struct segmentTerm));
+    writer.buffer += writer.keys;
+    
+    string tempPath = stateDirectory + "/" + HISTORY_SEGMENT_TEMP;
+    string path = segmentPath(startOffset, endOffset);
+    bool written = writeSegmentBuffer(writer) &&
+                   pwrite(writer.fd, &header, sizeof(header), 0) == sizeof(header) &&
+                   fdatasync(writer.fd) == 0;
+    close(writer.fd);
+    
+    if(!written || rename(tempPath.c_str(), path.c_str()) == -1 || !mapSegment(path, segment))
+    {
+        perror("history: segment");
+        unlink(tempPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+
+// Writes the messages indexed in memory out as a new segment
+void sealLiveSegment()
+{
+    struct segmentWriter writer;
+    struct historySegment segment;
+    if(liveMessages == 0 || !startSegment(writer)) return;
+    
+    vector<const string *> keys;
+    keys.reserve(liveTerms.size());
+    for(auto const & term : liveTerms) keys.push_back(&term.first);
+    sort(keys.begin(), keys.end(), [](const string *a, const string *b) { return *a < *b; });
+    
+    string postings;
+    for(auto const key : keys)
+    {
+        postings.clear();
+        uint64_t last = 0;
+        for(auto const & doc : liveTerms[*key])
+        {
+            appendVarint(postings, doc - last);
+            last = doc;
+        }
+        
+        uint64_t postingsOffset = writer.position;
+        writeSegmentBytes(writer, postings.data(), postings.length());
+        addSegmentTerm(writer, key->data(), key->length(), postingsOffset, last);
+    }
+    
+    if(!finishSegment(writer, liveStart, indexedOffset, liveMessages, segment)) return;
+    historySegments.push_back(segment);
+    liveTerms.clear();
+    liveIndexBytes = 0;
+    liveStart = indexedOffset;
+    liveMessages = 0;
+}
+
+
+// Orders keys the same way std::string does
+int compareKeys(const char *a, size_t aLength, const char *b, size_t bLength)
+{
+    int order = memcmp(a, b, min(aLength, bLength));
+    if(order != 0) return order;
+    return aLength < bLength ? -1 : (aLength > bLength ? 1 : 0);
+}
+
+
+void unmapSegment(const struct historySegment &segment, bool remove)
+{
+    munmap(segment.data, segment.length);
+    if(remove) unlink(segment.path.c_str());
+}
+
+
+// Merges the newest two segments into one. The newer one's messages all come
+// after the older one's, so where both have a key its postings just carry on
+// from the older ones, with only the first gap worked out again
+void mergeLastSegments()
+{
+    struct historySegment &older = historySegments[historySegments.size() - 2];
+    struct historySegment &newer = historySegments.back();
+    struct segmentWriter writer;
+    struct historySegment segment;
+    if(!startSegment(writer)) return;
+    
+    uint64_t i = 0, j = 0;
+    while(i < older.header.termCount || j < newer.header.termCount)
+    {
+        const struct segmentTerm *a = i < older.header.termCount ? &older.terms[i] : NULL;
+        const struct segmentTerm *b = j < newer.header.termCount ? &newer.terms[j] : NULL;
+        int order = !a ? 1 : (!b ? -1 : compareKeys(older.keys + a->keyOffset, a->keyLength,
+                                                     newer.keys + b->keyOffset, b->keyLength));
+        uint64_t postingsOffset = writer.position, lastDoc;
+        
+        if(order <= 0)
+        {
+            writeSegmentBytes(writer, older.data + a->postingsOffset, a->postingsLength);
+            lastDoc = a->lastDoc;
+        }
+        if(order >= 0)
+        {
+            const char *pos = newer.data + b->postingsOffset, *end = pos + b->postingsLength;
+            uint64_t first;
+            readVarint(pos, end, first);
+            
+            string gap;
+            appendVarint(gap, order == 0 ? first - a->lastDoc : first);
+            writeSegmentBytes(writer, gap.data(), gap.length());
+            writeSegmentBytes(writer, pos, end - pos);
+            lastDoc = b->lastDoc;
+        }
+        
+        if(order <= 0) addSegmentTerm(writer, older.keys + a->keyOffset, a->keyLength, postingsOffset, lastDoc);
+        else addSegmentTerm(writer, newer.keys + b->keyOffset, b->keyLength, postingsOffset, lastDoc);
+        if(order <= 0) i++;
+        if(order >= 0) j++;
+    }
+    
+    if(!finishSegment(writer, older.header.startOffset, newer.header.endOffset, 
+                      older.header.messages + newer.header.messages, segment)) return;
+    
+    unmapSegment(older, true);
+    unmapSegment(newer, true);
+    historySegments.pop_back();
+    historySegments.back() = segment;
+}
+
+
+// Returns the segment's entry for a key, or NULL if no message in it has the key
+const struct segmentTerm *findSegmentTerm(const struct historySegment &segment, const string &key)
+{
+    uint64_t low = 0, high = segment.header.termCount;
+    while(low < high)
+    {
+        uint64_t middle = low + (high - low) / 2;
+        const struct segmentTerm &term = segment.terms[middle];
+        int order = compareKeys(segment.keys + term.keyOffset, term.keyLength, key.data(), key.length());
+        
+        if(order == 0) return &term;
+        if(order < 0) low = middle + 1;
+        else high = middle;
+    }
+    return NULL;
+}
+
+
+// Puts the offsets of the messages in a segment that have every key in matches
+void matchSegment(const struct historySegment &segment, const vector<string> &keys, 
+                  vector<uint64_t> &matches)
+{
+    // Start from the key with the fewest postings so the lists stay short
+    vector<const struct segmentTerm *> terms;
+    for(auto const & key : keys)
+    {
+        const struct segmentTerm *term = findSegmentTerm(segment, key);
+        if(term == NULL) return;
+        terms.push_back(term);
+    }
+    sort(terms.begin(), terms.end(), [](const struct segmentTerm *a, const struct segmentTerm *b) {
+        return a->postingsLength < b->postingsLength;
+    });
+    
+    vector<uint64_t> docs;
+    for(size_t i = 0; i < terms.size(); i++)
+    {
+        const char *pos = segment.data + terms[i]->postingsOffset;
+        const char *end = pos + terms[i]->postingsLength;
+        uint64_t doc = 0, gap;
+        
+        docs.clear();
+        while(readVarint(pos, end, gap))
+        {
+            doc += gap;
+            if(i == 0 || binary_search(matches.begin(), matches.end(), doc)) docs.push_back(doc);
+        }
+        matches.swap(docs);
+        if(matches.empty()) return;
+    }
+}
+
+
+// Puts the offsets of the messages from liveStart on that have every key in matches
+void matchLiveTerms(const vector<string> &keys, vector<uint64_t> &matches)
+{
+    vector<const vector<uint64_t> *> lists;
+    for(auto const & key : keys)
+    {
+        auto term = liveTerms.find(key);
+        if(term == liveTerms.end()) return;
+        lists.push_back(&term->second);
+    }
+    sort(lists.begin(), lists.end(), [](const vector<uint64_t> *a, const vector<uint64_t> *b) {
+        return a->size() < b->size();
+    });
+    
+    matches = *lists[0];
+    vector<uint64_t> docs;
+    for(size_t i = 1; i < lists.size() && !matches.empty(); i++)
+    {
+        docs.clear();
+        set_intersection(matches.begin(), matches.end(), lists[i]->begin(), lists[i]->end(), 
+                         back_inserter(docs));
+        matches.swap(docs);
+    }
+}
+
+
+// Returns the log offsets of the newest SEARCH_RESULTS messages in a session
+// that have all the terms, oldest first
+vector<uint64_t> searchHistory(const string &sessionID, const vector<string> &terms)
+{
+    vector<string> keys;
+    for(auto const & term : terms) keys.push_back(historyKey(sessionID, term));
+    
+    vector<uint64_t> results, matches;
+    matchLiveTerms(keys, results);
+    
+    // Newest segments first, until there are enough
+    for(size_t i = historySegments.size(); i > 0 && results.size() < SEARCH_RESULTS; i--)
+    {
+        matches.clear();
+        matchSegment(historySegments[i - 1], keys, matches);
+        results.insert(results.begin(), matches.begin(), matches.end());
+    }
+    
+    if(results.size() > SEARCH_RESULTS) results.erase(results.begin(), results.end() - SEARCH_RESULTS);
+    return results;
+}
+
+
+// Writes the in-memory index out as a segment, then merges while the newest
+// segment is as big as the one before it
+void sealAndMergeSegments()
+{
+    sealLiveSegment();
+    while(historySegments.size() >= 2 && historySegments.back().header.messages >= 
+          historySegments[historySegments.size() - 2].header.messages)
+    {
+        mergeLastSegments();
+    }
+}
+
+
+// Indexes the messages added to the log since the last pass, up to
+// HISTORY_READ_SIZE bytes of them
+// Returns true if there are more waiting
+bool indexHistory()
+{
+    static vector<char> buffer(HISTORY_READ_SIZE);
+    
+    ssize_t numBytes = pread(historyReadfd, buffer.data(), buffer.size(), indexedOffset);
+    if(numBytes <= 0) return false;
+    
+    struct historyRecord record;
+    size_t pos = 0;
+    while(parseHistoryRecord(buffer.data() + pos, numBytes - pos, record))
+    {
+        string key = record.sessionID;
+        key += '\0';
+        size_t prefixLength = key.length();
+        
+        for(auto const & term : historyTerms(record.text, record.textLength))
+        {
+            key.resize(prefixLength);
+            key += term;
+            auto postings = liveTerms.emplace(key, vector<uint64_t>());
+            if(postings.second) liveIndexBytes += LIVE_TERM_MEMORY + stringMemory(key);
+            postings.first->second.push_back(indexedOffset + pos);
+            liveIndexBytes += sizeof(uint64_t);
+        }
+        pos += record.length;
+        liveMessages++;
+        
+        if(liveMessages == HISTORY_SEGMENT_MESSAGES || 
+           (softMemoryLimit != 0 && liveIndexBytes >= softMemoryLimit / HISTORY_MEMORY_SHARE))
+        {
+            indexedOffset += pos;
+            sealAndMergeSegments();
+            return true;
+        }
+    }
+    indexedOffset += pos;
+    return (size_t) numBytes == buffer.size();
+}
+
+
+// Sends the client the newest messages in a session that match its search, then
+// how many there were, all in one write
+void answerSearch(const struct searchRequest &request)
+{
+    struct mailboxItem item;
+    item.sockfd = request.sockfd;
+    item.recipientID = request.userID;
+    
+    vector<uint64_t> results = searchHistory(request.sessionID, request.terms);
+    vector<char> buffer(MAXDATASIZE * 2);
+    size_t found = 0;
+    for(auto const & offset : results)
+    {
+        struct historyRecord record;
+        ssize_t numBytes = pread(historyReadfd, buffer.data(), buffer.size(), offset);
+        if(numBytes <= 0 || !parseHistoryRecord(buffer.data(), numBytes, record)) continue;
+        
+        // Hit is "<time> <source> <text>", cut short if it won't fit in a packet
+        string hit = to_string(record.time) + " " + record.source + " ";
+        hit.append(record.text, min(record.textLength, (size_t) MAXDATASIZE - 32 - hit.length()));
+        item.packets += encodePacket<SE_HIT>("SERVER", hit);
+        item.packets += '\0';
+        found++;
+    }
+    item.packets += encodePacket<SE_ACK>("SERVER", to_string(found));
+    item.packets += '\0';
+    
+    postToMailboxOrWait(&loopMailbox, item);
+}
+
+
+// Body of the indexer thread. Keeps the index up to date with the log and
+// answers searches once it has caught up, until told to stop. It runs at idle
+// priority, so indexing never delays the event loop's broadcasts
+void runIndexer()
+{
+    // Only take CPU time the event loop doesn't want, and keep off its core
+    struct sched_param idle = {0};
+    if(pthread_setschedparam(pthread_self(), SCHED_IDLE, &idle) != 0)
+    {
+        cout << "indexer: can't lower priority" << endl;
+    }
+    if(loopCPU >= 0)
+    {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        for(long cpu = 0; cpu < sysconf(_SC_NPROCESSORS_CONF) && cpu < CPU_SETSIZE; cpu++)
+        {
+            if(cpu != loopCPU) CPU_SET(cpu, &cpus);
+        }
+        if(CPU_COUNT(&cpus) > 0 && sched_setaffinity(0, sizeof(cpus), &cpus) == -1) perror("sched_setaffinity");
+    }
+    
+    while(1)
+    {
+        bool behind = indexHistory();
+        
+        deque<struct searchRequest> requests;
+        bool stopping;
+        {
+            unique_lock<mutex> lock(indexerLock);
+            if(!behind)
+            {
+                indexerWakeup.wait_for(lock, chrono::milliseconds(HISTORY_INDEX_INTERVAL), [] {
+                    return indexerStopping || !searchRequests.empty();
+                });
+            }
+            requests.swap(searchRequests);
+            stopping = indexerStopping;
+        }
+        
+        // The event loop is short of memory, so give back what the index holds
+        // after every pass until it isn't
+        if(indexerShedding && liveMessages > 0)
+        {
+            sealAndMergeSegments();
+            malloc_trim(0);
+        }
+        
+        // Searches see every message sent before them
+        if(!requests.empty()) while(indexHistory());
+        for(auto const & request : requests) answerSearch(request);
+        if(stopping) break;
+    }
+    finishPosting(indexerFinished);
+}
+
+
+// Opens the history log and the segments indexing it, and gets the index ready
+// to carry on from the end of the last segment. A segment left behind by a
+// merge that didn't finish, or that doesn't follow on from the ones before it,
+// is removed, and so is a record only partly written when the server stopped
+void openHistory()
+{
+    string path = stateDirectory + "/" + HISTORY_FILE;
+    historyfd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    historyReadfd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(historyfd == -1 || historyReadfd == -1)
+    {
+        perror("history: open");
+        if(historyfd != -1) close(historyfd);
+        historyfd = -1;
+        return;
+    }
+    
+    vector<struct historySegment> segments;
+    DIR *dir = opendir(stateDirectory.c_str());
+    struct dirent *entry;
+    size_t prefixLength = strlen(HISTORY_SEGMENT_PREFIX);
+    while(dir != NULL && (entry = readdir(dir)) != NULL)
+    {
+        if(strncmp(entry->d_name, HISTORY_SEGMENT_PREFIX, prefixLength) != 0) continue;
+        
+        struct historySegment segment;
+        string segmentFile = stateDirectory + "/" + entry->d_name;
+        if(mapSegment(segmentFile, segment)) segments.push_back(segment);
+        else unlink(segmentFile.c_str());
+    }
+    if(dir != NULL) closedir(dir);
+    
+    // Longest first where two start at the same place, so a merged segment is
+    // kept over the ones it was made from
+    sort(segments.begin(), segments.end(), [](const struct historySegment &a, const struct historySegment &b) {
+        if(a.header.startOffset != b.header.startOffset) return a.header.startOffset < b.header.startOffset;
+        return a.header.endOffset > b.header.endOffset;
+    });
+    
+    struct stat info;
+    uint64_t logLength = fstat(historyReadfd, &info) == 0 ? info.st_size : 0;
+    historySegments.clear();
+    liveStart = 0;
+    for(auto const & segment : segments)
+    {
+        if(segment.header.startOffset == liveStart && segment.header.endOffset <= logLength)
+        {
+            historySegments.push_back(segment);
+            liveStart = segment.header.endOffset;
+        }
+        else unmapSegment(segment, true);
+    }
+    
+    // Find where the last whole record ends
+    indexedOffset = liveStart;
+    vector<char> buffer(HISTORY_READ_SIZE);
+    uint64_t end = liveStart;
+    ssize_t numBytes;
+    while((numBytes = pread(historyReadfd, buffer.data(), buffer.size(), end)) > 0)
+    {
+        struct historyRecord record;
+        size_t pos = 0;
+        while(parseHistoryRecord(buffer.data() + pos, numBytes - pos, record)) pos += record.length;
+        end += pos;
+        if(pos == 0) break;
+    }
+    if(end < logLength && ftruncate(historyfd, end) == -1) perror("history: ftruncate");
+    
+    liveTerms.clear();
+    liveMessages = 0;
+    printf("server: history has %zu index segments, %llu bytes to index\n", 
+           historySegments.size(), (unsigned long long) (end - liveStart));
+}
+
+
+void startIndexer()
+{
+    if(historyfd == -1) return;
+    indexerStopping = false;
+    indexerFinished.store(false, memory_order_relaxed);
+    indexerThread = thread(runIndexer);
+}
+
+
+// Stops the indexer once it has answered the searches it was given, which are
+// delivered here
+void stopIndexer()
+{
+    if(!indexerThread.joinable()) return;
+    {
+        lock_guard<mutex> lock(indexerLock);
+        indexerStopping = true;
+    }
+    indexerWakeup.notify_one();
+    joinPoster(indexerThread, indexerFinished);
+}
+
+
+// Hands a search to the indexer thread
+// Data is "<session> <terms>"
+void searchSession(int sockfd, const string &searchData)
+{
+    if(clientList.find(sockfd) == clientList.end()) return;
+    
+    struct message nak;
+    nak.type = SE_NAK;
+    nak.source = "SERVER";
+    
+    stringstream ss(searchData);
+    string sessionID, terms;
+    ss >> sessionID;
+    getline(ss, terms);
+    
+    struct searchRequest request;
+    request.sockfd = sockfd;
+    request.userID = clientName(sockfd);
+    request.sessionID = sessionID;
+    request.terms = historyTerms(terms.data(), terms.length());
+    
+    if(historyfd == -1) nak.data = "Server isn't keeping history!";
+    else if(!isInSession(sockfd, sessionID)) nak.data = "Not in session '" + sessionID + "'!";
+    else if(request.terms.empty()) nak.data = "No search terms!";
+    else
+    {
+        flushHistory();
+        {
+            lock_guard<mutex> lock(indexerLock);
+            searchRequests.push_back(request);
+        }
+        indexerWakeup.notify_one();
+        return;
+    }
+    
+    nak.size = nak.data.length() + 1;
+    sendToClient(&nak, sockfd);
+}
+
+
+// Sends a direct message to a client specified in the data of the given packet
+// If the client isn't logged in it's held until they are, and if it doesn't
+// exist, inform sender
+// Returns true if message sent successfully
+bool sendDirectMessage(struct message packet, int senderfd)
+{
+    struct message dirMessAck;
+    dirMessAck.source = "SERVER";
+    
+    stringstream ss(packet.data);
+    string receiverID, message;
+    ss >> receiverID;
+    
+    // Messages that came while the receiver was away are still being sent to
+    // them, so this one goes after them in their mailbox
+    auto mailbox = offlineMailboxes.find(receiverID);
+    bool catchingUp = mailbox != offlineMailboxes.end() && mailbox->second.delivering;
+    bool online = false;
+    
+    for(auto const & client : clientList)
+    {
+        if(userNames[client.second] == receiverID)
+        {
+            // Don't send to yourself
+            if(client.first == senderfd)
+            {
+                dirMessAck.type = DMESS_NAK;
+                dirMessAck.data = "Can't send message to yourself!";
+                dirMessAck.size = dirMessAck.data.length() + 1;
+                sendToClient(&dirMessAck, senderfd);
+                
+                return false;
+            }
+            if(catchingUp)
+            {
+                online = true;
+                break;
+            }
+            
+            // Send message to receiver
+            getline(ss, message);
+            message.erase(0, 1); // Remove extra space
+            packet.data = message;
+            sendToClient(&packet, client.first);
+            
+            // Tell sender the message was delivered
+            dirMessAck.type = DMESS_ACK;
+            dirMessAck.data = receiverID;
+            dirMessAck.size = dirMessAck.data.length() + 1;
+            sendToClient(&dirMessAck, senderfd);
+            
+            return true;
+        }
+    }
+    
+    // Hold the message if the user just isn't logged in right now, or is still
+    // being sent the ones that came while they were away
+    if(permittedClientList.find(receiverID) != permittedClientList.end())
+    {
+        getline(ss, message);
+        message.erase(0, 1); // Remove extra space
+        
+        if(queueOfflineMessage(receiverID, encodePacket<DIRMESSAGE>(packet.source, message)))
+        {
+            dirMessAck.type = DMESS_ACK;
+            dirMessAck.data = online ? receiverID : receiverID + OFFLINE_ACK;
+        }
+        else
+        {
+            dirMessAck.type = DMESS_NAK;
+            dirMessAck.data = "Mailbox for '" + receiverID + "' is full!";
+        }
+        dirMessAck.size = dirMessAck.data.length() + 1;
+        sendToClient(&dirMessAck, senderfd);
+        
+        return dirMessAck.type == DMESS_ACK;
+    }
+    
+    // Inform sender the user does not exist
+    dirMessAck.type = DMESS_NAK;
+    dirMessAck.data = "User '" + receiverID + "' does not exist!";
+    dirMessAck.size = dirMessAck.data.length() + 1;
+    sendToClient(&dirMessAck, senderfd);
+    
+    return false;
+}
+
+// Brings a session's message rate up to date
+// Returns its load, in deliveries a second
+double updateSessionLoad(uint32_t id, struct sessionLoad &load, uint64_t now)
+{
+    if(load.ratedAt != 0) load.rate *= exp(-(double) (now - load.ratedAt) / (SESSION_RATE_WINDOW * 1e9));
+    load.ratedAt = now;
+    
+    uint32_t members = sessionTable.records[id].members.count;
+    return members == 0 ? 0 : load.rate * (members - 1);
+}
+
+
+// Counts a message sent to a session, and marks it hot or not by its load.
+// Sessions of two are left alone, as their messages are more often answers
+// the other side is waiting on than a stream worth batching
+// Returns true if the session is hot
+bool countSessionMessage(const string &sessionID)
+{
+    uint32_t id = sessionIDOf(&sessionTable, sessionID);
+    if(id == NO_SESSION) return false;
+    struct sessionLoad &load = sessionLoads[id];
+    double deliveries = updateSessionLoad(id, load, monotonicNanoseconds());
+    load.messages++;
+    load.rate += 1 / SESSION_RATE_WINDOW;
+    
+    bool fansOut = sessionTable.records[id].members.count > 2;
+    if(!load.hot && hotSessionLoad > 0 && deliveries >= hotSessionLoad && fansOut)
+    {
+        load.hot = true;
+        cout << "Session '" << sessionID << "' is hot (" << (unsigned long) deliveries 
+             << " deliveries/s), batching its messages" << endl;
+    }
+    else if(load.hot && deliveries < hotSessionLoad / 2.0)
+    {
+        load.hot = false;
+        cout << "Session '" << sessionID << "' has cooled off (" << (unsigned long) deliveries 
+             << " deliveries/s)" << endl;
+    }
+    return load.hot;
+}
+
+
+// Returns the sessions named in "<session>[,<session>...]" that the client is
+// in, each only once
+vector<string> targetSessions(int senderfd, const string &targets)
+{
+    vector<string> sessionIDs;
+    stringstream names(targets);
+    for(string sessionID; getline(names, sessionID, SESSION_SEPARATOR); )
+    {
+        if(isInSession(senderfd, sessionID) && 
+           find(sessionIDs.begin(), sessionIDs.end(), sessionID) == sessionIDs.end())
+        {
+            sessionIDs.push_back(sessionID);
+        }
+    }
+    return sessionIDs;
+}
+
+
+// Sends a message from a client to everyone else in the sessions it names
+// Data is "<session>[,<session>...] <message>", and each recipient gets the
+// message once with the names of the sessions it shares with the sender, even
+// if it's in several of them
+// Chunks of a large message are relayed the same way as they arrive, so they
+// take turns with other clients' messages rather than holding up the session.
+// Messages to hot sessions are batched for each recipient
+template<msgType type>
+void sendSessionMessage(struct message &packet, int senderfd)
+{
+    string targets, text;
+    stringstream ss(packet.data);
+    ss >> targets;
+    ss.get(); // Remove extra space
+    getline(ss, text, '\0');
+    
+    vector<string> sessionIDs = targetSessions(senderfd, targets);
+    if(sessionIDs.empty()) return;
+    
+    bool batch = false;
+    if(type == MESSAGE)
+    {
+        const string &source = clientName(senderfd);
+        for(auto const & sessionID : sessionIDs)
+        {
+            recordHistory(sessionID, source, text);
+            if(countSessionMessage(sessionID)) batch = true;
+        }
+    }
+    
+    if(sessionIDs.size() == 1)
+    {
+        const string &sessionID = sessionIDs.front();
+        
+        auto group = multicastGroups.find(sessionID);
+        packet.data = text;
+        if(type == MESSAGE && group != multicastGroups.end() &&
+           sendMulticastMessage(group->second, sessionID, packet, senderfd))
+        {
+            cout << "Message sent to session '" << sessionID << "'" << endl;
+            return;
+        }
+        
+        // Everyone gets the same packet
+        string dataStr = encodePacket<type>(packet.source, sessionID + " " + text);
+        for(auto const & clientSockfd : membersOf(findSession(&sessionTable, sessionID)->members))
+        {
+            if(clientSockfd != senderfd) sendPacketToClient(dataStr, clientSockfd, batch);
+        }
+    }
+    else
+    {
+        // Work out which of the sessions each recipient is in before sending
+        // anything, so clients in several of them get one packet
+        unordered_map<int, string> recipients;
+        for(auto const & sessionID : sessionIDs)
+        {
+            for(auto const & clientSockfd : membersOf(findSession(&sessionTable, sessionID)->members))
+            {
+                if(clientSockfd == senderfd) continue;
+                
+                string &shared = recipients[clientSockfd];
+                if(!shared.empty()) shared += SESSION_SEPARATOR;
+                shared += sessionID;
+            }
+        }
+        
+        for(auto const & recipient : recipients)
+        {
+            sendPacketToClient(encodePacket<type>(packet.source, recipient.second + " " + text), 
+                               recipient.first, batch);
+        }
+    }
+    
+    if(type == MESSAGE) cout << "Message sent to session '" << targets << "'" << endl;
+}
+
+
+// Sends a traced message on like any other, with the times the server read it,
+// had worked out who to send it to, and wrote it to each recipient added
+// Data is "<sessions> <trace ID> <client read> <client send> <message>", and
+// recipients get "<sessions> <trace ID> <client read> <client send> <server
+// receive> <server enqueue> <server write> <message>". Traced messages always
+// go over TCP, and each recipient gets its own packet so it can be stamped
+void sendTracedMessage(struct message &packet, int senderfd)
+{
+    // Reads from this client are only timed once it has sent a traced message,
+    // so the first one is stamped when it's handled instead
+    struct receiveRing &ring = receiveRings[senderfd];
+    uint64_t received = ring.traced ? ring.receivedAt : monotonicNanoseconds();
+    ring.traced = true;
+    
+    string targets, traceID, clientRead, clientSend, text;
+    stringstream ss(packet.data);
+    ss >> targets >> traceID >> clientRead >> clientSend;
+    ss.get(); // Remove extra space
+    getline(ss, text, '\0');
+    
+    vector<string> sessionIDs = targetSessions(senderfd, targets);
+    if(sessionIDs.empty()) return;
+    
+    const string &source = clientName(senderfd);
+    unordered_map<int, string> recipients;
+    for(auto const & sessionID : sessionIDs)
+    {
+        recordHistory(sessionID, source, text);
+        countSessionMessage(sessionID);
+        for(auto const & clientSockfd : membersOf(findSession(&sessionTable, sessionID)->members))
+        {
+            if(clientSockfd == senderfd) continue;
+            
+            string &shared = recipients[clientSockfd];
+            if(!shared.empty()) shared += SESSION_SEPARATOR;
+            shared += sessionID;
+        }
+    }
+    
+    string stamps = " " + traceID + " " + clientRead + " " + clientSend + " " + to_string(received) + 
+                    " " + to_string(monotonicNanoseconds()) + " ";
+    for(auto const & recipient : recipients)
+    {
+        string data = recipient.second + stamps + to_string(monotonicNanoseconds()) + " " + text;
+        sendPacketToClient(encodePacket<MESSAGE_TRACE>(packet.source, data), recipient.first);
+    }
+}
+
+
+// Sends a file transfer reply to a client
+void acknowledgeFile(int sockfd, msgType type, string data)
+{
+    struct message ack;
+    ack.type = type;
+    ack.source = "SERVER";
+    ack.data = data;
+    ack.size = ack.data.length() + 1;
+    
+    sendToClient(&ack, sockfd);
+}
+
+
+// Returns the file descriptor of the client logged in as userID, or -1
+int userIDToSockfd(const string &userID)
+{
+    for(auto const & client : clientList)
+    {
+        if(userNames[client.second] == userID) return client.first;
+    }
+    return -1;
+}
+
+
+// Releases the spool and pipe of a file transfer
+void closeFileRelay(int sockfd)
+{
+    auto relay = fileRelays.find(sockfd);
+    if(relay == fileRelays.end()) return;
+    
+    close(relay->second.spoolfd);
+    close(relay->second.pipefds[0]);
+    close(relay->second.pipefds[1]);
+    fileRelays.erase(relay);
+}
+
+
+// Starts receiving a file from a client after checking it can be delivered
+// Request data is "<username or FILE_TO_SESSION[session]> <size> <file name>"
+// A file for FILE_TO_SESSION without a session name goes to the sender's only session
+// The client starts sending the contents once it gets FILE_ACK
+// Returns true if the transfer was accepted
+bool startFileRelay(int sockfd, string requestData)
+{
+    struct fileRelay relay;
+    stringstream ss(requestData);
+    ss >> relay.target >> relay.size;
+    ss.get(); // Remove the space before the name
+    getline(ss, relay.name, '\0');
+    relay.remaining = relay.size;
+    
+    if(relay.name.empty() || relay.size == 0)
+    {
+        acknowledgeFile(sockfd, FILE_NAK, "No file was provided!");
+        return false;
+    }
+    if(relay.size > MAX_FILE_SIZE)
+    {
+        acknowledgeFile(sockfd, FILE_NAK, "File is too large!");
+        return false;
+    }
+    bool toSession = relay.target.compare(0, strlen(FILE_TO_SESSION), FILE_TO_SESSION) == 0;
+    if(toSession)
+    {
+        string sessionID = relay.target.substr(strlen(FILE_TO_SESSION));
+        if(sessionID.empty()) sessionID = onlySessionOf(sockfd);
+        if(!isInSession(sockfd, sessionID))
+        {
+            acknowledgeFile(sockfd, FILE_NAK, sessionID == SESSION_NOT_FOUND ? 
+                            "Name the session to send to!" : "Not in session '" + sessionID + "'!");
+            return false;
+        }
+        relay.target = FILE_TO_SESSION + sessionID;
+    }
+    else
+    {
+        int receiverfd = userIDToSockfd(relay.target);
+        if(receiverfd == -1)
+        {
+            acknowledgeFile(sockfd, FILE_NAK, "User '" + relay.target + "' does not exist!");
+            return false;
+        }
+        if(receiverfd == sockfd)
+        {
+            acknowledgeFile(sockfd, FILE_NAK, "Can't send file to yourself!");
+            return false;
+        }
+    }
+    
+    // Spool to a temp file that disappears as soon as it is closed
+    char spoolName[] = FILE_SPOOL_TEMPLATE;
+    if((relay.spoolfd = mkstemp(spoolName)) == -1)
+    {
+        perror("mkstemp");
+        acknowledgeFile(sockfd, FILE_NAK, "Server can't store the file!");
+        return false;
+    }
+    unlink(spoolName);
+    
+    if(pipe(relay.pipefds) == -1)
+    {
+        perror("pipe");
+        close(relay.spoolfd);
+        acknowledgeFile(sockfd, FILE_NAK, "Server can't store the file!");
+        return false;
+    }
+    
+    fileRelays.insert(make_pair(sockfd, relay));
+    acknowledgeFile(sockfd, FILE_ACK, "Ready");
+    return true;
+}
+
+
+// Sends a finished file to its recipients, each getting a FILE_SEND packet with
+// data "<size> <file name>" followed by the contents, and tells the sender how
+// many clients it went to. Each recipient is sent the spool through its lanes,
+// so a slow one only holds up itself
+void finishFileRelay(int sockfd)
+{
+    struct fileRelay &relay = fileRelays.find(sockfd)->second;
+    vector<int> recipients;
+    
+    if(relay.target.compare(0, strlen(FILE_TO_SESSION), FILE_TO_SESSION) == 0)
+    {
+        string sessionID = relay.target.substr(strlen(FILE_TO_SESSION));
+        if(isInSession(sockfd, sessionID))
+        {
+            for(auto const & clientSockfd : membersOf(findSession(&sessionTable, sessionID)->members))
+            {
+                if(clientSockfd != sockfd) recipients.push_back(clientSockfd);
+            }
+        }
+    }
+    else
+    {
+        int receiverfd = userIDToSockfd(relay.target);
+        if(receiverfd != -1) recipients.push_back(receiverfd);
+    }
+    
+    struct message header;
+    header.type = FILE_SEND;
+    header.source = clientName(sockfd);
+    header.data = to_string(relay.size) + " " + relay.name;
+    header.size = header.data.length() + 1;
+    
+    string headerPacket = stringifyMessage(&header);
+    for(auto const & receiverfd : recipients)
+    {
+        int filefd = dup(relay.spoolfd);
+        if(filefd == -1) perror("dup");
+        else queueFileToClient(headerPacket, receiverfd, filefd, relay.size);
+    }
+    
+    if(relay.target != FILE_TO_SESSION && recipients.empty())
+    {
+        acknowledgeFile(sockfd, FILE_NAK, "User '" + relay.target + "' logged out!");
+    }
+    else acknowledgeFile(sockfd, FILE_ACK, to_string(recipients.size()));
+    
+    cout << "File '" << relay.name << "' sent to " << recipients.size() << " client(s)" << endl;
+    closeFileRelay(sockfd);
+}
+
+
+// Moves file data that arrived in the same read as other packets to the spool
+// Returns the number of bytes used
+size_t spoolFileData(int sockfd, const char *data, size_t length)
+{
+    struct fileRelay &relay = fileRelays.find(sockfd)->second;
+    if(length > relay.remaining) length = relay.remaining;
+    
+    if(write(relay.spoolfd, data, length) != (ssize_t) length) perror("write");
+    captureTraffic(sockfd, CAPTURE_FILE_DATA, NULL, length);
+    relay.remaining -= length;
+    
+    if(relay.remaining == 0) finishFileRelay(sockfd);
+    return length;
+}
+
+
+// Moves file data waiting on a client's socket to the spool without copying
+// it into the server
+// Returns false if the connection failed
+bool receiveFileData(int sockfd)
+{
+    struct fileRelay &relay = fileRelays.find(sockfd)->second;
+    size_t length = relay.remaining < FILE_SPLICE_SIZE ? relay.remaining : FILE_SPLICE_SIZE;
+    
+    // Data from shared memory has already been copied once, so it's just
+    // written out from there
+    struct sharedTransport *shared = sharedTransportOf(sockfd);
+    if(shared != NULL)
+    {
+        static char buffer[FILE_SPLICE_SIZE];
+        struct iovec iov = {buffer, length};
+        spoolFileData(sockfd, buffer, readSharedData(*shared, &iov, 1));
+        return true;
+    }
+    
+    ssize_t received = splice(sockfd, NULL, relay.pipefds[1], NULL, length,
+                              SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if(received <= 0)
+    {
+        if(received == -1 && errno == EAGAIN) return true;
+        if(received == -1) perror("splice");
+        return false;
+    }
+    
+    // Everything put into the pipe has to come out before the next read
+    for(ssize_t moved = 0; moved < received; )
+    {
+        ssize_t n = splice(relay.pipefds[0], NULL, relay.spoolfd, NULL, received - moved, SPLICE_F_MOVE);
+        if(n <= 0)
+        {
+            perror("splice");
+            return false;
+        }
+        moved += n;
+    }
+    
+    captureTraffic(sockfd, CAPTURE_FILE_DATA, NULL, received);
+    relay.remaining -= received;
+    if(relay.remaining == 0) finishFileRelay(sockfd);
+    return true;
+}
+
+
+// Moves a client on the local socket onto shared memory: a ring each way, and
+// an eventfd for each side to sleep on while its ring is empty or full. They
+// are passed to it with the SHM_ACK, the last thing sent over its socket. It
+// waits behind the replies already queued for the client, and the direct and
+// session messages queued go out through the ring after it
+void attachSharedMemory(int sockfd)
+{
+    struct message reply;
+    reply.type = SHM_NAK;
+    reply.source = "SERVER";
+    
+    struct sharedTransport shared;
+    if(!isLocalSocket(sockfd)) reply.data = "Shared memory is only for clients on the local socket";
+    else if(sharedTransportOf(sockfd) != NULL || attachingTransports.find(sockfd) != attachingTransports.end())
+    {
+        reply.data = "Already using shared memory";
+    }
+    else if(!openSharedTransport(shared, true)) reply.data = "Shared memory couldn't be set up";
+    if(!reply.data.empty())
+    {
+        reply.size = reply.data.length() + 1;
+        sendToClient(&reply, sockfd);
+        return;
+    }
+    
+    reply.type = SHM_ACK;
+    reply.data = ACK_DATA;
+    reply.size = reply.data.length() + 1;
+    string packet = stringifyMessage(&reply);
+    
+    struct outboundQueue &waiting = outboundQueues[sockfd];
+    waiting.lanes[LANE_CONTROL].push_back(queuedPacket());
+    struct queuedPacket &ack = waiting.lanes[LANE_CONTROL].back();
+    ack.data.assign(packet.c_str(), packet.length() + 1);
+    ack.passesShared = true;
+    waiting.bytes += ack.data.length();
+    outboundBytes += ack.data.length();
+    attachingTransports[sockfd] = shared;
+}
+
+
+// Handlers for packets from logged in clients, one for each packet type the
+// server deals with. packetDispatcher builds them into a table at compile time
+template<msgType type> struct serverHandler {
+    static bool handle(int, struct message &) { return false; }
+};
+
+template<> struct serverHandler<JOIN> {
+    static bool handle(int sockfd, struct message &packet)
+    {
+        string sessionID;
+        stringstream ss(packet.data);
+        ss >> sessionID;
+
+        if(joinSession(sockfd, packet.data))
+        {
+            cout << "Client '" << packet.source << "' joined session '" 
+                 << sessionID  << "'" << endl;
+        }
+        else
+        {
+            cout << "Client '" << packet.source << "' could not join session '" 
+                 << sessionID << "'" << endl;
+        }
+        return true;
+    }
+};
+
+template<> struct serverHandler<LEAVE_SESS> {
+    static bool handle(int sockfd, struct message &packet)
+    {
+        if (leaveSession(sockfd, packet.data))
+        {
+            cout << "Client '" << packet.source << "' has left session" << endl;
+        }
+        else
+        {
+            cout << "Client '" << packet.source << "' could not leave session" 
+                 << endl;
+        }
+        return true;
+    }
+};
+
+template<> struct serverHandler<NEW_SESS> {
+    static bool handle(int sockfd, struct message &packet)
+    {
+        string sessionID;
+        stringstream ss(packet.data);
+        ss >> sessionID;
+
+        if(createSession(sockfd, packet.data))
+        {
+            cout << "New session '" << sessionID << "' created for client "
+                 << packet.source << endl;
+        }
+        else
+        {
+            cout << "Session '" << sessionID << "' cannot be created" 
+                 << endl;
+        }     
+        return true;
+    }
+};
+
+template<> struct serverHandler<MESSAGE> {
+    static bool handle(int sockfd, struct message &packet)
+    {
+        sendSessionMessage<MESSAGE>(packet, sockfd);
+        return true;
+    }
+};
+
+template<> struct serverHandler<MESSAGE_CHUNK> {
+    static bool handle(int sockfd, struct message &packet)
+    {
+        sendSessionMessage<MESSAGE_CHUNK>(packet, sockfd);
+        return true;
+    }
+};
+
+template<> struct serverHandler<MESSAGE_TRACE> {
+    static bool handle(int sockfd, struct message &packet)
+    {
+        sendTracedMessage(packet, sockfd);
+        return true;
+    }
+};
+
+template<> struct serverHandler<DIRMESSAGE> {
+    static bool handle(int sockfd, struct message &packet)
+    {
+        if(!sendDirectMessage(packet, sockfd))
+        {
+            cout << "Direct message not sent" << endl;
+        }
+        else
+        {
+            cout << "Direct message sent" << endl;
+        }
+        return true;
+    }
+};
+
+template<> struct serverHandler<QUERY> {
+    static bool handle(int sockfd, struct message &packet)
+    {
+        createList(sockfd, packet.data);
+        return true;
+    }
+};
+
+template<> struct serverHandler<SEARCH> {
+    static bool handle(int sockfd, struct message &packet)
+    {
+        searchSession(sockfd, packet.data);
+        return true;
+    }
+};
+
+template<> struct serverHandler<MC_JOINED> {
+    static bool handle(int sockfd, struct message &packet)
+    {
+        joinMulticastGroup(sockfd, packet.data);
+        return true;
+    }
+};
+
+template<> struct serverHandler<MC_RECEIVING> {
+    static bool handle(int sockfd, struct message &packet)
+    {
+        confirmMulticastGroup(sockfd, packet.data);
+        return true;
+    }
+};
+
+template<> struct serverHandler<MC_NAK> {
+    static bool handle(int sockfd, struct message &packet)
+    {
+        repairMulticastGap(sockfd, packet.data);
+        return true;
+    }
+};
+
+template<> struct serverHandler<FILE_SEND> {
+    static bool handle(int sockfd, struct message &packet)
+    {
+        packet.data.erase(0, 1); // Remove extra space
+        startFileRelay(sockfd, packet.data);
+        return true;
+    }
+};
+
+template<> struct serverHandler<SHM_ATTACH> {
+    static bool handle(int sockfd, struct message &)
+    {
+        attachSharedMemory(sockfd);
+        return true;
+    }
+};
+
+
+// Handles a single packet received from a logged in client
+void handlePacket(int sockfd, struct message packet)
+{
+    packetDispatcher<serverHandler, int, struct message &>::dispatch(packet.type, sockfd, packet);
+}
+
+
+// Removes a client that hung up from the client and session lists and closes
+// its connection
+void disconnectClient(int sockfd, fd_set *master)
+{
+    auto client = clientList.find(sockfd);
+    if(client != clientList.end())
+    {
+        removePresence(onlineClients, userNames[client->second]);
+        clientList.erase(client); // Remove client
+    }
+
+    // Remove client from all their sessions
+    auto sessions = clientSessions.find(sockfd);
+    if(sessions != clientSessions.end())
+    {
+        vector<string> sessionIDs;
+        for(auto const & id : sessions->second) sessionIDs.push_back(sessionTable.records[id].name);
+        for(auto const & sessionID : sessionIDs) removeFromSession(sockfd, sessionID);
+    }
+    
+    closeFileRelay(sockfd);
+    auto ring = receiveRings.find(sockfd);
+    if(ring != receiveRings.end())
+    {
+        if(ring->second.data != NULL) ringBytes -= RECEIVE_RING_SIZE;
+        free(ring->second.data);
+        receiveRings.erase(ring);
+    }
+    backloggedClients.erase(sockfd);
+    pausedClients.erase(sockfd);
+    laggingClients.erase(sockfd);
+    dropOutboundQueue(sockfd);
+    for(auto transports : {&sharedTransports, &attachingTransports})
+    {
+        auto shared = transports->find(sockfd);
+        if(shared == transports->end()) continue;
+        ringBytes -= sizeof(struct sharedChannel);
+        closeSharedTransport(shared->second);
+        transports->erase(shared);
+    }
+    captureTraffic(sockfd, CAPTURE_CLOSE, NULL, 0);
+    close(sockfd);
+    FD_CLR(sockfd, master); // remove from master set
+    
+    // A task waiting to send to the client finds it gone and cleans up
+    auto waiter = writeWaiters.find(sockfd);
+    if(waiter != writeWaiters.end())
+    {
+        struct loopTask *task = waiter->second;
+        writeWaiters.erase(waiter);
+        task->step(task);
+    }
+}
+
+
+// Disconnects the clients that fell too far behind taking what's sent to them
+void disconnectLaggingClients(fd_set *master)
+{
+    while(!laggingClients.empty())
+    {
+        int sockfd = *laggingClients.begin();
+        printf("server: socket %d fell %d bytes behind, disconnecting\n", sockfd, OUTBOUND_QUEUE_LIMIT);
+        disconnectClient(sockfd, master);
+    }
+}
+
+
+// Returns the memory accounted to a session: its bookkeeping, its members and
+// its multicast group with the messages kept for it
+size_t sessionMemory(const string &sessionID)
+{
+    size_t bytes = 0;
+    struct sessionRecord *session = findSession(&sessionTable, sessionID);
+    if(session != NULL)
+    {
+        bytes += sessionFootprint(sessionID, session->password) + session->members.count * MEMBERSHIP_MEMORY;
+    }
+    auto group = multicastGroups.find(sessionID);
+    if(group != multicastGroups.end()) bytes += MULTICAST_GROUP_MEMORY + group->second.historyBytes;
+    return bytes;
+}
+
+
+// Returns the memory accounted to a connection: its receive ring and shared
+// memory, what's queued to be sent to it and an even share of each of its
+// sessions
+size_t connectionMemory(int sockfd)
+{
+    size_t bytes = 0;
+    auto ring = receiveRings.find(sockfd);
+    if(ring != receiveRings.end() && ring->second.data != NULL) bytes += RECEIVE_RING_SIZE;
+    if(sharedTransportOf(sockfd) != NULL) bytes += sizeof(struct sharedChannel);
+    auto queue = outboundQueues.find(sockfd);
+    if(queue != outboundQueues.end()) bytes += queue->second.bytes;
+    
+    auto sessions = clientSessions.find(sockfd);
+    if(sessions == clientSessions.end()) return bytes;
+    for(auto const & id : sessions->second)
+    {
+        const struct sessionRecord &session = sessionTable.records[id];
+        bytes += sessionMemory(session.name) / session.members.count;
+    }
+    return bytes;
+}
+
+
+// Returns the memory held for admin connections' commands and responses, and
+// the announcements they're making
+size_t adminMemory()
+{
+    size_t bytes = 0;
+    for(auto const & admin : adminConnections)
+    {
+        bytes += admin.second.input.capacity() + admin.second.output.capacity() + 
+                 admin.second.cursor.capacity() + admin.second.fds.capacity() * sizeof(int);
+    }
+    for(auto const & job : broadcastJobs)
+    {
+        bytes += job.packet.capacity() + job.recipients.capacity() * sizeof(job.recipients[0]) + 
+                 job.reached.size() * MEMBERSHIP_MEMORY;
+    }
+    return bytes;
+}
+
+
+// Returns the memory held for the history log and its index
+size_t historyMemory()
+{
+    return historyBuffer.capacity() + liveIndexBytes.load(memory_order_relaxed);
+}
+
+
+// Returns all the memory accounted for
+size_t accountedMemory()
+{
+    return ringBytes + sessionBytes + multicastBytes + offlineBytes + outboundBytes + historyMemory() + adminMemory();
+}
+
+
+// Returns the logged in client using the most memory, or -1 if there are none
+int biggestClient(size_t *bytes)
+{
+    int biggest = -1;
+    *bytes = 0;
+    for(auto const & client : clientList)
+    {
+        size_t clientBytes = connectionMemory(client.first);
+        if(biggest == -1 || clientBytes > *bytes)
+        {
+            biggest = client.first;
+            *bytes = clientBytes;
+        }
+    }
+    return biggest;
+}
+
+
+// Gives back the history held in memory: the messages kept to repair multicast
+// gaps, so members asking for them are told they're lost, the history log's
+// buffer, and the indexer's in-memory index, which it writes out as a segment
+// after each pass until memory isn't short any more
+void shedHistory()
+{
+    for(auto & group : multicastGroups)
+    {
+        deque<string>().swap(group.second.history);
+        group.second.historyBytes = 0;
+    }
+    multicastBytes = 0;
+    string().swap(historyBuffer);
+    
+    if(indexerThread.joinable())
+    {
+        {
+            lock_guard<mutex> lock(indexerLock);
+            indexerShedding = true;
+        }
+        indexerWakeup.notify_one();
+    }
+    malloc_trim(0);
+}
+
+
+// Stops reading from the connection using the most memory, and from any others
+// using more than an even share of what's accounted for. What they send waits
+// in the kernel, and TCP stops them sending more once it's full. Connections
+// sending a file are left alone, as its data goes to disk
+void pauseBiggestClients(size_t used)
+{
+    size_t biggestBytes;
+    int biggest = biggestClient(&biggestBytes);
+    
+    for(auto const & client : clientList)
+    {
+        if(fileRelays.find(client.first) != fileRelays.end()) continue;
+        if(client.first == biggest || connectionMemory(client.first) * clientList.size() > used)
+        {
+            pausedClients.insert(client.first);
+            backloggedClients.erase(client.first);
+        }
+    }
+}
+
+
+// Disconnects the connections using the most memory, biggest first, until usage
+// is back under the soft limit or the biggest left uses no more than an even
+// share. Only those over an even share to start with can be picked, so they
+// are found in one pass and sorted once
+// Returns the memory still in use
+size_t disconnectBiggestClients(size_t used, fd_set *master)
+{
+    vector<pair<size_t, int>> victims;
+    for(auto const & client : clientList)
+    {
+        size_t bytes = connectionMemory(client.first);
+        if(bytes * clientList.size() >= used) victims.push_back(make_pair(bytes, client.first));
+    }
+    sort(victims.begin(), victims.end(), greater<pair<size_t, int>>());
+    
+    for(auto const & victim : victims)
+    {
+        if(used < softMemoryLimit || victim.first * clientList.size() < used) break;
+        printf("server: %zu bytes in use, over the hard limit, disconnecting %s using %zu\n",
+               used, clientName(victim.second).c_str(), victim.first);
+        disconnectClient(victim.second, master);
+        used = accountedMemory();
+    }
+    return used;
+}
+
+
+// Starts reading from paused connections again, handling any whole packets
+// they had waiting first
+void resumePausedClients()
+{
+    for(auto const & sockfd : pausedClients)
+    {
+        if(receiveRings.find(sockfd) != receiveRings.end()) backloggedClients.insert(sockfd);
+    }
+    pausedClients.clear();
+}
+
+
+// Checks the memory accounted for against the limits, once every pass of the
+// main loop. Crossing the soft limit sheds history and pauses the biggest
+// connections, until memory falls to MEMORY_RESUME_PERCENT of it. Over the
+// hard limit, the biggest connections are disconnected until it's back under
+// the soft limit, as long as they are using more than an even share, since
+// disconnecting the others wouldn't help much
+void checkMemory(fd_set *master)
+{
+    if(softMemoryLimit == 0) return;
+    size_t used = accountedMemory();
+    bool repause = false;
+    
+    if(used >= softMemoryLimit && !memoryPressure)
+    {
+        printf("server: %zu bytes in use, over the soft limit, shedding history\n", used);
+        memoryPressure = true;
+        shedHistory();
+        used = accountedMemory();
+        repause = true;
+    }
+    
+    if(used >= hardMemoryLimit)
+    {
+        size_t before = used;
+        used = disconnectBiggestClients(used, master);
+        if(used != before) repause = true;
+    }
+    
+    if(used < softMemoryLimit / 100 * MEMORY_RESUME_PERCENT)
+    {
+        if(memoryPressure) printf("server: %zu bytes in use, back under the soft limit\n", used);
+        memoryPressure = false;
+        indexerShedding = false;
+        resumePausedClients();
+    }
+    else if(repause)
+    {
+        resumePausedClients();
+        pauseBiggestClients(used);
+    }
+}
+
+
+// Adds a report of where memory is going to an admin connection's response:
+// the totals for each kind of use, the heap and resident size for comparison,
+// and the connections and sessions using the most
+void reportMemory(string &output, size_t count)
+{
+    struct mallinfo2 heap = mallinfo2();
+    long residentPages = 0;
+    ifstream statm("/proc/self/statm");
+    statm >> residentPages >> residentPages;
+    
+    output += "accounted=" + to_string(accountedMemory()) + " soft_limit=" + to_string(softMemoryLimit) +
+              " hard_limit=" + to_string(hardMemoryLimit) + " short=" + (memoryPressure ? "yes" : "no") +
+              " paused=" + to_string(pausedClients.size()) + "\n";
+    output += "rings=" + to_string(ringBytes) + " sessions=" + to_string(sessionBytes) + 
+              " multicast=" + to_string(multicastBytes) + " offline=" + to_string(offlineBytes) + 
+              " outbound=" + to_string(outboundBytes) + " history=" + to_string(historyMemory()) + " admin=" + to_string(adminMemory()) + "\n";
+    output += "heap=" + to_string(heap.uordblks + heap.hblkhd) + 
+              " resident=" + to_string(residentPages * sysconf(_SC_PAGESIZE)) + "\n";
+    
+    vector<pair<size_t, int>> connections;
+    for(auto const & client : clientList) connections.push_back(make_pair(connectionMemory(client.first), client.first));
+    size_t shown = min(count, connections.size());
+    partial_sort(connections.begin(), connections.begin() + shown, connections.end(), greater<pair<size_t, int>>());
+    for(size_t i = 0; i < shown; i++)
+    {
+        output += "connection " + to_string(connections[i].second) + " " + clientName(connections[i].second) + 
+                  " bytes=" + to_string(connections[i].first) + "\n";
+    }
+    
+    vector<pair<size_t, string>> sessions;
+    sessions.reserve(sessionTable.count);
+    for(auto const & session : sessionTable.records) 
+    {
+        if(!session.name.empty()) sessions.push_back(make_pair(sessionMemory(session.name), session.name));
+    }
+    shown = min(count, sessions.size());
+    partial_sort(sessions.begin(), sessions.begin() + shown, sessions.end(), greater<pair<size_t, string>>());
+    for(size_t i = 0; i < shown; i++)
+    {
+        output += "session " + sessions[i].second + " bytes=" + to_string(sessions[i].first) + 
+                  " members=" + to_string(findSession(&sessionTable, sessions[i].second)->members.count) + "\n";
+    }
+}
+
+
+// Creates the admin console's listening socket at path, replacing any left
+// behind by an earlier run or by the server handing over to us
+// Returns -1 if it can't be created
+int createAdminSocket(const string &path)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if(path.length() >= sizeof(address.sun_path))
+    {
+        fprintf(stderr, "server: admin socket path is too long\n");
+        return -1;
+    }
+    strcpy(address.sun_path, path.c_str());
+    
+    int sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(sockfd == -1)
+    {
+        perror("admin: socket");
+        return -1;
+    }
+    
+    // Only the user running the server may connect
+    unlink(path.c_str());
+    mode_t mask = umask(077);
+    int bound = bind(sockfd, (struct sockaddr *) &address, sizeof(address));
+    umask(mask);
+    if(bound == -1 || listen(sockfd, BACKLOG) == -1)
+    {
+        perror("admin: bind");
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+
+// Describes a client connection on one line: who it is, how much it has sent
+// that hasn't been handled yet, in the ring and still in the kernel or shared
+// memory, how much is still to be taken from there by it, how much is queued
+// for it that hasn't been sent yet, and the bytes that have gone each way
+// over TCP
+string connectionLine(int sockfd)
+{
+    auto client = clientList.find(sockfd);
+    if(client == clientList.end()) return "";
+    
+    auto sessions = clientSessions.find(sockfd);
+    auto ring = receiveRings.find(sockfd);
+    auto queue = outboundQueues.find(sockfd);
+    int unread = 0, unsent = 0;
+    ioctl(sockfd, SIOCINQ, &unread);
+    ioctl(sockfd, SIOCOUTQ, &unsent);
+    struct sharedTransport *shared = sharedTransportOf(sockfd);
+    if(shared != NULL)
+    {
+        unread = sharedRingUsed(&shared->channel->toServer);
+        unsent = sharedRingUsed(&shared->channel->toClient);
+    }
+    struct tcp_info info;
+    socklen_t infoLength = sizeof(info);
+    memset(&info, 0, sizeof(info));
+    getsockopt(sockfd, IPPROTO_TCP, TCP_INFO, &info, &infoLength);
+    
+    return to_string(sockfd) + " " + userNames[client->second] + 
+           " sessions=" + to_string(sessions == clientSessions.end() ? 0 : sessions->second.size()) +
+           " ring=" + to_string(ring == receiveRings.end() ? 0 : ring->second.tail - ring->second.head) +
+           " inq=" + to_string(unread) + " outq=" + to_string(unsent) +
+           " queued=" + to_string(queue == outboundQueues.end() ? 0 : queue->second.bytes) +
+           " in=" + to_string(info.tcpi_bytes_received) + " out=" + to_string(info.tcpi_bytes_acked) + "\n";
+}
+
+
+// Closes a session, telling its members first
+void closeSessionByAdmin(const string &sessionID)
+{
+    struct message closed;
+    closed.type = SESS_CLOSED;
+    closed.source = "SERVER";
+    closed.data = sessionID;
+    closed.size = closed.data.length() + 1;
+    
+    vector<int> members;
+    for(auto const & clientSockfd : membersOf(findSession(&sessionTable, sessionID)->members)) members.push_back(clientSockfd);
+    if(members.empty()) closeSession(sessionID);
+    for(auto const & clientSockfd : members)
+    {
+        sendToClient(&closed, clientSockfd);
+        removeFromSession(clientSockfd, sessionID);
+    }
+    cout << "Session '" << sessionID << "' closed by admin" << endl;
+}
+
+
+// Adds a client to an announcement's recipients, unless its user already is one
+void addBroadcastRecipient(struct broadcastJob &job, int sockfd)
+{
+    auto client = clientList.find(sockfd);
+    if(client == clientList.end() || !job.reached.insert(client->second).second) return;
+    job.recipients.push_back(make_pair(sockfd, client->second));
+}
+
+
+// Starts an announcement to targets, which are "*" for every user logged in or
+// a comma separated list of sessions and fnmatch(3) patterns for their names.
+// Named sessions and everyone are found straight away, and sessions matching
+// patterns as it goes out
+// Returns the error to give the admin, or an empty string
+string startBroadcast(const string &targets, const string &text)
+{
+    struct broadcastJob job;
+    job.packet = encodePacket<BROADCAST>("SERVER", text);
+    job.packet.push_back('\0');
+    if(job.packet.length() > MAXDATASIZE) return "announcement is too long";
+    
+    stringstream ss(targets);
+    string target;
+    vector<struct sessionRecord *> sessions;
+    bool everyone = false;
+    while(getline(ss, target, ','))
+    {
+        if(target.empty()) continue;
+        if(target == "*") everyone = true;
+        else if(target.find_first_of("*?[\\") != string::npos) job.patterns.push_back(target);
+        else if(findSession(&sessionTable, target) != NULL) sessions.push_back(findSession(&sessionTable, target));
+        else return "no session '" + target + "'";
+    }
+    if(!everyone && sessions.empty() && job.patterns.empty()) return "no targets";
+    
+    if(everyone)
+    {
+        for(auto const & client : clientList) addBroadcastRecipient(job, client.first);
+        job.patterns.clear();
+    }
+    for(auto const & session : sessions)
+    {
+        for(auto const & clientSockfd : membersOf(session->members)) addBroadcastRecipient(job, clientSockfd);
+    }
+    
+    // Sessions are matched in name order, from the first one that could match
+    // to the last
+    for(size_t i = 0; i < job.patterns.size(); i++)
+    {
+        string literal = job.patterns[i].substr(0, job.patterns[i].find_first_of("*?[\\"));
+        if(i == 0) job.prefix = literal;
+        size_t shared = 0;
+        while(shared < job.prefix.length() && shared < literal.length() && 
+              job.prefix[shared] == literal[shared]) shared++;
+        job.prefix.resize(shared);
+    }
+    
+    job.startedAt = monotonicNanoseconds();
+    broadcastJobs.push_back(move(job));
+    return "";
+}
+
+
+// Matches up to limit more sessions against an announcement's patterns, adding
+// their members to its recipients. It's done once the sessions with its prefix
+// run out. Users found earlier may have logged out and others joined sessions
+// since, so it can't tell sooner that everyone has been found
+// Returns what's left of limit
+size_t matchBroadcastPatterns(struct broadcastJob &job, size_t limit)
+{
+    auto session = job.cursor.empty() ? availableSessions.lower_bound(job.prefix) : 
+                                        availableSessions.upper_bound(job.cursor);
+    for(; session != availableSessions.end() && limit > 0; ++session, limit--)
+    {
+        if(session->compare(0, job.prefix.length(), job.prefix) != 0) break;
+        
+        job.cursor = *session;
+        for(auto const & pattern : job.patterns)
+        {
+            if(fnmatch(pattern.c_str(), session->c_str(), 0) != 0) continue;
+            struct sessionRecord *record = findSession(&sessionTable, *session);
+            if(record == NULL) break;
+            for(auto const & clientSockfd : membersOf(record->members)) addBroadcastRecipient(job, clientSockfd);
+            break;
+        }
+    }
+    if(limit > 0) job.patterns.clear();
+    return limit;
+}
+
+
+// Moves announcements on by a pass, oldest first: sends to the next
+// BROADCAST_WAVE recipients between them, and matches the next BROADCAST_SCAN
+// sessions against their patterns. Recipients who logged out since being found
+// are skipped
+void sendBroadcastWaves()
+{
+    size_t wave = BROADCAST_WAVE, scan = BROADCAST_SCAN;
+    while(!broadcastJobs.empty() && wave > 0)
+    {
+        struct broadcastJob &job = broadcastJobs.front();
+        if(!job.patterns.empty()) scan = matchBroadcastPatterns(job, scan);
+        
+        for(; job.next < job.recipients.size() && wave > 0; job.next++, wave--)
+        {
+            int sockfd = job.recipients[job.next].first;
+            auto client = clientList.find(sockfd);
+            if(client == clientList.end() || client->second != job.recipients[job.next].second) continue;
+            if(sendPacketsToClient(job.packet.c_str(), job.packet.length(), sockfd, LANE_DIRECT)) job.delivered++;
+        }
+        if(job.next < job.recipients.size() || !job.patterns.empty()) return;
+        
+        printf("server: announcement sent to %zu users in %.1f ms\n", job.delivered, 
+               (monotonicNanoseconds() - job.startedAt) / 1e6);
+        broadcastJobs.pop_front();
+    }
+}
+
+
+// Adds the sessions with the most load to a response, busiest first
+void listHotSessions(string &output, size_t count)
+{
+    uint64_t now = monotonicNanoseconds();
+    vector<pair<double, uint32_t>> sessions;
+    sessions.reserve(sessionLoads.size());
+    for(auto & session : sessionLoads) 
+    {
+        sessions.push_back(make_pair(updateSessionLoad(session.first, session.second, now), session.first));
+    }
+    
+    count = min(count, sessions.size());
+    partial_sort(sessions.begin(), sessions.begin() + count, sessions.end(), 
+                 greater<pair<double, uint32_t>>());
+    for(size_t i = 0; i < count; i++)
+    {
+        const struct sessionLoad &load = sessionLoads[sessions[i].second];
+        const struct sessionRecord &session = sessionTable.records[sessions[i].second];
+        output += session.name + " messages=" + to_string(load.messages) + " members=" + 
+                  to_string(session.members.count) + 
+                  " rate=" + to_string(lround(load.rate)) + " load=" + to_string(lround(sessions[i].first)) + 
+                  (load.hot ? " hot" : "") + "\n";
+    }
+}
+
+
+// Runs one command from an admin connection. Listings of every session or
+// connection are only started here, and carried on by continueAdminStream()
+// as the connection reads them
+void runAdminCommand(struct adminConnection &admin, const string &line, fd_set *readable, fd_set *master)
+{
+    stringstream ss(line);
+    string command, argument;
+    ss >> command >> argument;
+    
+    if(command == "sessions")
+    {
+        admin.streaming = ADMIN_STREAM_SESSIONS;
+        admin.cursor.clear();
+        return;
+    }
+    if(command == "connections")
+    {
+        // Only the fds are copied, the lines are made as they're sent
+        admin.streaming = ADMIN_STREAM_CONNECTIONS;
+        admin.fds.clear();
+        for(auto const & client : clientList) admin.fds.push_back(client.first);
+        sort(admin.fds.begin(), admin.fds.end());
+        admin.next = 0;
+        return;
+    }
+    
+    if(command == "connection" || command == "kick")
+    {
+        int sockfd = userIDToSockfd(argument);
+        if(sockfd == -1) admin.output += "error: user '" + argument + "' is not logged in\n";
+        else if(command == "connection") admin.output += connectionLine(sockfd);
+        else
+        {
+            printf("server: admin kicked %s on socket %d\n", argument.c_str(), sockfd);
+            disconnectClient(sockfd, master);
+            FD_CLR(sockfd, readable);
+            admin.output += "kicked " + argument + "\n";
+        }
+    }
+    else if(command == "close")
+    {
+        if(findSession(&sessionTable, argument) == NULL)
+        {
+            admin.output += "error: no session '" + argument + "'\n";
+        }
+        else
+        {
+            closeSessionByAdmin(argument);
+            admin.output += "closed " + argument + "\n";
+        }
+    }
+    else if(command == "hot")
+    {
+        int count = argument.empty() ? ADMIN_HOT_SESSIONS : atoi(argument.c_str());
+        listHotSessions(admin.output, count > 0 ? count : ADMIN_HOT_SESSIONS);
+    }
+    else if(command == "broadcast")
+    {
+        string text;
+        getline(ss >> ws, text);
+        string error = text.empty() ? "usage: broadcast <targets> <message>" : startBroadcast(argument, text);
+        if(error.empty()) admin.output += "broadcasting to " + argument + "\n";
+        else admin.output += "error: " + error + "\n";
+    }
+    else if(command == "memory")
+    {
+        int count = argument.empty() ? MEMORY_REPORT_TOP : atoi(argument.c_str());
+        reportMemory(admin.output, count > 0 ? count : MEMORY_REPORT_TOP);
+    }
+    else if(command == "help")
+    {
+        admin.output += "sessions                 every session and its member count\n"
+                        "connections              every connection, as for connection\n"
+                        "connection <user>        queue depths and bytes sent each way\n"
+                        "kick <user>              disconnect a user\n"
+                        "close <session>          remove everyone from a session and close it\n"
+                        "hot [count]              sessions with the most messages\n"
+                        "memory [count]           where memory goes, and the biggest users of it\n"
+                        "broadcast <targets> <message>\n"
+                        "                         announce to * (everyone) or sessions and name patterns\n";
+    }
+    else if(!command.empty()) admin.output += "error: unknown command '" + command + "', try help\n";
+    
+    admin.output += ADMIN_END;
+}
 
-    string sessionID, sessionPassword;  
-    stringstream ss(sessionData);
-    ss >> sessionID >> sessionPassword;
+
+// Adds the next lines of a listing to an admin connection's response, until
+// there are ADMIN_OUTPUT_SIZE bytes waiting. Sessions are listed in name order
+// from the last one sent, and connections from the fds copied when the listing
+// started, so either can change in between without upsetting the listing
+void continueAdminStream(struct adminConnection &admin)
+{
+    if(admin.streaming == ADMIN_STREAM_SESSIONS)
+    {
+        auto session = admin.cursor.empty() ? availableSessions.begin() : 
+                                              availableSessions.upper_bound(admin.cursor);
+        for(; session != availableSessions.end() && admin.output.length() < ADMIN_OUTPUT_SIZE; ++session)
+        {
+            struct sessionRecord *record = findSession(&sessionTable, *session);
+            admin.output += *session + " " + to_string(record == NULL ? 0 : record->members.count) + "\n";
+            admin.cursor = *session;
+        }
+        if(session != availableSessions.end()) return;
+    }
+    else if(admin.streaming == ADMIN_STREAM_CONNECTIONS)
+    {
+        while(admin.next < admin.fds.size() && admin.output.length() < ADMIN_OUTPUT_SIZE)
+        {
+            admin.output += connectionLine(admin.fds[admin.next++]);
+        }
+        if(admin.next < admin.fds.size()) return;
+        admin.fds.clear();
+    }
+    else return;
+    
+    admin.streaming = ADMIN_STREAM_NONE;
+    admin.output += ADMIN_END;
+}
+
+
+// Writes as much of an admin connection's response as it will take
+// Returns false if the connection has gone
+bool flushAdminOutput(int adminfd, struct adminConnection &admin)
+{
+    while(!admin.output.empty())
+    {
+        ssize_t numBytes = send(adminfd, admin.output.data(), admin.output.length(), MSG_NOSIGNAL);
+        if(numBytes == -1) return errno == EAGAIN || errno == EWOULDBLOCK;
+        admin.output.erase(0, numBytes);
+    }
+    return true;
+}
+
+
+// Adds the admin listener and connections to the sets select() waits on.
+// Connections are watched for reading when they aren't in the middle of a
+// response, and for writing while there's more of one to go out
+void watchAdminConnections(fd_set *readable, fd_set *writable, int *maxfd)
+{
+    if(adminListener == -1) return;
     
-    // Find list of clients connected to the given session name
-    auto session = sessionList.find(sessionID);
+    FD_SET(adminListener, readable);
+    *maxfd = max(*maxfd, adminListener);
+    for(auto const & admin : adminConnections)
+    {
+        if(!admin.second.output.empty() || admin.second.streaming != ADMIN_STREAM_NONE)
+        {
+            FD_SET(admin.first, writable);
+        }
+        else FD_SET(admin.first, readable);
+        *maxfd = max(*maxfd, admin.first);
+    }
+}
+
+
+// Accepts admin connections, runs the commands they've sent and carries on
+// with their responses, a bounded amount for each per pass of the main loop.
+// Takes them out of readable afterwards so they aren't seen as clients
+void serviceAdminConnections(fd_set *readable, fd_set *writable, fd_set *master)
+{
+    if(adminListener == -1) return;
     
-    // Find session the client is connected to (if any)
-    string currentSessionID = clientSockfdToSessionID(sockfd);
+    if(FD_ISSET(adminListener, readable))
+    {
+        FD_CLR(adminListener, readable);
+        int adminfd = accept4(adminListener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(adminfd != -1) adminConnections[adminfd];
+        else if(errno != EAGAIN) perror("admin: accept");
+    }
     
-    // Checking that session exists and client is not already in a session
-    if (sessionID != ACK_DATA &&
-        currentSessionID == SESSION_NOT_FOUND &&
-        session != sessionList.end() && 
-        checkSessionPassword(sessionID, sessionPassword))
-    {        
+    vector<int> closed;
+    for(auto & entry : adminConnections)
+    {
+        int adminfd = entry.first;
+        struct adminConnection &admin = entry.second;
+        bool wasReadable = FD_ISSET(adminfd, readable);
+        FD_CLR(adminfd, readable);
+        if(FD_ISSET(adminfd, writable) && !flushAdminOutput(adminfd, admin))
+        {
+            closed.push_back(adminfd);
+            continue;
+        }
         
-        // Add client to the session
-        session->second.insert(sockfd);
+        if(wasReadable)
+        {
+            char buffer[ADMIN_MAX_COMMAND];
+            ssize_t numBytes = recv(adminfd, buffer, sizeof(buffer), 0);
+            if(numBytes == 0 || (numBytes == -1 && errno != EAGAIN))
+            {
+                closed.push_back(adminfd);
+                continue;
+            }
+            if(numBytes > 0) admin.input.append(buffer, numBytes);
+        }
+        
+        // Commands run one at a time, each once the one before has been listed
+        size_t end;
+        continueAdminStream(admin);
+        while(admin.streaming == ADMIN_STREAM_NONE && admin.output.length() < ADMIN_OUTPUT_SIZE &&
+              (end = admin.input.find('\n')) != string::npos)
+        {
+            string line = admin.input.substr(0, end);
+            admin.input.erase(0, end + 1);
+            runAdminCommand(admin, line, readable, master);
+            continueAdminStream(admin);
+        }
+        
+        bool tooLong = admin.input.length() > ADMIN_MAX_COMMAND && admin.input.find('\n') == string::npos;
+        if(tooLong || !flushAdminOutput(adminfd, admin))
+        {
+            closed.push_back(adminfd);
+        }
+    }
+    
+    for(auto const & adminfd : closed)
+    {
+        close(adminfd);
+        adminConnections.erase(adminfd);
+    }
+}
 
-        // Send response with the data as the sessionID
-        ack.type = JN_ACK;
-        ack.data = sessionID;
-        ack.size = ack.data.length() + 1;
 
-        sendToClient(&ack, sockfd);
-        return true;
+// Finds up to maxEnds packet ends in a client's receive ring, storing their
+// positions in ends, and returns how many it found
+// Bytes already searched aren't searched again, except for the last end found
+// when maxEnds is reached, which is found again the next time if it's left
+size_t scanRing(struct receiveRing &ring, size_t *ends, size_t maxEnds)
+{
+    size_t from = max(ring.scanned, ring.head), found = 0;
+    
+    while(found < maxEnds && from < ring.tail)
+    {
+        size_t index = from & (RECEIVE_RING_SIZE - 1);
+        size_t length = min(ring.tail - from, RECEIVE_RING_SIZE - index);
+        size_t count = findFrameEnds(ring.data + index, length, ends + found, maxEnds - found);
         
+        for(size_t f = found; f < found + count; f++) ends[f] += from;
+        found += count;
+        from += length;
+    }
+    ring.scanned = found == maxEnds ? ends[found - 1] : ring.tail;
+    return found;
+}
+
+
+// Reads as much as the client has sent and the ring has room for in one call,
+// from its socket or from its shared memory if it uses that
+// Returns the number of bytes read, 0 if the client hung up or -1 on error
+ssize_t receiveIntoRing(int sockfd)
+{
+    struct receiveRing &ring = receiveRings[sockfd];
+    if(ring.data == NULL)
+    {
+        if((ring.data = (char *) malloc(RECEIVE_RING_SIZE)) == NULL)
+        {
+            perror("malloc");
+            return -1;
+        }
+        ringBytes += RECEIVE_RING_SIZE;
     }
     
-    // Session does not exist or client is already in a session
-    else 
+    // The free space may wrap around the end of the buffer
+    size_t space = RECEIVE_RING_SIZE - (ring.tail - ring.head);
+    size_t index = ring.tail & (RECEIVE_RING_SIZE - 1);
+    size_t first = min(space, RECEIVE_RING_SIZE - index);
+    struct iovec iov[2] = {
+        {ring.data + index, first},
+        {ring.data, space - first}
+    };
+    
+    struct sharedTransport *shared = sharedTransportOf(sockfd);
+    ssize_t nbytes = shared == NULL ? readv(sockfd, iov, space > first ? 2 : 1) : 
+                                      readSharedData(*shared, iov, space > first ? 2 : 1);
+    if(nbytes > 0) ring.tail += nbytes;
+    if(nbytes > 0 && ring.traced) ring.receivedAt = monotonicNanoseconds();
+    return nbytes;
+}
+
+
+// Returns the packet in a client's ring that ends at position end. A packet
+// that wraps around the end of the buffer is copied out so it's contiguous
+const char *ringFrame(struct receiveRing &ring, size_t end)
+{
+    static char wrapped[MAXDATASIZE];
+    size_t index = ring.head & (RECEIVE_RING_SIZE - 1);
+    size_t length = end - ring.head + 1;
+    if(index + length <= RECEIVE_RING_SIZE) return ring.data + index;
+    
+    size_t first = RECEIVE_RING_SIZE - index;
+    memcpy(wrapped, ring.data + index, first);
+    memcpy(wrapped + first, ring.data, length - first);
+    return wrapped;
+}
+
+
+// Copies the unhandled bytes out of a client's ring, or into it
+string ringContents(int sockfd)
+{
+    string contents;
+    auto found = receiveRings.find(sockfd);
+    if(found == receiveRings.end()) return contents;
+    
+    struct receiveRing &ring = found->second;
+    for(size_t pos = ring.head; pos < ring.tail; )
     {
-        ack.type = JN_NAK;
+        size_t index = pos & (RECEIVE_RING_SIZE - 1);
+        size_t length = min(ring.tail - pos, RECEIVE_RING_SIZE - index);
+        contents.append(ring.data + index, length);
+        pos += length;
+    }
+    return contents;
+}
+
+bool fillRing(int sockfd, const string &contents)
+{
+    if(contents.length() > RECEIVE_RING_SIZE) return false;
+    
+    struct receiveRing &ring = receiveRings[sockfd];
+    if((ring.data = (char *) malloc(RECEIVE_RING_SIZE)) == NULL) return false;
+    ringBytes += RECEIVE_RING_SIZE;
+    memcpy(ring.data, contents.data(), contents.length());
+    ring.tail = contents.length();
+    return true;
+}
+
+
+// Handles up to FRAMES_PER_PASS whole packets waiting in a client's receive
+// ring and remembers the client if there are more left for the next pass
+// Returns false if the client sent something that can't be a packet
+bool handleReceivedPackets(int sockfd)
+{
+    auto found = receiveRings.find(sockfd);
+    if(found == receiveRings.end()) return true;
+    struct receiveRing &ring = found->second;
+    size_t ends[FRAMES_PER_PASS], count;
+    
+    for(int handled = 0; handled < FRAMES_PER_PASS; )
+    {
+        if((count = scanRing(ring, ends, FRAMES_PER_PASS - handled)) == 0) break;
         
-        if (sessionID == ACK_DATA) ack.data = "No session ID was provided!";
-        else if(currentSessionID != SESSION_NOT_FOUND) ack.data = "Already in a session!";
-        else if (session == sessionList.end()) ack.data = "Session not found!";
-        else if (checkSessionPassword(sessionID, sessionPassword) == false) ack.data = "Password is incorrect!";
+        bool rescan = false;
+        for(size_t f = 0; f < count && !rescan; f++, handled++)
+        {
+            // Packets are never bigger than MAXDATASIZE
+            if(ends[f] - ring.head >= MAXDATASIZE) return false;
+            const char *frame = ringFrame(ring, ends[f]);
+            captureTraffic(sockfd, CAPTURE_PACKET, frame, ends[f] - ring.head + 1);
+            handlePacket(sockfd, messageFromPacket(frame));
+            ring.head = ends[f] + 1;
+            
+            // The bytes after a file request belong to the file, not to
+            // packets, so any packet ends found among them don't count
+            while(fileRelays.find(sockfd) != fileRelays.end() && ring.head < ring.tail)
+            {
+                size_t index = ring.head & (RECEIVE_RING_SIZE - 1);
+                size_t length = min(ring.tail - ring.head, RECEIVE_RING_SIZE - index);
+                ring.head += spoolFileData(sockfd, ring.data + index, length);
+                ring.scanned = ring.head;
+                rescan = true;
+            }
+            if(fileRelays.find(sockfd) != fileRelays.end()) 
+            {
+                backloggedClients.erase(sockfd);
+                return true;
+            }
+        }
+    }
+    
+    count = scanRing(ring, ends, 1);
+    if(count != 0) backloggedClients.insert(sockfd);
+    else backloggedClients.erase(sockfd);
+    
+    // Anything this long without a packet end is garbage
+    return count != 0 || ring.tail - ring.head < MAXDATASIZE;
+}
 
 
-        ack.size = ack.data.length() + 1;
+// Signal handler asking the main loop to hand over to a new server
+void requestUpgrade(int)
+{
+    upgradeRequested = 1;
+}
+
+
+// Appends a number or length-prefixed string to a hand off blob
+void appendNumber(string &blob, uint32_t number)
+{
+    blob.append((const char *) &number, sizeof(number));
+}
+
+void appendString(string &blob, const string &str)
+{
+    appendNumber(blob, str.length());
+    blob += str;
+}
+
+
+// Reads a number or string appended to a hand off blob, moving pos past it
+// Returns false if the blob ends first
+bool readNumber(const string &blob, size_t &pos, uint32_t &number)
+{
+    if(pos + sizeof(number) > blob.length()) return false;
+    memcpy(&number, blob.data() + pos, sizeof(number));
+    pos += sizeof(number);
+    return true;
+}
+
+bool readString(const string &blob, size_t &pos, string &str)
+{
+    uint32_t length;
+    if(!readNumber(blob, pos, length) || pos + length > blob.length()) return false;
+    str = blob.substr(pos, length);
+    pos += length;
+    return true;
+}
+
+
+// Sends file descriptors over a Unix socket, HANDOFF_FDS_PER_MESSAGE at a time
+// Returns true if all of them were sent
+bool sendHandoffFds(int channel, const vector<int> &fds)
+{
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_FDS_PER_MESSAGE)];
+    
+    for(size_t first = 0; first < fds.size(); first += HANDOFF_FDS_PER_MESSAGE)
+    {
+        uint32_t count = fds.size() - first;
+        if(count > HANDOFF_FDS_PER_MESSAGE) count = HANDOFF_FDS_PER_MESSAGE;
+        
+        struct iovec iov = {&count, sizeof(count)};
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+        
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+        memcpy(CMSG_DATA(cmsg), &fds[first], sizeof(int) * count);
+        
+        if(sendmsg(channel, &msg, 0) == -1)
+        {
+            perror("handoff: sendmsg");
+            return false;
+        }
+    }
+    return true;
+}
+
+
+// Receives count file descriptors sent with sendHandoffFds()
+// Returns true if all of them arrived
+bool receiveHandoffFds(int channel, vector<int> &fds, size_t count)
+{
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_FDS_PER_MESSAGE)];
+    
+    while(fds.size() < count)
+    {
+        uint32_t batch;
+        struct iovec iov = {&batch, sizeof(batch)};
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        
+        // Keep them closed on exec so only the next hand off passes them on
+        if(recvmsg(channel, &msg, MSG_CMSG_CLOEXEC) <= 0)
+        {
+            perror("handoff: recvmsg");
+            return false;
+        }
+        
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if(cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS ||
+           cmsg->cmsg_len != CMSG_LEN(sizeof(int) * batch)) return false;
+        
+        int *received = (int *) CMSG_DATA(cmsg);
+        fds.insert(fds.end(), received, received + batch);
+    }
+    return true;
+}
+
+
+// Returns true if a client has hung up, without taking anything it sent
+bool clientHungUp(int sockfd)
+{
+    char byte;
+    ssize_t numBytes = recv(sockfd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return numBytes == 0 || (numBytes == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+}
+
+
+// Carries on with the tasks waiting for room to send to their clients before a
+// hand off, for up to HANDOFF_DRAIN_TIMEOUT. The worker has stopped by then, so
+// any work they still have is done here. Clients that hang up meanwhile, or
+// whose tasks still haven't finished by then, are disconnected, and what wasn't
+// sent them stays in their mailbox
+void finishTaskWriters(fd_set *master)
+{
+    uint64_t deadline = monotonicNanoseconds() + (uint64_t) HANDOFF_DRAIN_TIMEOUT * 1000000000;
+    while(!writeWaiters.empty() && monotonicNanoseconds() < deadline)
+    {
+        vector<int> gone;
+        for(auto const & waiter : writeWaiters)
+        {
+            if(clientHungUp(waiter.first)) gone.push_back(waiter.first);
+        }
+        for(auto const & sockfd : gone) disconnectClient(sockfd, master);
+        
+        fd_set writable;
+        FD_ZERO(&writable);
+        int maxfd = -1;
+        watchTaskWriters(&writable, &maxfd);
+        
+        struct timeval timeout = {0, HANDOFF_DRAIN_POLL * 1000};
+        if(select(maxfd + 1, NULL, &writable, NULL, &timeout) == -1) FD_ZERO(&writable);
+        resumeTaskWriters(&writable);
+    }
+    
+    vector<int> behind;
+    for(auto const & waiter : writeWaiters) behind.push_back(waiter.first);
+    for(auto const & sockfd : behind)
+    {
+        printf("server: %s didn't take its direct messages in time, disconnecting\n", clientName(sockfd).c_str());
+        disconnectClient(sockfd, master);
+    }
+}
+
+
+// Starts the binary at serverPath and hands it the listener, every client
+// connection, the client and session lists, the sessions' multicast groups,
+// what's queued for each client, the announcements still going out and the
+// connections still sending their LOGIN, so clients never see the server
+// restart. The successor gets one end of a socket
+// pair with -T
+// Returns true once the successor has taken over, false if this server should
+// keep running
+bool handOffToSuccessor(int listener)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    
+    // Clients are identified by their position in the list of fds sent. The
+    // local listener, the shared memory and wakeups of clients using it, and
+    // the connections still logging in come after them
+    vector<int> fds = {listener};
+    unordered_map<int, uint32_t> fdIndex;
+    string blob;
+    
+    // Connections logging in go in the order of their deadlines
+    vector<int> logins;
+    for(auto const & deadline : loginDeadlines)
+    {
+        auto pending = pendingLogins.find(deadline.second);
+        if(pending != pendingLogins.end() && pending->second.acceptedAt == deadline.first) logins.push_back(deadline.second);
+    }
+    
+    appendNumber(blob, clientList.size());
+    appendNumber(blob, (localListener != -1) + 3 * sharedTransports.size() + logins.size());
+    for(auto const & client : clientList)
+    {
+        fdIndex[client.first] = fds.size();
+        fds.push_back(client.first);
+        appendString(blob, userNames[client.second]);
+        appendString(blob, ringContents(client.first));
+    }
+    
+    appendNumber(blob, sessionTable.count);
+    for(auto const & session : sessionTable.records)
+    {
+        if(session.name.empty()) continue;
+        appendString(blob, session.name);
+        appendString(blob, session.password);
+        appendNumber(blob, session.members.count);
+        for(auto const & clientSockfd : membersOf(session.members)) appendNumber(blob, fdIndex[clientSockfd]);
+    }
+    
+    // Spilled messages stay where they are, only their size is passed on
+    appendString(blob, mailboxDirectory);
+    appendNumber(blob, offlineMailboxes.size());
+    for(auto const & mailbox : offlineMailboxes)
+    {
+        appendString(blob, mailbox.first);
+        appendNumber(blob, mailbox.second.spilledBytes);
+        appendNumber(blob, mailbox.second.packets.size());
+        for(auto const & packet : mailbox.second.packets) appendString(blob, packet);
+    }
+    
+    appendNumber(blob, localListener != -1);
+    if(localListener != -1) fds.push_back(localListener);
+    appendNumber(blob, sharedTransports.size());
+    for(auto const & shared : sharedTransports)
+    {
+        appendNumber(blob, fdIndex[shared.first]);
+        fds.insert(fds.end(), {shared.second.memfd, shared.second.serverWakeup, shared.second.clientWakeup});
+    }
+    
+    // Groups go on with the same numbering, so members see no gap
+    appendNumber(blob, nextMulticastGroup);
+    appendNumber(blob, multicastGroups.size());
+    for(auto const & group : multicastGroups)
+    {
+        appendString(blob, group.first);
+        appendNumber(blob, group.second.address.sin_addr.s_addr);
+        appendNumber(blob, group.second.address.sin_port);
+        appendNumber(blob, group.second.interface.s_addr);
+        appendNumber(blob, group.second.nextSequence);
+        for(auto const & members : {&group.second.listeners, &group.second.receivers})
+        {
+            appendNumber(blob, members->size());
+            for(auto const & clientSockfd : *members) appendNumber(blob, fdIndex[clientSockfd]);
+        }
+        appendNumber(blob, group.second.history.size());
+        for(auto const & packet : group.second.history) appendString(blob, packet);
+    }
+    
+    // What clients haven't taken yet is sent on by the successor, from where
+    // we stopped in the middle of a packet if we did. No files are queued by now
+    appendNumber(blob, outboundQueues.size());
+    for(auto const & queue : outboundQueues)
+    {
+        appendNumber(blob, fdIndex[queue.first]);
+        appendNumber(blob, queue.second.partialLane + 1);
+        appendNumber(blob, queue.second.sent);
+        for(auto const & packets : queue.second.lanes)
+        {
+            appendNumber(blob, packets.size());
+            for(auto const & packet : packets) appendString(blob, packet.data);
+        }
+    }
+    
+    // Announcements go on from where they are. Users are passed by name, as
+    // the successor numbers them afresh, and only recipients still logged in
+    // are passed
+    appendNumber(blob, broadcastJobs.size());
+    for(auto const & job : broadcastJobs)
+    {
+        appendString(blob, job.packet);
+        appendNumber(blob, job.patterns.size());
+        for(auto const & pattern : job.patterns) appendString(blob, pattern);
+        appendString(blob, job.prefix);
+        appendString(blob, job.cursor);
+        appendNumber(blob, job.reached.size());
+        for(auto const & user : job.reached) appendString(blob, userNames[user]);
+        
+        vector<uint32_t> recipients;
+        for(size_t i = job.next; i < job.recipients.size(); i++)
+        {
+            auto client = clientList.find(job.recipients[i].first);
+            if(client != clientList.end() && client->second == job.recipients[i].second)
+            {
+                recipients.push_back(fdIndex[client->first]);
+            }
+        }
+        appendNumber(blob, recipients.size());
+        for(auto const & recipient : recipients) appendNumber(blob, recipient);
+        appendNumber(blob, job.delivered);
+        appendNumber(blob, (monotonicNanoseconds() - job.startedAt) / 1000);
+    }
+    
+    // Connections logging in keep what they've sent of their LOGIN, and the
+    // time they have left to send the rest
+    appendNumber(blob, logins.size());
+    for(auto const & sockfd : logins)
+    {
+        struct pendingLogin &pending = pendingLogins[sockfd];
+        appendString(blob, pending.received);
+        appendNumber(blob, (monotonicNanoseconds() - pending.acceptedAt) / 1000);
+        fds.push_back(sockfd);
+    }
+    
+    int channel[2];
+    if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, channel) == -1)
+    {
+        perror("handoff: socketpair");
+        return false;
+    }
+    fcntl(channel[1], F_SETFD, 0); // The successor's end has to survive exec
+    
+    pid_t pid = fork();
+    if(pid == -1)
+    {
+        perror("handoff: fork");
+        close(channel[0]);
+        close(channel[1]);
+        return false;
+    }
+    if(pid == 0)
+    {
+        string channelArg = to_string(channel[1]);
+        vector<char *> args = {(char *) serverPath.c_str(), (char *) "-T", (char *) channelArg.c_str()};
+        for(auto & arg : serverArgs) args.push_back((char *) arg.c_str());
+        args.push_back(NULL);
         
-        sendToClient(&ack, sockfd);
+        execv(serverPath.c_str(), args.data());
+        perror("handoff: execv");
+        _exit(1);
+    }
+    close(channel[1]);
+    
+    // A successor that hangs instead of taking over is given up on, as one
+    // that fails is, so we don't stop serving waiting for it
+    struct timeval timeout = {HANDOFF_TIMEOUT, 0};
+    setsockopt(channel[0], SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    setsockopt(channel[0], SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    
+    // Registry state goes first so the successor knows how many fds to expect
+    uint64_t blobLength = blob.length();
+    bool sent = send(channel[0], &blobLength, sizeof(blobLength), 0) != -1;
+    for(size_t pos = 0; sent && pos < blob.length(); pos += HANDOFF_PIECE_SIZE)
+    {
+        sent = send(channel[0], blob.data() + pos, 
+                    min((size_t) HANDOFF_PIECE_SIZE, blob.length() - pos), 0) != -1;
+    }
+    sent = sent && sendHandoffFds(channel[0], fds);
+    
+    // Wait for the successor to say it has taken over
+    char ready = 0;
+    if(!sent || recv(channel[0], &ready, 1, 0) != 1)
+    {
+        cout << "Upgrade failed, continuing to serve" << endl;
+        close(channel[0]);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
         return false;
     }
+    
+    printf("server: handed %zu connections to process %d in %.3f ms\n", 
+           clientList.size() + logins.size(), pid, millisecondsSince(start));
+    return true;
 }
 
 
-// Removes client from their current session.
-// If they're in a session, it sends back the session they were removed from
-// Otherwise, it sends back the reason they couldn't leave the specified session
-// Returns true if successful
-bool leaveSession (int sockfd)
+// Rebuilds the client and session lists handed over by a predecessor and adds
+// the listener and client connections it passed on to the master set
+// Returns the listener, or -1 if the hand off failed
+int takeOverFromPredecessor(int channel, fd_set *master, int *fdmax)
 {
-    struct message ack;
-    ack.source = "SERVER";
-\
-    string currentSessionID = clientSockfdToSessionID(sockfd);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    
+    uint64_t blobLength;
+    if(recv(channel, &blobLength, sizeof(blobLength), 0) != sizeof(blobLength)) return -1;
     
-    // Check if client is in a session
-    if (currentSessionID != SESSION_NOT_FOUND)
+    string blob;
+    vector<char> piece(HANDOFF_PIECE_SIZE);
+    while(blob.length() < blobLength)
     {
-        // Remove client from session
-        auto currentSession = sessionList.find(currentSessionID);
-        currentSession->second.erase(sockfd);
+        ssize_t received = recv(channel, piece.data(), piece.size(), 0);
+        if(received <= 0) return -1;
+        blob.append(piece.data(), received);
+    }
+    
+    size_t pos = 0;
+    uint32_t clientCount, extraCount, sessionCount;
+    if(!readNumber(blob, pos, clientCount) || !readNumber(blob, pos, extraCount)) return -1;
+    
+    vector<int> fds;
+    if(!receiveHandoffFds(channel, fds, clientCount + 1 + extraCount)) return -1;
+    
+    int listener = fds[0];
+    FD_SET(listener, master);
+    if(listener > *fdmax) *fdmax = listener;
+    
+    for(uint32_t i = 1; i <= clientCount; i++)
+    {
+        string userID, buffer;
+        if(!readString(blob, pos, userID) || !readString(blob, pos, buffer)) return -1;
         
-        // No more clients in the session
-        if(currentSession->second.empty()) 
-        {
-            sessionList.erase(currentSessionID);
-            sessionPasswordList.erase(currentSessionID);
-        }
+        clientList.insert(make_pair(fds[i], internUser(userID)));
+        addPresence(onlineClients, userID);
+        if(!buffer.empty() && !fillRing(fds[i], buffer)) return -1;
+        if(buffer.find('\0') != string::npos) backloggedClients.insert(fds[i]);
         
-        ack.type = LS_ACK;
-        ack.data = currentSessionID;
-        ack.size = ack.data.length() + 1;
-
-        sendToClient(&ack, sockfd);
-        return true;
+        FD_SET(fds[i], master);
+        if(fds[i] > *fdmax) *fdmax = fds[i];
     }
-    else
+    
+    if(!readNumber(blob, pos, sessionCount)) return -1;
+    for(uint32_t i = 0; i < sessionCount; i++)
     {
-        ack.type = LS_NAK;
-        ack.data = "Not in a session!";
-        ack.size = ack.data.length() + 1;
+        string sessionID, sessionPassword;
+        uint32_t memberCount, member;
+        if(!readString(blob, pos, sessionID) || !readString(blob, pos, sessionPassword) ||
+           !readNumber(blob, pos, memberCount)) return -1;
         
-        sendToClient(&ack, sockfd);
-        return false;
+        addSession(&sessionTable, sessionID, sessionPassword);
+        for(uint32_t j = 0; j < memberCount; j++)
+        {
+            if(!readNumber(blob, pos, member) || member == 0 || member > clientCount) return -1;
+            addToSession(fds[member], sessionID);
+        }
+        sessionBytes += sessionFootprint(sessionID, sessionPassword);
+        addPresence(availableSessions, sessionID);
     }
-}
-
-
-// Create a new session in the session list and add the requesting client to it
-// If the session doesn't exist, it creates it and adds the client to it, and
-// sends back the sessionID
-// Otherwise, it sends back the reason why it couldn't be created
-// Returns true if successful
-bool createSession(int sockfd, string sessionData)
-{   
-    struct message ack;
-    ack.source = "SERVER";
     
-    if(clientSockfdToSessionID(sockfd) != SESSION_NOT_FOUND)
+    uint32_t mailboxCount;
+    if(!readString(blob, pos, mailboxDirectory) || !readNumber(blob, pos, mailboxCount)) return -1;
+    for(uint32_t i = 0; i < mailboxCount; i++)
     {
-        ack.type = NS_NAK;
-        ack.data = "Already in a session!";
-        ack.size = ack.data.length() + 1;
+        string userID, packet;
+        uint32_t spilledBytes, packetCount;
+        if(!readString(blob, pos, userID) || !readNumber(blob, pos, spilledBytes) || 
+           !readNumber(blob, pos, packetCount)) return -1;
         
-        sendToClient(&ack, sockfd);
-        return false;
+        struct offlineMailbox &box = offlineMailboxes[userID];
+        box.spilledBytes = spilledBytes;
+        for(uint32_t j = 0; j < packetCount; j++)
+        {
+            if(!readString(blob, pos, packet)) return -1;
+            box.packets.push_back(packet);
+            box.bytes += packet.length();
+        }
+        offlineBytes += box.bytes;
     }
     
-    string sessionID, sessionPassword;
-    stringstream ss(sessionData);
-    
-    ss >> sessionID >> sessionPassword;
-    
-    // Insert returns a pair describing if the insertion was successful
-    auto res = sessionList.insert(make_pair(sessionID, unordered_set<int>({sockfd})));
-    if(res.second == false)
+    uint32_t localCount, sharedCount, member;
+    size_t extra = clientCount + 1;
+    if(!readNumber(blob, pos, localCount)) return -1;
+    if(localCount > 0)
     {
-        ack.type = NS_NAK;
-        ack.data = "Session already exists!";
-        ack.size = ack.data.length() + 1;
-        
-        sendToClient(&ack, sockfd);
-        return false;
+        localListener = fds[extra++];
+        FD_SET(localListener, master);
+        if(localListener > *fdmax) *fdmax = localListener;
     }
-    else if (sessionID == ACK_DATA)
+    if(!readNumber(blob, pos, sharedCount)) return -1;
+    for(uint32_t i = 0; i < sharedCount; i++)
     {
-        ack.type = NS_NAK;
-        ack.data = "No session ID was provided!";
-        ack.size = ack.data.length() + 1;
-        
-        sendToClient(&ack, sockfd);
-        return false;  
+        if(!readNumber(blob, pos, member) || member == 0 || member > clientCount || extra + 3 > fds.size()) return -1;
+        struct sharedTransport shared;
+        shared.memfd = fds[extra++];
+        shared.serverWakeup = fds[extra++];
+        shared.clientWakeup = fds[extra++];
+        if(!openSharedTransport(shared, false)) return -1;
+        sharedTransports[fds[member]] = shared;
     }
     
-    else
+    uint32_t groupCount;
+    if(!readNumber(blob, pos, nextMulticastGroup) || !readNumber(blob, pos, groupCount)) return -1;
+    for(uint32_t i = 0; i < groupCount; i++)
     {
-        // Recording password of the created session list
-        sessionPasswordList.insert(make_pair(sessionID, sessionPassword));
+        string sessionID, packet;
+        struct multicastGroup group;
+        uint32_t port, memberCount, historyCount;
+        memset(&group.address, 0, sizeof(group.address));
+        if(!readString(blob, pos, sessionID) || !readNumber(blob, pos, group.address.sin_addr.s_addr) ||
+           !readNumber(blob, pos, port) || !readNumber(blob, pos, group.interface.s_addr) || 
+           !readNumber(blob, pos, group.nextSequence)) return -1;
+        group.address.sin_family = AF_INET;
+        group.address.sin_port = port;
         
-        ack.type = NS_ACK;
-        ack.data = sessionID;
-        ack.size = ack.data.length() + 1;
+        for(auto members : {&group.listeners, &group.receivers})
+        {
+            if(!readNumber(blob, pos, memberCount)) return -1;
+            for(uint32_t j = 0; j < memberCount; j++)
+            {
+                if(!readNumber(blob, pos, member) || member == 0 || member > clientCount) return -1;
+                members->insert(fds[member]);
+            }
+        }
         
-        sendToClient(&ack, sockfd);
-        return true;
+        if(!readNumber(blob, pos, historyCount)) return -1;
+        for(uint32_t j = 0; j < historyCount; j++)
+        {
+            if(!readString(blob, pos, packet)) return -1;
+            group.history.push_back(packet);
+            group.historyBytes += stringMemory(packet);
+        }
+        multicastBytes += group.historyBytes;
+        sessionBytes += MULTICAST_GROUP_MEMORY;
+        multicastGroups[sessionID] = group;
     }
-}
-
-
-// Send an acknowledge to a client for requesting a list
-void acknowledgeList(int sockfd, string buffer)
-{
-    struct message listAck;
-    listAck.type = QU_ACK;
-    listAck.size = buffer.length() + 1;
-    listAck.source = "SERVER";
-    listAck.data = buffer;
-    
-    sendToClient(&listAck, sockfd);
-}
-
-
-void createList(int sockfd)
-{
-    string buffer = "\nClients Online: ";
     
-    for(auto it : clientList){
-        buffer += it.second.first + " ";
+    uint32_t queueCount;
+    if(!readNumber(blob, pos, queueCount)) return -1;
+    for(uint32_t i = 0; i < queueCount; i++)
+    {
+        uint32_t partialLane, sent, packetCount;
+        if(!readNumber(blob, pos, member) || member == 0 || member > clientCount ||
+           !readNumber(blob, pos, partialLane) || partialLane > LANE_COUNT || !readNumber(blob, pos, sent)) return -1;
+        
+        struct outboundQueue &waiting = outboundQueues[fds[member]];
+        waiting.partialLane = (int) partialLane - 1;
+        waiting.sent = sent;
+        for(auto & packets : waiting.lanes)
+        {
+            if(!readNumber(blob, pos, packetCount)) return -1;
+            for(uint32_t j = 0; j < packetCount; j++)
+            {
+                packets.push_back(queuedPacket());
+                if(!readString(blob, pos, packets.back().data)) return -1;
+                waiting.bytes += packets.back().data.length();
+            }
+        }
+        outboundBytes += waiting.bytes;
     }
+    for(uint32_t i = 1; i <= clientCount; i++) outboundCredit[fds[i]] = OUTBOUND_QUANTUM;
     
+    uint32_t jobCount;
+    if(!readNumber(blob, pos, jobCount)) return -1;
+    for(uint32_t i = 0; i < jobCount; i++)
+    {
+        struct broadcastJob job;
+        string text;
+        uint32_t count, delivered, elapsed;
+        if(!readString(blob, pos, job.packet) || !readNumber(blob, pos, count)) return -1;
+        for(uint32_t j = 0; j < count; j++)
+        {
+            if(!readString(blob, pos, text)) return -1;
+            job.patterns.push_back(text);
+        }
+        if(!readString(blob, pos, job.prefix) || !readString(blob, pos, job.cursor) ||
+           !readNumber(blob, pos, count)) return -1;
+        for(uint32_t j = 0; j < count; j++)
+        {
+            if(!readString(blob, pos, text)) return -1;
+            job.reached.insert(internUser(text));
+        }
+        if(!readNumber(blob, pos, count)) return -1;
+        for(uint32_t j = 0; j < count; j++)
+        {
+            if(!readNumber(blob, pos, member) || member == 0 || member > clientCount) return -1;
+            job.recipients.push_back(make_pair(fds[member], clientList[fds[member]]));
+        }
+        if(!readNumber(blob, pos, delivered) || !readNumber(blob, pos, elapsed)) return -1;
+        job.delivered = delivered;
+        job.startedAt = monotonicNanoseconds() - (uint64_t) elapsed * 1000;
+        broadcastJobs.push_back(move(job));
+    }
     
-    buffer += "\nAvailable Sessions: ";
-    for(auto it : sessionList){
-        buffer += it.first + " ";
+    uint32_t loginCount;
+    if(!readNumber(blob, pos, loginCount)) return -1;
+    for(uint32_t i = 0; i < loginCount; i++)
+    {
+        struct pendingLogin pending;
+        uint32_t elapsed;
+        if(extra >= fds.size() || !readString(blob, pos, pending.received) || !readNumber(blob, pos, elapsed)) return -1;
+        
+        int sockfd = fds[extra++];
+        pending.acceptedAt = monotonicNanoseconds() - (uint64_t) elapsed * 1000;
+        pendingLogins[sockfd] = pending;
+        loginDeadlines.push_back(make_pair(pending.acceptedAt, sockfd));
+        FD_SET(sockfd, master);
+        if(sockfd > *fdmax) *fdmax = sockfd;
     }
     
-    acknowledgeList(sockfd, buffer);
+    // Predecessor exits once it hears this
+    char ready = 1;
+    if(send(channel, &ready, 1, 0) != 1) return -1;
+    close(channel);
+    
+    printf("server: took over %u connections and %u sessions in %.3f ms\n", 
+           clientCount + loginCount, sessionCount, millisecondsSince(start));
+    return listener;
 }
 
 
-// Sends a direct message to a client specified in the data of the given packet
-// If the client doesn't exist, inform sender
-// Returns true if message sent successfully
-bool sendDirectMessage(struct message packet, int senderfd)
+int main(int argc, char** argv)
 {
-    struct message dirMessAck;
-    dirMessAck.source = "SERVER";
+    fd_set master;    // Master file descriptor list
+    fd_set read_fds;  // Temp file descriptor list for select()
+    fd_set write_fds; // Admin connections with a response to write, and clients tasks wait to send to
+    int fdmax;        // Maximum file descriptor number
     
-    stringstream ss(packet.data);
-    string receiverID, message;
-    ss >> receiverID;
+    int opt;
+    int handoffChannel = -1; // Set when started by a server handing over to us
+    bool useMulticast = false;
     
-    for(auto const & client : clientList)
+    while((opt = getopt(argc, argv, "T:d:c:p:m:a:M:b:w:u:H:")) != -1)
     {
-        if(client.second.first == receiverID)
+        switch(opt)
         {
-            // Don't send to yourself
-            if(client.first == senderfd)
+            case 'T':
+                handoffChannel = atoi(optarg);
+                break;
+            case 'd':
+                stateDirectory = optarg;
+                break;
+            case 'c':
+                loopCPU = atoi(optarg);
+                break;
+            case 'p':
+                busyPollMicroseconds = atoi(optarg);
+                break;
+            case 'm':
+                if(inet_pton(AF_INET, optarg, &multicastBase) != 1 ||
+                   !IN_MULTICAST(ntohl(multicastBase.s_addr)))
+                {
+                    fprintf(stderr, "server: %s is not a multicast address\n", optarg);
+                    exit(1);
+                }
+                useMulticast = true;
+                break;
+            case 'a':
+                adminPath = optarg;
+                break;
+            case 'b':
+                listenBacklog = atoi(optarg);
+                break;
+            case 'w':
+                capturePath = optarg;
+                break;
+            case 'u':
+                localPath = optarg;
+                break;
+            case 'H':
+                hotSessionLoad = strtoul(optarg, NULL, 10);
+                break;
+            case 'M':
             {
-                dirMessAck.type = DMESS_NAK;
-                dirMessAck.data = "Can't send message to yourself!";
-                dirMessAck.size = dirMessAck.data.length() + 1;
-                sendToClient(&dirMessAck, senderfd);
-                
-                return false;
+                // "<soft>[,<hard>]" in megabytes, the hard limit a quarter over the soft one by default
+                char *hard = strchr(optarg, ',');
+                softMemoryLimit = strtoul(optarg, NULL, 10) << 20;
+                hardMemoryLimit = hard != NULL ? strtoul(hard + 1, NULL, 10) << 20 : softMemoryLimit / 4 * 5;
+                if(softMemoryLimit == 0 || hardMemoryLimit < softMemoryLimit)
+                {
+                    fprintf(stderr, "server: memory limits must be <soft_mb>[,<hard_mb>] with hard >= soft\n");
+                    exit(1);
+                }
+                break;
             }
-            
-            // Send message to receiver
-            getline(ss, message);
-            message.erase(0, 1); // Remove extra space
-            packet.data = message;
-            sendToClient(&packet, client.first);
-            
-            // Tell sender the message was delivered
-            dirMessAck.type = DMESS_ACK;
-            dirMessAck.data = receiverID;
-            dirMessAck.size = dirMessAck.data.length() + 1;
-            sendToClient(&dirMessAck, senderfd);
-            
-            return true;
+            default:
+                fprintf(stderr, "usage: server [-d state_directory] [-c cpu] [-p busy_poll_us] [-m multicast_group] "
+                                "[-a admin_socket] [-M soft_mb[,hard_mb]] [-b backlog] [-w capture_file] [-u local_socket] "
+                        "[-H hot_session_load] <server_port_number>\n");
+                exit(1);
         }
     }
+    if(optind != argc - 1)
+    {
+        fprintf(stderr, "usage: server [-d state_directory] [-c cpu] [-p busy_poll_us] [-m multicast_group] "
+                        "[-a admin_socket] [-M soft_mb[,hard_mb]] [-b backlog] [-w capture_file] [-u local_socket] "
+                        "[-H hot_session_load] <server_port_number>\n");
+        exit(1);
+    }
     
-    // Inform sender the user does not exist
-    dirMessAck.type = DMESS_NAK;
-    dirMessAck.data = "User '" + receiverID + "' does not exist!";
-    dirMessAck.size = dirMessAck.data.length() + 1;
-    sendToClient(&dirMessAck, senderfd);
-    
-    return false;
-}
-
-int main(int argc, char** argv)
-{
-    fd_set master;    // Master file descriptor list
-    fd_set read_fds;  // Temp file descriptor list for select()
-    int fdmax;        // Maximum file descriptor number
-
-    char remoteIP[INET6_ADDRSTRLEN];
+    // Pin before the client and session lists get allocated
+    if(loopCPU >= 0) pinEventLoop(loopCPU);
 
-    if(atoi(argv[1]) > 65535)
+    if(atoi(argv[optind]) > 65535)
     {
         cout << "Choose a valid port!" << endl;
         return 0;
     }
-    int listener = createListenerSocket(argv[1]);
     
-    cout << "Waiting for connections..." << endl;
+    // Remember how to start a successor, other than the hand off channel
+    char path[4096];
+    ssize_t pathLength = readlink("/proc/self/exe", path, sizeof(path) - 1);
+    serverPath = pathLength > 0 ? string(path, pathLength) : string(argv[0]);
+    // A successor doesn't capture, as the connections it's handed couldn't
+    // be replayed without the logins that came before
+    for(int arg = 1; arg < argc; arg++)
+    {
+        if(string(argv[arg]) == "-T" || string(argv[arg]) == "-w") arg++;
+        else serverArgs.push_back(argv[arg]);
+    }
+    
+    // Upgrade on SIGUSR2, interrupting select() so it happens right away
+    struct sigaction upgradeAction;
+    memset(&upgradeAction, 0, sizeof(upgradeAction));
+    upgradeAction.sa_handler = requestUpgrade;
+    sigaction(SIGUSR2, &upgradeAction, NULL);
     
-    // Clear master and temp sets and add the listener socket to master
+    // Clear master and temp sets
     FD_ZERO(&master);
     FD_ZERO(&read_fds);
-    FD_SET(listener, &master);
-
-    // Keep track of the biggest file descriptor
-    fdmax = listener;
+    fdmax = 0;
+    
+    // Add the listener socket to master, either a new one or the one our
+    // predecessor handed over with all its clients
+    int listener;
+    if(handoffChannel != -1)
+    {
+        if((listener = takeOverFromPredecessor(handoffChannel, &master, &fdmax)) == -1)
+        {
+            fprintf(stderr, "server: hand off failed\n");
+            exit(6);
+        }
+        
+        // Our backlog and accept options may be new
+        listenOn(listener);
+    }
+    else
+    {
+        listener = createListenerSocket(argv[optind]);
+        FD_SET(listener, &master);
+        if (listener > fdmax) fdmax = listener;
+    }
+    
+    // Sessions come from the predecessor on a hand off, which was already
+    // journaling them, otherwise from disk
+    if(!stateDirectory.empty())
+    {
+        if(handoffChannel != -1)
+        {
+            vector<uint32_t> generations = listJournalGenerations();
+            openJournal(generations.empty() ? 1 : generations.back());
+            lastSnapshot = time(NULL);
+        }
+        else
+        {
+            loadSessions();
+            mailboxDirectory = stateDirectory;
+            loadOfflineMailboxes();
+        }
+    }
+    
+    // Sessions joined after this get a multicast group, and those handed over
+    // by a predecessor keep theirs
+    if(useMulticast)
+    {
+        multicastPort = htons(atoi(argv[optind]));
+        if((multicastfd = createMulticastSocket()) == -1) exit(7);
+    }
+    
+    int mailboxfd = createMailbox(&loopMailbox);
+    if(mailboxfd == -1) exit(5);
+    FD_SET(mailboxfd, &master);
+    if (mailboxfd > fdmax) fdmax = mailboxfd;
+    
+    // Searches are answered through the mailbox, so it has to exist first
+    if(!stateDirectory.empty())
+    {
+        openHistory();
+        startIndexer();
+    }
+    
+    if(!adminPath.empty() && (adminListener = createAdminSocket(adminPath)) == -1) exit(8);
+    if(!localPath.empty() && localListener == -1)
+    {
+        if((localListener = createLocalSocket(localPath)) == -1) exit(10);
+        FD_SET(localListener, &master);
+        if (localListener > fdmax) fdmax = localListener;
+    }
+    if(!capturePath.empty() && handoffChannel == -1 && !openCapture(capturePath)) exit(9);
+    startTaskWorker(); // Hands tasks back through the mailbox too
+    
+    cout << "Waiting for connections..." << endl;
+    
+    struct timespec lastEvent; // When select() last found something to do
+    clock_gettime(CLOCK_MONOTONIC, &lastEvent);
 
     // Main loop
     while(1)
     {        
+        // A file half way through its transfer can't be handed over, nor can
+        // shared memory not yet passed to its client, so an upgrade waits
+        // until there are none coming in or going out
+        if(upgradeRequested && fileRelays.empty() && queuedFiles == 0 && attachingTransports.empty())
+        {
+            upgradeRequested = 0;
+            flushHistory();
+            flushCapture();
+            stopIndexer();
+            stopTaskWorker();
+            drainMailbox(&loopMailbox);
+            finishTaskWriters(&master);
+            disconnectLaggingClients(&master);
+            if(handOffToSuccessor(listener)) exit(0);
+            startIndexer();
+            startTaskWorker();
+        }
+        
+        // Snapshot the sessions every so often if they have changed
+        struct timeval timeout = {0, 0};
+        struct timeval *wait = NULL;
+        if(!stateDirectory.empty())
+        {
+            checkSnapshot();
+            time_t now = time(NULL);
+            if(sessionsChanged && now - lastSnapshot >= SNAPSHOT_INTERVAL) startSnapshot();
+            
+            timeout.tv_sec = SNAPSHOT_INTERVAL;
+            wait = &timeout;
+        }
+        
+        // Don't block if some clients still have packets waiting from the last
+        // pass or in shared memory, or announcements are going out, or in low
+        // latency mode if the last event was only just now
+        if(!backloggedClients.empty() || acceptsWaiting || localAcceptsWaiting || sharedTransportsReady() ||
+           !broadcastJobs.empty() ||
+           (busyPollMicroseconds > 0 && millisecondsSince(lastEvent) * 1000 < busyPollMicroseconds))
+        {
+            timeout.tv_sec = 0;
+            wait = &timeout;
+        }
+        
+        // Memory can be given back without any event, by the indexer writing
+        // out its index, so check for it every so often while it's short
+        else if(memoryPressure)
+        {
+            timeout.tv_sec = 0;
+            timeout.tv_usec = MEMORY_CHECK_INTERVAL * 1000;
+            wait = &timeout;
+        }
+        
+        // Wake up to drop connections that take too long to log in
+        else if(!pendingLogins.empty() && (wait == NULL || timeout.tv_sec > 1))
+        {
+            timeout.tv_sec = 1;
+            wait = &timeout;
+        }
+        
+        // Messages sent on the last pass go to the history log together, and
+        // what was received to the capture
+        flushHistory();
+        flushCapture();
+        checkMemory(&master);
+        expireLogins(&master);
+        disconnectLaggingClients(&master);
+        
         read_fds = master; // copy master list
-        if (select(fdmax+1, &read_fds, NULL, NULL, NULL) == -1)
+        for(auto const & sockfd : pausedClients) FD_CLR(sockfd, &read_fds);
+        FD_ZERO(&write_fds);
+        int maxfd = fdmax;
+        watchAdminConnections(&read_fds, &write_fds, &maxfd);
+        watchTaskWriters(&write_fds, &maxfd);
+        watchOutboundQueues(&write_fds, &maxfd);
+        watchSharedWakeups(&read_fds, &maxfd);
+        
+        int ready = select(maxfd+1, &read_fds, &write_fds, NULL, wait);
+        if (ready == -1)
         {
+            if (errno == EINTR) continue; // Signal arrived
             perror("select");
+            stopIndexer();
+            stopTaskWorker();
+            flushCapture();
             exit(4);
         }
+        if (ready > 0 && busyPollMicroseconds > 0) clock_gettime(CLOCK_MONOTONIC, &lastEvent);
+        
+        serviceAdminConnections(&read_fds, &write_fds, &master);
+        clearSharedWakeups(&read_fds);
+        resumeTaskWriters(&write_fds);
+        serviceOutboundQueues(&write_fds);
+        sendBroadcastWaves();
 
         // Run through the existing connections looking for data to read
         for(int i = 0; i <= fdmax; i++)
         {
-            if (FD_ISSET(i, &read_fds)) // Part of the tracked file descriptors
+            bool readable = FD_ISSET(i, &read_fds);
+            bool backlogged = backloggedClients.find(i) != backloggedClients.end() ||
+                              (i == listener && acceptsWaiting) || (i == localListener && localAcceptsWaiting);
+            
+            // A client using shared memory only has its socket turn readable
+            // when it hangs up, what it sends is found in its ring
+            struct sharedTransport *shared = sharedTransportOf(i);
+            if (shared != NULL)
+            {
+                if (readable && sharedSocketClosed(i))
+                {
+                    printf("server: socket %d hung up\n", i);
+                    disconnectClient(i, &master);
+                    continue;
+                }
+                readable = sharedRingUsed(&shared->channel->toServer) > 0;
+            }
+            
+            if (readable || backlogged) // Part of the tracked file descriptors
             { 
                 if (i == listener) // Handle new connections
                 {
-                    struct sockaddr_storage remoteaddr; // client address
-                    socklen_t addrlen = sizeof(remoteaddr);
-                    int newfd = accept(listener, (struct sockaddr *)&remoteaddr, &addrlen);
-
-                    if (newfd == -1) perror("accept");
-                    else
-                    {   
-                        if(loginClient(newfd) == true)
-                        {
-                            FD_SET(newfd, &master); // add to master set
-                            if (newfd > fdmax) fdmax = newfd;
-
-                            printf("server: new connection from %s on socket %d\n",
-                                inet_ntop(remoteaddr.ss_family,
-                                    get_in_addr((struct sockaddr*)&remoteaddr),
-                                    remoteIP, INET6_ADDRSTRLEN),
-                                    newfd);
-                        }
-                        else
-                        {
-                            cout << "Attempted connection failed" << endl;
-                            close(newfd);
-                        }
-                    }             
+                    acceptConnections(listener, &acceptsWaiting, &master, &fdmax);
+                }
+                
+                else if (i == localListener) // Handle new connections on the local socket
+                {
+                    acceptConnections(localListener, &localAcceptsWaiting, &master, &fdmax);
+                }
+                
+                else if (i == mailboxfd) // Handle packets handed over by other threads
+                {
+                    drainMailbox(&loopMailbox);
                 }
                 
                 else // Handle other commands from client
                 {
-                    int nbytes;
-                    char buf[MAXDATASIZE];
-
-                    if ((nbytes = recv(i, buf, MAXDATASIZE, 0)) <= 0)
+                    if (pendingLogins.find(i) != pendingLogins.end())
+                    {
+                        // Rest of a LOGIN has arrived, or the connection hung up
+                        finishLogin(i, readLogin(i), &master, &fdmax);
+                        continue;
+                    }
+                    
+                    if (readable && fileRelays.find(i) != fileRelays.end())
                     {
-                        // Got error or connection closed by client
-                        if (nbytes == 0) // Connection closed
+                        // Client is in the middle of sending a file
+                        if (!receiveFileData(i))
                         {
-                            printf("server: socket %d hung up\n", i);
-                            clientList.erase(i); // Remove client
-                            
-                            // Remove client from a session
-                            string sessionID = clientSockfdToSessionID(i);
-                            if(sessionID != SESSION_NOT_FOUND)
-                            {
-                                auto session = sessionList.find(sessionID);
-                                session->second.erase(i);
-                                if(session->second.empty())
-                                {
-                                    sessionList.erase(session);
-                                }
-                            }
+                            printf("server: socket %d hung up during a file transfer\n", i);
+                            disconnectClient(i, &master);
                         }
-                        else perror("recv");
-                        
-                        close(i);
-                        FD_CLR(i, &master); // remove from master set
+                        continue;
                     }
                     
-                    else // We got some data from a client
+                    // Paused while memory is short
+                    if (pausedClients.find(i) != pausedClients.end()) continue;
+                    
+                    // A full ring only holds packets waiting for their turn,
+                    // so the socket is left until some have been handled
+                    auto ring = receiveRings.find(i);
+                    if (readable && (ring == receiveRings.end() ||
+                        ring->second.tail - ring->second.head < RECEIVE_RING_SIZE))
                     {
-
-                        struct message packet = messageFromPacket(buf);
-                        string sessionID;
-                        stringstream ss(packet.data);
+                        ssize_t nbytes;
                         
-                        switch(packet.type)
+                        // select can find a socket readable that then isn't
+                        if ((nbytes = receiveIntoRing(i)) == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {}
+                        else if (nbytes <= 0)
                         {
-                            case JOIN:
-                                
-                                ss >> sessionID;
-                                
-                                if(joinSession(i, packet.data))
-                                {
-                                    cout << "Client '" << packet.source << "' joined session '" 
-                                         << sessionID  << "'" << endl;
-                                }
-                                else
-                                {
-                                    cout << "Client '" << packet.source << "' could not join session '" 
-                                         << sessionID << "'" << endl;
-                                }
-                                break;
-                                
-                                
-                            case LEAVE_SESS:
-                                if (leaveSession(i))
-                                {
-                                    cout << "Client '" << packet.source << "' has left session" << endl;
-                                         
-                                }
-                                else
-                                {
-                                    cout << "Client '" << packet.source << "' is not in a session" 
-                                         << endl;
-                                }
-                                break;
-                                
-                            case NEW_SESS:
-                                
-                                ss >> sessionID;
-                                
-                                if(createSession(i, packet.data))
-                                {
-                                    cout << "New session '" << sessionID << "' created for client "
-                                         << packet.source << endl;
-                                }
-                                else
-                                {
-                                    cout << "Session '" << sessionID << "' cannot be created" 
-                                         << endl;
-                                }     
-                                break;
-                            case MESSAGE:
-                            {
-                                // Get list of clients connected in the session with the sender
-                                string sessionID = clientSockfdToSessionID(i);
-                                unordered_set<int> session;
-                                if(sessionID != SESSION_NOT_FOUND)
-                                {
-                                    session = sessionList.find(sessionID)->second;
-                                }
-                                
-                                packet.data.erase(0, 1); // Remove extra space
-                                
-                                // Send message to all clients in the session (excluding the sender)
-                                for(auto const & clientSockfd : session)
-                                {
-                                    if(clientSockfd != i) sendToClient(&packet, clientSockfd);
-                                }
-                                
-                                cout << "Message sent to session '" << sessionID << "'" << endl;
-                                break;
-                            }
-                            case DIRMESSAGE:
-                            {
-                                if(!sendDirectMessage(packet, i))
-                                {
-                                    cout << "Direct message not sent" << endl;
-                                }
-                                else
-                                {
-                                    cout << "Direct message sent" << endl;
-                                }
-                            }
-                            case QUERY:
-                                createList(i);
-                                break;
-                            default:
-                                break;
+                            // Got error or connection closed by client
+                            if (nbytes == 0) printf("server: socket %d hung up\n", i);
+                            else perror("recv");
+
+                            disconnectClient(i, &master);
+                            continue;
                         }
                     }
+                    
+                    if (!handleReceivedPackets(i))
+                    {
+                        printf("server: socket %d sent an invalid packet\n", i);
+                        disconnectClient(i, &master);
+                    }
                 } // END handle data from client
             } // END got new incoming connection
         } // END looping through file descriptors
@@ -0,0 +1,267 @@
+/*
+ * File:   sessiontable.h
+ *
+ * Registry sessions are kept in: a compact record for each, found by name
+ * through a flat hash table, with its members kept in the record or moved out
+ * to a hash set
+ */
+
+#ifndef SESSIONTABLE_H
+#define SESSIONTABLE_H
+
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <string>
+#include <unordered_set>
+#include <vector>
+#include <stdint.h>
+
+#define SESSION_INLINE_MEMBERS 6    // Members kept in a session's own record before they move to a hash set
+#define SESSION_TABLE_SIZE 1024     // Slots the session table starts with, must be a power of two
+#define NO_SESSION UINT32_MAX       // Session ID meaning there's no such session
+
+// File descriptors of the clients in a session. Up to SESSION_INLINE_MEMBERS
+// are kept in the session's own record, so the many small sessions cost no
+// allocations for them, and bigger sessions move them all to a hash set
+struct sessionMembers {
+    uint32_t count = 0;
+    union {
+        int few[SESSION_INLINE_MEMBERS];    // While count is up to SESSION_INLINE_MEMBERS
+        std::unordered_set<int> *many;      // Once it's over
+    };
+};
+
+struct sessionRecord {
+    std::string name;       // Empty while the ID is free
+    std::string password;   // Set by the client making the session
+    struct sessionMembers members;
+};
+
+// Open-addressed table from session name to ID, probed linearly. Each slot
+// keeps the hash of its session's name, so probing only compares names that
+// are likely to match and growing the table never hashes them again
+struct sessionSlot {
+    uint32_t hash;
+    uint32_t id;    // NO_SESSION if the slot is empty
+};
+
+// Sessions by ID, and the slots finding them by name. Records never move once
+// made, and the IDs of closed sessions are handed out again, the most
+// recently freed first
+struct sessionTable {
+    std::deque<struct sessionRecord> records;
+    std::vector<uint32_t> freeIDs;
+    std::vector<struct sessionSlot> slots;
+    size_t count = 0;       // Sessions open
+};
+
+
+// Returns true if a client is one of a session's members
+inline bool hasMember(const struct sessionMembers &members, int sockfd)
+{
+    if(members.count > SESSION_INLINE_MEMBERS) return members.many->find(sockfd) != members.many->end();
+    return std::find(members.few, members.few + members.count, sockfd) != members.few + members.count;
+}
+
+
+// Adds a client to a session's members, moving them all to a hash set once
+// there are too many to keep in the record
+inline void addMember(struct sessionMembers &members, int sockfd)
+{
+    if(members.count < SESSION_INLINE_MEMBERS) members.few[members.count] = sockfd;
+    else if(members.count == SESSION_INLINE_MEMBERS)
+    {
+        std::unordered_set<int> *many = new std::unordered_set<int>(members.few, members.few + members.count);
+        many->insert(sockfd);
+        members.many = many;
+    }
+    else members.many->insert(sockfd);
+    members.count++;
+}
+
+
+// Removes a client from a session's members, moving them back into the
+// record once there are few enough
+inline void removeMember(struct sessionMembers &members, int sockfd)
+{
+    if(members.count <= SESSION_INLINE_MEMBERS)
+    {
+        int *end = members.few + members.count;
+        int *member = std::find(members.few, end, sockfd);
+        if(member == end) return;
+        *member = end[-1];
+    }
+    else
+    {
+        if(members.many->erase(sockfd) == 0) return;
+        if(members.count - 1 == SESSION_INLINE_MEMBERS)
+        {
+            std::unordered_set<int> *many = members.many;
+            std::copy(many->begin(), many->end(), members.few);
+            delete many;
+        }
+    }
+    members.count--;
+}
+
+
+// Walks the members of a session, whichever way they're kept, so they can be
+// gone through with a range for
+struct memberIterator {
+    const int *few;     // NULL if the members are in a hash set
+    std::unordered_set<int>::const_iterator many;
+    
+    int operator*() const { return few != NULL ? *few : *many; }
+    bool operator!=(const struct memberIterator &other) const
+    {
+        return few != NULL ? few != other.few : many != other.many;
+    }
+    struct memberIterator &operator++()
+    {
+        if(few != NULL) few++;
+        else ++many;
+        return *this;
+    }
+};
+
+struct memberRange {
+    struct memberIterator first, last;
+    struct memberIterator begin() const { return first; }
+    struct memberIterator end() const { return last; }
+};
+
+inline struct memberRange membersOf(const struct sessionMembers &members)
+{
+    struct memberRange range;
+    if(members.count <= SESSION_INLINE_MEMBERS)
+    {
+        range.first.few = members.few;
+        range.last.few = members.few + members.count;
+    }
+    else
+    {
+        range.first.few = range.last.few = NULL;
+        range.first.many = members.many->begin();
+        range.last.many = members.many->end();
+    }
+    return range;
+}
+
+
+// Returns the hash a session name is filed under in the session table
+inline uint32_t sessionHash(const std::string &sessionID)
+{
+    return std::hash<std::string>()(sessionID);
+}
+
+
+// Returns the ID of the named session, or NO_SESSION if there isn't one
+inline uint32_t sessionIDOf(const struct sessionTable *table, const std::string &sessionID)
+{
+    if(table->slots.empty()) return NO_SESSION;
+    
+    uint32_t hash = sessionHash(sessionID);
+    size_t mask = table->slots.size() - 1;
+    for(size_t slot = hash & mask; table->slots[slot].id != NO_SESSION; slot = (slot + 1) & mask)
+    {
+        if(table->slots[slot].hash == hash && table->records[table->slots[slot].id].name == sessionID)
+        {
+            return table->slots[slot].id;
+        }
+    }
+    return NO_SESSION;
+}
+
+
+// Returns the record of the named session, or NULL if there isn't one
+inline struct sessionRecord *findSession(struct sessionTable *table, const std::string &sessionID)
+{
+    uint32_t id = sessionIDOf(table, sessionID);
+    return id == NO_SESSION ? NULL : &table->records[id];
+}
+
+
+// Makes the session table big enough for count sessions, keeping it at most
+// three quarters full
+inline void reserveSessions(struct sessionTable *table, size_t count)
+{
+    size_t size = table->slots.empty() ? SESSION_TABLE_SIZE : table->slots.size();
+    while(count * 4 > size * 3) size *= 2;
+    if(size == table->slots.size()) return;
+    
+    std::vector<struct sessionSlot> slots(size, sessionSlot{0, NO_SESSION});
+    for(auto const & entry : table->slots)
+    {
+        if(entry.id == NO_SESSION) continue;
+        size_t slot = entry.hash & (size - 1);
+        while(slots[slot].id != NO_SESSION) slot = (slot + 1) & (size - 1);
+        slots[slot] = entry;
+    }
+    table->slots.swap(slots);
+}
+
+
+// Adds a session with no members to the registry
+// Returns its record
+inline struct sessionRecord *addSession(struct sessionTable *table, const std::string &sessionID,
+                                        const std::string &sessionPassword)
+{
+    reserveSessions(table, table->count + 1);
+    
+    uint32_t id;
+    if(table->freeIDs.empty())
+    {
+        id = table->records.size();
+        table->records.emplace_back();
+    }
+    else
+    {
+        id = table->freeIDs.back();
+        table->freeIDs.pop_back();
+    }
+    struct sessionRecord &session = table->records[id];
+    session.name = sessionID;
+    session.password = sessionPassword;
+    
+    uint32_t hash = sessionHash(sessionID);
+    size_t mask = table->slots.size() - 1;
+    size_t slot = hash & mask;
+    while(table->slots[slot].id != NO_SESSION) slot = (slot + 1) & mask;
+    table->slots[slot].hash = hash;
+    table->slots[slot].id = id;
+    table->count++;
+    return &session;
+}
+
+
+// Takes a session out of the registry and frees its ID. Later slots in its
+// run are shifted back into the gap, so lookups never need to skip deleted ones
+inline void removeSession(struct sessionTable *table, uint32_t id)
+{
+    struct sessionRecord &session = table->records[id];
+    size_t mask = table->slots.size() - 1;
+    size_t hole = sessionHash(session.name) & mask;
+    while(table->slots[hole].id != id) hole = (hole + 1) & mask;
+    
+    for(size_t next = (hole + 1) & mask; table->slots[next].id != NO_SESSION; next = (next + 1) & mask)
+    {
+        // Only move an entry back if the gap is still on its way from its home slot
+        size_t home = table->slots[next].hash & mask;
+        if(((next - home) & mask) >= ((next - hole) & mask))
+        {
+            table->slots[hole] = table->slots[next];
+            hole = next;
+        }
+    }
+    table->slots[hole].id = NO_SESSION;
+    table->count--;
+    
+    if(session.members.count > SESSION_INLINE_MEMBERS) delete session.members.many;
+    session.members.count = 0;
+    std::string().swap(session.name);
+    std::string().swap(session.password);
+    table->freeIDs.push_back(id);
+}
+
+#endif /* SESSIONTABLE_H */
@@ -0,0 +1,170 @@
+/*
+ * File:   tasks.h
+ *
+ * Tasks an event loop hands slow work off in, to a worker thread, carrying on
+ * with each once its work is done
+ */
+
+#ifndef TASKS_H
+#define TASKS_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/types.h>
+
+#define TASK_POOL_SIZE 256     // Finished task frames kept for reuse
+#define TASK_DATA_KEPT 1380    // Bytes of buffer a frame keeps, the longest packet the server takes
+
+// Work a handler started that waits on something slow, such as the disk,
+// without holding up the event loop. A task is a hand-written frame: each step
+// runs on the event loop and either finishes the task, or gives it to the
+// worker thread with awaitWork, which hands it back to the event loop to run
+// the next step once the work is done. The event loop can also keep a task
+// until something else it waits on, such as room to send to its client
+struct loopTask {
+    int sockfd;                             // Client the task is for, and the user
+    std::string userID;                     // logged in there when it started
+    void (*work)(struct loopTask *task);    // Runs next on the worker thread
+    void (*step)(struct loopTask *task);    // Runs next on the event loop
+    int fd;                                 // Kept between steps
+    off_t offset;
+    size_t length;
+    std::string data;
+    size_t sent;                            // Bytes of data sent to the client so far
+    size_t packets;                         // Packets in data taken from memory, if any
+};
+
+// The worker thread tasks are given to, and the frames of finished tasks kept
+// for the next. The worker hands each task back with handBack, which has the
+// event loop run its step, and calls finish with finished as it returns. Only
+// the event loop starts and stops it
+struct taskWorker {
+    std::vector<struct loopTask *> pool;    // Finished frames, event loop only
+    std::mutex lock;                        // Guards the two below
+    std::condition_variable wakeup;
+    std::deque<struct loopTask *> queue;    // Waiting for the worker thread
+    bool stopping;                          // Also only changed by the event loop
+    std::atomic<bool> finished;
+    std::thread thread;
+    void (*handBack)(struct loopTask *task);
+    void (*finish)(std::atomic<bool> &finished);
+};
+
+
+// Takes a frame from the pool for a task for the client logged in as userID
+// on sockfd
+inline struct loopTask *startTask(struct taskWorker *worker, int sockfd, const std::string &userID)
+{
+    struct loopTask *task;
+    if(worker->pool.empty()) task = new loopTask();
+    else
+    {
+        task = worker->pool.back();
+        worker->pool.pop_back();
+    }
+    
+    task->sockfd = sockfd;
+    task->userID = userID;
+    task->work = NULL;
+    task->step = NULL;
+    task->fd = -1;
+    task->offset = 0;
+    task->length = 0;
+    task->sent = 0;
+    task->packets = 0;
+    return task;
+}
+
+
+// Gives a finished task's frame back to the pool, without holding on to a big
+// buffer it was using
+inline void finishTask(struct taskWorker *worker, struct loopTask *task)
+{
+    if(worker->pool.size() >= TASK_POOL_SIZE)
+    {
+        delete task;
+        return;
+    }
+    task->userID.clear();
+    if(task->data.capacity() > TASK_DATA_KEPT) std::string().swap(task->data);
+    else task->data.clear();
+    worker->pool.push_back(task);
+}
+
+
+// Has the worker thread run work for a task, and the event loop carry on with
+// step once it's done. If the worker has stopped, or is being stopped, both
+// run straight away
+inline void awaitWork(struct taskWorker *worker, struct loopTask *task, void (*work)(struct loopTask *),
+                      void (*step)(struct loopTask *))
+{
+    task->work = work;
+    task->step = step;
+    if(!worker->thread.joinable() || worker->stopping)
+    {
+        work(task);
+        step(task);
+        return;
+    }
+    
+    {
+        std::lock_guard<std::mutex> lock(worker->lock);
+        worker->queue.push_back(task);
+    }
+    worker->wakeup.notify_one();
+}
+
+
+// Body of the worker thread. Does the work of each task it's given in turn and
+// hands the task back to the event loop, until told to stop and out of tasks
+inline void runTaskWorker(struct taskWorker *worker)
+{
+    while(1)
+    {
+        struct loopTask *task;
+        {
+            std::unique_lock<std::mutex> lock(worker->lock);
+            worker->wakeup.wait(lock, [worker] { return worker->stopping || !worker->queue.empty(); });
+            if(worker->queue.empty()) break;
+            task = worker->queue.front();
+            worker->queue.pop_front();
+        }
+        
+        task->work(task);
+        worker->handBack(task);
+    }
+    worker->finish(worker->finished);
+}
+
+
+// Starts the worker thread, handing tasks back to the event loop with handBack
+inline void startTaskWorker(struct taskWorker *worker, void (*handBack)(struct loopTask *),
+                            void (*finish)(std::atomic<bool> &))
+{
+    worker->handBack = handBack;
+    worker->finish = finish;
+    worker->stopping = false;
+    worker->finished.store(false, std::memory_order_relaxed);
+    worker->thread = std::thread(runTaskWorker, worker);
+}
+
+
+// Tells the worker to stop once it has done the work it was given. The event
+// loop has to carry on with the tasks it hands back meanwhile, until it has
+// called finish, and then join it. Any tasks that await work meanwhile have it
+// done straight away
+inline void askTaskWorkerToStop(struct taskWorker *worker)
+{
+    {
+        std::lock_guard<std::mutex> lock(worker->lock);
+        worker->stopping = true;
+    }
+    worker->wakeup.notify_one();
+}
+
+#endif /* TASKS_H */
@@ -0,0 +1,182 @@
+/*
+ * File:   announcebench.cpp
+ *
+ * Benchmark of announcements from the admin console. Only six users can log
+ * in, so instead of 100,000 recipients it gives an announcement 100,000
+ * sessions to go through: one client makes a million sessions, or the number
+ * given, a second joins those whose names end in 7, and a third joins only
+ * the last of them in name order, so matching "s*7" finds a tenth of the
+ * sessions and has to go through them all to reach everyone. Two more
+ * clients bounce a message back and forth in a session of their own
+ * meanwhile. Prints how long each recipient took to get the announcement and
+ * the round trips of the pair while it went out, then does the same for an
+ * announcement to everyone. Fails if a recipient doesn't get it, gets it
+ * twice, or if someone in no matching session gets it, or if the pair's
+ * slowest round trip takes more than a limit. Takes the path to the server
+ * and the number of sessions as its arguments
+ */
+
+#define TEST_NAME "announcebench"
+#include "testharness.h"
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+using namespace std;
+
+#define BENCH_SESSIONS 1000000      // Sessions made unless given
+#define BENCH_PATTERN "s*7"         // Matches the sessions whose number ends in 7
+#define BENCH_MAKER 0               // Members, by their place in testUsers
+#define BENCH_JOINER 1
+#define BENCH_LAST 2                // In only the last session matching
+#define BENCH_OUTSIDER 3            // In no session
+#define BENCH_PAIR_FIRST 4          // The pair are the last two
+#define BENCH_QUIET_TIME 200        // Milliseconds a client waits for a packet it shouldn't get
+#define BENCH_ROUND_TRIP_LIMIT 50   // Milliseconds the pair's slowest round trip may take
+#define BENCH_DIRECTORY_TEMPLATE "/tmp/announcebenchXXXXXX"
+
+atomic<bool> bouncing(false);
+vector<pair<uint64_t, uint64_t>> roundTrips; // When each of the pair's started and ended
+atomic<int> pairAnnounced[2];       // Announcements each of the pair got while bouncing
+
+
+// Reads the next message a member of the pair is sent, counting any
+// announcement that comes first
+void expectMessage(struct testClient *member, int place)
+{
+    struct message packet;
+    while(readPacket(member, &packet) && packet.type == BROADCAST) pairAnnounced[place]++;
+    if(packet.type != MESSAGE) fail(member->userID + " got a " + to_string(packet.type) + " instead of a message");
+}
+
+
+// Has the pair bounce a message back and forth until told to stop, timing
+// each round trip
+void bounce(vector<struct testClient> *pair)
+{
+    while(bouncing)
+    {
+        uint64_t start = nowNanoseconds();
+        sendPacket(&(*pair)[0], MESSAGE, "pair ping");
+        expectMessage(&(*pair)[1], 1);
+        sendPacket(&(*pair)[1], MESSAGE, "pair pong");
+        expectMessage(&(*pair)[0], 0);
+        roundTrips.push_back(make_pair(start, nowNanoseconds()));
+    }
+}
+
+
+// Fails if a client is sent anything within BENCH_QUIET_TIME
+void expectNothing(struct testClient *client, const string &why)
+{
+    struct message packet;
+    if(readPacket(client, &packet, BENCH_QUIET_TIME))
+    {
+        fail(client->userID + " got a " + to_string(packet.type) + " '" + packet.data + "' " + why);
+    }
+}
+
+
+// Announces to targets while the pair bounces messages, and times how long
+// each recipient takes to get it and the pair's round trips until the last
+// of them has. Fails if a recipient or either of the pair
+// gets it more or less often than it should, or if anyone else gets it, and if
+// the pair were held up too long
+void announce(int admin, const string &targets, vector<struct testClient *> recipients,
+              vector<struct testClient> &others, vector<struct testClient> &pair, int pairShouldGet)
+{
+    roundTrips.clear();
+    pairAnnounced[0] = pairAnnounced[1] = 0;
+    bouncing = true;
+    thread bouncer(bounce, &pair);
+    usleep(BENCH_QUIET_TIME * 1000);
+    
+    uint64_t start = nowNanoseconds();
+    string answer = adminCommand(admin, "broadcast " + targets + " Maintenance at noon");
+    if(answer.compare(0, 12, "broadcasting") != 0) fail("the announcement was turned down: " + answer);
+    string times;
+    char time[32];
+    for(auto client : recipients)
+    {
+        expectPacket(client, BROADCAST);
+        snprintf(time, sizeof(time), " %.1f ms", (nowNanoseconds() - start) / 1e6);
+        times += (times.empty() ? "" : ", ") + client->userID + time;
+    }
+    uint64_t finished = nowNanoseconds();
+    bouncing = false;
+    bouncer.join();
+    
+    // The pair may only get theirs once they've stopped
+    for(int place = 0; place < 2; place++)
+    {
+        if(pairAnnounced[place] < pairShouldGet) expectPacket(&pair[place], BROADCAST);
+        else if(pairAnnounced[place] > pairShouldGet) fail(pair[place].userID + " got the announcement twice");
+    }
+    for(auto client : recipients) expectNothing(client, "after the announcement");
+    for(auto & client : others) expectNothing(&client, "though it wasn't announced to");
+    for(auto & member : pair) expectNothing(&member, "after the announcement");
+    
+    // Round trips under way at any point while it went out
+    vector<uint64_t> during;
+    for(auto const & trip : roundTrips)
+    {
+        if(trip.second >= start && trip.first <= finished) during.push_back(trip.second - trip.first);
+    }
+    if(during.empty()) fail("the pair made no round trips while the announcement went out");
+    sort(during.begin(), during.end());
+    double median = during[during.size() / 2] / 1e6, worst = during.back() / 1e6;
+    printf("%s: to %s, got after %s, the pair's %zu round trips meanwhile median %.2f ms, worst %.2f ms\n",
+           TEST_NAME, targets.c_str(), times.c_str(), during.size(), median, worst);
+    if(worst > BENCH_ROUND_TRIP_LIMIT) fail("the pair's slowest round trip took " + to_string((int) worst) + " ms");
+}
+
+
+int main(int argc, char **argv)
+{
+    const char *serverPath = argc > 1 ? argv[1] : NULL;
+    size_t sessions = argc > 2 ? strtoul(argv[2], NULL, 10) : BENCH_SESSIONS;
+    if(sessions < 10) fail("give at least 10 sessions");
+    
+    char directory[] = BENCH_DIRECTORY_TEMPLATE;
+    if(mkdtemp(directory) == NULL) fail("mkdtemp failed");
+    string adminPath = string(directory) + "/admin";
+    struct testServer server = startServer(serverPath, {"-a", adminPath});
+    int admin = connectToLocalSocket(adminPath);
+    if(admin == -1) fail("can't connect to the admin socket");
+    
+    vector<struct testClient> clients;
+    for(int user = 0; user < BENCH_PAIR_FIRST; user++) clients.push_back(logIn(server, user));
+    vector<string> all, matching;
+    for(size_t i = 0; i < sessions; i++)
+    {
+        all.push_back("s" + to_string(i));
+        if(i % 10 == 7) matching.push_back(all.back());
+    }
+    requestSessions(&clients[BENCH_MAKER], NEW_SESS, NS_ACK, all);
+    requestSessions(&clients[BENCH_JOINER], JOIN, JN_ACK, matching);
+    string last = *max_element(matching.begin(), matching.end());
+    requestSessions(&clients[BENCH_LAST], JOIN, JN_ACK, vector<string>(1, last));
+    
+    vector<struct testClient> pair;
+    for(int member = 0; member < 2; member++)
+    {
+        pair.push_back(logIn(server, BENCH_PAIR_FIRST + member));
+        sendPacket(&pair.back(), member == 0 ? NEW_SESS : JOIN, "pair pw");
+        expectPacket(&pair.back(), member == 0 ? NS_ACK : JN_ACK);
+    }
+    
+    printf("%s: %zu sessions, %zu of them matching %s, the last in name order %s\n",
+           TEST_NAME, sessions, matching.size(), BENCH_PATTERN, last.c_str());
+    vector<struct testClient> outsiders(1, clients[BENCH_OUTSIDER]), nobody;
+    announce(admin, BENCH_PATTERN, {&clients[BENCH_MAKER], &clients[BENCH_JOINER], &clients[BENCH_LAST]},
+             outsiders, pair, 0);
+    announce(admin, "*", {&clients[BENCH_MAKER], &clients[BENCH_JOINER], &clients[BENCH_LAST],
+             &clients[BENCH_OUTSIDER]}, nobody, pair, 1);
+    
+    stopServer(&server);
+    close(admin);
+    unlink(adminPath.c_str());
+    rmdir(directory);
+    return 0;
+}
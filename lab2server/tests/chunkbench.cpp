@@ -0,0 +1,110 @@
+/*
+ * File:   chunkbench.cpp
+ *
+ * Throughput benchmark for large messages sent to a session as a stream of
+ * chunks. One member streams a message of several megabytes the way the
+ * client splits it up, while the others read it, and one of them sends an
+ * ordinary message half way through. Prints how fast the stream went out and
+ * was delivered, and how long the ordinary message took to get past it. Fails
+ * if a member misses a chunk or gets one out of order. Takes the path to the
+ * server and the size of the message in megabytes as its arguments. The
+ * server lets six users log in, so the session has six members
+ */
+
+#define TEST_NAME "chunkbench"
+#include "testharness.h"
+
+#include <atomic>
+#include <thread>
+
+using namespace std;
+
+#define BENCH_MEGABYTES 8           // Size of the message unless given
+#define BENCH_CHUNK_SIZE 1024       // Bytes of the message in each chunk, as the client sends them
+#define BENCH_MEMBERS TEST_USER_COUNT
+
+vector<struct testClient> members;
+atomic<uint64_t> chatSentAt(0);     // When the ordinary message went out, 0 until it has
+atomic<uint64_t> chatLatency(0);    // Nanoseconds the other members took to get it, summed
+atomic<size_t> chatBehind(0);       // Bytes of the stream each got after it, summed
+
+
+// Streams the message from the first member, and has the second send an
+// ordinary one once half of it is out
+void stream(size_t size)
+{
+    string payload(BENCH_CHUNK_SIZE, 'x');
+    for(size_t offset = 0; offset < size; offset += BENCH_CHUNK_SIZE)
+    {
+        size_t length = min((size_t) BENCH_CHUNK_SIZE, size - offset);
+        sendPacket(&members[0], MESSAGE_CHUNK, "bench 0 " + to_string(offset) + " " + to_string(size) + " " +
+                                               payload.substr(0, length));
+        if(offset < size / 2 && offset + BENCH_CHUNK_SIZE >= size / 2)
+        {
+            chatSentAt.store(nowNanoseconds());
+            sendPacket(&members[1], MESSAGE, "bench halfway");
+        }
+    }
+}
+
+
+// Reads the stream as one of the members, checking each chunk carries on
+// from the last, and times the ordinary message if it's due
+void receive(int member, size_t size)
+{
+    size_t received = 0, after = 0;
+    bool gotChat = member == 1;
+    struct message packet;
+    while(received < size || !gotChat)
+    {
+        if(!readPacket(&members[member], &packet)) fail(members[member].userID + " stopped getting chunks");
+        if(packet.type == MESSAGE)
+        {
+            chatLatency += nowNanoseconds() - chatSentAt.load();
+            gotChat = true;
+            continue;
+        }
+        if(packet.type != MESSAGE_CHUNK) fail("got a " + to_string(packet.type) + " instead of a chunk");
+        
+        // Data is " <session> <message ID> <offset> <total size> <payload>"
+        char session[64];
+        unsigned long id, offset, total;
+        int header;
+        if(sscanf(packet.data.c_str(), " %63s %lu %lu %lu %n", session, &id, &offset, &total, &header) != 4 ||
+           offset != received || total != size)
+        {
+            fail(members[member].userID + " got a chunk at " + to_string(offset) + " instead of " + to_string(received));
+        }
+        received += packet.data.length() - header;
+        if(gotChat) after += packet.data.length() - header;
+    }
+    if(member != 1) chatBehind += after;
+}
+
+
+int main(int argc, char **argv)
+{
+    size_t size = (argc > 2 ? strtoul(argv[2], NULL, 10) : BENCH_MEGABYTES) << 20;
+    struct testServer server = startServer(argc > 1 ? argv[1] : NULL, {});
+    members = startSession(server, BENCH_MEMBERS, "bench");
+    
+    vector<thread> readers;
+    for(int member = 1; member < BENCH_MEMBERS; member++) readers.push_back(thread(receive, member, size));
+    uint64_t start = nowNanoseconds();
+    stream(size);
+    uint64_t sent = nowNanoseconds() - start;
+    for(auto & reader : readers) reader.join();
+    uint64_t delivered = nowNanoseconds() - start;
+    double serverCPU = cpuSeconds(server.pid);
+    stopServer(&server);
+    
+    int others = BENCH_MEMBERS - 2;
+    printf("%s: %zu MB to %d members sent at %.1f MB/s, delivered at %.1f MB/s to each, "
+           "%.1f MB/s in all, %.2f s of server CPU\n",
+           TEST_NAME, size >> 20, BENCH_MEMBERS - 1, megabytesPerSecond(size, sent), megabytesPerSecond(size, delivered),
+           megabytesPerSecond(size * (BENCH_MEMBERS - 1), delivered), serverCPU);
+    printf("%s: a message sent half way through reached the others in %.2f ms, "
+           "with %.2f MB of the stream still to come\n",
+           TEST_NAME, chatLatency.load() / 1e6 / others, (double) chatBehind.load() / others / (1 << 20));
+    return 0;
+}
@@ -0,0 +1,249 @@
+/*
+ * File:   clientbench.cpp
+ *
+ * Benchmark of the client keeping up with a busy session. Runs the client
+ * with its input and output on pipes and plays the server to it, so only the
+ * client is measured: it logs the client in and lets it join a session, then
+ * sends it 50,000 of the session's messages a second, or the rate given, for
+ * a few seconds. Reads what the client shows as it goes. Prints how far
+ * behind the client's output was when the last message went, how many writes
+ * it took to show them all, and how much memory the client used at most.
+ * Fails if a message is missing or out of order, if the client falls more
+ * than a second behind, or if its memory grows past a limit. Takes the path to
+ * the client and the messages a second as its arguments
+ */
+
+#define TEST_NAME "clientbench"
+#include "testharness.h"
+
+#include <atomic>
+#include <thread>
+
+using namespace std;
+
+#define BENCH_CLIENT_PATH "../lab2client/dist/Debug/GNU-Linux/client" // Where make builds the client
+#define BENCH_RATE 50000            // Messages a second unless given
+#define BENCH_SECONDS 3             // How long they're sent for
+#define BENCH_TICK 1000             // Microseconds between bursts of messages
+#define BENCH_LAG_LIMIT 1000        // Milliseconds the client may fall behind
+#define BENCH_MEMORY_LIMIT (64UL << 20) // Most the client's memory may grow by
+#define BENCH_SENDER 0              // The member sending, by its place in testUsers
+#define BENCH_RECEIVER 1            // The member the client logs in as
+#define BENCH_SESSION "bench"
+
+atomic<size_t> shown(0);            // Messages the client has shown so far
+atomic<uint64_t> lastShownAt(0);
+
+
+// Returns a line of a process's /proc status or io file, as a number
+size_t procField(pid_t pid, const char *file, const char *field)
+{
+    char path[64], contents[4096];
+    snprintf(path, sizeof(path), "/proc/%d/%s", (int) pid, file);
+    int fd = open(path, O_RDONLY);
+    ssize_t numBytes = fd == -1 ? -1 : read(fd, contents, sizeof(contents) - 1);
+    if(fd != -1) close(fd);
+    if(numBytes <= 0) fail(string("can't read ") + path);
+    contents[numBytes] = '\0';
+    
+    const char *line = strstr(contents, field);
+    if(line == NULL) fail(string("no ") + field + " in " + path);
+    return strtoul(line + strlen(field), NULL, 10);
+}
+
+
+// Starts the client with its input and output on pipes
+// Returns its pid, and the ends of the pipes we use
+pid_t startClient(const char *path, int *input, int *output)
+{
+    int in[2], out[2];
+    if(pipe(in) == -1 || pipe(out) == -1) fail("pipe failed");
+    pid_t pid = fork();
+    if(pid == -1) fail("fork failed");
+    if(pid == 0)
+    {
+        dup2(in[0], STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        close(in[1]);
+        close(out[0]);
+        execl(path, path, (char *) NULL);
+        _exit(127);
+    }
+    close(in[0]);
+    close(out[1]);
+    *input = in[1];
+    *output = out[0];
+    return pid;
+}
+
+
+// Listens on a port of this host for the client
+// Returns the listening socket, and the port
+int listenForClient(int *port)
+{
+    int listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(address);
+    if(listener == -1 || bind(listener, (struct sockaddr *) &address, sizeof(address)) == -1 ||
+       listen(listener, 1) == -1 || getsockname(listener, (struct sockaddr *) &address, &length) == -1)
+    {
+        fail(string("can't listen for the client: ") + strerror(errno));
+    }
+    *port = ntohs(address.sin_port);
+    return listener;
+}
+
+
+// Reads a request from the client and answers it as the server would
+void answer(struct testClient *client, unsigned int request, unsigned int reply, const string &data)
+{
+    expectPacket(client, request);
+    struct message packet = {reply, (unsigned int) data.length() + 1, "SERVER", data};
+    string bytes = stringifyMessage(&packet);
+    bytes += '\0';
+    if(write(client->sockfd, bytes.data(), bytes.length()) != (ssize_t) bytes.length()) fail("can't answer the client");
+}
+
+
+// Has the client run a command. It reads its input a line at a time, so each
+// command waits until the last has been answered
+void type(int input, const string &command)
+{
+    string line = command + "\n";
+    if(write(input, line.data(), line.length()) != (ssize_t) line.length()) fail("the client stopped taking input");
+}
+
+
+// Reads what the client shows until a line starting with text, which is
+// taken to come after a line read already
+void waitForLine(int output, const string &text)
+{
+    string buffer = "\n";
+    char chunk[4096];
+    while(buffer.find("\n" + text) == string::npos)
+    {
+        struct pollfd readable = {output, POLLIN, 0};
+        ssize_t numBytes;
+        if(poll(&readable, 1, TEST_READ_LIMIT) != 1 || (numBytes = read(output, chunk, sizeof(chunk))) <= 0)
+        {
+            fail("the client never showed '" + text + "'");
+        }
+        buffer.append(chunk, numBytes);
+    }
+}
+
+
+// Reads the messages the client shows, checking they're numbered in order.
+// Lines that aren't messages from the sender are left out
+void readShown(int output, size_t messages)
+{
+    string expectedStart = string(testUsers[BENCH_SENDER][0]) + ": n ";
+    string buffer;
+    static char chunk[1 << 16];
+    while(shown < messages)
+    {
+        struct pollfd readable = {output, POLLIN, 0};
+        ssize_t numBytes;
+        if(poll(&readable, 1, TEST_READ_LIMIT) != 1 || (numBytes = read(output, chunk, sizeof(chunk))) <= 0)
+        {
+            fail("the client showed " + to_string(shown.load()) + " of " + to_string(messages) + " messages");
+        }
+        buffer.append(chunk, numBytes);
+        
+        size_t start = 0, end;
+        while((end = buffer.find('\n', start)) != string::npos)
+        {
+            string expected = expectedStart + to_string(shown.load());
+            if(buffer.compare(start, expectedStart.length(), expectedStart) != 0)
+            {
+                start = end + 1;
+                continue;
+            }
+            if(buffer.compare(start, end - start, expected) != 0)
+            {
+                fail("the client showed '" + buffer.substr(start, end - start) + "' instead of '" + expected + "'");
+            }
+            shown++;
+            start = end + 1;
+        }
+        buffer.erase(0, start);
+        lastShownAt = nowNanoseconds();
+    }
+}
+
+
+int main(int argc, char **argv)
+{
+    const char *clientPath = argc > 1 ? argv[1] : BENCH_CLIENT_PATH;
+    size_t rate = argc > 2 ? strtoul(argv[2], NULL, 10) : BENCH_RATE;
+    if(rate == 0) fail("give a rate of at least one message a second");
+    signal(SIGPIPE, SIG_IGN);
+    
+    int port, input, output;
+    int listener = listenForClient(&port);
+    pid_t client = startClient(clientPath, &input, &output);
+    type(input, string("/login ") + testUsers[BENCH_RECEIVER][0] + " " + testUsers[BENCH_RECEIVER][1] +
+                " 127.0.0.1 " + to_string(port));
+    struct testClient connection;
+    if((connection.sockfd = accept(listener, NULL, NULL)) == -1) fail("the client never connected");
+    connection.userID = testUsers[BENCH_RECEIVER][0];
+    answer(&connection, LOGIN, LO_ACK, "");
+    waitForLine(output, "Login successful!");
+    type(input, "/joinsession " BENCH_SESSION " pw");
+    answer(&connection, JOIN, JN_ACK, BENCH_SESSION);
+    waitForLine(output, "Session '" BENCH_SESSION "' joined!");
+    size_t writesBefore = procField(client, "io", "syscw:");
+    size_t memoryBefore = procField(client, "status", "VmRSS:") << 10;
+    
+    // Messages go in bursts, as many as are due each tick, gathered into one
+    // write as the server sends them
+    size_t messages = rate * BENCH_SECONDS;
+    thread reader(readShown, output, messages);
+    uint64_t start = nowNanoseconds();
+    string burst;
+    for(size_t sent = 0; sent < messages; )
+    {
+        size_t due = min(messages, (size_t) ((nowNanoseconds() - start) / 1e9 * rate));
+        burst.clear();
+        for(; sent < due; sent++)
+        {
+            string text = BENCH_SESSION " n " + to_string(sent);
+            struct message packet = {MESSAGE, (unsigned int) text.length() + 1, testUsers[BENCH_SENDER][0], text};
+            burst += stringifyMessage(&packet);
+            burst += '\0';
+        }
+        for(size_t written = 0; written < burst.length(); )
+        {
+            ssize_t numBytes = write(connection.sockfd, burst.data() + written, burst.length() - written);
+            if(numBytes <= 0) fail("the client hung up");
+            written += numBytes;
+        }
+        usleep(BENCH_TICK);
+    }
+    uint64_t sentAt = nowNanoseconds();
+    double sendSeconds = (sentAt - start) / 1e9;
+    reader.join();
+    
+    double lag = lastShownAt > sentAt ? (lastShownAt - sentAt) / 1e6 : 0;
+    size_t writes = procField(client, "io", "syscw:") - writesBefore;
+    size_t memoryPeak = procField(client, "status", "VmHWM:") << 10;
+    size_t growth = memoryPeak > memoryBefore ? memoryPeak - memoryBefore : 0;
+    double clientCPU = cpuSeconds(client);
+    kill(client, SIGKILL);
+    waitpid(client, NULL, 0);
+    close(connection.sockfd);
+    close(listener);
+    
+    printf("%s: %zu messages sent at %.0f a second, all shown by the client\n",
+           TEST_NAME, messages, messages / sendSeconds);
+    printf("%s: last shown %.1f ms after the last was sent, in %zu writes, %.0f messages a write\n",
+           TEST_NAME, lag, writes, (double) messages / max(writes, (size_t) 1));
+    printf("%s: client memory grew by at most %.1f MB, %.2f s of client CPU\n",
+           TEST_NAME, (double) growth / (1 << 20), clientCPU);
+    if(lag > BENCH_LAG_LIMIT) fail("the client fell " + to_string((int) lag) + " ms behind");
+    if(growth > BENCH_MEMORY_LIMIT) fail("the client's memory grew by " + to_string(growth >> 20) + " MB");
+    return 0;
+}
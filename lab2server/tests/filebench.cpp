@@ -0,0 +1,266 @@
+/*
+ * File:   filebench.cpp
+ *
+ * Benchmark of relaying files. First sends a file through the server to the
+ * rest of a session and times it, with the CPU the server used. Then, to set
+ * that against the plain way of doing it, relays the same file over loopback
+ * both ways the server could: spooled with splice() through a pipe and sent on
+ * with sendfile() as it does, and through a buffer with read() and write().
+ * Prints the throughput and relay CPU a gigabyte of each. Fails if a recipient
+ * gets the wrong bytes. Takes the path to the server and the size of the file
+ * in megabytes as its arguments
+ */
+
+#define TEST_NAME "filebench"
+#include "testharness.h"
+
+#include <thread>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+
+using namespace std;
+
+#define BENCH_MEGABYTES 16          // Size of the file unless given
+#define BENCH_MEMBERS TEST_USER_COUNT
+#define BENCH_BUFFER_SIZE (1 << 16) // Bytes moved per call, as the server splices them
+#define BENCH_SPOOL_TEMPLATE "/tmp/filebenchXXXXXX"
+
+size_t fileSize;
+
+
+// Returns the byte at an offset into the file, which repeats too seldom for a
+// chunk sent twice or skipped to go unnoticed
+inline char fileByte(size_t offset)
+{
+    return (char) (offset % 251);
+}
+
+
+// Writes the file to a socket a buffer at a time
+void sendFile(int sockfd)
+{
+    vector<char> buffer(BENCH_BUFFER_SIZE);
+    for(size_t offset = 0; offset < fileSize; )
+    {
+        size_t length = min(buffer.size(), fileSize - offset);
+        for(size_t i = 0; i < length; i++) buffer[i] = fileByte(offset + i);
+        for(size_t sent = 0; sent < length; )
+        {
+            ssize_t numBytes = write(sockfd, buffer.data() + sent, length - sent);
+            if(numBytes <= 0) fail(string("couldn't send the file: ") + strerror(errno));
+            sent += numBytes;
+        }
+        offset += length;
+    }
+}
+
+
+// Reads the file from a socket, starting with what's already been read past
+// the last packet, and checks every byte
+void receiveFile(int sockfd, string already)
+{
+    vector<char> buffer(BENCH_BUFFER_SIZE);
+    size_t offset = 0;
+    while(offset < fileSize)
+    {
+        size_t length;
+        if(!already.empty())
+        {
+            length = min(already.length(), fileSize);
+            memcpy(buffer.data(), already.data(), length);
+            already.clear();
+        }
+        else
+        {
+            ssize_t numBytes = read(sockfd, buffer.data(), min(buffer.size(), fileSize - offset));
+            if(numBytes <= 0) fail("the file stopped at " + to_string(offset) + " bytes");
+            length = numBytes;
+        }
+        for(size_t i = 0; i < length; i++)
+        {
+            if(buffer[i] != fileByte(offset + i)) fail("wrong byte at " + to_string(offset + i));
+        }
+        offset += length;
+    }
+}
+
+
+// Sends the file through the server to the rest of a session
+// Returns the nanoseconds it took, and sets the server CPU seconds it used
+uint64_t relayThroughServer(const char *serverPath, double *serverCPU)
+{
+    struct testServer server = startServer(serverPath, {});
+    vector<struct testClient> members = startSession(server, BENCH_MEMBERS, "bench");
+    
+    double cpuBefore = cpuSeconds(server.pid);
+    uint64_t start = nowNanoseconds();
+    sendPacket(&members[0], FILE_SEND, "-bench " + to_string(fileSize) + " bench.bin");
+    expectPacket(&members[0], FILE_ACK);
+    
+    vector<thread> receivers;
+    for(int member = 1; member < BENCH_MEMBERS; member++)
+    {
+        receivers.push_back(thread([&members, member] {
+            struct message header = expectPacket(&members[member], FILE_SEND);
+            if(strtoul(header.data.c_str(), NULL, 10) != fileSize) fail("FILE_SEND has the wrong size");
+            receiveFile(members[member].sockfd, members[member].buffer);
+        }));
+    }
+    sendFile(members[0].sockfd);
+    for(auto & receiver : receivers) receiver.join();
+    uint64_t elapsed = nowNanoseconds() - start;
+    
+    struct message done = expectPacket(&members[0], FILE_ACK);
+    if(atoi(done.data.c_str()) != BENCH_MEMBERS - 1) fail("file went to" + done.data + " clients");
+    *serverCPU = cpuSeconds(server.pid) - cpuBefore;
+    stopServer(&server);
+    return elapsed;
+}
+
+
+// Returns the CPU seconds the calling thread has used
+double threadCPU()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_THREAD, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+
+// Spools the file from the sender the way the server does, through a pipe
+// with splice(), so it never comes into user space
+void spliceToSpool(int senderfd, int spoolfd)
+{
+    int pipefds[2];
+    if(pipe(pipefds) == -1) fail("pipe failed");
+    for(size_t spooled = 0; spooled < fileSize; )
+    {
+        ssize_t received = splice(senderfd, NULL, pipefds[1], NULL, min((size_t) BENCH_BUFFER_SIZE, fileSize - spooled),
+                                  SPLICE_F_MOVE);
+        if(received <= 0) fail("splice from the sender failed");
+        for(ssize_t moved = 0; moved < received; )
+        {
+            ssize_t numBytes = splice(pipefds[0], NULL, spoolfd, NULL, received - moved, SPLICE_F_MOVE);
+            if(numBytes <= 0) fail("splice to the spool failed");
+            moved += numBytes;
+        }
+        spooled += received;
+    }
+    close(pipefds[0]);
+    close(pipefds[1]);
+}
+
+
+// Copies between two descriptors through a buffer, the plain way
+void copyThroughBuffer(int fromfd, int tofd, off_t offset)
+{
+    vector<char> buffer(BENCH_BUFFER_SIZE);
+    for(size_t copied = 0; copied < fileSize; )
+    {
+        ssize_t numBytes = offset >= 0 ? pread(fromfd, buffer.data(), buffer.size(), offset + copied)
+                                       : read(fromfd, buffer.data(), min(buffer.size(), fileSize - copied));
+        if(numBytes <= 0) fail("read failed");
+        for(ssize_t written = 0; written < numBytes; )
+        {
+            ssize_t n = write(tofd, buffer.data() + written, numBytes - written);
+            if(n <= 0) fail("write failed");
+            written += n;
+        }
+        copied += numBytes;
+    }
+}
+
+
+// Returns a connected pair of loopback TCP sockets
+void loopbackPair(int listener, int port, int *clientfd, int *serverfd)
+{
+    if((*clientfd = connectToPort(port)) == -1 || (*serverfd = accept(listener, NULL, NULL)) == -1)
+    {
+        fail("can't connect over loopback");
+    }
+}
+
+
+// Relays the file from a sender over loopback to the recipients, spooling it
+// first and then sending it to each in turn as the server does, either with
+// splice() and sendfile() or through a buffer
+// Returns the nanoseconds it took, and sets the relay's CPU seconds
+uint64_t relayOverLoopback(bool zeroCopy, double *relayCPU)
+{
+    int listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(address);
+    if(listener == -1 || bind(listener, (struct sockaddr *) &address, sizeof(address)) == -1 ||
+       listen(listener, BENCH_MEMBERS) == -1 || getsockname(listener, (struct sockaddr *) &address, &length) == -1)
+    {
+        fail("can't listen on loopback");
+    }
+    int port = ntohs(address.sin_port);
+    
+    int sender, senderRelay, recipients[BENCH_MEMBERS - 1], recipientRelays[BENCH_MEMBERS - 1];
+    loopbackPair(listener, port, &sender, &senderRelay);
+    for(int i = 0; i < BENCH_MEMBERS - 1; i++) loopbackPair(listener, port, &recipients[i], &recipientRelays[i]);
+    char spoolName[] = BENCH_SPOOL_TEMPLATE;
+    int spoolfd = mkstemp(spoolName);
+    if(spoolfd == -1) fail("mkstemp failed");
+    unlink(spoolName);
+    
+    uint64_t start = nowNanoseconds();
+    thread relay([&] {
+        double before = threadCPU();
+        if(zeroCopy) spliceToSpool(senderRelay, spoolfd);
+        else copyThroughBuffer(senderRelay, spoolfd, -1);
+        for(int i = 0; i < BENCH_MEMBERS - 1; i++)
+        {
+            if(!zeroCopy) copyThroughBuffer(spoolfd, recipientRelays[i], 0);
+            else for(off_t offset = 0; offset < (off_t) fileSize; )
+            {
+                if(sendfile(recipientRelays[i], spoolfd, &offset, fileSize - offset) <= 0) fail("sendfile failed");
+            }
+        }
+        *relayCPU = threadCPU() - before;
+    });
+    vector<thread> receivers;
+    for(int i = 0; i < BENCH_MEMBERS - 1; i++) receivers.push_back(thread(receiveFile, recipients[i], string()));
+    sendFile(sender);
+    relay.join();
+    for(auto & receiver : receivers) receiver.join();
+    uint64_t elapsed = nowNanoseconds() - start;
+    
+    close(spoolfd);
+    close(sender);
+    close(senderRelay);
+    for(int i = 0; i < BENCH_MEMBERS - 1; i++)
+    {
+        close(recipients[i]);
+        close(recipientRelays[i]);
+    }
+    close(listener);
+    return elapsed;
+}
+
+
+int main(int argc, char **argv)
+{
+    fileSize = (argc > 2 ? strtoul(argv[2], NULL, 10) : BENCH_MEGABYTES) << 20;
+    size_t relayed = fileSize * BENCH_MEMBERS;  // In from the sender, and out to each recipient
+    double gigabytes = (double) relayed / (1 << 30);
+    
+    double serverCPU, spliceCPU, copyCPU;
+    uint64_t server = relayThroughServer(argc > 1 ? argv[1] : NULL, &serverCPU);
+    uint64_t splice = relayOverLoopback(true, &spliceCPU);
+    uint64_t copy = relayOverLoopback(false, &copyCPU);
+    
+    printf("%s: %zu MB file to %d recipients, %.2f GB through the relay\n",
+           TEST_NAME, fileSize >> 20, BENCH_MEMBERS - 1, gigabytes);
+    printf("%s: through the server %.0f MB/s, %.2f s of server CPU a GB\n",
+           TEST_NAME, megabytesPerSecond(relayed, server), serverCPU / gigabytes);
+    printf("%s: splice and sendfile %.0f MB/s, %.2f s of relay CPU a GB\n",
+           TEST_NAME, megabytesPerSecond(relayed, splice), spliceCPU / gigabytes);
+    printf("%s: read and write %.0f MB/s, %.2f s of relay CPU a GB\n",
+           TEST_NAME, megabytesPerSecond(relayed, copy), copyCPU / gigabytes);
+    return 0;
+}
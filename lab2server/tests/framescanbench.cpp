@@ -0,0 +1,71 @@
+/*
+ * File:   framescanbench.cpp
+ *
+ * Throughput benchmark for finding packet ends, with the SIMD scan the server
+ * uses against a byte at a time. Fills a buffer the size of a client's
+ * receive ring with pipelined packets of a few sizes, from short chat to the
+ * largest a packet can be, and finds every end in it over and over. Prints
+ * the gigabytes a second each scan gets through. Takes the megabytes scanned
+ * for each size as its argument
+ */
+
+#define TEST_NAME "framescanbench"
+#include "testharness.h"
+#include "../framescan.h"
+
+using namespace std;
+
+#define BENCH_MEGABYTES 256         // Bytes scanned for each packet size unless given, in megabytes
+#define BENCH_BUFFER_SIZE (32 << 10) // As big as a client's receive ring
+
+const size_t packetSizes[] = {64, 256, 1380};  // The last is MAXDATASIZE, the longest the server takes
+volatile size_t sink;               // Keeps the scans from being optimised away
+
+
+// Scans the buffer until megabytes have been gone through
+// Returns the gigabytes a second it went at
+double scan(const vector<char> &buffer, size_t expected, size_t megabytes, bool simd)
+{
+    vector<size_t> ends(expected + 1);
+    size_t passes = (megabytes << 20) / buffer.size();
+    
+    uint64_t start = nowNanoseconds();
+    for(size_t pass = 0; pass < passes; pass++)
+    {
+        size_t found = simd ? findFrameEnds(buffer.data(), buffer.size(), ends.data(), ends.size())
+                            : findFrameEndsScalar(buffer.data(), buffer.size(), ends.data(), ends.size());
+        if(found != expected) fail("found " + to_string(found) + " ends instead of " + to_string(expected));
+        sink += ends[found - 1];
+    }
+    uint64_t elapsed = nowNanoseconds() - start;
+    return (double) passes * buffer.size() / (1 << 30) / (elapsed / 1e9);
+}
+
+
+int main(int argc, char **argv)
+{
+    size_t megabytes = argc > 1 ? strtoul(argv[1], NULL, 10) : BENCH_MEGABYTES;
+    if(megabytes == 0) fail("give at least a megabyte");
+
+#if defined(__AVX2__)
+    const char *kernel = "AVX2";
+#elif defined(__SSE2__)
+    const char *kernel = "SSE2";
+#else
+    const char *kernel = "no SIMD";
+#endif
+    printf("%s: %zu MB scanned a size, %d KB at a time, with %s\n", TEST_NAME, megabytes, BENCH_BUFFER_SIZE >> 10, kernel);
+    
+    for(size_t size : packetSizes)
+    {
+        vector<char> buffer(BENCH_BUFFER_SIZE, 'x');
+        size_t expected = 0;
+        for(size_t end = size - 1; end < buffer.size(); end += size, expected++) buffer[end] = '\0';
+        
+        double scalar = scan(buffer, expected, megabytes, false);
+        double simd = scan(buffer, expected, megabytes, true);
+        printf("%s: %zu byte packets, %zu a buffer, byte at a time %.2f GB/s, SIMD %.2f GB/s\n",
+               TEST_NAME, size, expected, scalar, simd);
+    }
+    return 0;
+}
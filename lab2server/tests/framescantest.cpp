@@ -0,0 +1,84 @@
+/*
+ * File:   framescantest.cpp
+ *
+ * Test of finding packet ends in framescan.h. Fills buffers of every length
+ * up to a few SIMD blocks with bytes that are NUL at random, at every
+ * alignment, and asks for the ends with limits from one to more than there
+ * are. Each buffer ends against a page that can't be read, so a scan that
+ * strays past the end crashes. Fails unless both the SIMD and the scalar scan
+ * find exactly the ends, in order, up to the limit
+ */
+
+#define TEST_NAME "framescantest"
+#include "testharness.h"
+#include "../framescan.h"
+
+#include <random>
+#include <sys/mman.h>
+
+using namespace std;
+
+#define TEST_MAX_LENGTH 200     // Longest buffer, a few AVX2 blocks and a tail
+#define TEST_ROUNDS 200         // Random fillings of each length
+#define TEST_MAX_ENDS 16
+
+
+// Checks one scan of a buffer against the ends a plain loop finds
+void check(const char *name, size_t found, const size_t *ends, const vector<size_t> &expected,
+           size_t length, size_t maxEnds)
+{
+    size_t want = min(expected.size(), maxEnds);
+    if(found != want)
+    {
+        fail(string(name) + " found " + to_string(found) + " ends instead of " + to_string(want) +
+             " in " + to_string(length) + " bytes with a limit of " + to_string(maxEnds));
+    }
+    for(size_t i = 0; i < found; i++)
+    {
+        if(ends[i] != expected[i])
+        {
+            fail(string(name) + " found an end at " + to_string(ends[i]) + " instead of " + to_string(expected[i]));
+        }
+    }
+}
+
+
+int main()
+{
+    // Two pages, the second unreadable, with each buffer ending where it starts
+    size_t page = sysconf(_SC_PAGESIZE);
+    char *pages = (char *) mmap(NULL, 2 * page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(pages == MAP_FAILED || mprotect(pages + page, page, PROT_NONE) == -1) fail("can't set up a guard page");
+    
+    mt19937 random(1);
+    size_t scans = 0, endsFound = 0;
+    size_t ends[TEST_MAX_ENDS + 1];
+    for(size_t length = 0; length <= TEST_MAX_LENGTH; length++)
+    {
+        char *data = pages + page - length;
+        for(int round = 0; round < TEST_ROUNDS; round++)
+        {
+            // From no NULs at all to nothing but, so runs of them and long
+            // stretches without both come up
+            unsigned int density = round % 11;
+            vector<size_t> expected;
+            for(size_t i = 0; i < length; i++)
+            {
+                data[i] = random() % 10 < density ? '\0' : 'a' + random() % 26;
+                if(data[i] == '\0') expected.push_back(i);
+            }
+            
+            for(size_t maxEnds = 1; maxEnds <= TEST_MAX_ENDS; maxEnds++)
+            {
+                check("findFrameEnds", findFrameEnds(data, length, ends, maxEnds), ends, expected, length, maxEnds);
+                check("findFrameEndsScalar", findFrameEndsScalar(data, length, ends, maxEnds), ends, expected,
+                      length, maxEnds);
+                scans += 2;
+                endsFound += 2 * min(expected.size(), maxEnds);
+            }
+        }
+    }
+    
+    printf("%s: %zu scans of up to %d bytes found %zu ends, OK\n", TEST_NAME, scans, TEST_MAX_LENGTH, endsFound);
+    return 0;
+}
@@ -0,0 +1,229 @@
+/*
+ * File:   hotsessiontest.cpp
+ *
+ * Test for sessions turning hot and cooling off again, and for the rest of the
+ * server getting its throughput back afterwards. Runs the server with an
+ * admin socket and watches which sessions are hot with its "hot" command. A
+ * session of two is flooded past the hot load first and never turns hot. Then
+ * a member floods a busy session of four until it turns hot, keeps flooding
+ * for a while, and slows down until it cools off again, twice over. Meanwhile
+ * the session of two bounces a message back and forth as fast as it can,
+ * before the flood, during it, and once the busy session has cooled off.
+ * Prints the round trips it made a second each time. Fails if the busy
+ * session turns hot before enough messages have been sent for its load to
+ * get there, if it doesn't turn hot or cool off in time, if the round trips
+ * after it cools off don't get back to a share of those before, or if a
+ * member misses a message or gets one out of order. Takes the path to the
+ * server as its argument
+ */
+
+#define TEST_NAME "hotsessiontest"
+#include "testharness.h"
+
+#include <atomic>
+#include <cmath>
+#include <thread>
+
+using namespace std;
+
+#define TEST_HOT_LOAD 20000         // Deliveries a second a session turns hot at, the server's default
+#define TEST_BUSY_MEMBERS 4         // In the busy session, the first of testUsers sending to it
+#define TEST_PAIR_FIRST 4           // The pair are the two users after them
+#define TEST_PAIR_FLOOD 30000       // Messages flooded to the pair, well past the hot load
+#define TEST_HEAT_LIMIT 1000000     // Messages flooded before giving up on the session turning hot
+#define TEST_SLOW_INTERVAL 10       // Milliseconds between messages while slowing down
+#define TEST_COOL_LIMIT 15000       // Milliseconds slowed down before giving up on it cooling off
+#define TEST_CHECK_INTERVAL 20      // Milliseconds between asking the server which sessions are hot
+#define TEST_MEASURE_TIME 1000      // Milliseconds the pair's round trips are counted for each time
+#define TEST_RECOVERED_PERCENT 50   // Share of the round trips before that must be made after
+#define TEST_ROUNDS 2
+#define TEST_DIRECTORY_TEMPLATE "/tmp/hotsessiontestXXXXXX"
+
+// How the busy session's sender goes
+enum floodPace {
+    FLOOD_FAST,
+    FLOOD_SLOW,
+    FLOOD_STOPPED
+};
+
+atomic<int> pace(FLOOD_STOPPED);
+atomic<size_t> sent(0);             // Messages sent to the busy session
+atomic<size_t> received[TEST_BUSY_MEMBERS];
+int admin;                          // Connection to the server's admin socket
+
+
+// Returns true if the server lists a session as hot, and sets the load it
+// lists it with. Sessions aren't listed until they're sent a message
+bool isHot(const string &sessionID, unsigned long *load = NULL)
+{
+    string listing = "\n" + adminCommand(admin, "hot 100");
+    size_t line = listing.find("\n" + sessionID + " ");
+    if(load != NULL) *load = 0;
+    if(line == string::npos) return false;
+    size_t end = listing.find('\n', line + 1), loadAt = listing.find(" load=", line);
+    if(load != NULL) *load = strtoul(listing.c_str() + loadAt + strlen(" load="), NULL, 10);
+    return listing.compare(end - 4, 4, " hot") == 0;
+}
+
+
+// Sends numbered messages to the busy session at the pace asked for
+void flood(struct testClient sender)
+{
+    while(pace != FLOOD_STOPPED)
+    {
+        sendPacket(&sender, MESSAGE, "busy busy-" + to_string(sent));
+        sent++;
+        if(pace == FLOOD_SLOW) usleep(TEST_SLOW_INTERVAL * 1000);
+    }
+}
+
+
+// Reads what a member of the busy session is sent until the server goes,
+// checking the messages are numbered in order
+void readBusy(struct testClient member, int place)
+{
+    struct message packet;
+    while(readPacket(&member, &packet, -1))
+    {
+        string expected = " busy busy-" + to_string(received[place]);
+        if(packet.type != MESSAGE || packet.data != expected)
+        {
+            fail(member.userID + " got '" + packet.data + "' instead of '" + expected + "'");
+        }
+        received[place]++;
+    }
+}
+
+
+// Has the pair bounce a message back and forth for TEST_MEASURE_TIME
+// Returns the round trips made a second
+double measurePair(vector<struct testClient> &pair)
+{
+    size_t roundTrips = 0;
+    uint64_t start = nowNanoseconds();
+    while(nowNanoseconds() - start < TEST_MEASURE_TIME * 1000000UL)
+    {
+        sendPacket(&pair[0], MESSAGE, "pair ping");
+        expectPacket(&pair[1], MESSAGE);
+        sendPacket(&pair[1], MESSAGE, "pair pong");
+        expectPacket(&pair[0], MESSAGE);
+        roundTrips++;
+    }
+    return roundTrips / ((nowNanoseconds() - start) / 1e9);
+}
+
+
+// Floods the pair well past the hot load, which a session of two doesn't
+// turn hot at
+void floodPair(vector<struct testClient> &pair)
+{
+    for(size_t i = 0; i < TEST_PAIR_FLOOD; i++) sendPacket(&pair[0], MESSAGE, "pair pair-" + to_string(i));
+    for(size_t i = 0; i < TEST_PAIR_FLOOD; i++)
+    {
+        struct message packet = expectPacket(&pair[1], MESSAGE);
+        if(packet.data != " pair pair-" + to_string(i)) fail("the pair got '" + packet.data + "' out of order");
+    }
+    unsigned long load;
+    if(isHot("pair", &load)) fail("a session of two turned hot");
+    if(load < TEST_HOT_LOAD) fail("couldn't flood the pair past the hot load, only to " + to_string(load));
+}
+
+
+// Floods the busy session until it turns hot
+void heatUp()
+{
+    size_t start = sent;
+    pace = FLOOD_FAST;
+    while(!isHot("busy"))
+    {
+        if(sent - start > TEST_HEAT_LIMIT) fail("never turned hot");
+        usleep(TEST_CHECK_INTERVAL * 1000);
+    }
+    
+    // Its rate only adds up to the messages sent, however quickly
+    size_t needed = TEST_HOT_LOAD / (TEST_BUSY_MEMBERS - 1);
+    if(sent - start < needed) fail("turned hot after only " + to_string(sent - start) + " messages");
+}
+
+
+// Sends to the busy session slowly until it cools off
+// Returns how long that took, in milliseconds
+uint64_t coolDown()
+{
+    uint64_t start = nowNanoseconds();
+    pace = FLOOD_SLOW;
+    while(isHot("busy"))
+    {
+        if(nowNanoseconds() - start > TEST_COOL_LIMIT * 1000000UL) fail("never cooled off");
+        usleep(TEST_CHECK_INTERVAL * 1000);
+    }
+    return (nowNanoseconds() - start) / 1000000;
+}
+
+
+int main(int argc, char **argv)
+{
+    const char *serverPath = argc > 1 ? argv[1] : NULL;
+    char directory[] = TEST_DIRECTORY_TEMPLATE;
+    if(mkdtemp(directory) == NULL) fail("mkdtemp failed");
+    string adminPath = string(directory) + "/admin";
+    struct testServer server = startServer(serverPath, {"-a", adminPath});
+    if((admin = connectToLocalSocket(adminPath)) == -1) fail("can't connect to the admin socket");
+    
+    vector<struct testClient> busy = startSession(server, TEST_BUSY_MEMBERS, "busy");
+    vector<struct testClient> pair;
+    for(int member = 0; member < 2; member++)
+    {
+        pair.push_back(logIn(server, TEST_PAIR_FIRST + member));
+        sendPacket(&pair.back(), member == 0 ? NEW_SESS : JOIN, "pair pw");
+        expectPacket(&pair.back(), member == 0 ? NS_ACK : JN_ACK);
+    }
+    vector<thread> readers;
+    for(int member = 1; member < TEST_BUSY_MEMBERS; member++) readers.push_back(thread(readBusy, busy[member], member));
+    
+    floodPair(pair);
+    double before = measurePair(pair);
+    string during, after, cooled;
+    for(int round = 0; round < TEST_ROUNDS; round++)
+    {
+        thread sender(flood, busy[0]);
+        heatUp();
+        during += (round == 0 ? "" : ", ") + to_string(lround(measurePair(pair)));
+        cooled += (round == 0 ? "" : ", ") + to_string(coolDown()) + " ms";
+        pace = FLOOD_STOPPED;
+        sender.join();
+        
+        double recovered = measurePair(pair);
+        after += (round == 0 ? "" : ", ") + to_string(lround(recovered));
+        if(recovered < before * TEST_RECOVERED_PERCENT / 100)
+        {
+            fail("the pair made " + to_string(lround(recovered)) + " round trips a second after the busy session "
+                 "cooled off, against " + to_string(lround(before)) + " before");
+        }
+    }
+    
+    // Every member has to get every message before the server goes
+    uint64_t start = nowNanoseconds();
+    for(int member = 1; member < TEST_BUSY_MEMBERS; member++)
+    {
+        while(received[member] < sent)
+        {
+            if(nowNanoseconds() - start > TEST_READ_LIMIT * 1000000UL)
+            {
+                fail(busy[member].userID + " got " + to_string(received[member]) + " of " + to_string(sent) + " messages");
+            }
+            usleep(1000);
+        }
+    }
+    stopServer(&server);
+    for(auto & reader : readers) reader.join();
+    close(admin);
+    unlink(adminPath.c_str());
+    rmdir(directory);
+    
+    printf("%s: pair made %.0f round trips a second before the hotspot, %s during and %s after\n",
+           TEST_NAME, before, during.c_str(), after.c_str());
+    printf("%s: turned hot and cooled off %d times, in %s, after %zu messages, OK\n",
+           TEST_NAME, TEST_ROUNDS, cooled.c_str(), sent.load());
+    return 0;
+}
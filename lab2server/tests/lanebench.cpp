@@ -0,0 +1,161 @@
+/*
+ * File:   lanebench.cpp
+ *
+ * Load generator for the outbound lanes. Five members of a session flood it
+ * with messages at a rate that goes up in steps, from none to more than the
+ * server can send on, while a sixth member, who gets all of them, keeps
+ * asking for the list of users and sessions. Prints how long the replies to
+ * its requests took at each step, next to how many session messages it was
+ * sent meanwhile. Replies go ahead of session messages, so they should take
+ * about as long however busy the session is. Fails if a request goes
+ * unanswered, if a step's slowest replies take more than a limit, or if the
+ * server drops a member. Takes the path to the server and the seconds each
+ * step runs for as its arguments
+ */
+
+#define TEST_NAME "lanebench"
+#include "testharness.h"
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+using namespace std;
+
+#define BENCH_SECONDS 2             // How long each step runs for unless given
+#define BENCH_FLOODERS 5            // Members flooding the session, the first of testUsers
+#define BENCH_PROBER 5              // The member asking for lists, by its place in testUsers
+#define BENCH_TICK 1000             // Microseconds between bursts of messages from a flooder
+#define BENCH_PROBE_INTERVAL 20     // Milliseconds between requests from the prober
+#define BENCH_TEXT_SIZE 100         // Bytes of text in each message flooded
+#define BENCH_PENDING_LIMIT (1 << 20) // Bytes a flooder lets wait to be sent before it stops adding more
+#define BENCH_REPLY_LIMIT 100       // Milliseconds the slowest 1% of replies at a step may take
+
+// Messages a second flooded into the session at each step, by all flooders
+const size_t benchRates[] = {0, 1000, 4000, 16000, 64000, 256000};
+#define BENCH_STEPS (sizeof(benchRates) / sizeof(benchRates[0]))
+
+atomic<size_t> floodRate(0);        // Messages a second for the flooders, all together
+atomic<size_t> flooded(0);
+atomic<bool> stopping(false);
+
+
+// Returns a percentile of sorted latencies, in milliseconds
+double percentile(const vector<uint64_t> &latencies, double fraction)
+{
+    return latencies[min(latencies.size() - 1, (size_t) (latencies.size() * fraction))] / 1e6;
+}
+
+
+// Floods the session with its share of the rate, gathering each tick's
+// messages into one write, and throws away what the session sends it. The
+// socket is nonblocking so it keeps reading while the server is too busy to
+// take what it writes
+void flood(struct testClient member)
+{
+    fcntl(member.sockfd, F_SETFL, fcntl(member.sockfd, F_GETFL) | O_NONBLOCK);
+    struct message packet = {MESSAGE, 0, member.userID, "lanes " + string(BENCH_TEXT_SIZE, 'f')};
+    packet.size = packet.data.length() + 1;
+    string bytes = stringifyMessage(&packet);
+    bytes += '\0';
+    
+    string pending;                 // Whole packets, but for the front one
+    size_t rate = 0, due = 0, written = 0;
+    uint64_t stepStart = 0;
+    char chunk[65536];
+    while(!stopping)
+    {
+        // The rate changes at each step, so what's due is counted from then
+        if(floodRate != rate)
+        {
+            rate = floodRate;
+            stepStart = nowNanoseconds();
+            due = 0;
+        }
+        size_t nowDue = (nowNanoseconds() - stepStart) / 1e9 * rate / BENCH_FLOODERS;
+        for(; due < nowDue; due++)
+        {
+            if(pending.length() < BENCH_PENDING_LIMIT) pending += bytes;
+        }
+        
+        struct pollfd events = {member.sockfd, (short) (POLLIN | (pending.empty() ? 0 : POLLOUT)), 0};
+        poll(&events, 1, BENCH_TICK / 1000);
+        ssize_t numBytes;
+        while((numBytes = read(member.sockfd, chunk, sizeof(chunk))) > 0);
+        if(numBytes == 0) fail(member.userID + " was dropped by the server");
+        if(!pending.empty() && (numBytes = write(member.sockfd, pending.data(), pending.length())) > 0)
+        {
+            pending.erase(0, numBytes);
+            written += numBytes;
+            flooded += written / bytes.length() - (written - numBytes) / bytes.length();
+        }
+    }
+}
+
+
+// Has the prober ask for the list every BENCH_PROBE_INTERVAL for a step, and
+// times each reply, reading the session's messages it's sent meanwhile
+// Returns the replies' times sorted, and adds the session messages to received
+vector<uint64_t> probe(struct testClient *prober, int seconds, size_t *received)
+{
+    vector<uint64_t> latencies;
+    uint64_t start = nowNanoseconds();
+    while(nowNanoseconds() - start < (uint64_t) seconds * 1000000000)
+    {
+        uint64_t askedAt = nowNanoseconds();
+        sendPacket(prober, QUERY, "- - 100 ");
+        struct message packet;
+        do
+        {
+            if(!readPacket(prober, &packet)) fail("the prober's request was never answered");
+            if(packet.type == MESSAGE) (*received)++;
+        } while(packet.type != QU_ACK);
+        latencies.push_back(nowNanoseconds() - askedAt);
+        
+        // Keep up with the session until the next request
+        uint64_t nextAt = askedAt + BENCH_PROBE_INTERVAL * 1000000UL;
+        for(uint64_t now; (now = nowNanoseconds()) < nextAt; )
+        {
+            if(!readPacket(prober, &packet, (nextAt - now) / 1000000)) continue;
+            if(packet.type == MESSAGE) (*received)++;
+            else fail("the prober got a " + to_string(packet.type) + " it didn't ask for");
+        }
+    }
+    sort(latencies.begin(), latencies.end());
+    return latencies;
+}
+
+
+int main(int argc, char **argv)
+{
+    const char *serverPath = argc > 1 ? argv[1] : NULL;
+    int seconds = argc > 2 ? atoi(argv[2]) : BENCH_SECONDS;
+    if(seconds <= 0) fail("give at least a second a step");
+    signal(SIGPIPE, SIG_IGN);
+    
+    struct testServer server = startServer(serverPath, {});
+    vector<struct testClient> members = startSession(server, TEST_USER_COUNT, "lanes");
+    vector<thread> flooders;
+    for(int i = 0; i < BENCH_FLOODERS; i++) flooders.push_back(thread(flood, members[i]));
+    
+    printf("%s: %d members flood a session while the sixth asks for the list every %d ms\n",
+           TEST_NAME, BENCH_FLOODERS, BENCH_PROBE_INTERVAL);
+    double worst = 0;
+    for(size_t step = 0; step < BENCH_STEPS; step++)
+    {
+        floodRate = benchRates[step];
+        size_t floodedBefore = flooded, received = 0;
+        vector<uint64_t> latencies = probe(&members[BENCH_PROBER], seconds, &received);
+        printf("%s: flooding %6zu a second, written %6.0f a second, prober got %6.0f a second, "
+               "replies median %.2f ms, 99th %.2f ms, worst %.2f ms\n",
+               TEST_NAME, benchRates[step], (double) (flooded - floodedBefore) / seconds, (double) received / seconds,
+               percentile(latencies, 0.5), percentile(latencies, 0.99), percentile(latencies, 1));
+        worst = max(worst, percentile(latencies, 0.99));
+    }
+    stopping = true;
+    for(auto & flooder : flooders) flooder.join();
+    stopServer(&server);
+    
+    if(worst > BENCH_REPLY_LIMIT) fail("the slowest replies took " + to_string((int) worst) + " ms");
+    return 0;
+}
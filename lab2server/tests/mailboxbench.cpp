@@ -0,0 +1,157 @@
+/*
+ * File:   mailboxbench.cpp
+ *
+ * Benchmark of the mailbox under contention, against the deque behind a mutex
+ * it replaced. Producers post numbered items as fast as they can while the
+ * consumer takes them only once woken by the eventfd, as the event loop does.
+ * Both queues wake the consumer the same way, so the difference is the cost
+ * of the lock. Prints the time per item and the wakeups it took for each
+ * number of producers. Takes the items to post in each run, split between
+ * the producers, as its argument
+ */
+
+#define TEST_NAME "mailboxbench"
+#include "testharness.h"
+#include "../mailbox.h"
+
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+#define BENCH_ITEMS 2000000     // Items posted in each run unless given
+#define BENCH_MAX_PRODUCERS 8   // Runs with 1, 2, 4... producers up to this
+
+// Numbered item from one of the producers
+struct testItem {
+    int producer;
+    unsigned int number;
+};
+
+// What the mailbox replaced: a deque behind a mutex, with the consumer woken
+// by the post that finds it empty
+struct lockedQueue {
+    mutex lock;
+    deque<struct testItem> items;
+    int eventfd;
+};
+
+struct mailbox<struct testItem> testMailbox;
+struct lockedQueue testQueue;
+
+
+// Posts an item to the deque, waking the consumer if it was empty
+void postLocked(struct lockedQueue *queue, const struct testItem &item)
+{
+    bool wasEmpty;
+    {
+        lock_guard<mutex> lock(queue->lock);
+        wasEmpty = queue->items.empty();
+        queue->items.push_back(item);
+    }
+    if(!wasEmpty) return;
+    
+    uint64_t one = 1;
+    if(write(queue->eventfd, &one, sizeof(one)) == -1) perror("write");
+}
+
+
+// Posts items numbered from 0 for producer to whichever queue is being run
+void produce(int producer, size_t items, bool locked)
+{
+    struct testItem item = {producer, 0};
+    for(; item.number < items; item.number++)
+    {
+        if(locked) postLocked(&testQueue, item);
+        else postToMailboxOrWait(&testMailbox, item);
+    }
+}
+
+
+// Checks an item is the next one from its producer
+void checkItem(const struct testItem &item, vector<unsigned int> &expected)
+{
+    if(item.producer < 0 || item.producer >= (int) expected.size() || item.number != expected[item.producer])
+    {
+        fail("item " + to_string(item.number) + " from producer " + to_string(item.producer) + " out of order");
+    }
+    expected[item.producer]++;
+}
+
+
+// Waits for the queue being run to wake the consumer
+void waitForWakeup(int eventfd)
+{
+    struct pollfd wakeup = {eventfd, POLLIN, 0};
+    if(poll(&wakeup, 1, -1) == -1 && errno != EINTR) fail("poll failed");
+}
+
+
+// Has the producers post items between them and takes them all
+// Returns the nanoseconds it took per item, and sets wakeups
+double run(int producers, size_t items, bool locked, size_t *wakeups)
+{
+    vector<unsigned int> expected(producers, 0);
+    size_t each = items / producers, received = 0;
+    *wakeups = 0;
+    
+    uint64_t start = nowNanoseconds();
+    vector<thread> threads;
+    for(int i = 0; i < producers; i++) threads.push_back(thread(produce, i, each, locked));
+    
+    struct testItem item;
+    deque<struct testItem> taken;
+    while(received < each * producers)
+    {
+        waitForWakeup(locked ? testQueue.eventfd : testMailbox.eventfd);
+        (*wakeups)++;
+        if(locked)
+        {
+            uint64_t count;
+            if(read(testQueue.eventfd, &count, sizeof(count)) == -1 && errno != EAGAIN) fail("read failed");
+            {
+                lock_guard<mutex> lock(testQueue.lock);
+                taken.swap(testQueue.items);
+            }
+            for(auto const & takenItem : taken) checkItem(takenItem, expected);
+            received += taken.size();
+            taken.clear();
+        }
+        else
+        {
+            clearMailboxWakeup(&testMailbox);
+            while(takeFromMailbox(&testMailbox, &item))
+            {
+                checkItem(item, expected);
+                received++;
+            }
+            announceMailboxRoom(&testMailbox);
+        }
+    }
+    uint64_t elapsed = nowNanoseconds() - start;
+    
+    for(auto & producer : threads) producer.join();
+    return (double) elapsed / received;
+}
+
+
+int main(int argc, char **argv)
+{
+    size_t items = argc > 1 ? strtoul(argv[1], NULL, 10) : BENCH_ITEMS;
+    if(createMailbox(&testMailbox) == -1) return 1;
+    if((testQueue.eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) fail("eventfd failed");
+    
+    printf("%s: %zu items a run on %ld CPUs\n", TEST_NAME, items, sysconf(_SC_NPROCESSORS_ONLN));
+    for(int producers = 1; producers <= BENCH_MAX_PRODUCERS; producers *= 2)
+    {
+        size_t mailboxWakeups, lockedWakeups;
+        double mailbox = run(producers, items, false, &mailboxWakeups);
+        double locked = run(producers, items, true, &lockedWakeups);
+        printf("%s: %d producers, mailbox %.0f ns an item in %zu wakeups, "
+               "mutex and deque %.0f ns an item in %zu wakeups\n",
+               TEST_NAME, producers, mailbox, mailboxWakeups, locked, lockedWakeups);
+    }
+    return 0;
+}
@@ -0,0 +1,151 @@
+/*
+ * File:   mailboxtest.cpp
+ *
+ * Stress test for the mailbox in mailbox.h, which other threads hand packets
+ * to the event loop through. Several producers post numbered items in bursts, all at once, then
+ * wait for the consumer to take them all. The consumer only drains when woken
+ * by the eventfd, as the event loop does, so a wakeup that goes missing leaves
+ * the end of a burst stranded. Fails if that happens, or if an item is lost,
+ * repeated or out of order. Then does it all again with bursts too big for the
+ * mailbox and a consumer too slow to keep up, so producers have to wait for
+ * room. Fails if none ever does, or if one is left waiting
+ */
+
+#define TEST_NAME "mailboxtest"
+#include "testharness.h"
+#include "../mailbox.h"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+#define TEST_PRODUCERS 4
+#define TEST_ROUNDS 5000        // Bursts posted by each producer
+#define TEST_BURST 64           // Most items in a burst, more than MAILBOX_CAPACITY between them fills it
+#define TEST_FULL_ROUNDS 50     // Bursts posted by each producer that fill the mailbox
+#define TEST_FULL_BURST (2 * MAILBOX_CAPACITY)
+#define TEST_SLEEP_LIMIT 2000   // Milliseconds the consumer waits for a wakeup before checking for a lost one
+
+// Numbered item from one of the producers
+struct testItem {
+    int producer;
+    unsigned int number;
+};
+
+struct mailbox<struct testItem> testMailbox;
+atomic<size_t> consumed(0);
+bool filling = false;           // Producers wait for room instead of retrying
+
+
+// Returns the size of a producer's burst in a round, which varies so that the
+// producers finish their bursts at different times
+size_t burstSize(int producer, size_t round)
+{
+    if(filling) return 1 + (round * 997 + producer * 1301) % TEST_FULL_BURST;
+    return 1 + (round * 7 + producer * 13) % TEST_BURST;
+}
+
+
+// Returns the items posted by every producer up to the end of a round
+size_t itemsBy(size_t round)
+{
+    size_t items = 0;
+    for(int producer = 0; producer < TEST_PRODUCERS; producer++)
+    {
+        for(size_t i = 0; i <= round; i++) items += burstSize(producer, i);
+    }
+    return items;
+}
+
+
+// Posts bursts of items numbered from 0 for producer, retrying or waiting while
+// the mailbox is full, and waits after each round for the consumer to catch up
+void produce(int producer, size_t rounds)
+{
+    struct testItem item = {producer, 0};
+    size_t target = 0;
+    for(size_t round = 0; round < rounds; round++)
+    {
+        for(size_t i = 0; i < burstSize(producer, round); i++, item.number++)
+        {
+            if(filling) postToMailboxOrWait(&testMailbox, item);
+            else while(!postToMailbox(&testMailbox, item)) this_thread::yield();
+        }
+        
+        for(int other = 0; other < TEST_PRODUCERS; other++) target += burstSize(other, round);
+        while(consumed.load(memory_order_acquire) < target) this_thread::yield();
+    }
+}
+
+
+// Checks an item is the next one from its producer
+void checkItem(const struct testItem &item, vector<unsigned int> &expected)
+{
+    if(item.producer < 0 || item.producer >= TEST_PRODUCERS || item.number != expected[item.producer])
+    {
+        fail("item " + to_string(item.number) + " from producer " + to_string(item.producer) + " out of order");
+    }
+    expected[item.producer]++;
+}
+
+
+// Has the producers post rounds of bursts, and takes their items as the event
+// loop does, only once woken
+void run(size_t rounds)
+{
+    consumed.store(0, memory_order_relaxed);
+    vector<thread> producers;
+    for(int i = 0; i < TEST_PRODUCERS; i++) producers.push_back(thread(produce, i, rounds));
+    
+    vector<unsigned int> expected(TEST_PRODUCERS, 0);
+    size_t received = 0, wakeups = 0, waiting = 0;
+    struct testItem item;
+    size_t total = itemsBy(rounds - 1);
+    while(received < total)
+    {
+        struct pollfd wakeup = {testMailbox.eventfd, POLLIN, 0};
+        if(poll(&wakeup, 1, TEST_SLEEP_LIMIT) == 0)
+        {
+            if(takeFromMailbox(&testMailbox, &item)) fail("lost wakeup after " + to_string(received) + " items");
+            if(testMailbox.roomWaiters.load() > 0) fail("producer left waiting after " + to_string(received) + " items");
+        }
+        
+        // A loop busy with something else lets the mailbox fill up
+        if(filling) this_thread::sleep_for(chrono::milliseconds(1));
+        if(testMailbox.roomWaiters.load() > 0) waiting++;
+        
+        wakeups++;
+        clearMailboxWakeup(&testMailbox);
+        while(takeFromMailbox(&testMailbox, &item))
+        {
+            checkItem(item, expected);
+            received++;
+        }
+        announceMailboxRoom(&testMailbox);
+        consumed.store(received, memory_order_release);
+    }
+    
+    for(auto & producer : producers) producer.join();
+    if(takeFromMailbox(&testMailbox, &item))
+    {
+        fail("extra item " + to_string(item.number) + " from producer " + to_string(item.producer));
+    }
+    if(filling && waiting == 0) fail("no producer waited for room");
+    
+    printf("mailboxtest: %zu items from %d producers in %zu wakeups, producers waiting at %zu, OK\n", 
+           received, TEST_PRODUCERS, wakeups, waiting);
+}
+
+
+int main()
+{
+    if(createMailbox(&testMailbox) == -1) return 1;
+    
+    run(TEST_ROUNDS);
+    filling = true;
+    run(TEST_FULL_ROUNDS);
+    return 0;
+}
@@ -0,0 +1,189 @@
+/*
+ * File:   multicastbench.cpp
+ *
+ * Benchmark of the server CPU it takes to send each message to a session,
+ * fanned out over TCP to every member and sent once to the session's
+ * multicast group. One member sends messages as fast as it can while the
+ * other five count what reaches them, over TCP or through the group on
+ * loopback. Prints the server CPU a message each way, and how many of them
+ * the members got. Before anything is sent, a member asks for messages the
+ * group never had, and after, for the last few again, which fails unless the
+ * server is still there to answer and sends them. Takes the path to the
+ * server and the number of messages as its arguments
+ */
+
+#define TEST_NAME "multicastbench"
+#include "testharness.h"
+
+#include <atomic>
+#include <thread>
+
+using namespace std;
+
+#define BENCH_MESSAGES 20000        // Messages sent each way unless given
+#define BENCH_MEMBERS TEST_USER_COUNT
+#define BENCH_MULTICAST_BASE "239.255.42.0"
+#define BENCH_TEXT_SIZE 200         // Bytes of text in each message
+#define BENCH_QUIET 2000            // Milliseconds without a message before a member stops counting
+#define BENCH_REPAIRED 3            // Messages asked for again at the end
+
+atomic<size_t> delivered(0);
+
+
+// Counts the messages reaching a member over TCP, until it has them all or
+// they stop coming
+void countOverTCP(struct testClient *member, size_t messages)
+{
+    struct message packet;
+    size_t got = 0;
+    while(got < messages && readPacket(member, &packet, BENCH_QUIET))
+    {
+        if(packet.type == MESSAGE || packet.type == MC_MESSAGE) got++;
+    }
+    delivered += got;
+}
+
+
+// Counts the messages reaching a member through its multicast socket, one a
+// datagram, until it has them all or they stop coming
+void countOverMulticast(int udpfd, size_t messages)
+{
+    char datagram[65536];
+    size_t got = 0;
+    struct pollfd readable = {udpfd, POLLIN, 0};
+    while(got < messages && poll(&readable, 1, BENCH_QUIET) == 1)
+    {
+        if(recv(udpfd, datagram, sizeof(datagram), 0) > 0) got++;
+    }
+    delivered += got;
+}
+
+
+// Joins the group a member was offered as it joined the session, and tells
+// the server it's listening
+// Returns the socket the group's messages arrive on
+int joinGroup(struct testClient *member)
+{
+    // Data is " <session> <address> <port> <next sequence>"
+    struct message offer = expectPacket(member, MC_GROUP);
+    char session[64], address[INET_ADDRSTRLEN];
+    int port;
+    if(sscanf(offer.data.c_str(), " %63s %15s %d", session, address, &port) != 3) fail("bad MC_GROUP " + offer.data);
+    
+    int udpfd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    int one = 1, bufferSize = 16 << 20;
+    struct sockaddr_in group;
+    memset(&group, 0, sizeof(group));
+    group.sin_family = AF_INET;
+    group.sin_port = htons(port);
+    inet_pton(AF_INET, address, &group.sin_addr);
+    struct ip_mreq membership;
+    membership.imr_multiaddr = group.sin_addr;
+    membership.imr_interface.s_addr = htonl(INADDR_LOOPBACK);
+    setsockopt(udpfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    setsockopt(udpfd, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
+    if(udpfd == -1 || bind(udpfd, (struct sockaddr *) &group, sizeof(group)) == -1 ||
+       setsockopt(udpfd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) == -1)
+    {
+        fail(string("can't join the multicast group: ") + strerror(errno));
+    }
+    sendPacket(member, MC_JOINED, "bench");
+    return udpfd;
+}
+
+
+// Checks the server answers a member, after it asked for something
+void expectAnswer(struct testClient *member, const string &after)
+{
+    sendPacket(member, QUERY, "");
+    struct message packet;
+    while(readPacket(member, &packet))
+    {
+        if(packet.type == QU_ACK) return;
+    }
+    fail("the server stopped answering after " + after);
+}
+
+
+// Sends messages from the first member to the rest of the session, over TCP or
+// through its multicast group
+// Returns the server CPU seconds a message took
+double run(const char *serverPath, bool multicast, size_t messages)
+{
+    struct testServer server = startServer(serverPath, multicast ? vector<string>{"-m", BENCH_MULTICAST_BASE}
+                                                                 : vector<string>{});
+    vector<struct testClient> members = startSession(server, BENCH_MEMBERS, "bench");
+    vector<int> udpfds;
+    if(multicast)
+    {
+        expectPacket(&members[0], MC_GROUP);
+        for(int member = 1; member < BENCH_MEMBERS; member++) udpfds.push_back(joinGroup(&members[member]));
+        
+        // Asking for messages before any were sent used to crash the server
+        sendPacket(&members[1], MC_NAK, "bench 0 5");
+        expectAnswer(&members[1], "asking for messages the group never had");
+        
+        // Members keep getting messages over TCP until they say one came
+        // through the group
+        sendPacket(&members[0], MESSAGE, "bench first");
+        for(int member = 1; member < BENCH_MEMBERS; member++)
+        {
+            expectPacket(&members[member], MC_MESSAGE);
+            char datagram[65536];
+            struct pollfd readable = {udpfds[member - 1], POLLIN, 0};
+            if(poll(&readable, 1, TEST_READ_LIMIT) != 1 || recv(udpfds[member - 1], datagram, sizeof(datagram), 0) <= 0)
+            {
+                fail("nothing came through the multicast group");
+            }
+            sendPacket(&members[member], MC_RECEIVING, "bench");
+        }
+        expectAnswer(&members[1], "saying the group works");
+    }
+    
+    delivered = 0;
+    vector<thread> counters;
+    for(int member = 1; member < BENCH_MEMBERS; member++)
+    {
+        if(multicast) counters.push_back(thread(countOverMulticast, udpfds[member - 1], messages));
+        else counters.push_back(thread(countOverTCP, &members[member], messages));
+    }
+    
+    double cpuBefore = cpuSeconds(server.pid);
+    string text = "bench " + string(BENCH_TEXT_SIZE, 'x');
+    for(size_t i = 0; i < messages; i++) sendPacket(&members[0], MESSAGE, text);
+    for(auto & counter : counters) counter.join();
+    double serverCPU = cpuSeconds(server.pid) - cpuBefore;
+    
+    size_t expected = messages * (BENCH_MEMBERS - 1);
+    if(!multicast && delivered != expected)
+    {
+        fail("only " + to_string(delivered.load()) + " of " + to_string(expected) + " messages came over TCP");
+    }
+    if(multicast)
+    {
+        // The last few are sent again over TCP, the first was numbered 0
+        sendPacket(&members[1], MC_NAK, "bench " + to_string(messages - BENCH_REPAIRED + 1) + " " + to_string(messages));
+        for(int i = 0; i < BENCH_REPAIRED; i++) expectPacket(&members[1], MC_MESSAGE);
+        expectAnswer(&members[1], "asking for messages again");
+    }
+    stopServer(&server);
+    
+    printf("%s: %s, %zu of %zu messages delivered, %.2f us of server CPU a message\n",
+           TEST_NAME, multicast ? "multicast group" : "TCP fan-out", delivered.load(), expected,
+           serverCPU / messages * 1e6);
+    return serverCPU / messages;
+}
+
+
+int main(int argc, char **argv)
+{
+    const char *serverPath = argc > 1 ? argv[1] : NULL;
+    size_t messages = argc > 2 ? strtoul(argv[2], NULL, 10) : BENCH_MESSAGES;
+    if(messages < BENCH_REPAIRED) fail("give at least " + to_string(BENCH_REPAIRED) + " messages");
+    
+    printf("%s: %zu messages of %d bytes to %d members\n", TEST_NAME, messages, BENCH_TEXT_SIZE, BENCH_MEMBERS - 1);
+    double tcp = run(serverPath, false, messages);
+    double multicast = run(serverPath, true, messages);
+    printf("%s: multicast takes %.0f%% of the server CPU of TCP fan-out\n", TEST_NAME, multicast / tcp * 100);
+    return 0;
+}
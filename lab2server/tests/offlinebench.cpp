@@ -0,0 +1,102 @@
+/*
+ * File:   offlinebench.cpp
+ *
+ * Benchmark of the direct messages held for users who are offline. One user
+ * sends a backlog of 10,000 messages of a kilobyte to each of the other five
+ * while they're offline, more than the server keeps in memory, so the rest go
+ * to their mailboxes on disk. Prints how much the server's resident memory
+ * grew meanwhile, and how long one of them then takes to get their backlog
+ * after logging in. Fails if the memory grew past what's kept in memory by
+ * more than a margin, or if a message is missing or out of order. The server
+ * lets six users log in, so there are five offline recipients rather than the
+ * large number asked about. Takes the path to the server and the size of the
+ * backlog as its arguments
+ */
+
+#define TEST_NAME "offlinebench"
+#include "testharness.h"
+
+using namespace std;
+
+#define BENCH_BACKLOG 10000             // Messages held for each recipient unless given
+#define BENCH_TEXT_SIZE 1000            // Bytes of text in each message
+#define BENCH_MEMORY_BUDGET (8UL << 20) // OFFLINE_MEMORY_BUDGET in the server
+#define BENCH_MEMORY_MARGIN (16UL << 20) // Growth allowed beyond it, for the allocator and buffers
+#define BENCH_DIRECTORY_TEMPLATE "/tmp/offlinebenchXXXXXX"
+
+
+// Returns the resident memory of a process, in bytes
+size_t residentBytes(pid_t pid)
+{
+    char path[64], status[4096];
+    snprintf(path, sizeof(path), "/proc/%d/status", (int) pid);
+    int fd = open(path, O_RDONLY);
+    ssize_t numBytes = fd == -1 ? -1 : read(fd, status, sizeof(status) - 1);
+    if(fd != -1) close(fd);
+    if(numBytes <= 0) fail(string("can't read ") + path);
+    status[numBytes] = '\0';
+    
+    const char *line = strstr(status, "VmRSS:");
+    if(line == NULL) fail(string("no VmRSS in ") + path);
+    return strtoul(line + strlen("VmRSS:"), NULL, 10) << 10;
+}
+
+
+int main(int argc, char **argv)
+{
+    const char *serverPath = argc > 1 ? argv[1] : NULL;
+    size_t backlog = argc > 2 ? strtoul(argv[2], NULL, 10) : BENCH_BACKLOG;
+    if(backlog == 0) fail("give a backlog of at least one message");
+    
+    char directory[] = BENCH_DIRECTORY_TEMPLATE;
+    if(mkdtemp(directory) == NULL) fail("mkdtemp failed");
+    struct testServer server = startServer(serverPath, {"-d", directory});
+    struct testClient sender = logIn(server, 0);
+    size_t before = residentBytes(server.pid);
+    
+    // Every recipient gets each message in turn, and the sender reads the
+    // acknowledgements as it goes so neither side's socket fills up
+    string text(BENCH_TEXT_SIZE, 'x');
+    uint64_t start = nowNanoseconds();
+    for(size_t i = 0; i < backlog; i++)
+    {
+        for(int user = 1; user < TEST_USER_COUNT; user++)
+        {
+            sendPacket(&sender, DIRMESSAGE, string(testUsers[user][0]) + " " + to_string(i) + " " + text);
+        }
+        for(int user = 1; user < TEST_USER_COUNT; user++) expectPacket(&sender, DMESS_ACK);
+    }
+    uint64_t queued = nowNanoseconds() - start;
+    size_t after = residentBytes(server.pid);
+    size_t growth = after > before ? after - before : 0;
+    if(growth > BENCH_MEMORY_BUDGET + BENCH_MEMORY_MARGIN)
+    {
+        fail("server memory grew by " + to_string(growth >> 20) + " MB holding the messages");
+    }
+    
+    // The clock runs from sending the LOGIN to the last message of the backlog
+    start = nowNanoseconds();
+    struct testClient recipient = logIn(server, 1);
+    struct message packet;
+    for(size_t i = 0; i < backlog; i++)
+    {
+        if(!readPacket(&recipient, &packet)) fail("got " + to_string(i) + " of the backlog");
+        if(packet.type != DIRMESSAGE || strtoul(packet.data.c_str(), NULL, 10) != i)
+        {
+            fail("message " + to_string(i) + " of the backlog came as '" + packet.data.substr(0, 20) + "'");
+        }
+    }
+    uint64_t delivered = nowNanoseconds() - start;
+    stopServer(&server);
+    string command = string("rm -rf ") + directory;
+    if(system(command.c_str()) != 0) fail("can't remove " + string(directory));
+    
+    size_t bytes = backlog * (TEST_USER_COUNT - 1) * BENCH_TEXT_SIZE;
+    printf("%s: %zu messages for each of %d offline users, %.1f MB, queued in %.2f s\n",
+           TEST_NAME, backlog, TEST_USER_COUNT - 1, (double) bytes / (1 << 20), queued / 1e9);
+    printf("%s: server memory grew by %.1f MB, keeping at most %lu MB in memory\n",
+           TEST_NAME, (double) growth / (1 << 20), BENCH_MEMORY_BUDGET >> 20);
+    printf("%s: a backlog of %zu delivered %.1f ms after logging in, %.0f messages a second\n",
+           TEST_NAME, backlog, delivered / 1e6, backlog / (delivered / 1e9));
+    return 0;
+}
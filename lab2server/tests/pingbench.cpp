@@ -0,0 +1,82 @@
+/*
+ * File:   pingbench.cpp
+ *
+ * Latency benchmark for the low-latency mode. Two members of a session send a
+ * message back and forth through the server over loopback, one at a time,
+ * first with the server as it normally runs and then with its event loop
+ * pinned to a CPU and busy polling. Prints the median and tail round trip
+ * each way. Takes the path to the server and the number of round trips as
+ * its arguments
+ */
+
+#define TEST_NAME "pingbench"
+#include "testharness.h"
+
+#include <algorithm>
+
+using namespace std;
+
+#define BENCH_ROUND_TRIPS 20000     // Round trips timed each way unless given
+#define BENCH_WARMUP 1000           // Round trips made first and not timed
+#define BENCH_BUSY_POLL "50"        // Microseconds the server busy polls for after each event
+#define BENCH_CPU "0"               // CPU the event loop is pinned to
+
+
+// Returns a percentile of sorted round trips, in microseconds
+double percentile(const vector<uint64_t> &roundTrips, double fraction)
+{
+    return roundTrips[min(roundTrips.size() - 1, (size_t) (roundTrips.size() * fraction))] / 1e3;
+}
+
+
+// Runs a server with the options given and times round trips through it
+// Returns them sorted, and sets the server CPU seconds they used
+vector<uint64_t> pingPong(const char *serverPath, const vector<string> &options, size_t count, double *serverCPU)
+{
+    struct testServer server = startServer(serverPath, options);
+    vector<struct testClient> members = startSession(server, 2, "bench");
+    
+    vector<uint64_t> roundTrips;
+    double cpuBefore = 0;
+    for(size_t i = 0; i < BENCH_WARMUP + count; i++)
+    {
+        if(i == BENCH_WARMUP) cpuBefore = cpuSeconds(server.pid);
+        uint64_t start = nowNanoseconds();
+        sendPacket(&members[0], MESSAGE, "bench ping");
+        expectPacket(&members[1], MESSAGE);
+        sendPacket(&members[1], MESSAGE, "bench pong");
+        expectPacket(&members[0], MESSAGE);
+        if(i >= BENCH_WARMUP) roundTrips.push_back(nowNanoseconds() - start);
+    }
+    *serverCPU = cpuSeconds(server.pid) - cpuBefore;
+    stopServer(&server);
+    
+    sort(roundTrips.begin(), roundTrips.end());
+    return roundTrips;
+}
+
+
+// Prints the median and tail of the round trips made one way
+void report(const char *mode, const vector<uint64_t> &roundTrips, double serverCPU)
+{
+    printf("%s: %s, median %.1f us, 99th %.1f us, 99.9th %.1f us, worst %.1f us, %.2f s of server CPU\n",
+           TEST_NAME, mode, percentile(roundTrips, 0.5), percentile(roundTrips, 0.99),
+           percentile(roundTrips, 0.999), roundTrips.back() / 1e3, serverCPU);
+}
+
+
+int main(int argc, char **argv)
+{
+    const char *serverPath = argc > 1 ? argv[1] : NULL;
+    size_t count = argc > 2 ? strtoul(argv[2], NULL, 10) : BENCH_ROUND_TRIPS;
+    if(count == 0) fail("give at least one round trip");
+    
+    double normalCPU, lowLatencyCPU;
+    vector<uint64_t> normal = pingPong(serverPath, {}, count, &normalCPU);
+    vector<uint64_t> lowLatency = pingPong(serverPath, {"-c", BENCH_CPU, "-p", BENCH_BUSY_POLL}, count, &lowLatencyCPU);
+    
+    printf("%s: %zu round trips each way on %ld CPUs\n", TEST_NAME, count, sysconf(_SC_NPROCESSORS_ONLN));
+    report("sleeping in select()", normal, normalCPU);
+    report("pinned to CPU " BENCH_CPU " and busy polling " BENCH_BUSY_POLL " us", lowLatency, lowLatencyCPU);
+    return 0;
+}
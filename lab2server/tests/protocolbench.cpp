@@ -0,0 +1,141 @@
+/*
+ * File:   protocolbench.cpp
+ *
+ * Benchmark of encoding and decoding packets with protocol.h, against the
+ * code it replaced: stringifyMessage() adding up temporary strings, and
+ * messageFromPacket() parsing through a stringstream. Also times handing
+ * packets to a handler through packetDispatcher's table against a switch.
+ * Fails if the two ways disagree on a packet. Takes the number of packets
+ * each is timed with as its argument
+ */
+
+#define TEST_NAME "protocolbench"
+#include "testharness.h"
+
+#include <sstream>
+
+using namespace std;
+
+#define BENCH_PACKETS 1000000   // Packets encoded and decoded each way unless given
+
+volatile size_t sink;           // Keeps the work from being optimised away
+size_t handled[MSG_TYPE_COUNT];
+
+
+// Creates a packet string from a message structure, as it was done before
+string oldStringifyMessage(const struct message *data)
+{
+    string dataStr = to_string(data->type) + " " + to_string(data->size)
+                     + " " + data->source + " " + data->data;
+    return dataStr;
+}
+
+
+// Creates a message structure from a packet (string), as it was done before
+struct message oldMessageFromPacket(const char *buf)
+{
+    string buffer(buf);
+    stringstream ss(buffer);
+    struct message packet;
+    ss >> packet.type >> packet.size >> packet.source;
+    if(!getline(ss, packet.data, '\0')) packet.data = ACK_DATA;
+    return packet;
+}
+
+
+// Counts the packets of each type handed to it, for the dispatch table
+template<msgType type> struct countingHandler {
+    static bool handle(const struct message &packet)
+    {
+        handled[type] += packet.size;
+        return true;
+    }
+};
+
+
+// Hands a packet to the same handler through a switch, as was done before
+bool switchDispatch(const struct message &packet)
+{
+    switch(packet.type)
+    {
+#define BENCH_CASE(name, number) case name: return countingHandler<name>::handle(packet);
+        PROTOCOL_MESSAGE_TYPES(BENCH_CASE)
+#undef BENCH_CASE
+        default: return false;
+    }
+}
+
+
+// Returns the nanoseconds per packet since start
+double perPacket(uint64_t start, size_t packets)
+{
+    return (double) (nowNanoseconds() - start) / packets;
+}
+
+
+int main(int argc, char **argv)
+{
+    size_t packets = argc > 1 ? strtoul(argv[1], NULL, 10) : BENCH_PACKETS;
+    
+    // A session message of a typical length
+    struct message sample;
+    sample.type = MESSAGE;
+    sample.source = "sadman";
+    sample.data = "room hello everyone, the build is green again";
+    sample.size = sample.data.length() + 1;
+    
+    string packet = encodePacket<MESSAGE>(sample.source, sample.data);
+    if(packet != oldStringifyMessage(&sample) || packet != stringifyMessage(&sample))
+    {
+        fail("encoders disagree: '" + packet + "'");
+    }
+    struct message decoded = messageFromPacket(packet.c_str()), oldDecoded = oldMessageFromPacket(packet.c_str());
+    if(decoded.type != oldDecoded.type || decoded.size != oldDecoded.size || decoded.source != oldDecoded.source ||
+       decoded.data != oldDecoded.data)
+    {
+        fail("decoders disagree on '" + packet + "'");
+    }
+    
+    uint64_t start = nowNanoseconds();
+    for(size_t i = 0; i < packets; i++) sink += oldStringifyMessage(&sample).length();
+    double oldEncode = perPacket(start, packets);
+    
+    start = nowNanoseconds();
+    for(size_t i = 0; i < packets; i++) sink += stringifyMessage(&sample).length();
+    double encode = perPacket(start, packets);
+    
+    start = nowNanoseconds();
+    for(size_t i = 0; i < packets; i++) sink += encodePacket<MESSAGE>(sample.source, sample.data).length();
+    double typedEncode = perPacket(start, packets);
+    
+    start = nowNanoseconds();
+    for(size_t i = 0; i < packets; i++) sink += oldMessageFromPacket(packet.c_str()).data.length();
+    double oldDecode = perPacket(start, packets);
+    
+    start = nowNanoseconds();
+    for(size_t i = 0; i < packets; i++) sink += messageFromPacket(packet.c_str()).data.length();
+    double decode = perPacket(start, packets);
+    
+    // Every type in turn, so neither way can guess the next one
+    vector<struct message> mixed(MSG_TYPE_COUNT, sample);
+    for(unsigned int type = 0; type < MSG_TYPE_COUNT; type++) mixed[type].type = type;
+    
+    start = nowNanoseconds();
+    for(size_t i = 0; i < packets; i++) sink += switchDispatch(mixed[i % MSG_TYPE_COUNT]);
+    double switched = perPacket(start, packets);
+    
+    start = nowNanoseconds();
+    for(size_t i = 0; i < packets; i++)
+    {
+        const struct message &next = mixed[i % MSG_TYPE_COUNT];
+        sink += packetDispatcher<countingHandler, const struct message &>::dispatch(next.type, next);
+    }
+    double table = perPacket(start, packets);
+    
+    printf("%s: %zu packets of %zu bytes\n", TEST_NAME, packets, packet.length());
+    printf("%s: encode before %.0f ns, stringifyMessage %.0f ns, encodePacket %.0f ns\n",
+           TEST_NAME, oldEncode, encode, typedEncode);
+    printf("%s: decode before %.0f ns, messageFromPacket %.0f ns\n", TEST_NAME, oldDecode, decode);
+    printf("%s: dispatch by switch %.1f ns, by table %.1f ns\n", TEST_NAME, switched, table);
+    return 0;
+}
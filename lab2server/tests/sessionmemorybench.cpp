@@ -0,0 +1,114 @@
+/*
+ * File:   sessionmemorybench.cpp
+ *
+ * Benchmark of the memory a server holding a million sessions takes. Runs the
+ * server with an admin socket, has one client make a million sessions, or the
+ * number given, then has a second join them all. Asks the server's "memory"
+ * command for its heap and the memory it accounts to sessions before and
+ * after each, and prints what each session took with one member and with
+ * two, in bytes. Fails if a session isn't made or joined, or if the memory
+ * accounted to sessions is off from what the heap grew by by more than a
+ * limit. Takes the path to the server and the number of sessions as its
+ * arguments
+ */
+
+#define TEST_NAME "sessionmemorybench"
+#include "testharness.h"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+#define BENCH_SESSIONS 1000000      // Sessions made unless given
+#define BENCH_ACCOUNTED_PERCENT 10  // How far the memory accounted may be off from the heap's growth
+#define BENCH_DIRECTORY_TEMPLATE "/tmp/sessionmemorybenchXXXXXX"
+
+// Memory the server reports, in bytes
+struct serverMemory {
+    size_t heap;
+    size_t resident;
+    size_t sessions;    // Accounted to sessions
+};
+
+
+// Returns a number the server reports as "name=<number>" in its memory report
+size_t reportedField(const string &report, const string &name)
+{
+    size_t at = report.find(" " + name + "=");
+    if(at == string::npos) fail("no " + name + " in the memory report");
+    return strtoul(report.c_str() + at + name.length() + 2, NULL, 10);
+}
+
+
+// Asks the server for its memory
+struct serverMemory readMemory(int admin)
+{
+    string report = " " + adminCommand(admin, "memory 0");
+    replace(report.begin(), report.end(), '\n', ' ');
+    struct serverMemory memory;
+    memory.heap = reportedField(report, "heap");
+    memory.resident = reportedField(report, "resident");
+    memory.sessions = reportedField(report, "sessions");
+    return memory;
+}
+
+
+// Has a client make or join every session
+// Returns how long it took, in seconds
+double requestAll(struct testClient *client, unsigned int request, unsigned int reply,
+                  const vector<string> &sessionIDs)
+{
+    uint64_t start = nowNanoseconds();
+    requestSessions(client, request, reply, sessionIDs);
+    return (nowNanoseconds() - start) / 1e9;
+}
+
+
+// Prints what each session took, and fails if what's accounted is too far off
+void report(const char *members, const struct serverMemory &before, const struct serverMemory &after,
+            size_t sessions, double seconds)
+{
+    double heap = (double) (after.heap - before.heap) / sessions;
+    double accounted = ((double) after.sessions - before.sessions) / sessions;
+    printf("%s: %s, %.0f bytes a session on the heap, %.0f accounted, %.0f resident, in %.1f s\n",
+           TEST_NAME, members, heap, accounted, ((double) after.resident - before.resident) / sessions, seconds);
+    if(accounted < heap * (100 - BENCH_ACCOUNTED_PERCENT) / 100 ||
+       accounted > heap * (100 + BENCH_ACCOUNTED_PERCENT) / 100)
+    {
+        fail(string(members) + ", " + to_string(lround(accounted)) + " bytes a session accounted against " +
+             to_string(lround(heap)) + " on the heap");
+    }
+}
+
+
+int main(int argc, char **argv)
+{
+    const char *serverPath = argc > 1 ? argv[1] : NULL;
+    size_t sessions = argc > 2 ? strtoul(argv[2], NULL, 10) : BENCH_SESSIONS;
+    if(sessions == 0) fail("give at least one session");
+    
+    char directory[] = BENCH_DIRECTORY_TEMPLATE;
+    if(mkdtemp(directory) == NULL) fail("mkdtemp failed");
+    string adminPath = string(directory) + "/admin";
+    struct testServer server = startServer(serverPath, {"-a", adminPath});
+    int admin = connectToLocalSocket(adminPath);
+    if(admin == -1) fail("can't connect to the admin socket");
+    
+    vector<string> sessionIDs;
+    for(size_t i = 0; i < sessions; i++) sessionIDs.push_back("s" + to_string(i));
+    struct testClient maker = logIn(server, 0), joiner = logIn(server, 1);
+    struct serverMemory empty = readMemory(admin);
+    double seconds = requestAll(&maker, NEW_SESS, NS_ACK, sessionIDs);
+    struct serverMemory made = readMemory(admin);
+    printf("%s: %zu sessions\n", TEST_NAME, sessions);
+    report("one member", empty, made, sessions, seconds);
+    seconds = requestAll(&joiner, JOIN, JN_ACK, sessionIDs);
+    report("two members", empty, readMemory(admin), sessions, seconds);
+    
+    stopServer(&server);
+    close(admin);
+    unlink(adminPath.c_str());
+    rmdir(directory);
+    return 0;
+}
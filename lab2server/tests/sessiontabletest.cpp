@@ -0,0 +1,214 @@
+/*
+ * File:   sessiontabletest.cpp
+ *
+ * Stress test for the registry in sessiontable.h that sessions are kept in:
+ * the open-addressed table from their names to IDs, their records, and the
+ * members kept in a record or moved out to a hash set. Sessions are made,
+ * joined, left and closed at random as the server does for its clients, with
+ * as many open as the table takes before growing, so runs of full slots are
+ * long and closing sessions keeps shifting entries back. Popular sessions keep
+ * crossing SESSION_INLINE_MEMBERS both ways. Everything is checked against a
+ * plain model as it goes. Fails if a session can't be found or is found when
+ * it shouldn't be, if its members differ from the model, or if an ID is used
+ * twice or not reused
+ */
+
+#define TEST_NAME "sessiontabletest"
+#include "testharness.h"
+#include "../sessiontable.h"
+
+#include <map>
+#include <random>
+#include <set>
+
+using namespace std;
+
+#define TEST_CLIENTS 64
+#define TEST_NAMES 8192             // Names sessions are made with
+#define TEST_POPULAR 8              // Of those, the ones half the joins go to and few leave
+#define TEST_CHURN 200000           // Random changes made at each level
+#define TEST_CHECK_EVERY 10000      // Changes between checking everything
+#define TEST_LEVELS {3000, 3070, 200, 3070, 0} // Sessions kept open in turn, 3072 filling 4096 slots
+
+struct sessionTable table;
+mt19937 generator(49);
+vector<string> names;
+map<string, set<int>> modelSessions;
+map<int, set<string>> modelClients;
+size_t peakSessions = 0;
+
+
+// Fails unless an open session can be found, before the registry is changed
+// in a way that relies on it
+void expectSession(const string &sessionID)
+{
+    if(findSession(&table, sessionID) == NULL) fail("lost '" + sessionID + "'");
+}
+
+
+// Returns a random number below limit
+size_t randomBelow(size_t limit)
+{
+    return uniform_int_distribution<size_t>(0, limit - 1)(generator);
+}
+
+
+// Makes a session for a client as createSession does
+void makeSession(int client, const string &sessionID)
+{
+    if(findSession(&table, sessionID) != NULL) fail("found '" + sessionID + "' before it was made");
+    struct sessionRecord *session = addSession(&table, sessionID, "pw");
+    expectSession(sessionID);
+    addMember(session->members, client);
+    modelSessions[sessionID].insert(client);
+    modelClients[client].insert(sessionID);
+    peakSessions = max(peakSessions, modelSessions.size());
+}
+
+
+// Has a client leave a session, which closes it if it was the last member
+void takeOutOfSession(int client, const string &sessionID)
+{
+    expectSession(sessionID);
+    uint32_t id = sessionIDOf(&table, sessionID);
+    removeMember(table.records[id].members, client);
+    if(table.records[id].members.count == 0) removeSession(&table, id);
+    modelSessions[sessionID].erase(client);
+    if(modelSessions[sessionID].empty()) modelSessions.erase(sessionID);
+    modelClients[client].erase(sessionID);
+    if(modelClients[client].empty()) modelClients.erase(client);
+    if(modelSessions.find(sessionID) == modelSessions.end() && findSession(&table, sessionID) != NULL)
+    {
+        fail("found '" + sessionID + "' after it was closed");
+    }
+}
+
+
+// Makes one random change, moving the number of sessions open towards level
+void changeSessions(size_t level)
+{
+    int client = randomBelow(TEST_CLIENTS);
+    size_t choice = randomBelow(4);
+    
+    if(modelSessions.size() < level && choice < 2)
+    {
+        const string &sessionID = names[randomBelow(names.size())];
+        if(modelSessions.find(sessionID) == modelSessions.end()) makeSession(client, sessionID);
+        return;
+    }
+    
+    // Joins go mostly to the popular sessions, so they grow past the members a
+    // record holds, and leaves mostly come from the others
+    if(choice == 2)
+    {
+        const string &sessionID = names[randomBelow(randomBelow(2) == 0 ? TEST_POPULAR : names.size())];
+        auto session = modelSessions.find(sessionID);
+        if(session == modelSessions.end() || session->second.count(client) > 0) return;
+        expectSession(sessionID);
+        addMember(findSession(&table, sessionID)->members, client);
+        session->second.insert(client);
+        modelClients[client].insert(sessionID);
+        return;
+    }
+    
+    auto sessions = modelClients.find(client);
+    if(sessions == modelClients.end()) return;
+    auto sessionID = sessions->second.begin();
+    advance(sessionID, randomBelow(sessions->second.size()));
+    if(sessionID->compare(0, 7, "popular") == 0 && randomBelow(4) != 0) return;
+    takeOutOfSession(client, *sessionID);
+}
+
+
+// Checks a session's record and members against the model
+void checkSession(const string &sessionID, const set<int> &members)
+{
+    struct sessionRecord *session = findSession(&table, sessionID);
+    if(session == NULL) fail("lost '" + sessionID + "'");
+    if(session->name != sessionID) fail("looking up '" + sessionID + "' found '" + session->name + "'");
+    if(session->members.count != members.size())
+    {
+        fail("'" + sessionID + "' has " + to_string(session->members.count) + " members instead of " +
+             to_string(members.size()));
+    }
+    
+    set<int> found;
+    for(auto const & clientSockfd : membersOf(session->members))
+    {
+        if(!found.insert(clientSockfd).second)
+        {
+            fail("client " + to_string(clientSockfd) + " listed twice in '" + sessionID + "'");
+        }
+    }
+    if(found != members) fail("'" + sessionID + "' lists the wrong members");
+    for(int client = 0; client < TEST_CLIENTS; client++)
+    {
+        if(hasMember(session->members, client) != (members.count(client) > 0))
+        {
+            fail("'" + sessionID + "' is wrong about client " + to_string(client));
+        }
+    }
+}
+
+
+// Checks every session and the table against the model
+void checkEverything()
+{
+    if(table.count != modelSessions.size())
+    {
+        fail("counted " + to_string(table.count) + " sessions instead of " + to_string(modelSessions.size()));
+    }
+    for(auto const & session : modelSessions) checkSession(session.first, session.second);
+    for(size_t i = 0; i < names.size(); i += 7)
+    {
+        if(modelSessions.find(names[i]) == modelSessions.end() && sessionIDOf(&table, names[i]) != NO_SESSION)
+        {
+            fail("found '" + names[i] + "' which isn't open");
+        }
+    }
+    
+    // Each open session is in the table once, and the IDs left over are free
+    set<uint32_t> ids;
+    for(auto const & slot : table.slots)
+    {
+        if(slot.id == NO_SESSION) continue;
+        if(!ids.insert(slot.id).second) fail("ID " + to_string(slot.id) + " is in the table twice");
+        if(slot.hash != sessionHash(table.records[slot.id].name)) fail("a slot has the wrong hash");
+    }
+    if(ids.size() + table.freeIDs.size() != table.records.size()) fail("IDs went missing");
+    if(table.records.size() > peakSessions) fail("IDs weren't reused");
+    for(auto const & id : table.freeIDs)
+    {
+        if(ids.count(id) > 0 || !table.records[id].name.empty()) fail("ID " + to_string(id) + " is free and in use");
+    }
+}
+
+
+int main()
+{
+    for(size_t i = 0; i < TEST_NAMES; i++)
+    {
+        if(i < TEST_POPULAR) names.push_back("popular" + to_string(i));
+        else names.push_back(i % 3 == 0 ? "a-session-with-a-longer-name-" + to_string(i) : "s" + to_string(i));
+    }
+    
+    size_t changes = 0, grown = 0;
+    for(size_t level : TEST_LEVELS)
+    {
+        size_t tableSize = table.slots.size();
+        for(size_t i = 0; i < TEST_CHURN || (level == 0 && !modelSessions.empty()); i++, changes++)
+        {
+            changeSessions(level);
+            if(changes % TEST_CHECK_EVERY == 0) checkEverything();
+        }
+        checkEverything();
+        if(table.slots.size() != tableSize) grown++;
+    }
+    
+    if(table.count != 0) fail("sessions left over at the end");
+    if(grown == 0) fail("the table never grew");
+    
+    printf("%s: %zu changes to up to %zu sessions in %zu slots, OK\n",
+           TEST_NAME, changes, peakSessions, table.slots.size());
+    return 0;
+}
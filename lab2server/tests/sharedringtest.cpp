@@ -0,0 +1,174 @@
+/*
+ * File:   sharedringtest.cpp
+ *
+ * Stress test for the shared memory rings clients on the same host talk to the
+ * server through. A client logs in on the server's local socket, moves to
+ * shared memory and makes a session, and a second client joins it over TCP.
+ * The second sends the session numbered messages of varying length, which the
+ * first reads a little at a time, pausing now and then, so its ring from the
+ * server keeps filling up and wrapping round. Meanwhile the first sends its
+ * own numbered messages through its ring to the server. Either side only
+ * sleeps once it has nothing to do, so a wakeup that goes missing leaves it
+ * asleep for good. Fails if that happens, or if a message is lost, repeated or
+ * out of order either way. It's run first with the first client only reading,
+ * so nothing it sends wakes the server when it makes room. Takes the path to
+ * the server as its argument
+ */
+
+#define TEST_NAME "sharedringtest"
+#include "testharness.h"
+
+#include <atomic>
+#include <thread>
+
+using namespace std;
+
+#define TEST_PACKETS 100000         // Messages sent each way
+#define TEST_MAX_PADDING 300        // Most bytes a message is padded with, so they wrap at different places
+#define TEST_CLIENT_READ 4096       // Bytes the shared memory client reads at a time
+#define TEST_SLOW_EVERY 16          // Reads between it stopping for a moment, long enough for the server to sleep
+#define TEST_SLOW_PAUSE 2000        // Microseconds it stops for
+#define TEST_SLEEP_LIMIT 2000       // Milliseconds it sleeps before taking a wakeup as lost
+#define TEST_DIRECTORY_TEMPLATE "/tmp/sharedringtestXXXXXX"
+
+atomic<size_t> tcpReceived(0);      // Messages the TCP member has been sent
+
+
+// Returns the text of message number, padded to a length that depends on it
+string numberedText(size_t number)
+{
+    return "ring " + to_string(number) + " " + string((number * 7919) % TEST_MAX_PADDING, 'x');
+}
+
+
+// Checks a session message is the next one numbered
+void checkMessage(const struct message &packet, size_t *next, const string &who)
+{
+    // The data keeps the space after the source
+    if(packet.type != MESSAGE || packet.data.compare(1, string::npos, numberedText(*next)) != 0)
+    {
+        fail(who + " got " + to_string(packet.type) + " '" + packet.data.substr(0, 20) + "' instead of message " +
+             to_string(*next));
+    }
+    (*next)++;
+}
+
+
+// Sends the session numbered messages from the TCP member
+void sendOverTCP(struct testClient *member)
+{
+    for(size_t i = 0; i < TEST_PACKETS; i++) sendPacket(member, MESSAGE, numberedText(i));
+}
+
+
+// Reads what the shared memory member sends the session, on the TCP member
+void readOverTCP(struct testClient member, size_t messages)
+{
+    struct message packet;
+    size_t next = 0;
+    while(next < messages)
+    {
+        if(!readPacket(&member, &packet)) fail("TCP member got only " + to_string(next) + " messages");
+        checkMessage(packet, &next, member.userID);
+        tcpReceived = next;
+    }
+}
+
+
+// Sends numbered messages through the shared memory member's ring and reads
+// those from the TCP member out of its own, as a client on shared memory
+// does: sleeping on its wakeup only when its ring to the server is full and the
+// one from it empty
+void runSharedMember(struct testClient *member, size_t messages)
+{
+    struct sharedRing *toServer = &member->shared->toServer, *toClient = &member->shared->toClient;
+    string sending, buffer;
+    size_t sentMessages = 0, received = 0, reads = 0, sent = 0;
+    char chunk[TEST_CLIENT_READ];
+    while(received < TEST_PACKETS || sentMessages < messages || sent < sending.length())
+    {
+        bool progress = false;
+        if(sent == sending.length() && sentMessages < messages)
+        {
+            string text = numberedText(sentMessages++);
+            struct message packet = {MESSAGE, (unsigned int) text.length() + 1, member->userID, text};
+            sending = stringifyMessage(&packet);
+            sending += '\0';
+            sent = 0;
+        }
+        if(sent < sending.length())
+        {
+            size_t numBytes = sharedRingWrite(toServer, sending.data() + sent, sending.length() - sent);
+            if(numBytes > 0) sharedRingWake(toServer->readerWaiting, member->serverWakeup);
+            sent += numBytes;
+            progress = numBytes > 0;
+        }
+        
+        size_t numBytes = sharedRingRead(toClient, chunk, sizeof(chunk));
+        if(numBytes > 0)
+        {
+            sharedRingWake(toClient->writerWaiting, member->serverWakeup);
+            buffer.append(chunk, numBytes);
+            size_t start = 0, end;
+            while((end = buffer.find('\0', start)) != string::npos)
+            {
+                checkMessage(messageFromPacket(buffer.c_str() + start), &received, member->userID);
+                start = end + 1;
+            }
+            buffer.erase(0, start);
+            if(++reads % TEST_SLOW_EVERY == 0) usleep(TEST_SLOW_PAUSE);
+            progress = true;
+        }
+        if(progress) continue;
+        
+        // Only sleep if the server still has to move for us to go on
+        bool canWrite = sent < sending.length() && !sharedRingWriterSleeps(toServer, 1);
+        if(!sharedRingReaderSleeps(toClient) || canWrite) continue;
+        if(!awaitServer(member, TEST_SLEEP_LIMIT))
+        {
+            fail(member->userID + " never woken, or dropped, " + to_string(received) + " messages in");
+        }
+    }
+}
+
+
+// Has the shared memory member send messages and be sent TEST_PACKETS
+void run(const char *serverPath, size_t messages)
+{
+    char directory[] = TEST_DIRECTORY_TEMPLATE;
+    if(mkdtemp(directory) == NULL) fail("mkdtemp failed");
+    string socketPath = string(directory) + "/socket";
+    struct testServer server = startServer(serverPath, {"-u", socketPath});
+    
+    struct testClient shared = logInLocally(socketPath, 0);
+    attachSharedMemory(&shared);
+    sendPacket(&shared, NEW_SESS, "ring pw");
+    expectPacket(&shared, NS_ACK);
+    struct testClient tcp = logIn(server, 1);
+    sendPacket(&tcp, JOIN, "ring pw");
+    expectPacket(&tcp, JN_ACK);
+    
+    tcpReceived = 0;
+    thread reader(readOverTCP, tcp, messages);
+    thread sender(sendOverTCP, &tcp);
+    uint64_t start = nowNanoseconds();
+    runSharedMember(&shared, messages);
+    sender.join();
+    reader.join();
+    uint64_t elapsed = nowNanoseconds() - start;
+    stopServer(&server);
+    unlink(socketPath.c_str());
+    rmdir(directory);
+    
+    printf("%s: %zu messages through the ring to the server and %d back in %.0f ms, OK\n",
+           TEST_NAME, tcpReceived.load(), TEST_PACKETS, elapsed / 1e6);
+}
+
+
+int main(int argc, char **argv)
+{
+    const char *serverPath = argc > 1 ? argv[1] : NULL;
+    run(serverPath, 0);
+    run(serverPath, TEST_PACKETS);
+    return 0;
+}
@@ -0,0 +1,255 @@
+/*
+ * File:   soaktest.cpp
+ *
+ * Soak test of the server's memory limits. Runs the server with -M 8,12 and
+ * keeps it under load meant to make it hold as much as it can: one member of
+ * a session floods it with messages, two members never read theirs, another
+ * streams a message of chunks that never ends, another floods direct
+ * messages to a user who's offline, and hundreds of connections sit part way
+ * through their LOGIN. Each logs back in whenever the server disconnects it.
+ * Samples the server's resident size throughout. Fails if it ever grows
+ * more than a margin past the hard limit, or if the server can't log in the
+ * offline user at the end. Takes the path to the server and the seconds to
+ * run for as its arguments
+ */
+
+#define TEST_NAME "soaktest"
+#include "testharness.h"
+
+#include <atomic>
+#include <thread>
+
+using namespace std;
+
+#define TEST_SECONDS 5                  // How long the load runs for unless given
+#define TEST_SOFT_LIMIT 8               // Megabytes, as given to -M
+#define TEST_HARD_LIMIT 12
+#define TEST_RESIDENT_MARGIN (24UL << 20) // Growth allowed past the hard limit, for the allocator
+#define TEST_PARTIAL_LOGINS 300
+#define TEST_SAMPLE_INTERVAL 50         // Milliseconds between looks at the server's resident size
+#define TEST_TEXT_SIZE 1000             // Bytes of text in each message flooded
+#define TEST_DIRECTORY_TEMPLATE "/tmp/soaktestXXXXXX"
+#define TEST_LOGIN_TRIES 100            // Times a user tries to log back in, 10 ms apart
+
+// Who does what, by their place in testUsers
+#define TEST_FLOODER 0
+#define TEST_FIRST_SILENT 1             // The first of the two members that never read
+#define TEST_STREAMER 3
+#define TEST_MESSENGER 4
+#define TEST_OFFLINE 5
+
+struct testServer server;
+atomic<bool> stopping(false);
+atomic<size_t> sent(0), reconnects(0), refused(0);
+
+
+// Returns the resident memory of a process, in bytes
+size_t residentBytes(pid_t pid)
+{
+    char path[64], status[4096];
+    snprintf(path, sizeof(path), "/proc/%d/status", (int) pid);
+    int fd = open(path, O_RDONLY);
+    ssize_t numBytes = fd == -1 ? -1 : read(fd, status, sizeof(status) - 1);
+    if(fd != -1) close(fd);
+    if(numBytes <= 0) fail(string("can't read ") + path);
+    status[numBytes] = '\0';
+    
+    const char *line = strstr(status, "VmRSS:");
+    if(line == NULL) fail(string("no VmRSS in ") + path);
+    return strtoul(line + strlen("VmRSS:"), NULL, 10) << 10;
+}
+
+
+// Writes all of a packet to the server, unless it has hung up or the test is
+// stopping
+// Returns false if it has, or it is
+bool trySend(struct testClient *client, unsigned int type, const string &data)
+{
+    struct message packet = {type, (unsigned int) data.length() + 1, client->userID, data};
+    string bytes = stringifyMessage(&packet);
+    bytes += '\0';
+    for(size_t sent = 0; sent < bytes.length(); )
+    {
+        ssize_t numBytes = write(client->sockfd, bytes.data() + sent, bytes.length() - sent);
+        if(numBytes == -1 && errno == EAGAIN)
+        {
+            if(stopping) return false;
+            struct pollfd room = {client->sockfd, POLLOUT, 0};
+            poll(&room, 1, TEST_SAMPLE_INTERVAL);
+        }
+        else if(numBytes == -1 && errno != EINTR) return false;
+        else if(numBytes > 0) sent += numBytes;
+    }
+    return true;
+}
+
+
+// Logs a user in, or back in once the server has dropped them, and has them
+// join the session unless it's the messenger
+// Returns a client without a socket if the test is stopping
+struct testClient rejoin(int user, struct testClient *last = NULL)
+{
+    if(last != NULL)
+    {
+        close(last->sockfd);
+        reconnects++;
+    }
+    
+    // The server may not have seen the last connection go yet
+    struct testClient client;
+    client.userID = testUsers[user][0];
+    struct message reply;
+    for(int tries = 0; tries < TEST_LOGIN_TRIES; tries++)
+    {
+        if(stopping)
+        {
+            client.sockfd = -1;
+            return client;
+        }
+        if((client.sockfd = connectToPort(server.port)) == -1) fail("can't connect to the server");
+        client.buffer.clear();
+        if(trySend(&client, LOGIN, testUsers[user][1]) && readPacket(&client, &reply) && reply.type == LO_ACK)
+        {
+            if(user == TEST_MESSENGER) return client;
+            if(trySend(&client, user == TEST_FLOODER ? NEW_SESS : JOIN, "soak pw") && readPacket(&client, &reply) &&
+               (reply.type == NS_ACK || reply.type == JN_ACK || reply.type == NS_NAK))
+            {
+                return client;
+            }
+        }
+        close(client.sockfd);
+        usleep(10000);
+    }
+    fail(client.userID + " couldn't log back in");
+    return client;
+}
+
+
+// Floods the session with messages, taking nothing it's sent
+void flood()
+{
+    struct testClient flooder = rejoin(TEST_FLOODER);
+    string text = "soak " + string(TEST_TEXT_SIZE, 'f');
+    while(!stopping)
+    {
+        if(trySend(&flooder, MESSAGE, text)) sent++;
+        else flooder = rejoin(TEST_FLOODER, &flooder);
+    }
+}
+
+
+// Sits in the session never reading
+void staySilent(int user)
+{
+    struct testClient member = rejoin(user);
+    while(!stopping)
+    {
+        struct pollfd hangup = {member.sockfd, POLLRDHUP, 0};
+        if(poll(&hangup, 1, TEST_SAMPLE_INTERVAL) == 1) member = rejoin(user, &member);
+    }
+}
+
+
+// Streams a message to the session in chunks without ever finishing it, and
+// reads what the session sends
+void stream()
+{
+    struct testClient streamer = rejoin(TEST_STREAMER);
+    string payload(TEST_TEXT_SIZE, 's');
+    char buffer[65536];
+    for(size_t offset = 0; !stopping; offset += TEST_TEXT_SIZE)
+    {
+        bool open = trySend(&streamer, MESSAGE_CHUNK, "soak 1 " + to_string(offset) + " 1000000000000 " + payload);
+        ssize_t numBytes;
+        while(open && (numBytes = recv(streamer.sockfd, buffer, sizeof(buffer), MSG_DONTWAIT)) != 0)
+        {
+            if(numBytes == -1) open = errno == EAGAIN || errno == EINTR;
+            if(numBytes == -1) break;
+        }
+        if(!open)
+        {
+            streamer = rejoin(TEST_STREAMER, &streamer);
+            offset = 0;
+        }
+    }
+}
+
+
+// Floods direct messages to the offline user, until their mailbox is full
+void message()
+{
+    struct testClient messenger = rejoin(TEST_MESSENGER);
+    string text = string(testUsers[TEST_OFFLINE][0]) + " " + string(TEST_TEXT_SIZE, 'd');
+    struct message reply;
+    while(!stopping)
+    {
+        if(!trySend(&messenger, DIRMESSAGE, text) || !readPacket(&messenger, &reply))
+        {
+            messenger = rejoin(TEST_MESSENGER, &messenger);
+        }
+        else if(reply.type == DMESS_NAK) refused++;
+    }
+}
+
+
+// Opens connections that send half a LOGIN and nothing more
+void startPartialLogins()
+{
+    for(int i = 0; i < TEST_PARTIAL_LOGINS; i++)
+    {
+        int sockfd = connectToPort(server.port);
+        if(sockfd == -1) fail("can't connect to the server");
+        if(write(sockfd, "0 6 joh", 7) != 7) fail("couldn't start a LOGIN");
+    }
+}
+
+
+int main(int argc, char **argv)
+{
+    const char *serverPath = argc > 1 ? argv[1] : NULL;
+    int seconds = argc > 2 ? atoi(argv[2]) : TEST_SECONDS;
+    
+    char directory[] = TEST_DIRECTORY_TEMPLATE;
+    if(mkdtemp(directory) == NULL) fail("mkdtemp failed");
+    string limits = to_string(TEST_SOFT_LIMIT) + "," + to_string(TEST_HARD_LIMIT);
+    server = startServer(serverPath, {"-d", directory, "-M", limits});
+    size_t baseline = residentBytes(server.pid), peak = baseline;
+    
+    // The session is made before the others join it
+    signal(SIGPIPE, SIG_IGN);
+    vector<thread> adversaries;
+    adversaries.push_back(thread(flood));
+    usleep(100000);
+    adversaries.push_back(thread(staySilent, TEST_FIRST_SILENT));
+    adversaries.push_back(thread(staySilent, TEST_FIRST_SILENT + 1));
+    adversaries.push_back(thread(stream));
+    adversaries.push_back(thread(message));
+    startPartialLogins();
+    
+    uint64_t start = nowNanoseconds();
+    while(nowNanoseconds() - start < (uint64_t) seconds * 1000000000)
+    {
+        usleep(TEST_SAMPLE_INTERVAL * 1000);
+        peak = max(peak, residentBytes(server.pid));
+        if(peak - baseline > ((size_t) TEST_HARD_LIMIT << 20) + TEST_RESIDENT_MARGIN)
+        {
+            fail("server grew by " + to_string((peak - baseline) >> 20) + " MB, past the hard limit of " +
+                 to_string(TEST_HARD_LIMIT) + " MB");
+        }
+    }
+    stopping = true;
+    for(auto & adversary : adversaries) adversary.join();
+    
+    // Under all that, the server must still let someone log in
+    struct testClient offline = logIn(server, TEST_OFFLINE);
+    close(offline.sockfd);
+    stopServer(&server);
+    string command = string("rm -rf ") + directory;
+    if(system(command.c_str()) != 0) fail("can't remove " + string(directory));
+    
+    printf("%s: %d s under load, %zu messages flooded, %zu reconnects, %zu direct messages refused\n",
+           TEST_NAME, seconds, sent.load(), reconnects.load(), refused.load());
+    printf("%s: server grew by at most %.1f MB with a hard limit of %d MB, OK\n",
+           TEST_NAME, (double) (peak - baseline) / (1 << 20), TEST_HARD_LIMIT);
+    return 0;
+}
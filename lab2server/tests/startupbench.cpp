@@ -0,0 +1,123 @@
+/*
+ * File:   startupbench.cpp
+ *
+ * Benchmark of starting the server with a great many sessions kept in its
+ * state directory. Writes a snapshot of them the way the server does, then
+ * times how long the server takes to log a client in once started with it,
+ * against starting with an empty state directory. The kernel completes
+ * connections to the listener before the sessions are loaded, so a LO_ACK is
+ * the first sign the server is ready. Joins the last session with its
+ * password to check they were all loaded. Takes the path to the server and
+ * the number of sessions as its arguments
+ */
+
+#define TEST_NAME "startupbench"
+#include "testharness.h"
+
+#include <algorithm>
+#include <sys/stat.h>
+
+using namespace std;
+
+#define BENCH_SESSIONS 1000000      // Sessions in the snapshot unless given
+#define BENCH_STARTS 3              // Starts timed each way, the quickest is kept
+#define BENCH_SNAPSHOT_FILE "sessions.snap"
+#define BENCH_SNAPSHOT_MAGIC "CHATSNP1"
+#define BENCH_DIRECTORY_TEMPLATE "/tmp/startupbenchXXXXXX"
+
+
+// Returns the name and password of one of the sessions in the snapshot
+string sessionName(uint32_t number)
+{
+    return "session" + to_string(number);
+}
+
+string sessionPassword(uint32_t number)
+{
+    return "pw" + to_string(number);
+}
+
+
+// Writes a snapshot of count sessions to the state directory, covering every
+// journal before the first generation. The server writes sessions in name
+// order, which it loads fastest, so they're sorted the same way here
+void writeSnapshot(const string &directory, uint32_t count)
+{
+    vector<string> names;
+    for(uint32_t i = 0; i < count; i++) names.push_back(sessionName(i));
+    sort(names.begin(), names.end());
+    
+    string snapshot(BENCH_SNAPSHOT_MAGIC);
+    uint32_t header[2] = {1, count};
+    snapshot.append((const char *) header, sizeof(header));
+    for(auto const & name : names)
+    {
+        string password = sessionPassword(strtoul(name.c_str() + strlen("session"), NULL, 10));
+        uint16_t lengths[2] = {(uint16_t) name.length(), (uint16_t) password.length()};
+        snapshot.append((const char *) lengths, sizeof(lengths));
+        snapshot += name + password;
+    }
+    
+    string path = directory + "/" + BENCH_SNAPSHOT_FILE;
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if(fd == -1 || write(fd, snapshot.data(), snapshot.length()) != (ssize_t) snapshot.length()) fail("can't write " + path);
+    close(fd);
+}
+
+
+// Removes the state directory and everything the server left in it
+void removeDirectory(const string &directory)
+{
+    string command = "rm -rf " + directory;
+    if(system(command.c_str()) != 0) fail("can't remove " + directory);
+}
+
+
+// Starts the server with a fresh state directory holding a snapshot of the
+// sessions, if there are any, and logs a client in
+// Returns the nanoseconds until it was logged in
+uint64_t timeStart(const char *serverPath, uint32_t sessions, struct testServer *server,
+                   struct testClient *client, string *directory)
+{
+    char name[] = BENCH_DIRECTORY_TEMPLATE;
+    if(mkdtemp(name) == NULL) fail("mkdtemp failed");
+    *directory = name;
+    if(sessions > 0) writeSnapshot(name, sessions);
+    
+    uint64_t start = nowNanoseconds();
+    *server = startServer(serverPath, {"-d", name});
+    *client = logIn(*server, 0);
+    return nowNanoseconds() - start;
+}
+
+
+int main(int argc, char **argv)
+{
+    const char *serverPath = argc > 1 ? argv[1] : NULL;
+    uint32_t sessions = argc > 2 ? strtoul(argv[2], NULL, 10) : BENCH_SESSIONS;
+    if(sessions == 0) fail("give at least one session");
+    
+    uint64_t empty = UINT64_MAX, loaded = UINT64_MAX;
+    struct testServer server;
+    struct testClient client;
+    string directory;
+    for(int i = 0; i < BENCH_STARTS; i++)
+    {
+        empty = min(empty, timeStart(serverPath, 0, &server, &client, &directory));
+        stopServer(&server);
+        close(client.sockfd);
+        removeDirectory(directory);
+        
+        // The last session loaded can be joined with its password
+        loaded = min(loaded, timeStart(serverPath, sessions, &server, &client, &directory));
+        sendPacket(&client, JOIN, sessionName(sessions - 1) + " " + sessionPassword(sessions - 1));
+        expectPacket(&client, JN_ACK);
+        stopServer(&server);
+        close(client.sockfd);
+        removeDirectory(directory);
+    }
+    
+    printf("%s: started with %u sessions in %.0f ms, with none in %.0f ms\n",
+           TEST_NAME, sessions, loaded / 1e6, empty / 1e6);
+    return 0;
+}
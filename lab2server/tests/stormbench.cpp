@@ -0,0 +1,195 @@
+/*
+ * File:   stormbench.cpp
+ *
+ * Benchmark of a reconnect storm, thousands of clients connecting and sending
+ * their LOGIN all at once as they would after a network blip. Every
+ * connection logs in as one of the six users the server lets in, so the first
+ * of each is let in and the rest are told the user is already logged in.
+ * Prints how long it took until every connection had its answer, how long
+ * each waited for it, and how many waited more than a second, which is what
+ * a connection dropped from a full accept queue waits for its SYN to be sent
+ * again. Fails unless each got an answer and exactly six were let in. Takes
+ * the path to the server and the number of connections as its arguments
+ */
+
+#define TEST_NAME "stormbench"
+#include "testharness.h"
+
+#include <algorithm>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+using namespace std;
+
+#define BENCH_CONNECTIONS 10000     // Connections in the storm unless given
+#define BENCH_SPARE_FDS 64          // Descriptors kept for other than the connections
+#define BENCH_RETRANSMIT 1000       // Milliseconds a dropped SYN waits to be sent again
+#define BENCH_EVENTS 256
+
+// A connection in the storm
+struct stormConnection {
+    int sockfd;
+    int user;
+    bool sent;                      // Its LOGIN has been written
+    uint64_t startedAt;
+    uint64_t answeredAt;
+    string buffer;
+};
+
+
+// Starts connecting to the server without waiting for it
+// Returns false if the connection couldn't be started
+bool startConnecting(struct stormConnection &connection, int port, int epollfd)
+{
+    connection.sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(connection.sockfd == -1) return false;
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    
+    connection.startedAt = nowNanoseconds();
+    if(connect(connection.sockfd, (struct sockaddr *) &address, sizeof(address)) == -1 && errno != EINPROGRESS)
+    {
+        return false;
+    }
+    struct epoll_event event;
+    event.events = EPOLLOUT | EPOLLIN;
+    event.data.ptr = &connection;
+    return epoll_ctl(epollfd, EPOLL_CTL_ADD, connection.sockfd, &event) == 0;
+}
+
+
+// Writes a connection's LOGIN once it has connected, all in one go as it's
+// far smaller than the socket's buffer
+// Returns false if it couldn't connect
+bool sendLogin(struct stormConnection &connection, int epollfd)
+{
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if(getsockopt(connection.sockfd, SOL_SOCKET, SO_ERROR, &error, &length) == -1 || error != 0) return false;
+    
+    struct message packet = {LOGIN, (unsigned int) strlen(testUsers[connection.user][1]) + 1,
+                             testUsers[connection.user][0], testUsers[connection.user][1]};
+    string bytes = stringifyMessage(&packet);
+    bytes += '\0';
+    if(write(connection.sockfd, bytes.data(), bytes.length()) != (ssize_t) bytes.length()) return false;
+    
+    connection.sent = true;
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = &connection;
+    return epoll_ctl(epollfd, EPOLL_CTL_MOD, connection.sockfd, &event) == 0;
+}
+
+
+// Reads what's arrived for a connection, and once the answer to its LOGIN has
+// all come, stops watching it. It's closed unless it was let in, as closing
+// it would log its user out for the next connection to be let in instead
+// Returns the answer's type once it has, 0 until then, or -1 if the server
+// hung up first
+int readAnswer(struct stormConnection &connection, int epollfd)
+{
+    char chunk[4096];
+    ssize_t numBytes = read(connection.sockfd, chunk, sizeof(chunk));
+    if(numBytes == -1 && (errno == EAGAIN || errno == EINTR)) return 0;
+    if(numBytes <= 0) return -1;
+    connection.buffer.append(chunk, numBytes);
+    if(connection.buffer.find('\0') == string::npos) return 0;
+    
+    connection.answeredAt = nowNanoseconds();
+    int type = messageFromPacket(connection.buffer.c_str()).type;
+    epoll_ctl(epollfd, EPOLL_CTL_DEL, connection.sockfd, NULL);
+    if(type != LO_ACK) close(connection.sockfd);
+    return type;
+}
+
+
+// Sends the LOGIN of each connection that has connected, and reads the
+// answers that have come, waiting up to timeout milliseconds for something to
+// happen. Counts the answers, and those that let the connection in
+// Returns false if nothing happened in time
+bool handleEvents(int epollfd, int timeout, size_t *answered, size_t *accepted)
+{
+    struct epoll_event events[BENCH_EVENTS];
+    int ready = epoll_wait(epollfd, events, BENCH_EVENTS, timeout);
+    if(ready == -1 && errno == EINTR) return true;
+    if(ready <= 0) return false;
+    
+    for(int e = 0; e < ready; e++)
+    {
+        struct stormConnection &connection = *(struct stormConnection *) events[e].data.ptr;
+        if(!connection.sent && (events[e].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+        {
+            if(!sendLogin(connection, epollfd)) fail("a connection couldn't send its LOGIN");
+            continue;
+        }
+        
+        int type = readAnswer(connection, epollfd);
+        if(type == -1) fail("the server hung up on a connection before answering it");
+        if(type == LO_ACK) (*accepted)++;
+        else if(type != 0 && type != LO_NAK) fail("a LOGIN was answered with a " + to_string(type));
+        if(type != 0) (*answered)++;
+    }
+    return true;
+}
+
+
+int main(int argc, char **argv)
+{
+    const char *serverPath = argc > 1 ? argv[1] : NULL;
+    size_t count = argc > 2 ? strtoul(argv[2], NULL, 10) : BENCH_CONNECTIONS;
+    if(count < TEST_USER_COUNT) fail("give at least " + to_string(TEST_USER_COUNT) + " connections");
+    
+    // Every connection is open at once
+    struct rlimit files;
+    getrlimit(RLIMIT_NOFILE, &files);
+    files.rlim_cur = files.rlim_max;
+    if(setrlimit(RLIMIT_NOFILE, &files) == -1 || files.rlim_cur < count + BENCH_SPARE_FDS)
+    {
+        fail("can only open " + to_string(files.rlim_cur) + " files, too few for " + to_string(count) +
+             " connections");
+    }
+    
+    struct testServer server = startServer(serverPath, {});
+    int epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if(epollfd == -1) fail("epoll_create1 failed");
+    vector<struct stormConnection> connections(count);
+    
+    // Each connection sends its LOGIN as soon as it has connected, as a
+    // client would, while the rest are still starting
+    size_t answered = 0, accepted = 0;
+    uint64_t start = nowNanoseconds();
+    for(size_t i = 0; i < count; i++)
+    {
+        connections[i].user = i % TEST_USER_COUNT;
+        connections[i].sent = false;
+        if(!startConnecting(connections[i], server.port, epollfd)) fail("couldn't start connection " + to_string(i));
+        handleEvents(epollfd, 0, &answered, &accepted);
+    }
+    while(answered < count)
+    {
+        if(!handleEvents(epollfd, TEST_READ_LIMIT, &answered, &accepted))
+        {
+            fail("only " + to_string(answered) + " of " + to_string(count) + " connections were answered");
+        }
+    }
+    uint64_t elapsed = nowNanoseconds() - start;
+    close(epollfd);
+    stopServer(&server);
+    if(accepted != TEST_USER_COUNT) fail(to_string(accepted) + " connections were let in");
+    
+    vector<double> waits;
+    size_t retransmitted = 0;
+    for(auto & connection : connections)
+    {
+        waits.push_back((connection.answeredAt - connection.startedAt) / 1e6);
+        if(waits.back() >= BENCH_RETRANSMIT) retransmitted++;
+    }
+    sort(waits.begin(), waits.end());
+    printf("%s: %zu connections answered in %.1f ms, %zu let in\n", TEST_NAME, count, elapsed / 1e6, accepted);
+    printf("%s: each waited median %.2f ms, 99th %.2f ms, worst %.2f ms, %zu more than %d ms\n",
+           TEST_NAME, waits[count / 2], waits[count * 99 / 100], waits.back(), retransmitted, BENCH_RETRANSMIT);
+    return 0;
+}
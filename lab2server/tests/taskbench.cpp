@@ -0,0 +1,161 @@
+/*
+ * File:   taskbench.cpp
+ *
+ * Benchmark of what it costs to run a handler as one of the tasks in tasks.h
+ * instead of calling it. Each message is decoded and handled by calling the
+ * handler straight away, by running it as the step of a task taken from and
+ * given back to the pool, and by having the worker thread run it as the
+ * task's work and hand the task back through a mailbox to the event loop to
+ * finish, with many in flight at once. Prints the nanoseconds a message each
+ * way takes. Fails if a way handles a different number of bytes. Takes the
+ * number of messages each way is timed with as its argument
+ */
+
+#define TEST_NAME "taskbench"
+#include "testharness.h"
+#include "../mailbox.h"
+#include "../tasks.h"
+
+using namespace std;
+
+#define BENCH_MESSAGES 1000000      // Messages handled each way unless given
+#define BENCH_IN_FLIGHT 1024        // Tasks given to the worker before waiting for any back
+
+struct taskWorker worker;
+struct mailbox<struct loopTask *> handedBack;   // Tasks the worker has done the work of
+string packet;
+size_t handledBytes = 0;            // Added to by the handler on the event loop
+size_t finishedTasks = 0;
+
+
+// The handler: decodes a packet and counts its data
+void handle(const string &data)
+{
+    handledBytes += messageFromPacket(data.c_str()).data.length();
+}
+
+
+// Handles a task's packet as its only step
+void handleStep(struct loopTask *task)
+{
+    handle(task->data);
+    finishTask(&worker, task);
+    finishedTasks++;
+}
+
+
+// Decodes a task's packet on the worker thread, keeping the length of its data
+void decodeWork(struct loopTask *task)
+{
+    task->length = messageFromPacket(task->data.c_str()).data.length();
+}
+
+
+// Counts the data the worker decoded, back on the event loop
+void countStep(struct loopTask *task)
+{
+    handledBytes += task->length;
+    finishTask(&worker, task);
+    finishedTasks++;
+}
+
+
+// Hands a task back to the event loop, on the worker thread
+void handBack(struct loopTask *task)
+{
+    postToMailboxOrWait(&handedBack, task);
+}
+
+
+// Wakes the event loop once the worker has handed back its last task
+void finish(atomic<bool> &finished)
+{
+    finished.store(true, memory_order_release);
+    uint64_t one = 1;
+    if(write(handedBack.eventfd, &one, sizeof(one)) == -1) fail("couldn't wake the event loop");
+}
+
+
+// Waits for the worker to hand tasks back and carries on with them
+void drainHandedBack()
+{
+    struct pollfd wakeup = {handedBack.eventfd, POLLIN, 0};
+    if(poll(&wakeup, 1, TEST_READ_LIMIT) != 1) fail("the worker stopped handing tasks back");
+    
+    struct loopTask *task;
+    clearMailboxWakeup(&handedBack);
+    while(takeFromMailbox(&handedBack, &task)) task->step(task);
+    announceMailboxRoom(&handedBack);
+}
+
+
+// Handles messages one of the three ways
+// Returns the nanoseconds a message took
+double run(int way, size_t messages)
+{
+    handledBytes = 0;
+    finishedTasks = 0;
+    uint64_t start = nowNanoseconds();
+    if(way == 0)
+    {
+        for(size_t i = 0; i < messages; i++) handle(packet);
+    }
+    else if(way == 1)
+    {
+        for(size_t i = 0; i < messages; i++)
+        {
+            struct loopTask *task = startTask(&worker, -1, "");
+            task->data = packet;
+            handleStep(task);
+        }
+    }
+    else
+    {
+        for(size_t given = 0; given < messages; )
+        {
+            for(; given < messages && given - finishedTasks < BENCH_IN_FLIGHT; given++)
+            {
+                struct loopTask *task = startTask(&worker, -1, "");
+                task->data = packet;
+                awaitWork(&worker, task, decodeWork, countStep);
+            }
+            drainHandedBack();
+        }
+        while(finishedTasks < messages) drainHandedBack();
+    }
+    uint64_t elapsed = nowNanoseconds() - start;
+    
+    size_t expected = messages * messageFromPacket(packet.c_str()).data.length();
+    if(handledBytes != expected)
+    {
+        fail("way " + to_string(way) + " handled " + to_string(handledBytes) + " bytes, not " + to_string(expected));
+    }
+    return (double) elapsed / messages;
+}
+
+
+int main(int argc, char **argv)
+{
+    size_t messages = argc > 1 ? strtoul(argv[1], NULL, 10) : BENCH_MESSAGES;
+    if(messages == 0) fail("give at least one message");
+    if(createMailbox(&handedBack) == -1) fail("couldn't create the mailbox");
+    
+    struct message chat = {MESSAGE, 0, "sadman", "lab2 hello there, this is a chat message"};
+    chat.size = chat.data.length() + 1;
+    packet = stringifyMessage(&chat);
+    
+    double direct = run(0, messages);
+    double step = run(1, messages);
+    startTaskWorker(&worker, handBack, finish);
+    double worked = run(2, messages);
+    askTaskWorkerToStop(&worker);
+    while(!worker.finished.load(memory_order_acquire)) drainHandedBack();
+    worker.thread.join();
+    
+    printf("%s: %zu messages of %zu bytes each way\n", TEST_NAME, messages, packet.length());
+    printf("%s: called directly %.1f ns, as a task's step %.1f ns, through the worker %.1f ns a message\n",
+           TEST_NAME, direct, step, worked);
+    printf("%s: a task adds %.1f ns on the event loop, and %.1f ns going through the worker\n",
+           TEST_NAME, step - direct, worked - direct);
+    return 0;
+}
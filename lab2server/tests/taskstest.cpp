@@ -0,0 +1,282 @@
+/*
+ * File:   taskstest.cpp
+ *
+ * Stress test for the tasks in tasks.h that an event loop hands slow work off
+ * in. Runs an event loop like the server's, which gets tasks back from the
+ * worker through a mailbox. Each client gets a task that has the worker thread
+ * build chunks of numbered packets and sends them from the event loop,
+ * waiting for room when its socket is full. Some clients read slowly so their
+ * tasks wait often. Fails if a packet is lost, repeated or out of order, if a
+ * step runs on the wrong thread, or if a frame goes back to the pool twice.
+ * Then does it all again stopping and starting the worker as an upgrade does,
+ * with tasks queued for it and handed back in the mailbox meanwhile
+ */
+
+#define TEST_NAME "taskstest"
+#include "testharness.h"
+#include "../mailbox.h"
+#include "../tasks.h"
+
+#include <set>
+#include <unordered_map>
+
+using namespace std;
+
+#define TEST_CLIENTS 8
+#define TEST_CHUNKS 20          // Chunks each task builds on the worker thread
+#define TEST_CHUNK_PACKETS 2000 // Packets in a chunk, more than a socket holds
+#define TEST_SEND_BUFFER 4096   // Bytes a client's socket holds, small so tasks wait for room
+#define TEST_SLOW_READ 512      // Bytes slow clients read at a time
+#define TEST_RESTART_PASSES 5   // Passes of the loop between worker restarts
+#define TEST_SLOW_WORK 200      // Microseconds each chunk takes to build meanwhile
+#define TEST_SLEEP_LIMIT 2000   // Milliseconds the loop waits for something to do before giving up
+
+struct taskWorker worker;
+struct mailbox<struct loopTask *> handedBack;          // Tasks the worker has done the work of
+unordered_map<int, struct loopTask *> writeWaiters;    // Tasks waiting for room, by their socket
+int clientSockets[TEST_CLIENTS];    // Server's end
+int readerSockets[TEST_CLIENTS];    // Client's end
+size_t chunksBuilt[TEST_CLIENTS];
+size_t finishedTasks = 0;
+size_t waits = 0;               // Times a task waited for room
+thread::id loopThread;
+bool restarting = false;        // Worker restarted every few passes, its work slowed so tasks queue up
+
+
+// Hands a task back to the event loop, on the worker thread
+void handBack(struct loopTask *task)
+{
+    postToMailboxOrWait(&handedBack, task);
+}
+
+
+// Wakes the event loop once the worker has handed back its last task
+void finish(atomic<bool> &finished)
+{
+    finished.store(true, memory_order_release);
+    uint64_t one = 1;
+    if(write(handedBack.eventfd, &one, sizeof(one)) == -1) fail("couldn't wake the event loop");
+}
+
+
+// Carries on with each task the worker has handed back
+void drainHandedBack()
+{
+    struct loopTask *task;
+    clearMailboxWakeup(&handedBack);
+    while(takeFromMailbox(&handedBack, &task)) task->step(task);
+    announceMailboxRoom(&handedBack);
+}
+
+
+// Stops the worker, carrying on with the tasks it hands back until it has
+void stopWorker()
+{
+    askTaskWorkerToStop(&worker);
+    while(!worker.finished.load(memory_order_acquire))
+    {
+        struct pollfd wakeup = {handedBack.eventfd, POLLIN, 0};
+        if(poll(&wakeup, 1, -1) == -1 && errno != EINTR) fail("poll failed");
+        drainHandedBack();
+    }
+    worker.thread.join();
+}
+
+
+// Returns the index of the client on sockfd
+int clientOf(int sockfd)
+{
+    for(int client = 0; client < TEST_CLIENTS; client++)
+    {
+        if(clientSockets[client] == sockfd) return client;
+    }
+    fail("task for unknown socket " + to_string(sockfd));
+    return -1;
+}
+
+
+// Builds a task's next chunk of packets, on the worker thread while it runs,
+// and on the event loop while it's being stopped or isn't running
+void buildChunk(struct loopTask *task)
+{
+    if(worker.thread.joinable() && !worker.stopping && this_thread::get_id() == loopThread)
+    {
+        fail("work ran on the event loop");
+    }
+    
+    int client = clientOf(task->sockfd);
+    task->data.clear();
+    for(size_t i = 0; i < TEST_CHUNK_PACKETS; i++)
+    {
+        task->data += to_string(client) + " " + to_string(task->offset++);
+        task->data += '\0';
+    }
+    task->sent = 0;
+    if(restarting) this_thread::sleep_for(chrono::microseconds(TEST_SLOW_WORK));
+}
+
+
+// Sends a task's chunk as its client has room, then has the next one built,
+// or finishes the task
+void sendChunk(struct loopTask *task)
+{
+    if(this_thread::get_id() != loopThread) fail("step ran off the event loop");
+    
+    while(task->sent < task->data.length())
+    {
+        ssize_t numBytes = send(task->sockfd, task->data.data() + task->sent, task->data.length() - task->sent,
+                                MSG_NOSIGNAL);
+        if(numBytes == -1 && errno != EAGAIN) fail(string("send failed: ") + strerror(errno));
+        if(numBytes == -1)
+        {
+            waits++;
+            writeWaiters[task->sockfd] = task;
+            return;
+        }
+        task->sent += numBytes;
+    }
+    
+    int client = clientOf(task->sockfd);
+    if(++chunksBuilt[client] < TEST_CHUNKS)
+    {
+        awaitWork(&worker, task, buildChunk, sendChunk);
+        return;
+    }
+    
+    finishTask(&worker, task);
+    finishedTasks++;
+}
+
+
+// Reads what a client is sent until its socket closes, checking the packets
+// are numbered in order. Odd clients read slowly, a little at a time
+void readPackets(int client, size_t *received)
+{
+    string buffer;
+    char chunk[TEST_SEND_BUFFER];
+    size_t readSize = client % 2 == 1 ? TEST_SLOW_READ : sizeof(chunk);
+    ssize_t numBytes;
+    while((numBytes = read(readerSockets[client], chunk, readSize)) > 0)
+    {
+        buffer.append(chunk, numBytes);
+        size_t start = 0, end;
+        while((end = buffer.find('\0', start)) != string::npos)
+        {
+            string expected = to_string(client) + " " + to_string(*received);
+            if(buffer.compare(start, end - start, expected) != 0)
+            {
+                fail("client " + to_string(client) + " got " + buffer.substr(start, end - start) +
+                     " instead of " + expected);
+            }
+            (*received)++;
+            start = end + 1;
+        }
+        buffer.erase(0, start);
+        if(client % 2 == 1) this_thread::sleep_for(chrono::microseconds(100));
+    }
+}
+
+
+// Starts a task for each client and runs the event loop until they're all
+// finished
+void run()
+{
+    vector<thread> readers;
+    vector<size_t> received(TEST_CLIENTS, 0);
+    for(int client = 0; client < TEST_CLIENTS; client++)
+    {
+        int sockets[2];
+        if(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == -1) fail("socketpair failed");
+        fcntl(sockets[0], F_SETFL, O_NONBLOCK);
+        int size = TEST_SEND_BUFFER;
+        setsockopt(sockets[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+        clientSockets[client] = sockets[0];
+        readerSockets[client] = sockets[1];
+        chunksBuilt[client] = 0;
+        readers.push_back(thread(readPackets, client, &received[client]));
+    }
+    
+    finishedTasks = 0;
+    waits = 0;
+    startTaskWorker(&worker, handBack, finish);
+    for(int client = 0; client < TEST_CLIENTS; client++)
+    {
+        struct loopTask *task = startTask(&worker, clientSockets[client], "user" + to_string(client));
+        awaitWork(&worker, task, buildChunk, sendChunk);
+    }
+    
+    size_t passes = 0, restarts = 0;
+    while(finishedTasks < TEST_CLIENTS)
+    {
+        fd_set readable, writable;
+        FD_ZERO(&readable);
+        FD_ZERO(&writable);
+        FD_SET(handedBack.eventfd, &readable);
+        int maxfd = handedBack.eventfd;
+        for(auto const & waiter : writeWaiters)
+        {
+            FD_SET(waiter.first, &writable);
+            maxfd = max(maxfd, waiter.first);
+        }
+        
+        struct timeval timeout = {TEST_SLEEP_LIMIT / 1000, 0};
+        int ready = select(maxfd + 1, &readable, &writable, NULL, &timeout);
+        if(ready == -1) fail("select failed");
+        if(ready == 0) fail("stuck with " + to_string(finishedTasks) + " tasks finished");
+        
+        if(FD_ISSET(handedBack.eventfd, &readable)) drainHandedBack();
+        vector<struct loopTask *> writers;
+        for(auto it = writeWaiters.begin(); it != writeWaiters.end(); )
+        {
+            if(!FD_ISSET(it->first, &writable)) it++;
+            else
+            {
+                writers.push_back(it->second);
+                it = writeWaiters.erase(it);
+            }
+        }
+        for(auto const & task : writers) task->step(task);
+        
+        if(restarting && ++passes % TEST_RESTART_PASSES == 0)
+        {
+            stopWorker();
+            if(!worker.queue.empty()) fail("tasks left queued for a stopped worker");
+            drainHandedBack();
+            startTaskWorker(&worker, handBack, finish);
+            restarts++;
+        }
+    }
+    stopWorker();
+    
+    for(int client = 0; client < TEST_CLIENTS; client++) close(clientSockets[client]);
+    for(auto & reader : readers) reader.join();
+    for(int client = 0; client < TEST_CLIENTS; client++)
+    {
+        close(readerSockets[client]);
+        if(received[client] != TEST_CHUNKS * TEST_CHUNK_PACKETS)
+        {
+            fail("client " + to_string(client) + " got " + to_string(received[client]) + " packets");
+        }
+    }
+    
+    set<struct loopTask *> frames(worker.pool.begin(), worker.pool.end());
+    if(frames.size() != worker.pool.size()) fail("a frame went back to the pool twice");
+    if(!writeWaiters.empty()) fail("tasks still waiting for room");
+    if(waits == 0) fail("no task waited for room");
+    if(restarting && restarts == 0) fail("the worker was never restarted");
+    
+    printf("%s: %d tasks sent %d packets each, waiting for room %zu times, %zu worker restarts, OK\n",
+           TEST_NAME, TEST_CLIENTS, TEST_CHUNKS * TEST_CHUNK_PACKETS, waits, restarts);
+}
+
+
+int main()
+{
+    if(createMailbox(&handedBack) == -1) fail("couldn't create the mailbox");
+    loopThread = this_thread::get_id();
+    
+    run();
+    restarting = true;
+    run();
+    return 0;
+}
@@ -0,0 +1,478 @@
+/*
+ * File:   testharness.h
+ *
+ * What the server's tests and benchmarks share: reporting, timing, and
+ * running a server to talk to over its sockets, or the shared memory it moves
+ * local clients to, as a client would. Each one defines TEST_NAME, the name it
+ * reports under, before including this
+ */
+
+#ifndef TESTHARNESS_H
+#define TESTHARNESS_H
+
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "protocol.h"
+#include "sharedring.h"
+
+#ifndef TEST_NAME
+#error "define TEST_NAME before including testharness.h"
+#endif
+
+#define TEST_SERVER_PATH "dist/Debug/GNU-Linux/server" // Where make builds the server, from lab2server
+#define TEST_START_LIMIT 5000      // Milliseconds to wait for a server to take connections
+#define TEST_READ_LIMIT 10000      // Milliseconds to wait for a packet before giving up
+#define TEST_USER_COUNT 6
+
+// The users the server lets log in, and their passwords. It lets each log in
+// once at a time, so no test can have more clients than this
+const char *const testUsers[TEST_USER_COUNT][2] = {
+    {"sadman", "ahmed"}, {"eliano", "anile"}, {"chris", "pua"},
+    {"username", "password"}, {"hamid", "timorabadi"}, {"john", "smith"}
+};
+
+// A server started for a test
+struct testServer {
+    pid_t pid;
+    int port;
+};
+
+// A connection to the server, with what it has read past the last packet. One
+// the server has moved to shared memory sends and reads through its rings
+// instead, and only watches its socket for the server hanging up
+struct testClient {
+    int sockfd;
+    std::string userID;
+    std::string buffer;
+    struct sharedChannel *shared = NULL;
+    int wakeup = -1;                    // Signalled by the server, slept on while a ring is empty or full
+    int serverWakeup = -1;              // Signalled after reading or writing, if the server waits
+};
+
+
+// Reports a failure and exits straight away, without waiting for other threads
+// or cleaning up after them
+inline void fail(const std::string &reason)
+{
+    printf("%s: %s\n", TEST_NAME, reason.c_str());
+    fflush(stdout);
+    _exit(1);
+}
+
+
+// Returns nanoseconds on the monotonic clock
+inline uint64_t nowNanoseconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+
+// Returns the rate bytes were moved at in nanoseconds, in megabytes a second
+inline double megabytesPerSecond(uint64_t bytes, uint64_t nanoseconds)
+{
+    return (double) bytes / (1 << 20) / (nanoseconds / 1e9);
+}
+
+
+
+// Returns the CPU time a process has used so far, in seconds
+inline double cpuSeconds(pid_t pid)
+{
+    char path[64], stat[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+    int fd = open(path, O_RDONLY);
+    ssize_t numBytes = fd == -1 ? -1 : read(fd, stat, sizeof(stat) - 1);
+    if(fd != -1) close(fd);
+    if(numBytes <= 0) fail(std::string("can't read ") + path);
+    stat[numBytes] = '\0';
+    
+    // User and system time are the 14th and 15th fields, after the name in brackets
+    unsigned long user, system;
+    const char *fields = strrchr(stat, ')');
+    if(fields == NULL || sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &user, &system) != 2)
+    {
+        fail(std::string("can't parse ") + path);
+    }
+    return (double) (user + system) / sysconf(_SC_CLK_TCK);
+}
+
+
+// Connects to a port on this host over TCP, with Nagle's algorithm off as the
+// client has it
+// Returns the socket, or -1 if nothing is listening
+inline int connectToPort(int port)
+{
+    int sockfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(sockfd == -1) fail("socket failed");
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(connect(sockfd, (struct sockaddr *) &address, sizeof(address)) == -1)
+    {
+        close(sockfd);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return sockfd;
+}
+
+
+// Connects to the server's local socket at path
+// Returns the socket, or -1 if nothing is listening there
+inline int connectToLocalSocket(const std::string &path)
+{
+    int sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(sockfd == -1) fail("socket failed");
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+    if(connect(sockfd, (struct sockaddr *) &address, sizeof(address)) == -1)
+    {
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+
+// Returns a TCP port nothing on this host is listening on at the moment
+inline int freePort()
+{
+    int sockfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(address);
+    if(sockfd == -1 || bind(sockfd, (struct sockaddr *) &address, sizeof(address)) == -1 ||
+       getsockname(sockfd, (struct sockaddr *) &address, &length) == -1)
+    {
+        fail("can't find a free port");
+    }
+    close(sockfd);
+    return ntohs(address.sin_port);
+}
+
+
+// Starts the server at path, or where make builds it if path is NULL, with
+// options before its port, and waits until it takes connections. What it logs
+// is thrown away, as it logs every packet
+inline struct testServer startServer(const char *path, const std::vector<std::string> &options)
+{
+    struct testServer server;
+    server.port = freePort();
+    std::string portNumber = std::to_string(server.port);
+    if(path == NULL) path = TEST_SERVER_PATH;
+    
+    std::vector<char *> args;
+    args.push_back((char *) path);
+    for(auto const & option : options) args.push_back((char *) option.c_str());
+    args.push_back((char *) portNumber.c_str());
+    args.push_back(NULL);
+    
+    if((server.pid = fork()) == -1) fail("fork failed");
+    if(server.pid == 0)
+    {
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, STDOUT_FILENO);
+        execv(path, args.data());
+        fprintf(stderr, "%s: can't run %s: %s\n", TEST_NAME, path, strerror(errno));
+        _exit(127);
+    }
+    
+    uint64_t start = nowNanoseconds();
+    int sockfd;
+    while((sockfd = connectToPort(server.port)) == -1)
+    {
+        int status;
+        if(waitpid(server.pid, &status, WNOHANG) == server.pid) fail(std::string("server at ") + path + " exited");
+        if(nowNanoseconds() - start > (uint64_t) TEST_START_LIMIT * 1000000) fail("server never took connections");
+        usleep(10000);
+    }
+    close(sockfd);
+    return server;
+}
+
+
+// Kills a server started for a test and waits for it to go
+inline void stopServer(struct testServer *server)
+{
+    kill(server->pid, SIGKILL);
+    waitpid(server->pid, NULL, 0);
+}
+
+
+// Sleeps until the server signals a client on shared memory, for up to timeout
+// milliseconds
+// Returns false if it didn't in time, or hung up instead
+inline bool awaitServer(struct testClient *client, int timeout)
+{
+    struct pollfd events[2] = {{client->wakeup, POLLIN, 0}, {client->sockfd, POLLIN, 0}};
+    if(poll(events, 2, timeout) <= 0 || events[1].revents != 0) return false;
+    uint64_t count;
+    if(read(client->wakeup, &count, sizeof(count)) == -1 && errno != EAGAIN) fail("eventfd read failed");
+    return true;
+}
+
+
+// Writes bytes to the server through a client's shared memory, sleeping while
+// its ring is full
+inline void sendShared(struct testClient *client, const char *data, size_t length)
+{
+    struct sharedRing *ring = &client->shared->toServer;
+    size_t sent = 0;
+    while(sent < length)
+    {
+        size_t numBytes = sharedRingWrite(ring, data + sent, length - sent);
+        sent += numBytes;
+        if(numBytes > 0) sharedRingWake(ring->readerWaiting, client->serverWakeup);
+        else if(sharedRingWriterSleeps(ring, 1) && !awaitServer(client, TEST_READ_LIMIT))
+        {
+            fail(client->userID + " was never given room in its ring");
+        }
+    }
+}
+
+
+// Reads what the server has sent a client through its shared memory, up to
+// length bytes, sleeping up to timeout milliseconds for some to arrive
+// Returns the number of bytes read, 0 if none came in time or the server hung up
+inline size_t readShared(struct testClient *client, char *buffer, size_t length, int timeout)
+{
+    struct sharedRing *ring = &client->shared->toClient;
+    size_t numBytes;
+    while((numBytes = sharedRingRead(ring, buffer, length)) == 0)
+    {
+        if(sharedRingReaderSleeps(ring) && !awaitServer(client, timeout)) return 0;
+    }
+    sharedRingWake(ring->writerWaiting, client->serverWakeup);
+    return numBytes;
+}
+
+
+// Writes all of a packet and its terminator to the server, waiting for room
+// if the client's socket is nonblocking
+inline void sendPacket(struct testClient *client, unsigned int type, const std::string &data)
+{
+    struct message packet;
+    packet.type = type;
+    packet.size = data.length() + 1;
+    packet.source = client->userID;
+    packet.data = data;
+    std::string bytes = stringifyMessage(&packet);
+    bytes += '\0';
+    if(client->shared != NULL)
+    {
+        sendShared(client, bytes.data(), bytes.length());
+        return;
+    }
+    
+    size_t sent = 0;
+    while(sent < bytes.length())
+    {
+        ssize_t numBytes = write(client->sockfd, bytes.data() + sent, bytes.length() - sent);
+        if(numBytes == -1 && errno == EAGAIN)
+        {
+            struct pollfd room = {client->sockfd, POLLOUT, 0};
+            poll(&room, 1, -1);
+        }
+        else if(numBytes == -1 && errno != EINTR) fail(client->userID + " couldn't send: " + strerror(errno));
+        else if(numBytes > 0) sent += numBytes;
+    }
+}
+
+
+// Reads the next packet the server sends a client, waiting up to timeout
+// milliseconds for it. The data keeps the space after the source
+// Returns false if none came in time or the server hung up
+inline bool readPacket(struct testClient *client, struct message *packet, int timeout = TEST_READ_LIMIT)
+{
+    size_t end;
+    while((end = client->buffer.find('\0')) == std::string::npos)
+    {
+        char chunk[65536];
+        if(client->shared != NULL)
+        {
+            size_t numBytes = readShared(client, chunk, sizeof(chunk), timeout);
+            if(numBytes == 0) return false;
+            client->buffer.append(chunk, numBytes);
+            continue;
+        }
+        
+        struct pollfd readable = {client->sockfd, POLLIN, 0};
+        if(poll(&readable, 1, timeout) <= 0) return false;
+        
+        ssize_t numBytes = read(client->sockfd, chunk, sizeof(chunk));
+        if(numBytes == -1 && (errno == EAGAIN || errno == EINTR)) continue;
+        if(numBytes <= 0) return false;
+        client->buffer.append(chunk, numBytes);
+    }
+    
+    *packet = messageFromPacket(client->buffer.c_str());
+    client->buffer.erase(0, end + 1);
+    return true;
+}
+
+
+// Reads the next packet the server sends a client, failing unless it's of type
+inline struct message expectPacket(struct testClient *client, unsigned int type)
+{
+    struct message packet;
+    if(!readPacket(client, &packet)) fail(client->userID + " got nothing while waiting for a " + std::to_string(type));
+    if(packet.type != type)
+    {
+        fail(client->userID + " got a " + std::to_string(packet.type) + " '" + packet.data + 
+             "' instead of a " + std::to_string(type));
+    }
+    return packet;
+}
+
+
+// Connects to the server over TCP and logs in as one of testUsers
+inline struct testClient logIn(const struct testServer &server, int user)
+{
+    struct testClient client;
+    client.userID = testUsers[user][0];
+    if((client.sockfd = connectToPort(server.port)) == -1) fail("can't connect to the server");
+    sendPacket(&client, LOGIN, testUsers[user][1]);
+    expectPacket(&client, LO_ACK);
+    return client;
+}
+
+
+// Connects to the server's local socket at path and logs in as one of
+// testUsers
+inline struct testClient logInLocally(const std::string &path, int user)
+{
+    struct testClient client;
+    client.userID = testUsers[user][0];
+    if((client.sockfd = connectToLocalSocket(path)) == -1) fail("can't connect to " + path);
+    sendPacket(&client, LOGIN, testUsers[user][1]);
+    expectPacket(&client, LO_ACK);
+    return client;
+}
+
+
+// Has a client logged in on the local socket move to shared memory, which the
+// server passes it with the SHM_ACK, the last thing it sends over the socket
+inline void attachSharedMemory(struct testClient *client)
+{
+    sendPacket(client, SHM_ATTACH, "");
+    int fds[3], passed = 0;
+    while(client->buffer.find('\0') == std::string::npos)
+    {
+        char chunk[4096], control[CMSG_SPACE(sizeof(fds))];
+        struct iovec iov = {chunk, sizeof(chunk)};
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        
+        struct pollfd readable = {client->sockfd, POLLIN, 0};
+        ssize_t numBytes = -1;
+        if(poll(&readable, 1, TEST_READ_LIMIT) == 1) numBytes = recvmsg(client->sockfd, &msg, MSG_CMSG_CLOEXEC);
+        if(numBytes <= 0) fail(client->userID + " got no answer to SHM_ATTACH");
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if(cmsg != NULL && cmsg->cmsg_type == SCM_RIGHTS && cmsg->cmsg_len == CMSG_LEN(sizeof(fds)))
+        {
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+            passed = 3;
+        }
+        client->buffer.append(chunk, numBytes);
+    }
+    
+    struct message reply;
+    readPacket(client, &reply);
+    if(reply.type != SHM_ACK || passed != 3) fail(client->userID + " wasn't moved to shared memory: " + reply.data);
+    void *memory = mmap(NULL, sizeof(struct sharedChannel), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    if(memory == MAP_FAILED) fail("couldn't map the shared memory");
+    close(fds[0]);
+    client->shared = (struct sharedChannel *) memory;
+    client->serverWakeup = fds[1];
+    client->wakeup = fds[2];
+}
+
+
+// Logs in the first members of testUsers, has the first make a session and
+// the rest join it
+inline std::vector<struct testClient> startSession(const struct testServer &server, int members, 
+                                                  const std::string &sessionID)
+{
+    std::vector<struct testClient> clients;
+    for(int member = 0; member < members; member++)
+    {
+        clients.push_back(logIn(server, member));
+        sendPacket(&clients.back(), member == 0 ? NEW_SESS : JOIN, sessionID + " pw");
+        expectPacket(&clients.back(), member == 0 ? NS_ACK : JN_ACK);
+    }
+    return clients;
+}
+
+
+// Has a client make or join each of the sessions named, sending every request
+// before the replies are all read so neither side waits on the other
+inline void requestSessions(struct testClient *client, unsigned int request, unsigned int reply,
+                            const std::vector<std::string> &sessionIDs)
+{
+    std::thread sender([client, request, &sessionIDs] {
+        for(auto const & sessionID : sessionIDs) sendPacket(client, request, sessionID + " pw");
+    });
+    for(auto const & sessionID : sessionIDs)
+    {
+        // The data keeps the space after the source
+        struct message packet = expectPacket(client, reply);
+        if(packet.data.compare(1, std::string::npos, sessionID) != 0)
+        {
+            fail(client->userID + " got '" + packet.data + "' for session " + sessionID);
+        }
+    }
+    sender.join();
+}
+
+
+// Runs a command on a connection to the server's admin socket
+// Returns what the server answered, without the "." line ending it
+inline std::string adminCommand(int admin, const std::string &command)
+{
+    std::string line = command + "\n", answer;
+    if(write(admin, line.data(), line.length()) != (ssize_t) line.length()) fail("couldn't write to the admin socket");
+    while(answer != ".\n" && (answer.length() < 3 || answer.compare(answer.length() - 3, 3, "\n.\n") != 0))
+    {
+        char chunk[4096];
+        struct pollfd readable = {admin, POLLIN, 0};
+        ssize_t numBytes = -1;
+        if(poll(&readable, 1, TEST_READ_LIMIT) == 1) numBytes = read(admin, chunk, sizeof(chunk));
+        if(numBytes <= 0) fail("no answer to '" + command + "' on the admin socket");
+        answer.append(chunk, numBytes);
+    }
+    return answer.substr(0, answer.length() - 2);
+}
+
+#endif /* TESTHARNESS_H */
@@ -0,0 +1,115 @@
+/*
+ * File:   transportbench.cpp
+ *
+ * Benchmark of the ways a client on the same host can talk to the server: over
+ * TCP on loopback, over the local socket, and over shared memory. Two members
+ * of a session, both connected the same way, send a message back and forth
+ * through the server one at a time, then one streams messages of 100 bytes to
+ * the other. Prints the median and tail round trip and the messages a second
+ * streamed each way. Takes the path to the server and the number of round
+ * trips as its arguments
+ */
+
+#define TEST_NAME "transportbench"
+#include "testharness.h"
+
+#include <algorithm>
+#include <thread>
+
+using namespace std;
+
+#define BENCH_ROUND_TRIPS 20000     // Round trips timed each way unless given
+#define BENCH_WARMUP 1000           // Round trips made first and not timed
+#define BENCH_STREAMED 100000       // Messages streamed each way
+#define BENCH_TEXT_SIZE 100         // Bytes of text in each message streamed
+#define BENCH_DIRECTORY_TEMPLATE "/tmp/transportbenchXXXXXX"
+
+enum transport {
+    OVER_TCP,
+    OVER_LOCAL_SOCKET,
+    OVER_SHARED_MEMORY
+};
+const char *const transportNames[] = {"TCP", "local socket", "shared memory"};
+
+
+// Returns a percentile of sorted round trips, in microseconds
+double percentile(const vector<uint64_t> &roundTrips, double fraction)
+{
+    return roundTrips[min(roundTrips.size() - 1, (size_t) (roundTrips.size() * fraction))] / 1e3;
+}
+
+
+// Streams messages from one member to the other
+// Returns the messages a second the other got them at
+double stream(vector<struct testClient> &members)
+{
+    string text = "bench " + string(BENCH_TEXT_SIZE - 6, 's');
+    uint64_t start = nowNanoseconds();
+    thread sender([&members, &text] {
+        for(size_t i = 0; i < BENCH_STREAMED; i++) sendPacket(&members[0], MESSAGE, text);
+    });
+    for(size_t i = 0; i < BENCH_STREAMED; i++) expectPacket(&members[1], MESSAGE);
+    uint64_t elapsed = nowNanoseconds() - start;
+    sender.join();
+    return BENCH_STREAMED / (elapsed / 1e9);
+}
+
+
+// Runs a server, connects two members of a session to it one way, and times
+// round trips and a stream between them
+// Returns the round trips sorted, and sets the rate messages were streamed at
+vector<uint64_t> measure(const char *serverPath, enum transport way, size_t count, double *streamed)
+{
+    char directory[] = BENCH_DIRECTORY_TEMPLATE;
+    if(mkdtemp(directory) == NULL) fail("mkdtemp failed");
+    string socketPath = string(directory) + "/socket";
+    struct testServer server = startServer(serverPath, {"-u", socketPath});
+    
+    vector<struct testClient> members;
+    for(int member = 0; member < 2; member++)
+    {
+        if(way == OVER_TCP) members.push_back(logIn(server, member));
+        else members.push_back(logInLocally(socketPath, member));
+        if(way == OVER_SHARED_MEMORY) attachSharedMemory(&members.back());
+        sendPacket(&members.back(), member == 0 ? NEW_SESS : JOIN, "bench pw");
+        expectPacket(&members.back(), member == 0 ? NS_ACK : JN_ACK);
+    }
+    
+    vector<uint64_t> roundTrips;
+    for(size_t i = 0; i < BENCH_WARMUP + count; i++)
+    {
+        uint64_t start = nowNanoseconds();
+        sendPacket(&members[0], MESSAGE, "bench ping");
+        expectPacket(&members[1], MESSAGE);
+        sendPacket(&members[1], MESSAGE, "bench pong");
+        expectPacket(&members[0], MESSAGE);
+        if(i >= BENCH_WARMUP) roundTrips.push_back(nowNanoseconds() - start);
+    }
+    *streamed = stream(members);
+    stopServer(&server);
+    unlink(socketPath.c_str());
+    rmdir(directory);
+    
+    sort(roundTrips.begin(), roundTrips.end());
+    return roundTrips;
+}
+
+
+int main(int argc, char **argv)
+{
+    const char *serverPath = argc > 1 ? argv[1] : NULL;
+    size_t count = argc > 2 ? strtoul(argv[2], NULL, 10) : BENCH_ROUND_TRIPS;
+    if(count == 0) fail("give at least one round trip");
+    
+    printf("%s: %zu round trips and %d messages of %d bytes streamed each way\n",
+           TEST_NAME, count, BENCH_STREAMED, BENCH_TEXT_SIZE);
+    for(int way = OVER_TCP; way <= OVER_SHARED_MEMORY; way++)
+    {
+        double streamed;
+        vector<uint64_t> roundTrips = measure(serverPath, (enum transport) way, count, &streamed);
+        printf("%s: %-13s round trip median %.1f us, 99th %.1f us, 99.9th %.1f us, streamed %.0f a second\n",
+               TEST_NAME, transportNames[way], percentile(roundTrips, 0.5), percentile(roundTrips, 0.99),
+               percentile(roundTrips, 0.999), streamed);
+    }
+    return 0;
+}
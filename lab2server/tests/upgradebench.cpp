@@ -0,0 +1,134 @@
+/*
+ * File:   upgradebench.cpp
+ *
+ * Benchmark of the pause clients see while the server hands itself over to a
+ * new copy of its binary. Two members of a session ping each other through it
+ * while many more connections are part way through sending their LOGIN, and
+ * the server is told to upgrade half way. Prints how long the handover took
+ * and the slowest ping across it against the usual one. Then finishes every
+ * LOGIN, which fails unless the connections still logging in were handed over
+ * with what they had sent. Takes the path to the server and the number of
+ * connections logging in as its arguments. The server watches its sockets
+ * with select(), which can't go past FD_SETSIZE descriptors, so it can't be
+ * run with the 10,000 connections that were asked about
+ */
+
+#define TEST_NAME "upgradebench"
+#include "testharness.h"
+
+#include <sys/prctl.h>
+
+using namespace std;
+
+#define BENCH_LOGINS 500            // Connections logging in unless given
+#define BENCH_MAX_LOGINS (FD_SETSIZE - 64) // Leaves the server room for its own descriptors
+#define BENCH_PINGS 200             // Pings either side of the upgrade
+#define BENCH_MEMBERS 2             // Members pinging, the other users are left to log in as
+
+// The rest of a LOGIN still to be sent on one of the connections logging in
+struct partialLogin {
+    int sockfd;
+    int user;
+    string rest;
+};
+
+
+// Sends a message from one member of the session to the other and waits for it
+// Returns the nanoseconds it took
+uint64_t ping(vector<struct testClient> &members)
+{
+    uint64_t start = nowNanoseconds();
+    sendPacket(&members[0], MESSAGE, "bench ping");
+    expectPacket(&members[1], MESSAGE);
+    return nowNanoseconds() - start;
+}
+
+
+// Connects and sends the first half of a LOGIN for one of the users not in the
+// session
+struct partialLogin startLogin(const struct testServer &server, int number)
+{
+    struct partialLogin login;
+    login.user = BENCH_MEMBERS + number % (TEST_USER_COUNT - BENCH_MEMBERS);
+    if((login.sockfd = connectToPort(server.port)) == -1) fail("can't connect to the server");
+    
+    struct message packet;
+    packet.type = LOGIN;
+    packet.source = testUsers[login.user][0];
+    packet.data = testUsers[login.user][1];
+    packet.size = packet.data.length() + 1;
+    string bytes = stringifyMessage(&packet);
+    bytes += '\0';
+    
+    size_t half = bytes.length() / 2;
+    if(write(login.sockfd, bytes.data(), half) != (ssize_t) half) fail("couldn't start a LOGIN");
+    login.rest = bytes.substr(half);
+    return login;
+}
+
+
+// Returns the process the server handed over to, which is left to us to reap
+pid_t findSuccessor()
+{
+    char path[64], children[256];
+    snprintf(path, sizeof(path), "/proc/self/task/%d/children", (int) getpid());
+    int fd = open(path, O_RDONLY);
+    ssize_t numBytes = fd == -1 ? -1 : read(fd, children, sizeof(children) - 1);
+    if(fd != -1) close(fd);
+    if(numBytes <= 0) fail("the server didn't hand over to anything");
+    children[numBytes] = '\0';
+    return atoi(children);
+}
+
+
+int main(int argc, char **argv)
+{
+    int logins = argc > 2 ? atoi(argv[2]) : BENCH_LOGINS;
+    if(logins > BENCH_MAX_LOGINS) fail("select() can't watch more than " + to_string(BENCH_MAX_LOGINS) + " logins");
+    
+    // The successor is started by the server, so it would otherwise be left
+    // to init once the server exits
+    if(prctl(PR_SET_CHILD_SUBREAPER, 1) == -1) fail("prctl failed");
+    struct testServer server = startServer(argc > 1 ? argv[1] : NULL, {});
+    vector<struct testClient> members = startSession(server, BENCH_MEMBERS, "bench");
+    vector<struct partialLogin> pending;
+    for(int i = 0; i < logins; i++) pending.push_back(startLogin(server, i));
+    
+    uint64_t usual = 0, slowest = 0;
+    for(int i = 0; i < BENCH_PINGS; i++) usual += ping(members);
+    
+    // Keep pinging through the upgrade until the old server has gone
+    uint64_t start = nowNanoseconds();
+    kill(server.pid, SIGUSR2);
+    int status;
+    while(waitpid(server.pid, &status, WNOHANG) == 0) slowest = max(slowest, ping(members));
+    uint64_t handover = nowNanoseconds() - start;
+    if(!WIFEXITED(status) || WEXITSTATUS(status) != 0) fail("the old server didn't exit cleanly");
+    server.pid = findSuccessor();
+    for(int i = 0; i < BENCH_PINGS; i++) slowest = max(slowest, ping(members));
+    
+    // Each user not in the session can log in once, the other LOGINs for them
+    // are refused, but all of them must be answered
+    int accepted = 0;
+    for(auto & login : pending)
+    {
+        struct testClient client;
+        client.sockfd = login.sockfd;
+        client.userID = testUsers[login.user][0];
+        if(write(login.sockfd, login.rest.data(), login.rest.length()) != (ssize_t) login.rest.length())
+        {
+            fail("couldn't finish a LOGIN");
+        }
+        struct message reply;
+        if(!readPacket(&client, &reply)) fail("a connection logging in was dropped by the upgrade");
+        if(reply.type == LO_ACK) accepted++;
+        else if(reply.type != LO_NAK) fail("LOGIN got a " + to_string(reply.type));
+    }
+    if(accepted != TEST_USER_COUNT - BENCH_MEMBERS) fail(to_string(accepted) + " LOGINs were accepted");
+    stopServer(&server);
+    
+    printf("%s: %d connections logging in, handover took %.2f ms\n", TEST_NAME, logins, handover / 1e6);
+    printf("%s: slowest ping across it %.2f ms, usually %.3f ms\n",
+           TEST_NAME, slowest / 1e6, usual / 1e6 / BENCH_PINGS);
+    return 0;
+}